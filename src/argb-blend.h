@@ -0,0 +1,521 @@
+#ifndef ARGB_BLEND_H
+#define ARGB_BLEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ARGB_BLEND_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define ARGB_BLEND_NEON 1
+#endif
+
+/* ============================================================
+ * argb-blend.h - CPU compositor for ARGB8888 layers
+ *
+ * A layer that did not get a hardware plane still has to be seen, so
+ * it is blended into the primary plane's XRGB8888/ARGB8888 buffer with
+ * the Porter-Duff "over" operator on premultiplied pixels:
+ *
+ *   dst = src + dst * (255 - src.a) / 255      (every channel)
+ *
+ * which is also what KMS planes do with the default "pixel blend
+ * mode" of "Pre-multiplied".  Straight-alpha layers are premultiplied
+ * once, when the layer is loaded, not on every frame.
+ *
+ * Most of a real layer is either fully opaque (a window body) or
+ * fully transparent (rounded corners, the area around a pointer).
+ * argb_layer_init() splits every row into spans once:
+ *
+ *   ARGB_SPAN_COPY   all alpha 255 -- copied, the destination is not read
+ *   ARGB_SPAN_BLEND  anything else -- through the blend kernel
+ *   (no span)        all pixels 0  -- skipped entirely
+ *
+ * Opaque or transparent runs shorter than ARGB_BLEND_MIN_RUN are left
+ * inside the surrounding blend span: the kernel gets the same answer
+ * and a span per pixel would cost more than it saves.
+ *
+ * The blend reads the destination.  A dumb buffer mapping is usually
+ * write-combined, so callers should blend only where the frame was
+ * damaged (argb_layer_composite() takes a rectangle for that) and keep
+ * the layer itself in cached memory, which argb_layer does.
+ *
+ * Kernels (best first), all byte-identical to the scalar reference:
+ *   avx2    8 pixels per step, x86 with AVX2
+ *   sse2    4 pixels per step, any x86-64
+ *   neon    16 pixels per step (VLD4 de-interleave), AArch64
+ *   scalar  reference implementation, always available
+ *
+ * Setting ARGB_BLEND=<name> in the environment forces a kernel.
+ * ============================================================ */
+
+#define ARGB_BLEND_MIN_RUN 16
+
+typedef void (*argb_blend_fn)(uint32_t *dst, const uint32_t *src,
+			      uint32_t count);
+
+struct argb_blend_impl {
+	const char    *name;
+	argb_blend_fn  blend;
+	bool         (*supported)(void);
+};
+
+/* x / 255, rounded, exact for every x <= 255 * 255 */
+static inline uint32_t argb_div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline void argb_blend_scalar(uint32_t *dst, const uint32_t *src,
+				     uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t s = src[i], d = dst[i], ia = 255 - (s >> 24), out = 0;
+
+		for (int sh = 0; sh < 32; sh += 8) {
+			uint32_t c = ((s >> sh) & 0xff) +
+				     argb_div255(((d >> sh) & 0xff) * ia);
+			out |= (c > 255 ? 255 : c) << sh;
+		}
+		dst[i] = out;
+	}
+}
+
+static inline bool argb_blend_always(void)
+{
+	return true;
+}
+
+#ifdef ARGB_BLEND_X86
+/*
+ * Both x86 kernels widen the destination to 16-bit lanes, multiply by
+ * 255 - alpha broadcast over each pixel's four lanes, divide by 255
+ * the same way as argb_div255() and add the source with saturation.
+ * The largest intermediate, 255 * 255 + 128 + 254, fits 16 bits.
+ */
+__attribute__((target("sse2")))
+static inline __m128i argb_sse2_scale(__m128i d, __m128i ia)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(d, ia), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static inline void argb_blend_sse2(uint32_t *dst, const uint32_t *src,
+				   uint32_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+		/* 255 - a in both 16-bit halves of each pixel */
+		__m128i ia = _mm_srli_epi32(_mm_xor_si128(s,
+					    _mm_set1_epi32(-1)), 24);
+		ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+
+		__m128i lo = argb_sse2_scale(_mm_unpacklo_epi8(d, zero),
+					     _mm_unpacklo_epi32(ia, ia));
+		__m128i hi = argb_sse2_scale(_mm_unpackhi_epi8(d, zero),
+					     _mm_unpackhi_epi32(ia, ia));
+		_mm_storeu_si128((__m128i *)(dst + i),
+				 _mm_adds_epu8(s, _mm_packus_epi16(lo, hi)));
+	}
+	argb_blend_scalar(dst + i, src + i, count - i);
+}
+
+static inline bool argb_blend_has_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+/* Same steps; unpack and pack both work per 128-bit lane, so they pair */
+__attribute__((target("avx2")))
+static inline __m256i argb_avx2_scale(__m256i d, __m256i ia)
+{
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(d, ia),
+				     _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)),
+				 8);
+}
+
+__attribute__((target("avx2")))
+static inline void argb_blend_avx2(uint32_t *dst, const uint32_t *src,
+				   uint32_t count)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i ia = _mm256_srli_epi32(_mm256_xor_si256(s,
+					       _mm256_set1_epi32(-1)), 24);
+		ia = _mm256_or_si256(ia, _mm256_slli_epi32(ia, 16));
+
+		__m256i lo = argb_avx2_scale(_mm256_unpacklo_epi8(d, zero),
+					     _mm256_unpacklo_epi32(ia, ia));
+		__m256i hi = argb_avx2_scale(_mm256_unpackhi_epi8(d, zero),
+					     _mm256_unpackhi_epi32(ia, ia));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+				    _mm256_adds_epu8(s,
+					_mm256_packus_epi16(lo, hi)));
+	}
+	argb_blend_scalar(dst + i, src + i, count - i);
+}
+
+static inline bool argb_blend_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif /* ARGB_BLEND_X86 */
+
+#ifdef ARGB_BLEND_NEON
+/*
+ * VLD4 puts B, G, R and A of 16 pixels in four registers, so 255 - a
+ * is a single VMVN.  VRSHR + VRSHRN is the rounded divide by 255 of
+ * argb_div255(): (x + ((x + 128) >> 8) + 128) >> 8.
+ */
+static inline uint8x8_t argb_neon_scale(uint8x8_t d, uint8x8_t ia)
+{
+	uint16x8_t t = vmull_u8(d, ia);
+
+	return vrshrn_n_u16(vaddq_u16(t, vrshrq_n_u16(t, 8)), 8);
+}
+
+static inline void argb_blend_neon(uint32_t *dst, const uint32_t *src,
+				   uint32_t count)
+{
+	uint32_t i = 0;
+
+	for (; i + 16 <= count; i += 16) {
+		uint8x16x4_t s = vld4q_u8((const uint8_t *)(src + i));
+		uint8x16x4_t d = vld4q_u8((const uint8_t *)(dst + i));
+		uint8x16_t ia = vmvnq_u8(s.val[3]);
+
+		for (int c = 0; c < 4; c++) {
+			uint8x16_t scaled = vcombine_u8(
+				argb_neon_scale(vget_low_u8(d.val[c]),
+						vget_low_u8(ia)),
+				argb_neon_scale(vget_high_u8(d.val[c]),
+						vget_high_u8(ia)));
+			d.val[c] = vqaddq_u8(s.val[c], scaled);
+		}
+		vst4q_u8((uint8_t *)(dst + i), d);
+	}
+	argb_blend_scalar(dst + i, src + i, count - i);
+}
+#endif /* ARGB_BLEND_NEON */
+
+static const struct argb_blend_impl argb_blend_impls[] = {
+#ifdef ARGB_BLEND_X86
+	{ "avx2",   argb_blend_avx2,   argb_blend_has_avx2 },
+	{ "sse2",   argb_blend_sse2,   argb_blend_has_sse2 },
+#endif
+#ifdef ARGB_BLEND_NEON
+	{ "neon",   argb_blend_neon,   argb_blend_always   },
+#endif
+	{ "scalar", argb_blend_scalar, argb_blend_always   },
+};
+
+#define ARGB_BLEND_NUM_IMPLS \
+	(sizeof(argb_blend_impls) / sizeof(argb_blend_impls[0]))
+
+/* First supported kernel, or the one named by $ARGB_BLEND (cached) */
+static inline const struct argb_blend_impl *argb_blend_select(void)
+{
+	static const struct argb_blend_impl *chosen;
+
+	if (chosen)
+		return chosen;
+
+	const char *force = getenv("ARGB_BLEND");
+	for (size_t i = 0; i < ARGB_BLEND_NUM_IMPLS; i++) {
+		const struct argb_blend_impl *impl = &argb_blend_impls[i];
+		if (!impl->supported())
+			continue;
+		if (force && strcmp(force, impl->name) != 0)
+			continue;
+		chosen = impl;
+		break;
+	}
+	if (!chosen) {
+		fprintf(stderr, "ARGB_BLEND=%s not available, using default\n",
+			force);
+		for (size_t i = 0; !chosen && i < ARGB_BLEND_NUM_IMPLS; i++)
+			if (argb_blend_impls[i].supported())
+				chosen = &argb_blend_impls[i];
+	}
+	return chosen;
+}
+
+/* Straight to premultiplied alpha; the alpha channel is kept */
+static inline uint32_t argb_premultiply(uint32_t p)
+{
+	uint32_t a = p >> 24;
+
+	return a << 24 |
+	       argb_div255((p >> 16 & 0xff) * a) << 16 |
+	       argb_div255((p >> 8 & 0xff) * a) << 8 |
+	       argb_div255((p & 0xff) * a);
+}
+
+enum argb_span_kind {
+	ARGB_SPAN_COPY,
+	ARGB_SPAN_BLEND,
+};
+
+struct argb_span {
+	uint32_t x0, x1; /* Columns [x0, x1) of the row */
+	uint32_t kind;   /* enum argb_span_kind */
+};
+
+struct argb_layer {
+	uint32_t          width, height;
+	uint32_t         *pixels;   /* Premultiplied, width * height */
+	struct argb_span *spans;    /* All rows, top to bottom */
+	uint32_t         *row;      /* Row y: spans[row[y] .. row[y + 1]) */
+	uint32_t          nspans;
+};
+
+/* Pixels touched by argb_layer_composite(), by what happened to them */
+struct argb_blend_stats {
+	uint64_t copied;
+	uint64_t blended;
+	uint64_t skipped;
+};
+
+/* 0: transparent, 1: opaque, 2: anything else */
+static inline int argb_pixel_class(uint32_t p)
+{
+	if (!p)
+		return 0;
+	return p >> 24 == 0xff ? 1 : 2;
+}
+
+/* Append [x0, x1) of row @y as @kind, merging adjacent blend spans */
+static inline int argb_layer_push(struct argb_layer *l, uint32_t *cap,
+				  uint32_t y, uint32_t x0, uint32_t x1,
+				  uint32_t kind)
+{
+	struct argb_span *last = l->nspans > l->row[y] ?
+				 &l->spans[l->nspans - 1] : NULL;
+
+	if (last && last->x1 == x0 && last->kind == kind &&
+	    kind == ARGB_SPAN_BLEND) {
+		last->x1 = x1;
+		return 0;
+	}
+	if (l->nspans == *cap) {
+		uint32_t n = *cap ? *cap * 2 : 64;
+		struct argb_span *s = realloc(l->spans, n * sizeof(*s));
+		if (!s)
+			return -1;
+		l->spans = s;
+		*cap = n;
+	}
+	l->spans[l->nspans++] = (struct argb_span){ x0, x1, kind };
+	return 0;
+}
+
+static inline void argb_layer_free(struct argb_layer *l)
+{
+	free(l->pixels);
+	free(l->spans);
+	free(l->row);
+	memset(l, 0, sizeof(*l));
+}
+
+/* ============================================================
+ * argb_layer_init - Load a layer and build its span table.
+ * @src:           ARGB8888 pixels, @stride bytes per row.
+ * @premultiplied: false if @src has straight alpha.
+ *
+ * Returns 0, or -1 if out of memory.
+ * ============================================================ */
+static inline int argb_layer_init(struct argb_layer *l, const void *src,
+				  uint32_t width, uint32_t height,
+				  uint32_t stride, bool premultiplied)
+{
+	uint32_t cap = 0;
+
+	memset(l, 0, sizeof(*l));
+	l->width  = width;
+	l->height = height;
+	l->pixels = malloc((size_t)width * height * sizeof(uint32_t));
+	l->row    = malloc((size_t)(height + 1) * sizeof(uint32_t));
+	if (!l->pixels || !l->row)
+		goto fail;
+
+	for (uint32_t y = 0; y < height; y++) {
+		const uint32_t *in = (const uint32_t *)
+			((const uint8_t *)src + (size_t)y * stride);
+		uint32_t *px = l->pixels + (size_t)y * width;
+
+		for (uint32_t x = 0; x < width; x++)
+			px[x] = premultiplied ? in[x] : argb_premultiply(in[x]);
+
+		l->row[y] = l->nspans;
+		for (uint32_t x0 = 0, x1; x0 < width; x0 = x1) {
+			int cls = argb_pixel_class(px[x0]);
+
+			for (x1 = x0 + 1; x1 < width &&
+			     argb_pixel_class(px[x1]) == cls; x1++)
+				;
+			if (cls != 2 && x1 - x0 < ARGB_BLEND_MIN_RUN)
+				cls = 2;
+			if (cls == 0)
+				continue;
+			if (argb_layer_push(l, &cap, y, x0, x1,
+					    cls == 1 ? ARGB_SPAN_COPY
+						     : ARGB_SPAN_BLEND) < 0)
+				goto fail;
+		}
+	}
+	l->row[height] = l->nspans;
+	return 0;
+
+fail:
+	argb_layer_free(l);
+	return -1;
+}
+
+/* ============================================================
+ * argb_layer_composite - Blend part of a layer over a 32-bit buffer.
+ * @dst:    The pixel where the layer's top-left corner goes.
+ * @pitch:  Bytes per destination row.
+ * @x0..y1: Rectangle to draw, in layer coordinates (clipped).
+ * @stats:  Accumulates pixel counts, may be NULL.
+ * ============================================================ */
+static inline void argb_layer_composite(const struct argb_layer *l,
+					const struct argb_blend_impl *impl,
+					uint8_t *dst, uint32_t pitch,
+					int32_t x0, int32_t y0,
+					int32_t x1, int32_t y1,
+					struct argb_blend_stats *stats)
+{
+	struct argb_blend_stats st = { 0, 0, 0 };
+
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > (int32_t)l->width)  x1 = (int32_t)l->width;
+	if (y1 > (int32_t)l->height) y1 = (int32_t)l->height;
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	for (int32_t y = y0; y < y1; y++) {
+		uint32_t *out = (uint32_t *)(dst + (size_t)y * pitch);
+		const uint32_t *in = l->pixels + (size_t)y * l->width;
+		uint64_t drawn = 0;
+
+		for (uint32_t k = l->row[y]; k < l->row[y + 1]; k++) {
+			const struct argb_span *s = &l->spans[k];
+			uint32_t a = s->x0 > (uint32_t)x0 ? s->x0 : (uint32_t)x0;
+			uint32_t b = s->x1 < (uint32_t)x1 ? s->x1 : (uint32_t)x1;
+
+			if (a >= b)
+				continue;
+			if (s->kind == ARGB_SPAN_COPY) {
+				memcpy(out + a, in + a, (b - a) * sizeof(*out));
+				st.copied += b - a;
+			} else {
+				impl->blend(out + a, in + a, b - a);
+				st.blended += b - a;
+			}
+			drawn += b - a;
+		}
+		st.skipped += (uint64_t)(x1 - x0) - drawn;
+	}
+	if (stats) {
+		stats->copied  += st.copied;
+		stats->blended += st.blended;
+		stats->skipped += st.skipped;
+	}
+}
+
+/* ============================================================
+ * argb_blend_selftest - Every kernel against the scalar reference.
+ *
+ * Blends pseudo-random premultiplied pixels over random destinations
+ * at every length up to 70 (vector loops and scalar tails), checks the
+ * anchors (opaque source replaces, zero source keeps, alpha 128 black
+ * halves white to 127), and that a composited layer's spans give the
+ * same pixels as blending the whole layer.
+ *
+ * Returns the number of mismatches.
+ * ============================================================ */
+static inline int argb_blend_selftest(void)
+{
+	enum { N = 70, W = 96, H = 8 };
+	static uint32_t src[N], dst[N], ref[N], out[N];
+	static uint32_t img[H][W], full[H][W], spans[H][W];
+	uint32_t seed = 12345;
+	int failures = 0;
+
+	for (int i = 0; i < N; i++) {
+		seed = seed * 1103515245u + 12345u;
+		src[i] = argb_premultiply(seed);
+		seed = seed * 1103515245u + 12345u;
+		dst[i] = seed;
+	}
+	src[0] = 0xff123456;
+	src[1] = 0;
+	src[2] = 0x80000000;
+	dst[2] = 0xffffffff;
+
+	memcpy(ref, dst, sizeof(ref));
+	argb_blend_scalar(ref, src, 3);
+	if (ref[0] != src[0] || ref[1] != dst[1] || ref[2] != 0xff7f7f7f)
+		failures++;
+
+	for (size_t i = 0; i < ARGB_BLEND_NUM_IMPLS; i++) {
+		const struct argb_blend_impl *impl = &argb_blend_impls[i];
+		int bad = 0;
+
+		if (!impl->supported())
+			continue;
+
+		for (uint32_t n = 0; n <= N; n++) {
+			memcpy(ref, dst, sizeof(ref));
+			memcpy(out, dst, sizeof(out));
+			argb_blend_scalar(ref, src, n);
+			impl->blend(out, src, n);
+			if (memcmp(ref, out, sizeof(ref)))
+				bad++;
+		}
+		printf("  %-6s  %s\n", impl->name,
+		       bad ? "MISMATCH" : "byte-identical to scalar");
+		failures += bad;
+	}
+
+	/* Transparent margin, opaque body, a translucent band */
+	for (int y = 0; y < H; y++)
+		for (int x = 0; x < W; x++) {
+			seed = seed * 1103515245u + 12345u;
+			img[y][x] = x < 20 ? 0 : x < 60 ? 0xff000000 | seed
+						    : seed;
+			full[y][x] = spans[y][x] = ~seed;
+		}
+	struct argb_layer l;
+	if (argb_layer_init(&l, img, W, H, W * 4, false) < 0)
+		return failures + 1;
+	argb_blend_scalar(full[0], l.pixels, W * H);
+	argb_layer_composite(&l, argb_blend_select(), (uint8_t *)spans,
+			     W * 4, 0, 0, W, H, NULL);
+	if (memcmp(full, spans, sizeof(full)))
+		failures++;
+	argb_layer_free(&l);
+	return failures;
+}
+
+#endif /* ARGB_BLEND_H */
@@ -0,0 +1,444 @@
+#ifndef ATOMIC_REQ_H
+#define ATOMIC_REQ_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <xf86drm.h>
+
+/* ============================================================
+ * atomic-req.h - Reusable atomic request with a userspace mirror of
+ *                the committed KMS state
+ *
+ * The per-frame pattern
+ *
+ *   req = drmModeAtomicAlloc();
+ *   drmModeAtomicAddProperty(req, ...);    (grows the item array)
+ *   drmModeAtomicCommit(fd, req, ...);     (duplicates and sorts req,
+ *                                           then mallocs four arrays)
+ *   drmModeAtomicFree(req);
+ *
+ * costs around half a dozen heap allocations per flip, and re-sends
+ * properties such as the plane's CRTC_ID that never change.  A struct
+ * atomic_req is set up once and reused:
+ *
+ *   - The items and the four arrays DRM_IOCTL_MODE_ATOMIC takes are
+ *     fixed-size members, filled in place; the ioctl is issued
+ *     directly.  Steady-state flipping does not touch the heap.
+ *   - atomic_req_set() compares against a mirror of the last value
+ *     committed for each (object, property) pair and leaves unchanged
+ *     ones out.  The mirror is updated only when a real (not
+ *     TEST_ONLY) commit succeeded: a failed commit changed nothing.
+ *   - atomic_req_add() always sends.  It is for properties that are
+ *     not plane/CRTC state but per-commit arguments: FB_DAMAGE_CLIPS,
+ *     IN_FENCE_FD, OUT_FENCE_PTR.
+ *   - atomic_req_get_cursor()/atomic_req_set_cursor() work like their
+ *     drmModeAtomic counterparts, to drop optional properties again
+ *     after a failed TEST_ONLY.
+ *
+ * The mirror only knows what went through this request.  Values start
+ * out unknown (so the first set always sends); call
+ * atomic_req_invalidate() after committing through another path.
+ *
+ * One request per DRM fd, used from one thread.
+ * ============================================================ */
+
+#define ATOMIC_REQ_MAX_PROPS 64  /* Properties in one commit     */
+#define ATOMIC_REQ_MAX_STATE 128 /* Mirrored (object, property)  */
+
+struct atomic_req_item {
+	uint32_t obj;
+	uint32_t prop;
+	uint64_t value;
+	int      state; /* Mirror slot, -1 for atomic_req_add() */
+};
+
+struct atomic_req_state {
+	uint32_t obj;
+	uint32_t prop;
+	uint64_t value; /* Last committed value, if known */
+	bool     known;
+};
+
+struct atomic_req {
+	struct atomic_req_item  items[ATOMIC_REQ_MAX_PROPS];
+	int                     count;
+	bool                    overflow; /* Items dropped: commit fails */
+	int                     last;     /* Mirror slot set most recently */
+
+	struct atomic_req_state state[ATOMIC_REQ_MAX_STATE];
+	int                     nstate;
+
+	/* DRM_IOCTL_MODE_ATOMIC arguments, grouped by object */
+	uint32_t objs[ATOMIC_REQ_MAX_PROPS];
+	uint32_t count_props[ATOMIC_REQ_MAX_PROPS];
+	uint32_t props[ATOMIC_REQ_MAX_PROPS];
+	uint64_t values[ATOMIC_REQ_MAX_PROPS];
+
+	/* Statistics */
+	uint64_t commits;
+	uint64_t sent;    /* Properties passed to the kernel        */
+	uint64_t elided;  /* atomic_req_set() calls left out        */
+};
+
+static inline void atomic_req_init(struct atomic_req *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->last = -1;
+}
+
+/* Start a new request; the mirror is kept */
+static inline void atomic_req_begin(struct atomic_req *r)
+{
+	r->count    = 0;
+	r->overflow = false;
+	r->last     = -1;
+}
+
+static inline int atomic_req_get_cursor(const struct atomic_req *r)
+{
+	return r->count;
+}
+
+/* Drop every property added after @cursor was taken */
+static inline void atomic_req_set_cursor(struct atomic_req *r, int cursor)
+{
+	r->count = cursor;
+}
+
+/* Forget the mirrored state: every property is sent again */
+static inline void atomic_req_invalidate(struct atomic_req *r)
+{
+	for (int i = 0; i < r->nstate; i++)
+		r->state[i].known = false;
+}
+
+static inline int atomic_req_push(struct atomic_req *r, uint32_t obj,
+				  uint32_t prop, uint64_t value, int state)
+{
+	if (r->count == ATOMIC_REQ_MAX_PROPS) {
+		r->overflow = true;
+		return -ENOSPC;
+	}
+	r->items[r->count] = (struct atomic_req_item){
+		.obj = obj, .prop = prop, .value = value, .state = state,
+	};
+	return r->count++;
+}
+
+/* Per-commit argument, sent whatever was sent before */
+static inline int atomic_req_add(struct atomic_req *r, uint32_t obj,
+				 uint32_t prop, uint64_t value)
+{
+	int i = atomic_req_push(r, obj, prop, value, -1);
+
+	return i < 0 ? i : 0;
+}
+
+/* Mirror slot of (@obj, @prop); -1 once the table is full */
+static inline int atomic_req_state_find(struct atomic_req *r, uint32_t obj,
+					uint32_t prop)
+{
+	for (int i = 0; i < r->nstate; i++)
+		if (r->state[i].obj == obj && r->state[i].prop == prop)
+			return i;
+	if (r->nstate == ATOMIC_REQ_MAX_STATE)
+		return -1;
+	r->state[r->nstate] = (struct atomic_req_state){
+		.obj = obj, .prop = prop,
+	};
+	return r->nstate++;
+}
+
+/* ============================================================
+ * atomic_req_set - Put @obj.@prop = @value into the request unless
+ *                  it is the value already committed.
+ *
+ * Setting a property already in the request sends it again, and the
+ * kernel applies the last value -- as with drmModeAtomicAddProperty(),
+ * which keeps atomic_req_set_cursor() able to drop the later one.
+ * Returns 0, or -ENOSPC (the commit will then fail too).
+ * ============================================================ */
+static inline int atomic_req_set(struct atomic_req *r, uint32_t obj,
+				 uint32_t prop, uint64_t value)
+{
+	int s = atomic_req_state_find(r, obj, prop);
+	bool queued = false;
+
+	if (s < 0)
+		return atomic_req_add(r, obj, prop, value);
+
+	r->last = s;
+	for (int i = 0; i < r->count && !queued; i++)
+		queued = r->items[i].state == s;
+	if (!queued && r->state[s].known && r->state[s].value == value) {
+		r->elided++;
+		return 0;
+	}
+
+	int i = atomic_req_push(r, obj, prop, value, s);
+	return i < 0 ? i : 0;
+}
+
+/* ============================================================
+ * atomic_req_commit - Issue the request built since atomic_req_begin().
+ *
+ * Same flags, user_data and return convention as
+ * drmModeAtomicCommit(): 0 or -errno.  A flip whose properties all
+ * matched the mirror would reach the kernel naming no CRTC and thus
+ * without an event to deliver, so it re-sends the last property set.
+ * The request is empty again afterwards, whatever the outcome.
+ * ============================================================ */
+static inline int atomic_req_commit(struct atomic_req *r, int fd,
+				    uint32_t flags, void *user_data)
+{
+	uint32_t nobjs = 0, n = 0;
+	int ret;
+
+	if (r->overflow) {
+		fprintf(stderr, "atomic request: more than %d properties\n",
+			ATOMIC_REQ_MAX_PROPS);
+		atomic_req_begin(r);
+		return -ENOSPC;
+	}
+	if (!r->count && (flags & DRM_MODE_PAGE_FLIP_EVENT) && r->last >= 0) {
+		struct atomic_req_state *st = &r->state[r->last];
+
+		atomic_req_push(r, st->obj, st->prop, st->value, r->last);
+	}
+
+	/* The ioctl wants the properties grouped per object */
+	for (int i = 0; i < r->count; i++) {
+		uint32_t o = 0;
+
+		while (o < nobjs && r->objs[o] != r->items[i].obj)
+			o++;
+		if (o == nobjs) {
+			r->objs[nobjs]          = r->items[i].obj;
+			r->count_props[nobjs++] = 0;
+		}
+		r->count_props[o]++;
+	}
+	for (uint32_t o = 0; o < nobjs; o++)
+		for (int i = 0; i < r->count; i++)
+			if (r->items[i].obj == r->objs[o]) {
+				r->props[n]    = r->items[i].prop;
+				r->values[n++] = r->items[i].value;
+			}
+
+	struct drm_mode_atomic arg = {
+		.flags           = flags,
+		.count_objs      = nobjs,
+		.objs_ptr        = (uint64_t)(uintptr_t)r->objs,
+		.count_props_ptr = (uint64_t)(uintptr_t)r->count_props,
+		.props_ptr       = (uint64_t)(uintptr_t)r->props,
+		.prop_values_ptr = (uint64_t)(uintptr_t)r->values,
+		.user_data       = (uint64_t)(uintptr_t)user_data,
+	};
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_ATOMIC, &arg) ? -errno : 0;
+
+	if (!ret && !(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		for (int i = 0; i < r->count; i++) {
+			int s = r->items[i].state;
+
+			if (s < 0)
+				continue;
+			r->state[s].value = r->items[i].value;
+			r->state[s].known = true;
+		}
+		r->commits++;
+		r->sent += (uint64_t)r->count;
+	}
+	atomic_req_begin(r);
+	return ret;
+}
+
+static inline void atomic_req_report(const struct atomic_req *r)
+{
+	if (!r->commits)
+		return;
+	printf("Atomic requests: %llu commits, %.1f properties/commit sent, "
+	       "%llu unchanged left out\n",
+	       (unsigned long long)r->commits,
+	       (double)r->sent / (double)r->commits,
+	       (unsigned long long)r->elided);
+}
+
+/* ============================================================
+ * TEST_ONLY validation cache
+ *
+ * A compositor that tries several plane layouts per frame asks the
+ * kernel "would this work?" far more often than anything changes: the
+ * same few layouts come back every frame, only with other buffers in
+ * them.  atomic_req_test() remembers each answer, keyed by a hash of
+ * the configuration the request would produce:
+ *
+ *   - every mirrored property of every object the request touches,
+ *     with the request's value if it sets one and the committed value
+ *     otherwise -- iterated over the mirror, so the order the
+ *     properties were added in does not matter,
+ *   - per-commit arguments (atomic_req_add()),
+ *   - the commit flags.
+ *
+ * Properties registered with atomic_test_cache_ignore() (FB_ID, fence
+ * fds) change every frame without changing the answer; they only
+ * contribute whether they are 0, since "no framebuffer" disables a
+ * plane.  That assumes every buffer cycled through a plane has the
+ * same size and format, which holds for swapchain buffers.
+ *
+ * The kernel's answer also depends on what is not in the key: the
+ * mode, and which displays are connected.  Call
+ * atomic_test_cache_invalidate() after a modeset or a hotplug.
+ * ============================================================ */
+#define ATOMIC_TEST_CACHE_SIZE   256 /* Power of two          */
+#define ATOMIC_TEST_CACHE_IGNORE 8   /* Volatile property IDs */
+
+struct atomic_test_entry {
+	uint64_t key;   /* 0 = empty */
+	int      result; /* 0 or -errno from the TEST_ONLY commit */
+};
+
+struct atomic_test_cache {
+	struct atomic_test_entry slots[ATOMIC_TEST_CACHE_SIZE];
+	uint32_t ignore[ATOMIC_TEST_CACHE_IGNORE];
+	int      nignore;
+
+	/* Statistics */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t invalidations;
+};
+
+static inline void atomic_test_cache_init(struct atomic_test_cache *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+/* Treat @prop as volatile; 0 (e.g. a property the driver lacks) is ignored */
+static inline void atomic_test_cache_ignore(struct atomic_test_cache *c,
+					    uint32_t prop)
+{
+	if (prop && c->nignore < ATOMIC_TEST_CACHE_IGNORE)
+		c->ignore[c->nignore++] = prop;
+}
+
+static inline void atomic_test_cache_invalidate(struct atomic_test_cache *c)
+{
+	memset(c->slots, 0, sizeof(c->slots));
+	c->invalidations++;
+}
+
+/* splitmix64 finalizer */
+static inline uint64_t atomic_test_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static inline uint64_t atomic_test_term(const struct atomic_test_cache *c,
+					uint32_t obj, uint32_t prop,
+					uint64_t value, bool known)
+{
+	for (int i = 0; i < c->nignore; i++)
+		if (c->ignore[i] == prop)
+			value = value != 0;
+	return atomic_test_mix(atomic_test_mix((uint64_t)obj << 32 | prop) ^
+			       value ^ (known ? 0 : 0x5a5a5a5a5a5a5a5aULL));
+}
+
+/* Hash of the configuration the request in @r would produce */
+static inline uint64_t atomic_test_key(const struct atomic_test_cache *c,
+				       const struct atomic_req *r,
+				       uint32_t flags)
+{
+	uint64_t key = atomic_test_mix(flags | 1ULL << 63);
+
+	/* Terms are summed: the result is independent of their order */
+	for (int s = 0; s < r->nstate; s++) {
+		const struct atomic_req_state *st = &r->state[s];
+		bool touched = false, queued = false;
+		uint64_t value = st->value;
+
+		for (int i = r->count - 1; i >= 0; i--) {
+			if (r->items[i].obj != st->obj)
+				continue;
+			touched = true;
+			if (r->items[i].state == s) {
+				value  = r->items[i].value;
+				queued = true;
+				break;
+			}
+		}
+		if (touched)
+			key += atomic_test_term(c, st->obj, st->prop, value,
+						queued || st->known);
+	}
+	for (int i = 0; i < r->count; i++)
+		if (r->items[i].state < 0)
+			key += atomic_test_term(c, r->items[i].obj,
+						r->items[i].prop,
+						r->items[i].value, true);
+	return key ? key : 1;
+}
+
+/* ============================================================
+ * atomic_req_test - TEST_ONLY commit of the request, answered from
+ *                   @c when this configuration was tried before.
+ *
+ * Returns 0 if the kernel accepts it, -errno otherwise (-EINVAL or
+ * -ERANGE for a rejected configuration, the ones cached); either way the
+ * request is empty again, as after atomic_req_commit().  @c may be
+ * NULL to always ask the kernel.
+ * ============================================================ */
+static inline int atomic_req_test(struct atomic_req *r, int fd,
+				  uint32_t flags, struct atomic_test_cache *c)
+{
+	flags |= DRM_MODE_ATOMIC_TEST_ONLY;
+	if (!c)
+		return atomic_req_commit(r, fd, flags, NULL);
+
+	uint64_t key = atomic_test_key(c, r, flags);
+	uint32_t slot = (uint32_t)key & (ATOMIC_TEST_CACHE_SIZE - 1);
+
+	/* Linear probing, 8 slots; a full run evicts the home slot */
+	for (uint32_t p = 0; p < 8; p++) {
+		struct atomic_test_entry *e =
+			&c->slots[(slot + p) & (ATOMIC_TEST_CACHE_SIZE - 1)];
+
+		if (e->key == key) {
+			c->hits++;
+			atomic_req_begin(r);
+			return e->result;
+		}
+		if (!e->key) {
+			slot = (slot + p) & (ATOMIC_TEST_CACHE_SIZE - 1);
+			break;
+		}
+	}
+
+	int ret = atomic_req_commit(r, fd, flags, NULL);
+
+	/* Only "accepted" and "rejected" are answers; -EINTR etc. are not */
+	c->misses++;
+	if (ret == 0 || ret == -EINVAL || ret == -ERANGE)
+		c->slots[slot] = (struct atomic_test_entry){ key, ret };
+	return ret;
+}
+
+static inline void atomic_test_cache_report(const struct atomic_test_cache *c)
+{
+	if (!c->hits && !c->misses)
+		return;
+	printf("TEST_ONLY cache: %llu hits, %llu misses (%.1f%%), "
+	       "%llu invalidations\n",
+	       (unsigned long long)c->hits, (unsigned long long)c->misses,
+	       100.0 * (double)c->hits / (double)(c->hits + c->misses),
+	       (unsigned long long)c->invalidations);
+}
+
+#endif /* ATOMIC_REQ_H */
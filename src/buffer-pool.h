@@ -0,0 +1,239 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ============================================================
+ * buffer-pool.h - Recycle scanout buffers by size and format
+ *
+ * A dumb-buffer framebuffer costs CREATE_DUMB, ADDFB2, MAP_DUMB and
+ * an mmap(), and then a page fault on every page the renderer first
+ * touches (8 MB at 1080p XRGB8888, 2 k faults).  The demos used to pay
+ * that once at startup and undo it at exit; anything that changes the
+ * resolution, the format or the number of buffers pays it again for
+ * every buffer.
+ *
+ * A pool keeps released buffers instead, whole: GEM handle, FB ID and
+ * the mapping, pages already faulted in.  They are filed in classes by
+ * (width, height, fourcc), the things an FB is created for, and a get
+ * with the same key returns one without entering the kernel.  A miss
+ * calls the caller's allocator.
+ *
+ * Idle buffers hold kernel memory (usually CMA on these boards), so
+ * the pool keeps at most @high_water bytes of them: releasing past the
+ * mark, or buffer_pool_trim(), frees the least recently released ones
+ * first, which are the classes the display no longer uses.
+ *
+ * The pool stores the caller's buffer struct by value (@elem_size
+ * bytes) and never looks inside; buffers in use are not tracked.
+ * ============================================================ */
+
+#define BUFFER_POOL_MAX_IDLE 32
+
+/* Fill in @buf (whose key fields the caller set) with a new buffer */
+typedef int  (*buffer_pool_alloc_fn)(void *ctx, void *buf);
+typedef void (*buffer_pool_free_fn)(void *ctx, void *buf);
+
+struct buffer_pool_entry {
+	uint32_t width, height, fourcc;
+	uint64_t bytes;
+	uint64_t released; /* Release order, for least-recently-used */
+};
+
+struct buffer_pool {
+	size_t               elem_size;
+	buffer_pool_alloc_fn alloc;
+	buffer_pool_free_fn  free;
+	void                *ctx;
+	uint64_t             high_water; /* Idle bytes kept at most */
+
+	struct buffer_pool_entry idle[BUFFER_POOL_MAX_IDLE];
+	unsigned char           *store; /* idle[i]'s buffer at i * elem_size */
+	int                      nidle;
+	uint64_t                 idle_bytes;
+	uint64_t                 seq;
+
+	/* Statistics */
+	uint64_t gets;
+	uint64_t hits;
+	uint64_t trimmed;
+	uint64_t peak_idle_bytes;
+	double   hit_ms, miss_ms; /* Total time in get, by outcome */
+	double   max_miss_ms;
+};
+
+static inline double buffer_pool_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Returns 0, or -1 if out of memory */
+static inline int buffer_pool_init(struct buffer_pool *bp, size_t elem_size,
+				   buffer_pool_alloc_fn alloc,
+				   buffer_pool_free_fn free_fn, void *ctx,
+				   uint64_t high_water)
+{
+	memset(bp, 0, sizeof(*bp));
+	bp->store = calloc(BUFFER_POOL_MAX_IDLE, elem_size);
+	if (!bp->store)
+		return -1;
+	bp->elem_size  = elem_size;
+	bp->alloc      = alloc;
+	bp->free       = free_fn;
+	bp->ctx        = ctx;
+	bp->high_water = high_water;
+	return 0;
+}
+
+static inline void *buffer_pool_slot(struct buffer_pool *bp, int i)
+{
+	return bp->store + (size_t)i * bp->elem_size;
+}
+
+/* Take idle buffer @i out of the pool (into @buf, or freed if NULL) */
+static inline void buffer_pool_remove(struct buffer_pool *bp, int i, void *buf)
+{
+	if (buf) {
+		memcpy(buf, buffer_pool_slot(bp, i), bp->elem_size);
+	} else {
+		bp->free(bp->ctx, buffer_pool_slot(bp, i));
+		bp->trimmed++;
+	}
+	bp->idle_bytes -= bp->idle[i].bytes;
+	bp->nidle--;
+	if (i != bp->nidle) {
+		bp->idle[i] = bp->idle[bp->nidle];
+		memcpy(buffer_pool_slot(bp, i), buffer_pool_slot(bp, bp->nidle),
+		       bp->elem_size);
+	}
+}
+
+static inline int buffer_pool_oldest(const struct buffer_pool *bp)
+{
+	int oldest = 0;
+
+	for (int i = 1; i < bp->nidle; i++)
+		if (bp->idle[i].released < bp->idle[oldest].released)
+			oldest = i;
+	return oldest;
+}
+
+/* ============================================================
+ * buffer_pool_trim - Free idle buffers, least recently released
+ *                    first, until at most @keep bytes are left.
+ *
+ * buffer_pool_trim(bp, 0) empties the pool.
+ * ============================================================ */
+static inline void buffer_pool_trim(struct buffer_pool *bp, uint64_t keep)
+{
+	while (bp->nidle && bp->idle_bytes > keep)
+		buffer_pool_remove(bp, buffer_pool_oldest(bp), NULL);
+}
+
+/* ============================================================
+ * buffer_pool_get - A buffer for (@width, @height, @fourcc).
+ * @buf: The caller's buffer struct, with whatever its allocator
+ *       needs already filled in.
+ *
+ * Copies the most recently released idle buffer of that class into
+ * @buf, or calls the allocator.  Returns 0, or the allocator's error.
+ * ============================================================ */
+static inline int buffer_pool_get(struct buffer_pool *bp, void *buf,
+				  uint32_t width, uint32_t height,
+				  uint32_t fourcc)
+{
+	double t0 = buffer_pool_now_ms();
+	int best = -1;
+
+	bp->gets++;
+	for (int i = 0; i < bp->nidle; i++) {
+		const struct buffer_pool_entry *e = &bp->idle[i];
+
+		if (e->width == width && e->height == height &&
+		    e->fourcc == fourcc &&
+		    (best < 0 || e->released > bp->idle[best].released))
+			best = i;
+	}
+
+	if (best >= 0) {
+		buffer_pool_remove(bp, best, buf);
+		bp->hits++;
+		bp->hit_ms += buffer_pool_now_ms() - t0;
+		return 0;
+	}
+
+	int ret = bp->alloc(bp->ctx, buf);
+	double dt = buffer_pool_now_ms() - t0;
+
+	bp->miss_ms += dt;
+	if (dt > bp->max_miss_ms)
+		bp->max_miss_ms = dt;
+	return ret;
+}
+
+/* ============================================================
+ * buffer_pool_put - Hand back a buffer from buffer_pool_get().
+ * @bytes: Memory it holds, counted against the high-water mark.
+ *
+ * The buffer must no longer be on screen.  It is kept idle, then the
+ * pool is trimmed to the high-water mark (which may free this very
+ * buffer if it is larger than the mark).
+ * ============================================================ */
+static inline void buffer_pool_put(struct buffer_pool *bp, void *buf,
+				   uint32_t width, uint32_t height,
+				   uint32_t fourcc, uint64_t bytes)
+{
+	if (bp->nidle == BUFFER_POOL_MAX_IDLE)
+		buffer_pool_remove(bp, buffer_pool_oldest(bp), NULL);
+
+	bp->idle[bp->nidle] = (struct buffer_pool_entry){
+		.width    = width,
+		.height   = height,
+		.fourcc   = fourcc,
+		.bytes    = bytes,
+		.released = ++bp->seq,
+	};
+	memcpy(buffer_pool_slot(bp, bp->nidle), buf, bp->elem_size);
+	bp->nidle++;
+	bp->idle_bytes += bytes;
+	if (bp->idle_bytes > bp->peak_idle_bytes)
+		bp->peak_idle_bytes = bp->idle_bytes;
+	buffer_pool_trim(bp, bp->high_water);
+}
+
+/* Free every idle buffer and the pool itself */
+static inline void buffer_pool_destroy(struct buffer_pool *bp)
+{
+	buffer_pool_trim(bp, 0);
+	free(bp->store);
+	bp->store = NULL;
+}
+
+static inline void buffer_pool_report(const struct buffer_pool *bp,
+				      const char *name)
+{
+	uint64_t misses = bp->gets - bp->hits;
+
+	if (!bp->gets)
+		return;
+	printf("Buffer pool (%s): %llu gets, %llu hits (%.0f%%), "
+	       "%llu freed by trimming, peak %.1f MiB idle\n",
+	       name, (unsigned long long)bp->gets,
+	       (unsigned long long)bp->hits, 100.0 * bp->hits / bp->gets,
+	       (unsigned long long)bp->trimmed,
+	       bp->peak_idle_bytes / (1024.0 * 1024.0));
+	printf("  allocation %.3f ms avg (%.3f max) over %llu misses, "
+	       "reuse %.4f ms avg\n",
+	       misses ? bp->miss_ms / misses : 0.0, bp->max_miss_ms,
+	       (unsigned long long)misses,
+	       bp->hits ? bp->hit_ms / bp->hits : 0.0);
+}
+
+#endif /* BUFFER_POOL_H */
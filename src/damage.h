@@ -0,0 +1,285 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* ============================================================
+ * damage.h - Damage tracking with per-buffer age
+ *
+ * Between two frames of the moving-bar scene only two narrow column
+ * strips change: the strip the bar just left and the strip it just
+ * moved into.  Repainting the whole framebuffer every frame therefore
+ * writes ~2M pixels at 1080p when a few tens of thousands would do.
+ *
+ * The catch is that with N buffers in the swap set, the back buffer
+ * we are about to draw into does not hold the previous frame -- it
+ * holds the frame from N flips ago.  Its "age" (in frames) tells us
+ * how many frames of damage it missed:
+ *
+ *   age 0      buffer never rendered  -> repaint everything
+ *   age k      buffer holds frame F-k -> repaint damage(F-k+1 .. F)
+ *   age > hist history lost           -> repaint everything
+ *
+ * This is the same model as EGL_EXT_buffer_age.  The tracker keeps a
+ * small ring of per-frame damage regions and the frame number each
+ * buffer was last brought up to date at.
+ *
+ * Rectangles are half-open [x1, x2) x [y1, y2), the same layout as
+ * struct drm_mode_rect, so they can be handed straight to the kernel
+ * as FB_DAMAGE_CLIPS.
+ * ============================================================ */
+
+#define DAMAGE_MAX_RECTS   8  /* Per region; overflow collapses to bbox */
+#define DAMAGE_HISTORY     8  /* Frames of damage kept (>= swap depth)  */
+#define DAMAGE_MAX_BUFFERS 8
+
+struct damage_rect {
+	int32_t x1, y1;
+	int32_t x2, y2;
+};
+
+struct damage_region {
+	uint32_t           count;
+	struct damage_rect rects[DAMAGE_MAX_RECTS];
+};
+
+struct damage_tracker {
+	int32_t  width;
+	int32_t  height;
+	uint64_t frame;                            /* Current frame, 1-based */
+	uint64_t buffer_frame[DAMAGE_MAX_BUFFERS]; /* 0 = never rendered     */
+	struct damage_region history[DAMAGE_HISTORY];
+	struct damage_region repaint;              /* Scratch for callers    */
+	bool     repaint_full;                     /* Last repaint was full  */
+
+	/* Pixel write counters */
+	uint64_t pixels_frame;  /* Pixels repainted in the current frame */
+	uint64_t pixels_total;
+	uint64_t full_repaints;
+};
+
+static inline void damage_tracker_init(struct damage_tracker *dt,
+				       uint32_t width, uint32_t height)
+{
+	memset(dt, 0, sizeof(*dt));
+	dt->width  = (int32_t)width;
+	dt->height = (int32_t)height;
+}
+
+static inline int64_t damage_rect_area(const struct damage_rect *r)
+{
+	return (int64_t)(r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static inline int64_t damage_region_area(const struct damage_region *rg)
+{
+	int64_t area = 0;
+	for (uint32_t i = 0; i < rg->count; i++)
+		area += damage_rect_area(&rg->rects[i]);
+	return area;
+}
+
+/* Rectangles that overlap or share an edge can be merged into one */
+static inline int damage_rect_touches(const struct damage_rect *a,
+				      const struct damage_rect *b)
+{
+	return a->x1 <= b->x2 && b->x1 <= a->x2 &&
+	       a->y1 <= b->y2 && b->y1 <= a->y2;
+}
+
+static inline void damage_rect_union(struct damage_rect *a,
+				     const struct damage_rect *b)
+{
+	if (b->x1 < a->x1) a->x1 = b->x1;
+	if (b->y1 < a->y1) a->y1 = b->y1;
+	if (b->x2 > a->x2) a->x2 = b->x2;
+	if (b->y2 > a->y2) a->y2 = b->y2;
+}
+
+/* ============================================================
+ * damage_region_add - Add a rectangle, keeping the region disjoint.
+ *
+ * The rectangle is clipped to [0, w) x [0, h) first.  Touching
+ * rectangles are merged into their bounding box, and merging repeats
+ * until no two rectangles touch, so every pixel in the region is
+ * painted exactly once.  The bounding box can over-cover corners for
+ * rectangles with different extents -- harmless, since repainting a
+ * clean pixel only costs bandwidth, never correctness.
+ * ============================================================ */
+static inline void damage_region_add(struct damage_region *rg,
+				     struct damage_rect r,
+				     int32_t w, int32_t h)
+{
+	if (r.x1 < 0) r.x1 = 0;
+	if (r.y1 < 0) r.y1 = 0;
+	if (r.x2 > w) r.x2 = w;
+	if (r.y2 > h) r.y2 = h;
+	if (r.x1 >= r.x2 || r.y1 >= r.y2)
+		return;
+
+	for (uint32_t i = 0; i < rg->count; ) {
+		if (damage_rect_touches(&rg->rects[i], &r)) {
+			damage_rect_union(&r, &rg->rects[i]);
+			rg->rects[i] = rg->rects[--rg->count];
+			i = 0; /* The grown rect may now touch earlier ones */
+			continue;
+		}
+		i++;
+	}
+
+	if (rg->count == DAMAGE_MAX_RECTS) {
+		for (uint32_t i = 1; i < rg->count; i++)
+			damage_rect_union(&rg->rects[0], &rg->rects[i]);
+		damage_rect_union(&rg->rects[0], &r);
+		rg->count = 1;
+		return;
+	}
+	rg->rects[rg->count++] = r;
+}
+
+static inline void damage_region_full(struct damage_region *rg,
+				      int32_t w, int32_t h)
+{
+	rg->count = 1;
+	rg->rects[0] = (struct damage_rect){ 0, 0, w, h };
+}
+
+/* ============================================================
+ * damage_add_column_move - Damage for a full-height column span that
+ *                          moved from [old_x, old_x + span_w) to
+ *                          [new_x, new_x + span_w).
+ *
+ * Only the symmetric difference changes: when the spans overlap that
+ * is one strip at each end (the area left behind and the area moved
+ * into); when they do not, it is both spans in full.
+ * ============================================================ */
+static inline void damage_add_column_move(struct damage_region *rg,
+					  int32_t old_x, int32_t new_x,
+					  int32_t span_w,
+					  int32_t w, int32_t h)
+{
+	int32_t a0 = old_x, a1 = old_x + span_w;
+	int32_t b0 = new_x, b1 = new_x + span_w;
+
+	if (a1 <= b0 || b1 <= a0) {
+		damage_region_add(rg, (struct damage_rect){ a0, 0, a1, h }, w, h);
+		damage_region_add(rg, (struct damage_rect){ b0, 0, b1, h }, w, h);
+		return;
+	}
+	damage_region_add(rg, (struct damage_rect){
+		a0 < b0 ? a0 : b0, 0, a0 < b0 ? b0 : a0, h }, w, h);
+	damage_region_add(rg, (struct damage_rect){
+		a1 < b1 ? a1 : b1, 0, a1 < b1 ? b1 : a1, h }, w, h);
+}
+
+/* ============================================================
+ * damage_begin_frame - Start a new frame.
+ *
+ * Returns the (empty) region in which the caller records what changes
+ * between the previous frame and this one.
+ * ============================================================ */
+static inline struct damage_region *damage_begin_frame(struct damage_tracker *dt)
+{
+	struct damage_region *rg = &dt->history[++dt->frame % DAMAGE_HISTORY];
+
+	rg->count = 0;
+	dt->pixels_frame = 0;
+	return rg;
+}
+
+/* What changed between the previous frame and the current one */
+static inline const struct damage_region *
+damage_frame_region(const struct damage_tracker *dt)
+{
+	return &dt->history[dt->frame % DAMAGE_HISTORY];
+}
+
+static inline uint32_t damage_buffer_age(const struct damage_tracker *dt,
+					 int buf)
+{
+	if (!dt->buffer_frame[buf])
+		return 0;
+	return (uint32_t)(dt->frame - dt->buffer_frame[buf]);
+}
+
+/* ============================================================
+ * damage_buffer_repaint - Region to redraw in @buf for this frame.
+ *
+ * Unions the damage of the last age(@buf) frames (including the one
+ * just begun), marks @buf as up to date and accounts the pixel count.
+ * The returned region lives in the tracker until the next call.
+ * ============================================================ */
+static inline const struct damage_region *
+damage_buffer_repaint(struct damage_tracker *dt, int buf)
+{
+	struct damage_region *out = &dt->repaint;
+	uint32_t age = damage_buffer_age(dt, buf);
+
+	out->count = 0;
+	dt->repaint_full = (age == 0 || age > DAMAGE_HISTORY);
+	if (dt->repaint_full) {
+		damage_region_full(out, dt->width, dt->height);
+		dt->full_repaints++;
+	} else {
+		for (uint32_t k = 0; k < age; k++) {
+			const struct damage_region *h =
+				&dt->history[(dt->frame - k) % DAMAGE_HISTORY];
+			for (uint32_t i = 0; i < h->count; i++)
+				damage_region_add(out, h->rects[i],
+						  dt->width, dt->height);
+		}
+	}
+
+	dt->buffer_frame[buf] = dt->frame;
+	dt->pixels_frame  = (uint64_t)damage_region_area(out);
+	dt->pixels_total += dt->pixels_frame;
+	return out;
+}
+
+/* ============================================================
+ * damage_between - What changed from frame @from to frame @to.
+ *
+ * Unions the damage of frames @from + 1 .. @to into @out.  Returns
+ * false when the answer is unknown -- @from is 0 (initial contents)
+ * or part of the span has dropped out of the history -- and the
+ * caller must treat everything as damaged.
+ * ============================================================ */
+static inline bool damage_between(const struct damage_tracker *dt,
+				  uint64_t from, uint64_t to,
+				  struct damage_region *out)
+{
+	out->count = 0;
+	if (!from || from > to || to > dt->frame ||
+	    dt->frame - from > DAMAGE_HISTORY)
+		return false;
+
+	for (uint64_t f = from + 1; f <= to; f++) {
+		const struct damage_region *h = &dt->history[f % DAMAGE_HISTORY];
+		for (uint32_t i = 0; i < h->count; i++)
+			damage_region_add(out, h->rects[i],
+					  dt->width, dt->height);
+	}
+	return true;
+}
+
+/* Print the pixel-write counter once every @every frames */
+static inline void damage_report(const struct damage_tracker *dt,
+				 uint32_t every)
+{
+	if (!every || dt->frame % every)
+		return;
+
+	uint64_t full = (uint64_t)dt->width * (uint64_t)dt->height;
+	printf("  Frame %llu: %llu px written (%.1f%% of %llu), avg %llu px/frame, %llu full repaints\n",
+	       (unsigned long long)dt->frame,
+	       (unsigned long long)dt->pixels_frame,
+	       full ? 100.0 * (double)dt->pixels_frame / (double)full : 0.0,
+	       (unsigned long long)full,
+	       (unsigned long long)(dt->pixels_total / dt->frame),
+	       (unsigned long long)dt->full_repaints);
+}
+
+#endif /* DAMAGE_H */
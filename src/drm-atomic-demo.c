@@ -8,11 +8,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <sys/select.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "argb-blend.h"
+#include "atomic-req.h"
+#include "buffer-pool.h"
+#include "damage.h"
+#include "event-loop.h"
+#include "frame-pipeline.h"
+#include "frame-sched.h"
+#include "frame-telemetry.h"
+#include "kms-snapshot.h"
+#include "layer-planner.h"
+#include "pixel-format.h"
+#include "prop-index.h"
+#include "render-pool.h"
+#include "shadow-buffer.h"
+#include "span-fill.h"
+#include "swapchain.h"
+
+/* Older libdrm headers predate atomic async flips (Linux 6.8) */
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
 /* ============================================================
  * DRM Atomic KMS Demo
  *
@@ -23,15 +44,32 @@
  *   drm-pageflip-vs-tearing.c  -- legacy SetCrtc / PageFlip API
  *   drm-atomic-demo.c          -- atomic commit, properties, planes
  *
- * Three runnable modes:
+ * Five runnable modes:
  *   (default)     Print all KMS object properties and exit
- *   --atomic      Atomic modesetting + non-blocking page flip
+ *   --atomic      Atomic modesetting + non-blocking page flip, through
+ *                 a swapchain (--buffers N, --present MODE), or with
+ *                 --threaded from a separate render thread;
+ *                 --bench-commit times the flip request instead,
+ *                 --bench-resize swapchain resizes with and without
+ *                 the buffer pool, --bench-arena separate buffers
+ *                 against one arena (--arena)
  *   --multiplane  Primary plane animation + static overlay plane
+ *                 (blended by the CPU if no overlay plane is usable);
+ *                 --bench-layouts times TEST_ONLY layout trials,
+ *                 --layers N spreads N layers over every usable plane
+ *   --multihead   --atomic on every connected display at once, each
+ *                 head on its own CRTC and at its own refresh rate;
+ *                 with --genlock one scene across all of them, every
+ *                 head updated by the same commit
+ *   --selftest    Check the CPU blend kernels against the reference
  *
  * Tested on RK3588 / VOP2 with Ubuntu Lite (no compositor).
  * ============================================================ */
 
-#define MAX_BUFFERS 2
+#define MAX_BUFFERS 2 /* --multiplane; --atomic uses --buffers */
+
+#define BAR_STEP   8      /* Pixels per frame, fixed-step animation   */
+#define BAR_SPEED  480.0  /* Pixels per second with --deadline (8@60) */
 
 /* ============================================================
  * Property ID cache
@@ -62,6 +100,7 @@ struct plane_props {
 	uint32_t src_w;
 	uint32_t src_h;
 	uint32_t type;   /* PRIMARY / OVERLAY / CURSOR */
+	uint32_t fb_damage_clips; /* Optional: 0 if the driver lacks it */
 };
 
 struct crtc_props {
@@ -71,6 +110,43 @@ struct crtc_props {
 
 struct connector_props {
 	uint32_t crtc_id;
+	uint32_t edid;     /* Blob property; 0 if the connector has none */
+};
+
+/* ============================================================
+ * Damage clip blob cache
+ *
+ * FB_DAMAGE_CLIPS takes a blob of struct drm_mode_rect telling the
+ * driver which part of the new framebuffer differs from the one on
+ * screen.  Drivers that upload partially (SPI/USB panels, virtual
+ * GPUs) or run self-refresh panels (PSR2 selective update) can then
+ * skip the untouched area.
+ *
+ * Blobs are immutable kernel objects, so the obvious implementation
+ * creates one per flip and destroys it afterwards: two extra ioctls
+ * per frame.  Instead rects are snapped outward to a DAMAGE_CLIP_ALIGN
+ * grid -- the bouncing bar then yields only a few dozen distinct clip
+ * sets -- and blobs are kept in a content-addressed LRU cache.  In
+ * steady state every flip reuses an existing blob ID.
+ *
+ * Destroying an evicted blob is safe even if an in-flight commit still
+ * references it: the plane state holds its own kernel reference.
+ * ============================================================ */
+#define DAMAGE_CLIP_ALIGN  64
+#define DAMAGE_BLOB_CACHE  128
+
+struct damage_blob {
+	uint32_t             blob_id; /* 0 = empty slot */
+	uint32_t             count;
+	uint64_t             last_use;
+	struct drm_mode_rect rects[DAMAGE_MAX_RECTS];
+};
+
+struct damage_blob_cache {
+	uint64_t           tick;
+	uint64_t           hits;
+	uint64_t           created;
+	struct damage_blob slots[DAMAGE_BLOB_CACHE];
 };
 
 /* Top-level KMS pipeline state */
@@ -90,6 +166,8 @@ struct kms_state {
 	struct crtc_props       crtc_props;
 	struct plane_props      primary_props;
 	struct plane_props      overlay_props;
+
+	struct damage_blob_cache damage_blobs;
 };
 
 struct buffer_object {
@@ -100,22 +178,58 @@ struct buffer_object {
 	uint32_t size;
 	uint8_t  *vaddr;
 	uint32_t fb_id;
+	const struct pixel_format *fmt;
 };
 
 struct animation_state {
 	int bar_x;
+	int prev_bar_x; /* Position before the last update (damage source) */
 	int bar_width;
 	int direction;
 	int frame_count;
+	double time_ms; /* Presentation time of the frame (--deadline) */
+	double frac;    /* Sub-pixel motion carried to the next frame  */
 };
 
 struct flip_pending {
 	bool waiting;
+	struct swapchain   *sc;    /* --atomic: advanced on every flip event */
+	struct frame_sched *sched; /* --deadline: fed every flip event       */
+};
+
+/* ============================================================
+ * Multi-head state (--multihead)
+ *
+ * Every connected connector gets its own CRTC and primary plane and
+ * runs the --atomic loop on its own buffers, swapchain, damage
+ * tracker, animation and timing histograms.  All heads share the one
+ * DRM fd, so their flip events arrive interleaved on it and are
+ * routed by the crtc_id the atomic event carries.
+ * ============================================================ */
+#define MAX_HEADS 4 /* RK3588 VOP2 has four video ports */
+
+struct head {
+	struct kms_state       kms;  /* Shared fd; own CRTC, plane, mode */
+	struct buffer_object   bufs[SWAPCHAIN_MAX_DEPTH];
+	struct swapchain       sc;
+	struct damage_tracker  dt;
+	struct animation_state anim;
+	struct frame_telemetry tel;
+	bool                   waiting; /* Flip in flight */
+	double                 flip_ms; /* Timestamp of the last flip event */
+	int32_t                wall_x;  /* --genlock: left edge in the wall */
+	char                   name[16];
+};
+
+static struct head heads[MAX_HEADS];
+static int nheads; /* 0 outside --multihead */
+
+static const uint32_t head_colors[MAX_HEADS] = {
+	0xffffff, 0x00ff88, 0x4488ff, 0xffaa00,
 };
 
 /* ============================================================
  * get_property_id - Look up a property ID by name on a DRM object.
- * @fd:      DRM file descriptor.
  * @props:   Property list returned by drmModeObjectGetProperties().
  * @name:    Property name string to search for.
  * @id_out:  Receives the property ID if found.
@@ -125,27 +239,21 @@ struct flip_pending {
  * Every KMS object (connector, CRTC, plane) exposes a set of named
  * properties.  The property IDs are assigned dynamically by the kernel
  * at driver load time, so they must be discovered at runtime rather
- * than hard-coded.  This helper performs that discovery.
+ * than hard-coded.  This helper performs that discovery, with the
+ * names coming from the process-wide index (see prop-index.h).
  * ============================================================ */
-static int get_property_id(int fd,
-			   drmModeObjectProperties *props,
+static struct prop_index prop_index;
+
+static int get_property_id(drmModeObjectProperties *props,
 			   const char *name,
 			   uint32_t *id_out)
 {
-	for (uint32_t i = 0; i < props->count_props; i++) {
-		drmModePropertyRes *prop =
-			drmModeGetProperty(fd, props->props[i]);
-		if (!prop)
-			continue;
+	int i = prop_index_find(&prop_index, props, name);
 
-		if (strcmp(prop->name, name) == 0) {
-			*id_out = prop->prop_id;
-			drmModeFreeProperty(prop);
-			return 0;
-		}
-		drmModeFreeProperty(prop);
-	}
-	return -1;
+	if (i < 0)
+		return -1;
+	*id_out = props->props[i];
+	return 0;
 }
 
 /* ============================================================
@@ -178,8 +286,8 @@ static void print_object_properties(int fd, uint32_t obj_id,
 			  "  ------------  -------------");
 
 	for (uint32_t i = 0; i < props->count_props; i++) {
-		drmModePropertyRes *prop =
-			drmModeGetProperty(fd, props->props[i]);
+		const struct prop_info *prop =
+			prop_index_get(&prop_index, props->props[i]);
 		if (!prop)
 			continue;
 
@@ -201,7 +309,7 @@ static void print_object_properties(int fd, uint32_t obj_id,
 			strcat(flags, "SIGNED_RANGE");
 
 		printf("  %-6u  %-32s  %-12s  %" PRIu64 "\n",
-		       prop->prop_id, prop->name, flags,
+		       prop->id, prop->name, flags,
 		       props->prop_values[i]);
 
 		/*
@@ -210,14 +318,12 @@ static void print_object_properties(int fd, uint32_t obj_id,
 		 *   0=Overlay, 1=Primary, 2=Cursor
 		 */
 		if (prop->flags & DRM_MODE_PROP_ENUM) {
-			for (int e = 0; e < prop->count_enums; e++) {
+			for (uint32_t e = 0; e < prop->count_enums; e++) {
 				printf("  %6s  %-32s  %-12s  value=%" PRIu64 "\n",
 				       "", prop->enums[e].name, "(enum)",
 				       (uint64_t)prop->enums[e].value);
 			}
 		}
-
-		drmModeFreeProperty(prop);
 	}
 
 	drmModeFreeObjectProperties(props);
@@ -299,22 +405,15 @@ static void run_property_discovery(int fd, drmModeRes *res,
 						   DRM_MODE_OBJECT_PLANE);
 		const char *type_str = "Unknown";
 		if (oprops) {
-			for (uint32_t p = 0; p < oprops->count_props; p++) {
-				drmModePropertyRes *pr =
-					drmModeGetProperty(fd,
-							   oprops->props[p]);
-				if (pr && strcmp(pr->name, "type") == 0) {
-					uint64_t val = oprops->prop_values[p];
-					if (val == DRM_PLANE_TYPE_PRIMARY)
-						type_str = "PRIMARY";
-					else if (val == DRM_PLANE_TYPE_OVERLAY)
-						type_str = "OVERLAY";
-					else if (val == DRM_PLANE_TYPE_CURSOR)
-						type_str = "CURSOR";
-					drmModeFreeProperty(pr);
-					break;
-				}
-				drmModeFreeProperty(pr);
+			int p = prop_index_find(&prop_index, oprops, "type");
+			if (p >= 0) {
+				uint64_t val = oprops->prop_values[p];
+				if (val == DRM_PLANE_TYPE_PRIMARY)
+					type_str = "PRIMARY";
+				else if (val == DRM_PLANE_TYPE_OVERLAY)
+					type_str = "OVERLAY";
+				else if (val == DRM_PLANE_TYPE_CURSOR)
+					type_str = "CURSOR";
 			}
 			drmModeFreeObjectProperties(oprops);
 		}
@@ -347,17 +446,26 @@ static int cache_plane_props(int fd, uint32_t plane_id, struct plane_props *p)
 	if (!props) return -1;
 
 	int ret = 0;
-	ret |= get_property_id(fd, props, "FB_ID",   &p->fb_id);
-	ret |= get_property_id(fd, props, "CRTC_ID", &p->crtc_id);
-	ret |= get_property_id(fd, props, "CRTC_X",  &p->crtc_x);
-	ret |= get_property_id(fd, props, "CRTC_Y",  &p->crtc_y);
-	ret |= get_property_id(fd, props, "CRTC_W",  &p->crtc_w);
-	ret |= get_property_id(fd, props, "CRTC_H",  &p->crtc_h);
-	ret |= get_property_id(fd, props, "SRC_X",   &p->src_x);
-	ret |= get_property_id(fd, props, "SRC_Y",   &p->src_y);
-	ret |= get_property_id(fd, props, "SRC_W",   &p->src_w);
-	ret |= get_property_id(fd, props, "SRC_H",   &p->src_h);
-	ret |= get_property_id(fd, props, "type",    &p->type);
+	ret |= get_property_id(props, "FB_ID",   &p->fb_id);
+	ret |= get_property_id(props, "CRTC_ID", &p->crtc_id);
+	ret |= get_property_id(props, "CRTC_X",  &p->crtc_x);
+	ret |= get_property_id(props, "CRTC_Y",  &p->crtc_y);
+	ret |= get_property_id(props, "CRTC_W",  &p->crtc_w);
+	ret |= get_property_id(props, "CRTC_H",  &p->crtc_h);
+	ret |= get_property_id(props, "SRC_X",   &p->src_x);
+	ret |= get_property_id(props, "SRC_Y",   &p->src_y);
+	ret |= get_property_id(props, "SRC_W",   &p->src_w);
+	ret |= get_property_id(props, "SRC_H",   &p->src_h);
+	ret |= get_property_id(props, "type",    &p->type);
+
+	/*
+	 * FB_DAMAGE_CLIPS is optional (drivers opt in per plane).  Without
+	 * it every flip is treated as a full-plane update, which is also
+	 * what the kernel assumes when the property is simply not set.
+	 */
+	if (get_property_id(props, "FB_DAMAGE_CLIPS",
+			    &p->fb_damage_clips) < 0)
+		p->fb_damage_clips = 0;
 
 	drmModeFreeObjectProperties(props);
 	return ret;
@@ -370,8 +478,8 @@ static int cache_crtc_props(int fd, uint32_t crtc_id, struct crtc_props *p)
 	if (!props) return -1;
 
 	int ret = 0;
-	ret |= get_property_id(fd, props, "ACTIVE",  &p->active);
-	ret |= get_property_id(fd, props, "MODE_ID", &p->mode_id);
+	ret |= get_property_id(props, "ACTIVE",  &p->active);
+	ret |= get_property_id(props, "MODE_ID", &p->mode_id);
 
 	drmModeFreeObjectProperties(props);
 	return ret;
@@ -385,23 +493,31 @@ static int cache_connector_props(int fd, uint32_t conn_id,
 					   DRM_MODE_OBJECT_CONNECTOR);
 	if (!props) return -1;
 
-	int ret = get_property_id(fd, props, "CRTC_ID", &p->crtc_id);
+	int ret = get_property_id(props, "CRTC_ID", &p->crtc_id);
+
+	if (get_property_id(props, "EDID", &p->edid) < 0)
+		p->edid = 0;
 
 	drmModeFreeObjectProperties(props);
 	return ret;
 }
 
 /* ============================================================
- * Framebuffer helpers (unchanged from previous demo)
+ * Framebuffer helpers
+ *
+ * Same dumb-buffer path as the previous demo, but registered with
+ * drmModeAddFB2() so the fourcc in bo->fmt (--format) decides the
+ * scanout layout instead of the legacy depth 24 / bpp 32 pair.
  * ============================================================ */
 static int create_fb(int fd, struct buffer_object *bo)
 {
 	struct drm_mode_create_dumb create = {
 		.width  = bo->width,
 		.height = bo->height,
-		.bpp    = 32,
+		.bpp    = bo->fmt->cpp * 8,
 	};
 	struct drm_mode_map_dumb map = {0};
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
 
 	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
 		return -1;
@@ -410,14 +526,24 @@ static int create_fb(int fd, struct buffer_object *bo)
 	bo->size   = create.size;
 	bo->handle = create.handle;
 
-	if (drmModeAddFB(fd, bo->width, bo->height, 24, 32,
-			 bo->pitch, bo->handle, &bo->fb_id))
+	handles[0] = bo->handle;
+	pitches[0] = bo->pitch;
+	if (drmModeAddFB2(fd, bo->width, bo->height, bo->fmt->fourcc,
+			  handles, pitches, offsets, &bo->fb_id, 0)) {
+		perror("drmModeAddFB2");
 		return -1;
+	}
 
 	map.handle = bo->handle;
 	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)
 		return -1;
 
+	/*
+	 * Not MAP_POPULATE: GEM mmaps are PFN mappings, which populate
+	 * skips, and CMA/IOMMU drivers map everything up front anyway.
+	 * Where pages are faulted in on first touch, warm_up() takes
+	 * the faults on the render pool (render_pool_prefault()).
+	 */
 	bo->vaddr = mmap(0, bo->size, PROT_READ | PROT_WRITE,
 			 MAP_SHARED, fd, map.offset);
 	if (bo->vaddr == MAP_FAILED)
@@ -434,28 +560,227 @@ static void destroy_fb(int fd, struct buffer_object *bo)
 	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
 }
 
+/* ============================================================
+ * Framebuffer arena (--arena)
+ *
+ * One dumb buffer tall enough for N frames, mapped once, with the N
+ * framebuffers placed in it by drmModeAddFB2() offsets: one GEM handle
+ * and one mapping instead of N.  Each frame starts on a page boundary.
+ * The mapping stays at the page size: GEM mmaps are PFN mappings,
+ * which transparent huge pages never back, so MADV_HUGEPAGE would be
+ * accepted and change nothing.
+ *
+ * Arena framebuffers share the GEM object, so they never go through
+ * destroy_fb() or the pool: destroy_arena() takes them all down.
+ * ============================================================ */
+#define ARENA_ALIGN 4096
+
+struct fb_arena {
+	uint32_t handle;
+	uint64_t size;
+	uint8_t *vaddr;
+};
+
+static void destroy_arena(int fd, struct fb_arena *a,
+			  struct buffer_object *bufs, int n)
+{
+	struct drm_mode_destroy_dumb destroy = { .handle = a->handle };
+
+	for (int i = 0; i < n; i++)
+		if (bufs[i].fb_id)
+			drmModeRmFB(fd, bufs[i].fb_id);
+	memset(bufs, 0, (size_t)n * sizeof(*bufs));
+	if (a->vaddr)
+		munmap(a->vaddr, a->size);
+	if (a->handle)
+		drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	memset(a, 0, sizeof(*a));
+}
+
+/* ============================================================
+ * create_arena - Allocate @n @width x @height @fmt framebuffers
+ *                from a single dumb buffer.
+ *
+ * Returns 0, or -1 with everything released again.
+ * ============================================================ */
+static int create_arena(int fd, struct fb_arena *a, struct buffer_object *bufs,
+			int n, uint32_t width, uint32_t height,
+			const struct pixel_format *fmt)
+{
+	/*
+	 * The pitch is the driver's choice, but never below width * cpp,
+	 * so this many rows of padding per frame covers page alignment.
+	 */
+	uint32_t pad = (ARENA_ALIGN + width * fmt->cpp - 1) / (width * fmt->cpp);
+	struct drm_mode_create_dumb create = {
+		.width  = width,
+		.height = (height + pad) * (uint32_t)n,
+		.bpp    = fmt->cpp * 8,
+	};
+	struct drm_mode_map_dumb map = {0};
+	uint64_t offset = 0;
+
+	memset(a, 0, sizeof(*a));
+	memset(bufs, 0, (size_t)n * sizeof(*bufs));
+	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+		perror("DRM_IOCTL_MODE_CREATE_DUMB");
+		return -1;
+	}
+	a->handle = create.handle;
+	a->size   = create.size;
+
+	map.handle = a->handle;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)
+		goto fail;
+	a->vaddr = mmap(0, a->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			map.offset);
+	if (a->vaddr == MAP_FAILED) {
+		a->vaddr = NULL;
+		goto fail;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct buffer_object *bo = &bufs[i];
+		uint32_t handles[4] = { a->handle }, pitches[4] = { create.pitch };
+		uint32_t offsets[4] = {0};
+
+		offset = (offset + ARENA_ALIGN - 1) & ~(uint64_t)(ARENA_ALIGN - 1);
+		if (offset + (uint64_t)create.pitch * height > a->size)
+			goto fail;
+		offsets[0] = (uint32_t)offset;
+
+		bo->width  = width;
+		bo->height = height;
+		bo->fmt    = fmt;
+		bo->pitch  = create.pitch;
+		bo->size   = create.pitch * height;
+		bo->handle = a->handle;
+		bo->vaddr  = a->vaddr + offset;
+		if (drmModeAddFB2(fd, width, height, fmt->fourcc, handles,
+				  pitches, offsets, &bo->fb_id, 0)) {
+			perror("drmModeAddFB2");
+			bo->fb_id = 0;
+			goto fail;
+		}
+		offset += bo->size;
+	}
+	return 0;
+
+fail:
+	destroy_arena(fd, a, bufs, n);
+	return -1;
+}
+
+/* ============================================================
+ * Framebuffer pool
+ *
+ * Every framebuffer comes from get_fb() and goes back through
+ * put_fb(), so a buffer of a size and format seen before is reused
+ * with its FB and mapping (see buffer-pool.h).  Idle buffers are kept
+ * up to --pool-mb MiB; main() frees them before closing the device.
+ * ============================================================ */
+#define FB_POOL_DEFAULT_MB 64
+
+static struct buffer_pool fb_pool;
+
+static int fb_pool_alloc(void *ctx, void *buf)
+{
+	return create_fb(*(int *)ctx, buf);
+}
+
+static void fb_pool_free(void *ctx, void *buf)
+{
+	destroy_fb(*(int *)ctx, buf);
+}
+
+/* A @width x @height @fmt framebuffer; contents undefined if reused */
+static int get_fb(struct buffer_object *bo, uint32_t width, uint32_t height,
+		  const struct pixel_format *fmt)
+{
+	*bo = (struct buffer_object){
+		.width  = width,
+		.height = height,
+		.fmt    = fmt,
+	};
+	return buffer_pool_get(&fb_pool, bo, width, height, fmt->fourcc);
+}
+
+/* Give back a framebuffer that is no longer on any plane */
+static void put_fb(struct buffer_object *bo)
+{
+	buffer_pool_put(&fb_pool, bo, bo->width, bo->height, bo->fmt->fourcc,
+			bo->size);
+	memset(bo, 0, sizeof(*bo));
+}
+
+/* Band renderer for all modes; sized by --threads (default 1) */
+static struct render_pool pool;
+
+/* Cached copy of the primary plane's frame, allocated with --shadow */
+static struct shadow_buffer shadow;
+
+/* Per-frame timing histograms, printed when the animation exits */
+static struct frame_telemetry telemetry;
+
+/* DRM fd and Ctrl+C; every wait goes through it */
+static struct event_loop events;
+
+/* Every flip commit, sending only what changed; see atomic-req.h */
+static struct atomic_req flip_req;
+
+/* TEST_ONLY answers per layout, dropped on modeset; see atomic-req.h */
+static struct atomic_test_cache test_cache;
+
+/* Until Ctrl+C or --frames N */
+static bool keep_running(void)
+{
+	return !events.quit && !telemetry_done(&telemetry);
+}
+
+/*
+ * Row = background / bar / background spans in bo->fmt, see
+ * pixel-format.h; colours are packed once per call.
+ * @region limits the repaint to damaged rectangles (NULL = everything).
+ * Rectangles are rendered in bands on the worker pool; render_pool_run()
+ * waits for every band, so the buffer is finished before the commit.
+ */
 static void draw_moving_bar(struct buffer_object *bo,
 			    struct animation_state *anim,
-			    uint32_t color)
+			    uint32_t color,
+			    const struct damage_region *region)
 {
-	uint32_t *pixel   = (uint32_t *)bo->vaddr;
-	uint32_t bg_color = 0x202020;
+	struct damage_region full;
+	struct pixel_bar_job job = {
+		.fmt       = bo->fmt,
+		.base      = bo->vaddr,
+		.pitch     = bo->pitch,
+		.bar_x     = anim->bar_x,
+		.bar_width = anim->bar_width,
+		.bar_color = bo->fmt->pack(color),
+		.bg_color  = bo->fmt->pack(0x202020),
+	};
 
-	for (uint32_t y = 0; y < bo->height; y++) {
-		for (uint32_t x = 0; x < bo->width; x++) {
-			uint32_t offset = y * (bo->pitch / 4) + x;
-			if ((int)x >= anim->bar_x &&
-			    (int)x <  anim->bar_x + anim->bar_width)
-				pixel[offset] = color;
-			else
-				pixel[offset] = bg_color;
-		}
+	if (!region) {
+		damage_region_full(&full, (int32_t)bo->width,
+				   (int32_t)bo->height);
+		region = &full;
+	}
+
+	for (uint32_t i = 0; i < region->count; i++) {
+		const struct damage_rect *r = &region->rects[i];
+
+		job.xa = (uint32_t)r->x1;
+		job.xb = (uint32_t)r->x2;
+		render_pool_run(&pool, pixel_bar_band, &job,
+				(uint32_t)r->y1, (uint32_t)r->y2, bo->pitch,
+				(job.xb - job.xa) * bo->fmt->cpp);
 	}
 }
 
-static void update_animation(struct animation_state *anim, int screen_width)
+static void move_bar(struct animation_state *anim, int screen_width, int step)
 {
-	anim->bar_x += anim->direction * 8;
+	anim->prev_bar_x = anim->bar_x;
+	anim->bar_x += anim->direction * step;
 	if (anim->bar_x + anim->bar_width >= screen_width) {
 		anim->bar_x = screen_width - anim->bar_width;
 		anim->direction = -1;
@@ -466,11 +791,197 @@ static void update_animation(struct animation_state *anim, int screen_width)
 	anim->frame_count++;
 }
 
+static void update_animation(struct animation_state *anim, int screen_width)
+{
+	move_bar(anim, screen_width, BAR_STEP);
+}
+
+/* Advance to presentation time @t_ms at BAR_SPEED, see frame-sched.h */
+static void update_animation_at(struct animation_state *anim,
+				int screen_width, double t_ms)
+{
+	double px = anim->frac;
+
+	if (anim->time_ms)
+		px += BAR_SPEED * (t_ms - anim->time_ms) / 1e3;
+	anim->time_ms = t_ms;
+	anim->frac = px - (int)px;
+	move_bar(anim, screen_width, (int)px);
+}
+
+/* ============================================================
+ * render_frame - Damage-tracked redraw of back buffer @idx.
+ *
+ * The frame's damage is the pair of column strips the bar left and
+ * entered (prev_bar_x -> bar_x).  Only the union of the damage that
+ * bufs[idx] missed since it was last drawn -- its buffer age -- is
+ * repainted; see damage.h.
+ *
+ * With --shadow the bar is drawn into the cached shadow (one frame of
+ * damage, the shadow is always current) and the repaint region is
+ * then streamed into the dumb-buffer mapping; see shadow-buffer.h.
+ * ============================================================ */
+static void render_frame(struct damage_tracker *dt,
+			 struct buffer_object *bufs, int idx,
+			 struct animation_state *anim, uint32_t color)
+{
+	struct damage_region *frame = damage_begin_frame(dt);
+
+	damage_add_column_move(frame, anim->prev_bar_x, anim->bar_x,
+			       anim->bar_width, dt->width, dt->height);
+
+	if (!shadow.pixels) {
+		draw_moving_bar(&bufs[idx], anim, color,
+				damage_buffer_repaint(dt, idx));
+	} else {
+		struct buffer_object target = {
+			.fmt    = bufs[idx].fmt,
+			.width  = shadow.width,
+			.height = shadow.height,
+			.pitch  = shadow.pitch,
+			.vaddr  = shadow.pixels,
+		};
+
+		draw_moving_bar(&target, anim, color,
+				shadow.valid ? frame : NULL);
+		shadow.valid = true;
+		shadow_buffer_flush(&pool, &shadow, bufs[idx].vaddr,
+				    bufs[idx].pitch,
+				    damage_buffer_repaint(dt, idx),
+				    shadow_copy_select());
+	}
+	damage_report(dt, 300);
+}
+
+/* ============================================================
+ * damage_blob_lookup - Blob ID holding @region as FB_DAMAGE_CLIPS.
+ * @fd:     DRM file descriptor.
+ * @cache:  Blob cache.
+ * @region: Damage to submit (screen coordinates).
+ * @width:  Plane width, for clipping the snapped rectangles.
+ * @height: Plane height.
+ *
+ * Returns a cached blob when the snapped rect set was seen before,
+ * otherwise creates one, evicting the least recently used entry.
+ * Returns 0 if no blob could be created (caller sends full damage).
+ * ============================================================ */
+static uint32_t damage_blob_lookup(int fd, struct damage_blob_cache *cache,
+				   const struct damage_region *region,
+				   int32_t width, int32_t height)
+{
+	struct damage_region snapped = { .count = 0 };
+	const int32_t a = DAMAGE_CLIP_ALIGN;
+
+	for (uint32_t i = 0; i < region->count; i++) {
+		struct damage_rect r = region->rects[i];
+		r.x1 = r.x1 / a * a;
+		r.y1 = r.y1 / a * a;
+		r.x2 = (r.x2 + a - 1) / a * a;
+		r.y2 = (r.y2 + a - 1) / a * a;
+		damage_region_add(&snapped, r, width, height);
+	}
+	if (!snapped.count)
+		return 0;
+
+	struct drm_mode_rect clips[DAMAGE_MAX_RECTS];
+	for (uint32_t i = 0; i < snapped.count; i++) {
+		clips[i].x1 = snapped.rects[i].x1;
+		clips[i].y1 = snapped.rects[i].y1;
+		clips[i].x2 = snapped.rects[i].x2;
+		clips[i].y2 = snapped.rects[i].y2;
+	}
+
+	struct damage_blob *victim = &cache->slots[0];
+	cache->tick++;
+	for (int i = 0; i < DAMAGE_BLOB_CACHE; i++) {
+		struct damage_blob *b = &cache->slots[i];
+		if (b->blob_id && b->count == snapped.count &&
+		    !memcmp(b->rects, clips, snapped.count * sizeof(clips[0]))) {
+			b->last_use = cache->tick;
+			cache->hits++;
+			return b->blob_id;
+		}
+		if (!b->blob_id || (victim->blob_id &&
+				    b->last_use < victim->last_use))
+			victim = b;
+	}
+
+	if (victim->blob_id)
+		drmModeDestroyPropertyBlob(fd, victim->blob_id);
+	victim->blob_id = 0;
+	if (drmModeCreatePropertyBlob(fd, clips,
+				      snapped.count * sizeof(clips[0]),
+				      &victim->blob_id)) {
+		victim->blob_id = 0;
+		return 0;
+	}
+	victim->count    = snapped.count;
+	victim->last_use = cache->tick;
+	memcpy(victim->rects, clips, snapped.count * sizeof(clips[0]));
+	cache->created++;
+	return victim->blob_id;
+}
+
+static void damage_blob_cache_destroy(int fd, struct damage_blob_cache *cache)
+{
+	for (int i = 0; i < DAMAGE_BLOB_CACHE; i++) {
+		if (cache->slots[i].blob_id)
+			drmModeDestroyPropertyBlob(fd, cache->slots[i].blob_id);
+		cache->slots[i].blob_id = 0;
+	}
+}
+
+/* ============================================================
+ * add_damage_clips - Attach the damage of a flip to its request.
+ * @shown: Frame number currently on screen.
+ * @next:  Frame number held by the buffer being committed.
+ *
+ * The clips describe what changed relative to the frame currently on
+ * screen: the damage of frames @shown + 1 .. @next, which is a single
+ * frame's damage with double buffering but can span several frames
+ * when the swapchain queues or drops frames -- never the (larger)
+ * buffer-age repaint region.  Nothing is attached, and the kernel
+ * falls back to a full-plane update, when:
+ *   - the plane has no FB_DAMAGE_CLIPS property,
+ *   - the screen still shows the initial contents, or the span has
+ *     left the damage history, or
+ *   - the span has no damage or no blob could be created.
+ * The property is not sticky: the kernel drops it from the plane
+ * state after every commit, so omitting it really means "full".
+ * ============================================================ */
+static void add_damage_clips(struct kms_state *kms, struct atomic_req *req,
+			     const struct damage_tracker *dt,
+			     uint64_t shown, uint64_t next)
+{
+	struct damage_region changed;
+
+	if (!kms->primary_props.fb_damage_clips ||
+	    !damage_between(dt, shown, next, &changed))
+		return;
+
+	uint32_t blob = damage_blob_lookup(kms->fd, &kms->damage_blobs,
+					   &changed, dt->width, dt->height);
+	if (!blob)
+		return;
+
+	atomic_req_add(req, kms->plane_id,
+		       kms->primary_props.fb_damage_clips, blob);
+
+	if (next % 300 == 0)
+		printf("  FB_DAMAGE_CLIPS: %llu blob reuses, %llu blobs created\n",
+		       (unsigned long long)kms->damage_blobs.hits,
+		       (unsigned long long)kms->damage_blobs.created);
+}
+
 /* ============================================================
- * atomic_modeset - Perform initial display configuration atomically.
+ * atomic_modeset_add - Initial display configuration of one head.
  * @kms:    KMS pipeline state with cached property IDs.
+ * @req:    Request the properties are added to.
  * @fb_id:  Initial framebuffer to display.
  *
+ * atomic_modeset() commits it on its own; --multihead puts every head
+ * into one request so all displays light up in a single commit.
+ *
  * This replaces the legacy drmModeSetCrtc().  The key differences:
  *
  * 1. All changes are expressed as (object_id, property_id, value) tuples.
@@ -481,7 +992,8 @@ static void update_animation(struct animation_state *anim, int screen_width)
  * The kernel creates the blob object and returns an ID; subsequent
  * atomic commits reference this ID rather than copying the mode data.
  * ============================================================ */
-static int atomic_modeset(struct kms_state *kms, uint32_t fb_id)
+static int atomic_modeset_add(struct kms_state *kms, drmModeAtomicReq *req,
+			      uint32_t fb_id)
 {
 	int ret;
 
@@ -501,9 +1013,6 @@ static int atomic_modeset(struct kms_state *kms, uint32_t fb_id)
 	       kms->mode_blob_id,
 	       kms->mode.hdisplay, kms->mode.vdisplay, kms->mode.vrefresh);
 
-	drmModeAtomicReq *req = drmModeAtomicAlloc();
-	if (!req) return -ENOMEM;
-
 	/*
 	 * Build the atomic request: set properties on three object types.
 	 *
@@ -550,6 +1059,15 @@ static int atomic_modeset(struct kms_state *kms, uint32_t fb_id)
 	drmModeAtomicAddProperty(req, kms->plane_id,
 			     kms->primary_props.src_h,
 			     (uint64_t)kms->mode.vdisplay << 16);
+	return 0;
+}
+
+/* ============================================================
+ * atomic_commit_modeset - TEST_ONLY, then commit, a modeset request.
+ * ============================================================ */
+static int atomic_commit_modeset(int fd, drmModeAtomicReq *req)
+{
+	int ret;
 
 	/*
 	 * TEST_ONLY: ask the kernel to validate the request without
@@ -557,29 +1075,86 @@ static int atomic_modeset(struct kms_state *kms, uint32_t fb_id)
 	 * combination of properties is rejected by the driver.
 	 * This is unique to atomic -- legacy API had no dry-run path.
 	 */
-	ret = drmModeAtomicCommit(kms->fd, req,
+	ret = drmModeAtomicCommit(fd, req,
 				  DRM_MODE_ATOMIC_TEST_ONLY |
 				  DRM_MODE_ATOMIC_ALLOW_MODESET,
 				  NULL);
 	if (ret) {
 		fprintf(stderr, "Atomic TEST_ONLY failed: %s\n",
 			strerror(-ret));
-		drmModeAtomicFree(req);
 		return ret;
 	}
 	printf("Atomic TEST_ONLY passed -- committing for real\n");
 
 	/* Commit for real, with ALLOW_MODESET to permit clock/PLL changes */
-	ret = drmModeAtomicCommit(kms->fd, req,
+	ret = drmModeAtomicCommit(fd, req,
 				  DRM_MODE_ATOMIC_ALLOW_MODESET,
 				  NULL);
 	if (ret)
 		perror("drmModeAtomicCommit (modeset)");
+	else
+		atomic_test_cache_invalidate(&test_cache);
+	return ret;
+}
 
+static int atomic_modeset(struct kms_state *kms, uint32_t fb_id)
+{
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	int ret;
+
+	if (!req) return -ENOMEM;
+	ret = atomic_modeset_add(kms, req, fb_id);
+	if (!ret)
+		ret = atomic_commit_modeset(kms->fd, req);
 	drmModeAtomicFree(req);
 	return ret;
 }
 
+/* ============================================================
+ * warm_up - Pay first-use costs before frame 0 instead of during it.
+ *
+ * Run after the modeset, before the first flip:
+ *   - one byte per page of every buffer written on the render pool:
+ *     the prefault (nothing else touches the buffers before frame 0,
+ *     and MAP_POPULATE does nothing for GEM mappings),
+ *   - one full frame into each of @bufs[0 .. @n): settles the SIMD
+ *     kernel choice and the render path,
+ *   - a TEST_ONLY flip to each of them through flip_req, which runs
+ *     the driver's check path for every framebuffer once and sizes
+ *     flip_req's arrays.
+ *
+ * The buffers are left holding a full frame; the damage tracker still
+ * treats them as never rendered and repaints them in full.  Skipped
+ * with --no-warmup, which leaves the faults to the first frames.
+ * ============================================================ */
+static void warm_up(struct kms_state *kms, struct buffer_object *bufs, int n)
+{
+	struct animation_state anim = { .bar_width = 80, .direction = 1 };
+	const struct plane_props *pp = &kms->primary_props;
+	double t0 = render_pool_now_ms(), t1, t2;
+	int refused = 0;
+
+	for (int i = 0; i < n; i++)
+		render_pool_prefault(&pool, bufs[i].vaddr, bufs[i].size);
+	t1 = render_pool_now_ms();
+	for (int i = 0; i < n; i++)
+		draw_moving_bar(&bufs[i], &anim, 0xFF4040, NULL);
+	t2 = render_pool_now_ms();
+
+	for (int i = 0; i < n; i++) {
+		atomic_req_set(&flip_req, kms->plane_id, pp->fb_id,
+			       bufs[i].fb_id);
+		atomic_req_set(&flip_req, kms->plane_id, pp->crtc_id,
+			       kms->crtc_id);
+		if (atomic_req_commit(&flip_req, kms->fd,
+				      DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+			refused++;
+	}
+	printf("Warm-up: %d buffers, prefault %.1f ms, render %.1f ms, "
+	       "TEST_ONLY %.1f ms (%d refused)\n", n, t1 - t0, t2 - t1,
+	       render_pool_now_ms() - t2, refused);
+}
+
 /* ============================================================
  * Page flip callback for atomic non-blocking commits.
  *
@@ -588,17 +1163,55 @@ static int atomic_modeset(struct kms_state *kms, uint32_t fb_id)
  * DRM_EVENT_FLIP_COMPLETE event is delivered for the entire commit,
  * not one per plane -- this is the "atomic" guarantee.
  * ============================================================ */
+static void head_flip_done(uint32_t crtc_id, unsigned int sequence,
+			   unsigned int tv_sec, unsigned int tv_usec)
+{
+	for (int i = 0; i < nheads; i++) {
+		struct head *h = &heads[i];
+
+		if (h->kms.crtc_id != crtc_id)
+			continue;
+		h->waiting = false;
+		h->flip_ms = (double)tv_sec * 1e3 + (double)tv_usec / 1e3;
+		swapchain_flip_done(&h->sc, render_pool_now_ms());
+		telemetry_flip(&h->tel, sequence);
+		telemetry_frame(&telemetry); /* All heads: --frames, CPU */
+		return;
+	}
+	fprintf(stderr, "Flip event for unknown CRTC %u\n", crtc_id);
+}
+
 static void atomic_flip_handler(int fd, unsigned int sequence,
 				unsigned int tv_sec, unsigned int tv_usec,
 				unsigned int crtc_id, void *user_data)
 {
+	/* --multihead: one event per CRTC, crtc_id names the head */
+	if (nheads) {
+		head_flip_done(crtc_id, sequence, tv_sec, tv_usec);
+		(void)fd; (void)user_data;
+		return;
+	}
+
 	struct flip_pending *pending = user_data;
 	pending->waiting = false;
+	if (pending->sc)
+		swapchain_flip_done(pending->sc, render_pool_now_ms());
+	if (pending->sched)
+		frame_sched_vblank(pending->sched, sequence, tv_sec, tv_usec);
+	telemetry_flip(&telemetry, sequence);
 
-	(void)fd; (void)sequence; (void)tv_sec;
-	(void)tv_usec; (void)crtc_id;
+	(void)fd;
 }
 
+/*
+ * Use the v2 event context which includes crtc_id in the callback.
+ * This matters when driving multiple displays from the same fd.
+ */
+static drmEventContext ev_ctx = {
+	.version            = 3,
+	.page_flip_handler2 = atomic_flip_handler,
+};
+
 /* ============================================================
  * run_atomic_pageflip - Non-blocking atomic page flip animation.
  *
@@ -614,9 +1227,23 @@ static void atomic_flip_handler(int fd, unsigned int sequence,
  *   - Can update multiple planes in one atomic operation
  *   - Can change plane position/size alongside the FB swap
  *   - All changes appear simultaneously on screen (true atomicity)
+ *
+ * Buffers rotate through a swapchain (see swapchain.h) instead of
+ * "back = 1 - cur", so with --buffers 3+ the loop keeps rendering
+ * while a flip is outstanding:
+ *   1. Render into any buffer the swapchain hands out.
+ *   2. Commit the oldest queued frame if no flip is in flight.
+ *   3. Poll the fd for the flip event -- without blocking while there
+ *      is still a buffer to render into, otherwise for up to 1 s.
+ *
+ * With @sched (--deadline, two buffers, fifo) step 1 first sleeps
+ * until just enough time is left before the next vblank and places
+ * the bar for that vblank's timestamp; see frame-sched.h.
  * ============================================================ */
 static void run_atomic_pageflip(struct kms_state *kms,
-				struct buffer_object bufs[MAX_BUFFERS])
+				struct buffer_object *bufs, int depth,
+				enum swapchain_mode mode,
+				struct frame_sched *sched)
 {
 	struct animation_state anim = {
 		.bar_x      = 0,
@@ -624,112 +1251,655 @@ static void run_atomic_pageflip(struct kms_state *kms,
 		.direction  = 1,
 		.frame_count = 0,
 	};
-	int cur = 0;
-	struct flip_pending pending = { .waiting = false };
-
-	/*
-	 * Use the v2 event context which includes crtc_id in the callback.
-	 * This matters when driving multiple displays from the same fd.
-	 */
-	drmEventContext ev_ctx = {
-		.version                 = 3,
-		.page_flip_handler2      = atomic_flip_handler,
+	struct swapchain sc;
+	struct flip_pending pending = {
+		.waiting = false,
+		.sc      = &sc,
+		.sched   = sched,
 	};
+	struct damage_tracker dt;
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
 
-	printf("\n[ATOMIC PAGE FLIP] Non-blocking vblank-synced animation\n");
-	printf("Primary plane only -- Ctrl+C to stop\n\n");
-
-	while (1) {
-		int back = 1 - cur;
+	if (mode == SWAPCHAIN_IMMEDIATE)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
 
-		draw_moving_bar(&bufs[back], &anim, 0xffffff);
-		update_animation(&anim, (int)bufs[back].width);
+	damage_tracker_init(&dt, bufs[0].width, bufs[0].height);
+	swapchain_init(&sc, depth, mode, 0, render_pool_now_ms());
 
-		drmModeAtomicReq *req = drmModeAtomicAlloc();
-		if (!req) break;
+	printf("\n[ATOMIC PAGE FLIP] Non-blocking vblank-synced animation\n");
+	printf("Primary plane only, %d buffers, %s present -- Ctrl+C to stop\n\n",
+	       depth, swapchain_mode_names[mode]);
+
+	while (keep_running()) {
+		int idx = swapchain_acquire(&sc);
+		if (idx >= 0) {
+			if (sched)
+				update_animation_at(&anim, (int)bufs[idx].width,
+						    frame_sched_begin(sched));
+			telemetry_begin(&telemetry, TEL_RENDER);
+			render_frame(&dt, bufs, idx, &anim, 0xffffff);
+			telemetry_end(&telemetry, TEL_RENDER);
+			if (sched)
+				frame_sched_end(sched);
+			else
+				update_animation(&anim, (int)bufs[idx].width);
+			swapchain_queue(&sc, idx, dt.frame, render_pool_now_ms());
+		}
 
-		/*
-		 * Minimal flip request: only FB_ID changes.
-		 * The kernel diffing engine compares this against the
-		 * current committed state and only updates what changed.
-		 */
-		drmModeAtomicAddProperty(req, kms->plane_id,
-				     kms->primary_props.fb_id,
-				     bufs[back].fb_id);
-		drmModeAtomicAddProperty(req, kms->plane_id,
-				     kms->primary_props.crtc_id,
-				     kms->crtc_id);
-
-		int ret = drmModeAtomicCommit(kms->fd, req,
-					      DRM_MODE_ATOMIC_NONBLOCK |
-					      DRM_MODE_PAGE_FLIP_EVENT,
-					      &pending);
-		drmModeAtomicFree(req);
+		bool busy = false;
+		int next = swapchain_next(&sc);
+		if (next >= 0) {
+			/*
+			 * Minimal flip request: only FB_ID changes.
+			 * The kernel diffing engine compares this against the
+			 * current committed state and only updates what changed;
+			 * flip_req already leaves out the unchanged CRTC_ID.
+			 * FB_DAMAGE_CLIPS narrows "what changed" down to the
+			 * pixels inside the new framebuffer as well.  Async
+			 * flips may carry FB_ID and nothing else.
+			 */
+			atomic_req_set(&flip_req, kms->plane_id,
+				       kms->primary_props.fb_id,
+				       bufs[next].fb_id);
+			if (mode != SWAPCHAIN_IMMEDIATE) {
+				atomic_req_set(&flip_req, kms->plane_id,
+					       kms->primary_props.crtc_id,
+					       kms->crtc_id);
+				add_damage_clips(kms, &flip_req, &dt,
+						 swapchain_scanout_frame(&sc),
+						 sc.slots[next].frame);
+			}
 
-		if (ret) {
-			perror("drmModeAtomicCommit (flip)");
-			break;
+			telemetry_begin(&telemetry, TEL_COMMIT);
+			int ret = atomic_req_commit(&flip_req, kms->fd, flags,
+						    &pending);
+
+			if (ret == -EBUSY) {
+				/* Previous flip not retired yet; retry later */
+				sc.busy++;
+				busy = true;
+			} else if (ret) {
+				fprintf(stderr, "drmModeAtomicCommit (flip): %s\n",
+					strerror(-ret));
+				break;
+			} else {
+				telemetry_end(&telemetry, TEL_COMMIT);
+				swapchain_committed(&sc);
+				pending.waiting = true;
+			}
 		}
-		pending.waiting = true;
 
-		/* Wait for the vblank event before preparing the next frame */
-		while (pending.waiting) {
-			fd_set fds;
-			FD_ZERO(&fds);
-			FD_SET(kms->fd, &fds);
-
-			struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
-			int s = select(kms->fd + 1, &fds, NULL, NULL, &timeout);
-			if (s < 0) { perror("select"); return; }
-			if (s == 0) {
-				fprintf(stderr, "Vblank timeout\n");
-				return;
-			}
-			drmHandleEvent(kms->fd, &ev_ctx);
+		/*
+		 * Block for the flip event only when there is nothing to
+		 * render; after -EBUSY poll briefly instead of spinning.
+		 */
+		bool idle = !swapchain_can_acquire(&sc);
+		int s = event_loop_dispatch(&events,
+					    busy ? 1 : idle ? 1000 : 0);
+		if (s < 0)
+			return;
+		if (s == 0 && idle && !busy) {
+			fprintf(stderr, "Vblank timeout\n");
+			return;
 		}
 
-		cur = back;
+		swapchain_report(&sc, 300, render_pool_now_ms());
+		if (sched)
+			frame_sched_report(sched, 300);
 	}
+
+	/* Ctrl+C: the buffers must not go away under a queued flip */
+	if (pending.waiting &&
+	    event_loop_wait(&events, &pending.waiting, 1000) < 0)
+		perror("Waiting for the last flip");
 }
 
 /* ============================================================
- * run_multiplane - Animate primary plane while overlay stays static.
- *
- * This demonstrates the core advantage of atomic KMS: updating two
- * planes in a single commit guarantees they change on the same vblank.
- * With legacy API you would need two separate ioctls; the display
- * engine could scan out a frame showing plane A updated but plane B
- * not yet -- atomic eliminates this class of glitch entirely.
+ * run_threaded_pageflip - --atomic with rendering on its own thread.
  *
- * Layout:
- *   Primary plane:  full-screen moving white bar (dark background)
- *   Overlay plane:  small red rectangle fixed at top-left corner
- *                   (if hardware overlay is available on this CRTC)
+ * Same scene and flip request as run_atomic_pageflip(), but the render
+ * thread draws into free buffers while this thread commits the newest
+ * finished one and waits for its flip event; see frame-pipeline.h.
+ * The damage tracker belongs to the render thread, so flips carry no
+ * FB_DAMAGE_CLIPS here and the kernel treats them as full updates.
  * ============================================================ */
-static void run_multiplane(struct kms_state *kms,
-			   struct buffer_object primary_bufs[MAX_BUFFERS],
-			   struct buffer_object *overlay_buf)
-{
-	struct animation_state anim = {
-		.bar_x      = 0,
-		.bar_width  = 80,
-		.direction  = 1,
-		.frame_count = 0,
-	};
-	int cur = 0;
-	struct flip_pending pending = { .waiting = false };
+struct threaded_flip {
+	struct kms_state      *kms;
+	struct buffer_object  *bufs;
+	struct flip_pending   *pending;
+	uint32_t               flags;
+	struct damage_tracker  dt;   /* Render thread only */
+	struct animation_state anim; /* Render thread only */
+};
 
-	drmEventContext ev_ctx = {
-		.version            = 3,
-		.page_flip_handler2 = atomic_flip_handler,
-	};
+static uint64_t threaded_render(void *ctx, int idx)
+{
+	struct threaded_flip *t = ctx;
 
-	/* Fill the overlay buffer with a solid red rectangle */
-	memset(overlay_buf->vaddr, 0, overlay_buf->size);
-	uint32_t *pix = (uint32_t *)overlay_buf->vaddr;
-	for (uint32_t y = 0; y < overlay_buf->height; y++)
-		for (uint32_t x = 0; x < overlay_buf->width; x++)
-			pix[y * (overlay_buf->pitch / 4) + x] = 0xff0000;
+	render_frame(&t->dt, t->bufs, idx, &t->anim, 0xffffff);
+	update_animation(&t->anim, (int)t->bufs[idx].width);
+	return t->dt.frame;
+}
+
+static int threaded_commit(void *ctx, int idx)
+{
+	struct threaded_flip *t = ctx;
+
+	atomic_req_set(&flip_req, t->kms->plane_id,
+		       t->kms->primary_props.fb_id, t->bufs[idx].fb_id);
+	if (!(t->flags & DRM_MODE_PAGE_FLIP_ASYNC))
+		atomic_req_set(&flip_req, t->kms->plane_id,
+			       t->kms->primary_props.crtc_id, t->kms->crtc_id);
+	return atomic_req_commit(&flip_req, t->kms->fd, t->flags, t->pending);
+}
+
+static void run_threaded_pageflip(struct kms_state *kms,
+				  struct buffer_object *bufs, int depth,
+				  enum swapchain_mode mode)
+{
+	struct flip_pending pending = { .waiting = false };
+	struct frame_pipeline fp;
+	struct threaded_flip t = {
+		.kms     = kms,
+		.bufs    = bufs,
+		.pending = &pending,
+		.flags   = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+		.anim    = { .bar_width = 80, .direction = 1 },
+	};
+
+	if (mode == SWAPCHAIN_IMMEDIATE)
+		t.flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+	damage_tracker_init(&t.dt, bufs[0].width, bufs[0].height);
+
+	printf("\n[ATOMIC PAGE FLIP] Render thread + display thread, %d buffers%s\n",
+	       depth, mode == SWAPCHAIN_IMMEDIATE ? ", async flips" : "");
+	printf("Newest finished frame is flipped each vblank -- Ctrl+C to stop\n\n");
+
+	if (frame_pipeline_start(&fp, depth, 0, threaded_render, &t,
+				 &telemetry) < 0)
+		return;
+	frame_pipeline_display(&fp, &events, &pending.waiting,
+			       threaded_commit, &t, 0,
+			       1000.0 / (kms->mode.vrefresh ? kms->mode.vrefresh : 60));
+	frame_pipeline_stop(&fp);
+}
+
+/* ============================================================
+ * run_commit_bench - What building and committing a flip costs
+ *                    (--atomic --bench-commit).
+ *
+ * Times COMMIT_BENCH_ITERS flips of bufs[1] over bufs[0], once with a
+ * drmModeAtomicAlloc()ed request per flip -- the pattern every loop
+ * here used before -- and once through flip_req.  The commits are
+ * TEST_ONLY: the driver runs its full check but neither touches the
+ * hardware nor waits for vblank, so the numbers are CPU time only.
+ * "build" leaves the ioctl out; for libdrm that also leaves out the
+ * copy, sort and allocations inside drmModeAtomicCommit(), which
+ * flatters the old pattern.
+ * ============================================================ */
+#define COMMIT_BENCH_ITERS 10000
+
+static void run_commit_bench(struct kms_state *kms, struct buffer_object *bufs)
+{
+	uint32_t plane = kms->plane_id;
+	const struct plane_props *pp = &kms->primary_props;
+	double t0, build[2], commit[2];
+	int fails[2] = {0, 0};
+
+	printf("\n[COMMIT BENCH] %d TEST_ONLY flips per variant\n",
+	       COMMIT_BENCH_ITERS);
+
+	/* A real commit first, so the mirror knows what the plane shows */
+	atomic_req_set(&flip_req, plane, pp->fb_id, bufs[0].fb_id);
+	atomic_req_set(&flip_req, plane, pp->crtc_id, kms->crtc_id);
+	if (atomic_req_commit(&flip_req, kms->fd, 0, NULL)) {
+		perror("atomic commit");
+		return;
+	}
+
+	t0 = render_pool_now_ms();
+	for (int i = 0; i < COMMIT_BENCH_ITERS; i++) {
+		drmModeAtomicReq *req = drmModeAtomicAlloc();
+
+		drmModeAtomicAddProperty(req, plane, pp->fb_id, bufs[1].fb_id);
+		drmModeAtomicAddProperty(req, plane, pp->crtc_id, kms->crtc_id);
+		drmModeAtomicFree(req);
+	}
+	build[0] = render_pool_now_ms() - t0;
+
+	t0 = render_pool_now_ms();
+	for (int i = 0; i < COMMIT_BENCH_ITERS; i++) {
+		drmModeAtomicReq *req = drmModeAtomicAlloc();
+
+		drmModeAtomicAddProperty(req, plane, pp->fb_id, bufs[1].fb_id);
+		drmModeAtomicAddProperty(req, plane, pp->crtc_id, kms->crtc_id);
+		if (drmModeAtomicCommit(kms->fd, req,
+					DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+			fails[0]++;
+		drmModeAtomicFree(req);
+	}
+	commit[0] = render_pool_now_ms() - t0;
+
+	t0 = render_pool_now_ms();
+	for (int i = 0; i < COMMIT_BENCH_ITERS; i++) {
+		atomic_req_set(&flip_req, plane, pp->fb_id, bufs[1].fb_id);
+		atomic_req_set(&flip_req, plane, pp->crtc_id, kms->crtc_id);
+		atomic_req_begin(&flip_req);
+	}
+	build[1] = render_pool_now_ms() - t0;
+
+	t0 = render_pool_now_ms();
+	for (int i = 0; i < COMMIT_BENCH_ITERS; i++) {
+		atomic_req_set(&flip_req, plane, pp->fb_id, bufs[1].fb_id);
+		atomic_req_set(&flip_req, plane, pp->crtc_id, kms->crtc_id);
+		if (atomic_req_commit(&flip_req, kms->fd,
+				      DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+			fails[1]++;
+	}
+	commit[1] = render_pool_now_ms() - t0;
+
+	printf("  %-28s %10s %16s %8s\n", "", "build", "build+commit", "failed");
+	printf("  %-28s %7.0f ns %13.0f ns %8d\n",
+	       "drmModeAtomicAlloc per flip",
+	       build[0] * 1e6 / COMMIT_BENCH_ITERS,
+	       commit[0] * 1e6 / COMMIT_BENCH_ITERS, fails[0]);
+	printf("  %-28s %7.0f ns %13.0f ns %8d\n",
+	       "reused request + mirror",
+	       build[1] * 1e6 / COMMIT_BENCH_ITERS,
+	       commit[1] * 1e6 / COMMIT_BENCH_ITERS, fails[1]);
+	printf("  (2 properties per libdrm request, 1 with the mirror: "
+	       "CRTC_ID is unchanged)\n");
+}
+
+/* ============================================================
+ * run_resize_bench - Time swapchain reallocation with and without
+ *                    keeping idle buffers.
+ *
+ * Each round reallocates the swapchain the way a mode switch or a
+ * change of buffer count would: alternately at the full mode and at
+ * half of it, with 2 to 4 buffers, each cleared once (first-touch page
+ * faults included) and all of them given back at the end of the round.
+ * The first pass goes through a pool with no room for idle buffers,
+ * so every buffer is created and destroyed as before; the second
+ * keeps up to --pool-mb MiB.  Nothing is put on screen.
+ * ============================================================ */
+#define RESIZE_BENCH_ROUNDS 24
+
+static double resize_rounds(struct buffer_pool *bp, const struct kms_state *kms,
+			    const struct pixel_format *fmt)
+{
+	struct buffer_object bufs[4];
+	double t0 = render_pool_now_ms();
+
+	for (int r = 0; r < RESIZE_BENCH_ROUNDS; r++) {
+		uint32_t w = kms->mode.hdisplay >> (r & 1);
+		uint32_t h = kms->mode.vdisplay >> (r & 1);
+		int n = 2 + r % 3, got;
+
+		for (got = 0; got < n; got++) {
+			bufs[got] = (struct buffer_object){
+				.width = w, .height = h, .fmt = fmt,
+			};
+			if (buffer_pool_get(bp, &bufs[got], w, h,
+					    fmt->fourcc) < 0) {
+				fprintf(stderr, "Failed to create fb %dx%d\n",
+					w, h);
+				break;
+			}
+			memset(bufs[got].vaddr, 0x20, bufs[got].size);
+		}
+		while (got--)
+			buffer_pool_put(bp, &bufs[got], w, h, fmt->fourcc,
+					bufs[got].size);
+	}
+	return (render_pool_now_ms() - t0) / RESIZE_BENCH_ROUNDS;
+}
+
+static void run_resize_bench(struct kms_state *kms,
+			     const struct pixel_format *fmt)
+{
+	struct buffer_pool direct, pooled;
+	double ms[2];
+
+	printf("\n[RESIZE BENCH] %d swapchain reallocations, %dx%d and "
+	       "%dx%d %s, 2-4 buffers\n", RESIZE_BENCH_ROUNDS,
+	       kms->mode.hdisplay, kms->mode.vdisplay,
+	       kms->mode.hdisplay / 2, kms->mode.vdisplay / 2, fmt->name);
+
+	if (buffer_pool_init(&direct, sizeof(struct buffer_object),
+			     fb_pool_alloc, fb_pool_free, &kms->fd, 0) < 0 ||
+	    buffer_pool_init(&pooled, sizeof(struct buffer_object),
+			     fb_pool_alloc, fb_pool_free, &kms->fd,
+			     fb_pool.high_water) < 0)
+		return;
+
+	ms[0] = resize_rounds(&direct, kms, fmt);
+	ms[1] = resize_rounds(&pooled, kms, fmt);
+	buffer_pool_report(&direct, "no idle buffers");
+	buffer_pool_report(&pooled, "pooled");
+	printf("  %.2f ms per reallocation without the pool, %.2f ms with "
+	       "it\n", ms[0], ms[1]);
+	buffer_pool_destroy(&direct);
+	buffer_pool_destroy(&pooled);
+}
+
+/* ============================================================
+ * run_arena_bench - Separate dumb buffers vs one arena.
+ *
+ * Setup: ARENA_BENCH_SETUPS times, allocate @n full-screen buffers
+ * each way, clear each once (first-touch page faults included) and
+ * free them again.  Render: ARENA_BENCH_FRAMES full-frame repaints,
+ * rotating through the @n buffers like a swapchain.  Nothing is put
+ * on screen.
+ * ============================================================ */
+#define ARENA_BENCH_SETUPS 8
+#define ARENA_BENCH_FRAMES 240
+
+static double arena_bench_render(struct buffer_object *bufs, int n)
+{
+	struct animation_state anim = { .bar_width = 80, .direction = 1 };
+	double t0 = render_pool_now_ms();
+
+	for (int f = 0; f < ARENA_BENCH_FRAMES; f++) {
+		draw_moving_bar(&bufs[f % n], &anim, 0xFF4040, NULL);
+		update_animation(&anim, (int)bufs[0].width);
+	}
+	return (render_pool_now_ms() - t0) / ARENA_BENCH_FRAMES;
+}
+
+/* One variant; returns -1 if the buffers cannot be allocated */
+static int arena_bench_pass(struct kms_state *kms,
+			    const struct pixel_format *fmt, int n,
+			    bool use_arena, double *setup_ms,
+			    double *render_ms)
+{
+	struct buffer_object bufs[SWAPCHAIN_MAX_DEPTH];
+	struct fb_arena arena;
+	uint32_t w = kms->mode.hdisplay, h = kms->mode.vdisplay;
+
+	*setup_ms = 0;
+	for (int s = 0; s < ARENA_BENCH_SETUPS; s++) {
+		double t0 = render_pool_now_ms();
+		int got = 0;
+
+		if (use_arena) {
+			if (create_arena(kms->fd, &arena, bufs, n, w, h,
+					 fmt) < 0)
+				return -1;
+			got = n;
+		} else {
+			for (; got < n; got++) {
+				bufs[got] = (struct buffer_object){
+					.width = w, .height = h, .fmt = fmt,
+				};
+				if (create_fb(kms->fd, &bufs[got]) < 0)
+					break;
+			}
+		}
+		for (int i = 0; i < got; i++)
+			memset(bufs[i].vaddr, 0x20, bufs[i].size);
+		*setup_ms += render_pool_now_ms() - t0;
+
+		if (got == n && s == ARENA_BENCH_SETUPS - 1)
+			*render_ms = arena_bench_render(bufs, n);
+
+		if (use_arena) {
+			destroy_arena(kms->fd, &arena, bufs, n);
+		} else {
+			for (int i = 0; i < got; i++)
+				destroy_fb(kms->fd, &bufs[i]);
+			if (got < n)
+				return -1;
+		}
+	}
+	*setup_ms /= ARENA_BENCH_SETUPS;
+	return 0;
+}
+
+static void run_arena_bench(struct kms_state *kms,
+			    const struct pixel_format *fmt, int n)
+{
+	double setup[2], render[2];
+
+	printf("\n[ARENA BENCH] %d x %ux%u %s, %d setups, %d frames\n", n,
+	       kms->mode.hdisplay, kms->mode.vdisplay, fmt->name,
+	       ARENA_BENCH_SETUPS, ARENA_BENCH_FRAMES);
+	if (arena_bench_pass(kms, fmt, n, false, &setup[0], &render[0]) < 0 ||
+	    arena_bench_pass(kms, fmt, n, true, &setup[1], &render[1]) < 0) {
+		fprintf(stderr, "Cannot allocate the benchmark buffers\n");
+		return;
+	}
+
+	printf("  %-20s %10s %12s %10s\n", "", "setup", "render", "handles");
+	printf("  %-20s %7.2f ms %7.2f ms/f %10d\n", "separate buffers",
+	       setup[0], render[0], n);
+	printf("  %-20s %7.2f ms %7.2f ms/f %10d\n", "arena", setup[1],
+	       render[1], 1);
+}
+
+/* ============================================================
+ * CPU composition
+ *
+ * Layers left without a plane are blended into the primary buffer
+ * by argb-blend.h, inside the region the frame repainted.
+ * ============================================================ */
+/* Can argb-blend.h draw into buffers of @fmt? */
+static bool argb_blend_target(const struct pixel_format *fmt)
+{
+	return fmt->fourcc == DRM_FORMAT_XRGB8888 ||
+	       fmt->fourcc == DRM_FORMAT_ARGB8888;
+}
+
+/*
+ * Load a @w x @h ARGB8888 layer of straight-alpha colour @argb with
+ * transparent rounded corners (@round percent of the shorter side),
+ * handing it to argb-blend.h premultiplied or not, as asked.
+ */
+static int load_argb_layer(struct argb_layer *layer, uint32_t w, uint32_t h,
+			   uint32_t argb, uint32_t round, bool premultiplied)
+{
+	uint32_t *px = malloc((size_t)w * h * sizeof(*px));
+	uint32_t color = premultiplied ? argb_premultiply(argb) : argb;
+	int32_t r = (int32_t)((w < h ? w : h) * round / 100);
+	int ret;
+
+	if (!px)
+		return -1;
+
+	for (int32_t y = 0; y < (int32_t)h; y++) {
+		for (int32_t x = 0; x < (int32_t)w; x++) {
+			/* Distance into the corner square, 0 outside it */
+			int32_t dx = x < r ? r - x : x >= (int32_t)w - r ?
+				     x - ((int32_t)w - r - 1) : 0;
+			int32_t dy = y < r ? r - y : y >= (int32_t)h - r ?
+				     y - ((int32_t)h - r - 1) : 0;
+
+			px[(size_t)y * w + x] =
+				dx * dx + dy * dy > r * r ? 0 : color;
+		}
+	}
+	ret = argb_layer_init(layer, px, w, h, w * sizeof(*px),
+			      premultiplied);
+	free(px);
+	return ret;
+}
+
+/*
+ * Blend @layer, placed at (@lx, @ly), over @bo (XRGB8888 or ARGB8888)
+ * inside @region.
+ */
+static void composite_argb(struct buffer_object *bo,
+			   const struct argb_layer *layer,
+			   int32_t lx, int32_t ly,
+			   const struct damage_region *region,
+			   struct argb_blend_stats *stats)
+{
+	const struct argb_blend_impl *impl = argb_blend_select();
+	uint8_t *origin = bo->vaddr + (size_t)ly * bo->pitch +
+			  (size_t)lx * sizeof(uint32_t);
+
+	for (uint32_t i = 0; i < region->count; i++) {
+		const struct damage_rect *r = &region->rects[i];
+
+		argb_layer_composite(layer, impl, origin, bo->pitch,
+				     r->x1 - lx, r->y1 - ly,
+				     r->x2 - lx, r->y2 - ly, stats);
+	}
+}
+
+/* ============================================================
+ * Overlay layouts
+ *
+ * Where the overlay goes on the primary plane's CRTC.  w == 0 turns
+ * the overlay off.  The whole overlay buffer is always the source;
+ * CRTC_W/CRTC_H other than its size ask the plane to scale.
+ * ============================================================ */
+struct overlay_layout {
+	const char *name;
+	int32_t     x, y;
+	uint32_t    w, h;
+};
+
+static void add_overlay_layout(struct kms_state *kms, struct atomic_req *req,
+			       uint32_t primary_fb,
+			       const struct buffer_object *overlay_buf,
+			       const struct overlay_layout *l)
+{
+	const struct plane_props *op = &kms->overlay_props;
+
+	/* Primary plane */
+	atomic_req_set(req, kms->plane_id, kms->primary_props.fb_id,
+		       primary_fb);
+	atomic_req_set(req, kms->plane_id, kms->primary_props.crtc_id,
+		       kms->crtc_id);
+
+	/* Overlay plane; CRTC_X/Y are signed */
+	if (!l->w) {
+		atomic_req_set(req, kms->overlay_id, op->fb_id, 0);
+		atomic_req_set(req, kms->overlay_id, op->crtc_id, 0);
+		return;
+	}
+	atomic_req_set(req, kms->overlay_id, op->fb_id, overlay_buf->fb_id);
+	atomic_req_set(req, kms->overlay_id, op->crtc_id, kms->crtc_id);
+	atomic_req_set(req, kms->overlay_id, op->crtc_x, (uint64_t)(int64_t)l->x);
+	atomic_req_set(req, kms->overlay_id, op->crtc_y, (uint64_t)(int64_t)l->y);
+	atomic_req_set(req, kms->overlay_id, op->crtc_w, l->w);
+	atomic_req_set(req, kms->overlay_id, op->crtc_h, l->h);
+	/* SRC_* in 16.16 fixed-point */
+	atomic_req_set(req, kms->overlay_id, op->src_x, 0);
+	atomic_req_set(req, kms->overlay_id, op->src_y, 0);
+	atomic_req_set(req, kms->overlay_id, op->src_w,
+		       (uint64_t)overlay_buf->width << 16);
+	atomic_req_set(req, kms->overlay_id, op->src_h,
+		       (uint64_t)overlay_buf->height << 16);
+}
+
+/* ============================================================
+ * run_layout_bench - Replay per-frame layout trials
+ *                    (--multiplane --bench-layouts).
+ *
+ * What a compositor deciding between overlay and composition does
+ * every frame: TEST_ONLY a handful of candidate layouts, with that
+ * frame's buffers in them, and pick the first one the kernel takes.
+ * LAYOUT_BENCH_FRAMES frames of that run once straight to the kernel
+ * and once through test_cache, which has to give the same answers.
+ * ============================================================ */
+#define LAYOUT_BENCH_FRAMES 500
+
+static void run_layout_bench(struct kms_state *kms,
+			     struct buffer_object primary_bufs[MAX_BUFFERS],
+			     struct buffer_object *overlay_buf)
+{
+	int32_t  sw = kms->mode.hdisplay, sh = kms->mode.vdisplay;
+	uint32_t ow = overlay_buf->width, oh = overlay_buf->height;
+	const struct overlay_layout layouts[] = {
+		{ "top-left, 1:1",     50, 50, ow, oh },
+		{ "bottom-right, 1:1", sw - (int32_t)ow - 50,
+				       sh - (int32_t)oh - 50, ow, oh },
+		{ "2x upscale",        50, 50, ow * 2, oh * 2 },
+		{ "2x downscale",      50, 50, ow / 2, oh / 2 },
+		{ "half off-screen",   sw - (int32_t)ow / 2, 50, ow, oh },
+		{ "overlay off",       0, 0, 0, 0 },
+	};
+	const int n = (int)(sizeof(layouts) / sizeof(layouts[0]));
+	int answer[sizeof(layouts) / sizeof(layouts[0])];
+	double elapsed[2];
+	int mismatches = 0;
+
+	printf("\n[LAYOUT BENCH] %d frames x %d TEST_ONLY layout trials\n",
+	       LAYOUT_BENCH_FRAMES, n);
+
+	for (int pass = 0; pass < 2; pass++) {
+		struct atomic_test_cache *c = pass ? &test_cache : NULL;
+		double t0 = render_pool_now_ms();
+
+		for (int f = 0; f < LAYOUT_BENCH_FRAMES; f++) {
+			for (int i = 0; i < n; i++) {
+				add_overlay_layout(kms, &flip_req,
+						   primary_bufs[f & 1].fb_id,
+						   overlay_buf, &layouts[i]);
+				int ret = atomic_req_test(&flip_req, kms->fd,
+						DRM_MODE_ATOMIC_ALLOW_MODESET, c);
+				if (!pass && !f)
+					answer[i] = ret;
+				else if (ret != answer[i])
+					mismatches++;
+			}
+		}
+		elapsed[pass] = render_pool_now_ms() - t0;
+	}
+
+	for (int i = 0; i < n; i++)
+		printf("  %-20s %s\n", layouts[i].name,
+		       answer[i] ? strerror(-answer[i]) : "accepted");
+	printf("  kernel every time: %8.2f us/trial\n",
+	       elapsed[0] * 1e3 / (LAYOUT_BENCH_FRAMES * n));
+	printf("  validation cache:  %8.2f us/trial\n",
+	       elapsed[1] * 1e3 / (LAYOUT_BENCH_FRAMES * n));
+	if (mismatches)
+		printf("  %d answers differed between trials\n", mismatches);
+}
+
+/* ============================================================
+ * run_multiplane - Animate primary plane while overlay stays static.
+ *
+ * This demonstrates the core advantage of atomic KMS: updating two
+ * planes in a single commit guarantees they change on the same vblank.
+ * With legacy API you would need two separate ioctls; the display
+ * engine could scan out a frame showing plane A updated but plane B
+ * not yet -- atomic eliminates this class of glitch entirely.
+ *
+ * Layout:
+ *   Primary plane:  full-screen moving white bar (dark background)
+ *   Overlay plane:  small red rectangle fixed at top-left corner
+ *                   (if hardware overlay is available on this CRTC)
+ *
+ * Without a usable overlay plane the rectangle is blended into the
+ * primary buffer by the CPU instead (argb-blend.h), only where the bar
+ * repainted underneath it, and the cost is reported per frame.
+ * ============================================================ */
+static void run_multiplane(struct kms_state *kms,
+			   struct buffer_object primary_bufs[MAX_BUFFERS],
+			   struct buffer_object *overlay_buf)
+{
+	struct animation_state anim = {
+		.bar_x      = 0,
+		.bar_width  = 80,
+		.direction  = 1,
+		.frame_count = 0,
+	};
+	int cur = 0;
+	struct flip_pending pending = { .waiting = false };
+	struct damage_tracker dt;
+	struct overlay_layout fixed = {
+		.x = 50, .y = 50,
+		.w = overlay_buf->width, .h = overlay_buf->height,
+	};
+	struct argb_layer cpu_overlay = { .pixels = NULL };
+	struct argb_blend_stats blend = { 0, 0, 0 };
+	double cpu_ms = 0;
+
+	damage_tracker_init(&dt, primary_bufs[0].width, primary_bufs[0].height);
 
 	/*
 	 * Commit both planes in a single atomic request.
@@ -739,172 +1909,1319 @@ static void run_multiplane(struct kms_state *kms,
 	 * Overlay SRC_W/SRC_H must match the overlay framebuffer dimensions.
 	 * CRTC_W/CRTC_H can differ -- VOP2 will scale the overlay if needed.
 	 */
-	{
-		uint32_t ow = overlay_buf->width;
-		uint32_t oh = overlay_buf->height;
+	if (kms->overlay_id) {
+		/* Fill the overlay buffer with a solid red rectangle */
+		uint32_t red = overlay_buf->fmt->pack(0xff0000);
+		for (uint32_t y = 0; y < overlay_buf->height; y++)
+			overlay_buf->fmt->fill(overlay_buf->vaddr +
+					       (size_t)y * overlay_buf->pitch,
+					       red, overlay_buf->width);
+
+		add_overlay_layout(kms, &flip_req, primary_bufs[cur].fb_id,
+				   overlay_buf, &fixed);
+		int ret = atomic_req_commit(&flip_req, kms->fd,
+					    DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+		if (ret) {
+			fprintf(stderr,
+				"Overlay initial commit failed: %s\n"
+				"Hardware may not support overlay plane "
+				"on this CRTC -- compositing it on the CPU\n",
+				strerror(-ret));
+			kms->overlay_id = 0;
+		}
+	}
+	if (!kms->overlay_id) {
+		if (!argb_blend_target(primary_bufs[0].fmt))
+			fprintf(stderr, "Cannot blend into %s -- overlay dropped\n",
+				primary_bufs[0].fmt->name);
+		else if (load_argb_layer(&cpu_overlay, fixed.w, fixed.h,
+					 0xffff0000, 0, true) < 0)
+			fprintf(stderr, "Out of memory -- overlay dropped\n");
+	}
+
+	printf("\n[MULTI-PLANE ATOMIC] Primary (animated) + Overlay (static red)\n");
+	if (kms->overlay_id)
+		printf("Both planes update on the same vblank -- Ctrl+C to stop\n\n");
+	else if (cpu_overlay.pixels)
+		printf("Overlay CPU-composited, blend kernel %s -- "
+		       "Ctrl+C to stop\n\n", argb_blend_select()->name);
+
+	while (keep_running()) {
+		int back = 1 - cur;
+
+		telemetry_begin(&telemetry, TEL_RENDER);
+		render_frame(&dt, primary_bufs, back, &anim, 0xffffff);
+		if (cpu_overlay.pixels) {
+			double c0 = render_pool_now_ms();
+			composite_argb(&primary_bufs[back], &cpu_overlay,
+				       fixed.x, fixed.y, &dt.repaint, &blend);
+			cpu_ms += render_pool_now_ms() - c0;
+		}
+		update_animation(&anim, (int)primary_bufs[back].width);
+		telemetry_end(&telemetry, TEL_RENDER);
+
+		/*
+		 * Only FB_ID of the primary plane changes each frame.
+		 * The overlay stays at the same framebuffer and position,
+		 * so it does not need to be included in every flip commit.
+		 * The kernel's state machine retains the overlay configuration
+		 * from the initial commit above.
+		 */
+		atomic_req_set(&flip_req, kms->plane_id,
+			       kms->primary_props.fb_id,
+			       primary_bufs[back].fb_id);
+		atomic_req_set(&flip_req, kms->plane_id,
+			       kms->primary_props.crtc_id, kms->crtc_id);
+		add_damage_clips(kms, &flip_req, &dt, dt.frame - 1, dt.frame);
+
+		telemetry_begin(&telemetry, TEL_COMMIT);
+		int ret = atomic_req_commit(&flip_req, kms->fd,
+					    DRM_MODE_ATOMIC_NONBLOCK |
+					    DRM_MODE_PAGE_FLIP_EVENT,
+					    &pending);
+
+		if (ret) { perror("atomic flip"); break; }
+		telemetry_end(&telemetry, TEL_COMMIT);
+		pending.waiting = true;
+
+		if (event_loop_wait(&events, &pending.waiting, 1000) < 0) {
+			fprintf(stderr, "No vblank event: %s\n", strerror(errno));
+			break;
+		}
+
+		cur = back;
+	}
+
+	if (cpu_overlay.pixels && anim.frame_count) {
+		double n = anim.frame_count;
+
+		printf("CPU overlay: %.3f ms/frame, %.0f px copied, "
+		       "%.0f blended per frame\n", cpu_ms / n,
+		       blend.copied / n, blend.blended / n);
+	}
+	argb_layer_free(&cpu_overlay);
+}
+
+/* ============================================================
+ * plane_supports_format - Is @fourcc in the plane's format list?
+ *
+ * AddFB2 accepts any format the driver knows, but a given plane may
+ * scan out only a subset (e.g. VOP2 cluster vs esmart windows), and
+ * the mismatch would only surface as a failed commit.
+ * ============================================================ */
+static bool plane_supports_format(int fd, uint32_t plane_id, uint32_t fourcc)
+{
+	drmModePlane *plane = drmModeGetPlane(fd, plane_id);
+	bool found = false;
+
+	if (!plane)
+		return false;
+	for (uint32_t i = 0; i < plane->count_formats && !found; i++)
+		found = plane->formats[i] == fourcc;
+	drmModeFreePlane(plane);
+	return found;
+}
+
+/* ============================================================
+ * find_primary_and_overlay - Walk plane list for this CRTC.
+ * @fd:          DRM file descriptor.
+ * @crtc_idx:    Index into resource crtc array (used in bitmask check).
+ * @primary_out: Receives the primary plane ID.
+ * @overlay_out: Receives the first overlay plane ID (0 if none).
+ * ============================================================ */
+static int find_planes(int fd, uint32_t crtc_id, uint32_t crtc_idx,
+                       uint32_t *primary_out, uint32_t *overlay_out)
+{
+        drmModePlaneRes *plane_res = drmModeGetPlaneResources(fd);
+        if (!plane_res) return -1;
+
+        *primary_out = 0;
+        *overlay_out = 0;
+
+        for (uint32_t i = 0; i < plane_res->count_planes; i++) {
+                drmModePlane *plane =
+                        drmModeGetPlane(fd, plane_res->planes[i]);
+                if (!plane) continue;
+
+                if (!(plane->possible_crtcs & (1 << crtc_idx))) {
+                        drmModeFreePlane(plane);
+                        continue;
+                }
+
+                drmModeObjectProperties *props =
+                        drmModeObjectGetProperties(fd, plane->plane_id,
+                                                   DRM_MODE_OBJECT_PLANE);
+                if (!props) { drmModeFreePlane(plane); continue; }
+
+                uint64_t type     = 0;
+                uint64_t curr_crtc = 0;
+
+                for (uint32_t p = 0; p < props->count_props; p++) {
+                        const struct prop_info *pr =
+                                prop_index_get(&prop_index, props->props[p]);
+                        if (!pr) continue;
+                        if (strcmp(pr->name, "type") == 0)
+                                type = props->prop_values[p];
+                        if (strcmp(pr->name, "CRTC_ID") == 0)
+                                curr_crtc = props->prop_values[p];
+                }
+
+                drmModeFreeObjectProperties(props);
+
+                if (type == DRM_PLANE_TYPE_PRIMARY) {
+                        /*
+                         * Prefer the plane already active on this CRTC.
+                         * If none is active yet, fall back to the first
+                         * compatible PRIMARY plane found.
+                         */
+                        if (curr_crtc == crtc_id)
+                                *primary_out = plane->plane_id; /* best match */
+                        else if (!*primary_out)
+                                *primary_out = plane->plane_id; /* fallback */
+                } else if (type == DRM_PLANE_TYPE_OVERLAY && !*overlay_out) {
+                        *overlay_out = plane->plane_id;
+                }
+
+                drmModeFreePlane(plane);
+        }
+
+        drmModeFreePlaneResources(plane_res);
+        return (*primary_out) ? 0 : -1;
+}
+
+/* ============================================================
+ * Layer planning (--multiplane --layers N)
+ *
+ * A desktop-like scene of N static layers over the animated primary
+ * plane.  layer-planner.h decides which layers get a plane of their
+ * own; the rest are drawn by the CPU into the primary buffer every
+ * time the bar repaints underneath them.
+ *
+ * Positions and sizes are in 1/1000 of the screen, so the scene fits
+ * any mode.  The formats differ on purpose: not every VOP2 window
+ * takes every format.
+ *
+ * ARGB8888 layers are rounded rectangles with real alpha: transparent
+ * corners (@round, in percent of the shorter side) around a body of
+ * opacity @alpha, stored straight or premultiplied.  Without a plane
+ * they go through argb-blend.h; their plane buffers always hold
+ * premultiplied pixels, the KMS default blend mode.
+ * ============================================================ */
+struct scene_layer {
+	const char *name;
+	int32_t     x, y;
+	uint32_t    w, h;
+	const char *format;
+	uint32_t    color;
+	uint8_t     alpha;         /* ARGB8888 only */
+	uint8_t     round;
+	bool        premultiplied;
+};
+
+static const struct scene_layer scene[PLANNER_MAX_LAYERS] = {
+	{ "top bar",  0,   0,   1000, 60,  "XRGB8888", 0x303848, 0,   0,  0 },
+	{ "video",    80,  140, 480,  480, "RGB565",   0x2060c0, 0,   0,  0 },
+	{ "window A", 520, 180, 380,  420, "ARGB8888", 0xc0c0b0, 255, 6,  1 },
+	{ "window B", 640, 480, 300,  360, "XRGB8888", 0x50a060, 0,   0,  0 },
+	{ "osd",      60,  700, 420,  140, "ARGB8888", 0xe0a020, 176, 25, 0 },
+	{ "badge",    900, 90,  60,   60,  "BGR888",   0xd03030, 0,   0,  0 },
+	{ "pointer",  460, 460, 24,   24,  "ARGB8888", 0xffffff, 255, 50, 0 },
+	{ "dock",     250, 900, 500,  80,  "RGB565",   0x606870, 0,   0,  0 },
+};
+
+/* Every plane this CRTC could use, as layer-planner.h sees them */
+struct crtc_planes {
+	struct planner_plane planes[PLANNER_MAX_PLANES];
+	struct plane_props   props[PLANNER_MAX_PLANES];
+	uint32_t             zpos_prop[PLANNER_MAX_PLANES]; /* 0: none */
+	int                  count;
+	int                  primary;
+};
+
+struct layer_scene {
+	struct kms_state     *kms;
+	struct crtc_planes    cp;
+	struct planner_layer  layers[PLANNER_MAX_LAYERS];
+	struct buffer_object  bufs[PLANNER_MAX_LAYERS];
+	struct argb_layer     argb[PLANNER_MAX_LAYERS]; /* ARGB8888 layers */
+	int                   nlayers;
+	uint32_t              primary_fb;
+};
+
+/* ============================================================
+ * enumerate_crtc_planes - Planes usable on the CRTC of @kms.
+ *
+ * Unlike find_planes() this keeps every overlay, with its formats
+ * and zpos.  Planes currently showing something on another CRTC are
+ * left out: turning them off would blank someone else's display.
+ * ============================================================ */
+static int enumerate_crtc_planes(int fd, const struct kms_state *kms,
+				 struct crtc_planes *cp)
+{
+	drmModePlaneRes *plane_res = drmModeGetPlaneResources(fd);
+
+	if (!plane_res)
+		return -1;
+	cp->count   = 0;
+	cp->primary = -1;
+
+	for (uint32_t i = 0; i < plane_res->count_planes &&
+			     cp->count < PLANNER_MAX_PLANES; i++) {
+		drmModePlane *plane = drmModeGetPlane(fd, plane_res->planes[i]);
+		if (!plane)
+			continue;
+		if (!(plane->possible_crtcs & (1u << kms->crtc_idx)) ||
+		    (plane->crtc_id && plane->crtc_id != kms->crtc_id)) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		struct planner_plane *pp = &cp->planes[cp->count];
+		*pp = (struct planner_plane){ .id = plane->plane_id };
+		pp->nformats = plane->count_formats < PLANNER_MAX_FORMATS ?
+			       plane->count_formats : PLANNER_MAX_FORMATS;
+		memcpy(pp->formats, plane->formats,
+		       pp->nformats * sizeof(pp->formats[0]));
+		cp->zpos_prop[cp->count] = 0;
+
+		drmModeObjectProperties *props =
+			drmModeObjectGetProperties(fd, plane->plane_id,
+						   DRM_MODE_OBJECT_PLANE);
+		for (uint32_t p = 0; props && p < props->count_props; p++) {
+			const struct prop_info *pr =
+				prop_index_get(&prop_index, props->props[p]);
+			if (!pr)
+				continue;
+			if (strcmp(pr->name, "type") == 0)
+				pp->type = (uint32_t)props->prop_values[p];
+			if (strcmp(pr->name, "zpos") == 0) {
+				pp->has_zpos     = true;
+				pp->zpos_mutable =
+					!(pr->flags & DRM_MODE_PROP_IMMUTABLE);
+				pp->zpos     = props->prop_values[p];
+				pp->zpos_min = pr->count_values > 0 ?
+					       pr->values[0] : pp->zpos;
+				pp->zpos_max = pr->count_values > 1 ?
+					       pr->values[1] : pp->zpos;
+				cp->zpos_prop[cp->count] = pr->id;
+			}
+		}
+		drmModeFreeObjectProperties(props);
+
+		if (cache_plane_props(fd, plane->plane_id,
+				      &cp->props[cp->count]) == 0) {
+			if (plane->plane_id == kms->plane_id)
+				cp->primary = cp->count;
+			cp->count++;
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(plane_res);
+	return cp->primary < 0 ? -1 : 0;
+}
+
+/* Request for the primary plane plus layers[0 .. @n) on their planes */
+static void layer_scene_build(struct layer_scene *s, int n)
+{
+	struct kms_state *kms = s->kms;
+
+	atomic_req_set(&flip_req, kms->plane_id, kms->primary_props.fb_id,
+		       s->primary_fb);
+	atomic_req_set(&flip_req, kms->plane_id, kms->primary_props.crtc_id,
+		       kms->crtc_id);
+
+	for (int p = 0; p < s->cp.count; p++) {
+		const struct plane_props *pp = &s->cp.props[p];
+		uint32_t id = s->cp.planes[p].id;
+		int k = 0;
+
+		if (p == s->cp.primary)
+			continue;
+		while (k < n && s->layers[k].plane != p)
+			k++;
+		if (k == n) {
+			atomic_req_set(&flip_req, id, pp->fb_id, 0);
+			atomic_req_set(&flip_req, id, pp->crtc_id, 0);
+			continue;
+		}
+
+		const struct planner_layer *l = &s->layers[k];
+		atomic_req_set(&flip_req, id, pp->fb_id, s->bufs[k].fb_id);
+		atomic_req_set(&flip_req, id, pp->crtc_id, kms->crtc_id);
+		atomic_req_set(&flip_req, id, pp->crtc_x, (uint64_t)(int64_t)l->x);
+		atomic_req_set(&flip_req, id, pp->crtc_y, (uint64_t)(int64_t)l->y);
+		atomic_req_set(&flip_req, id, pp->crtc_w, l->w);
+		atomic_req_set(&flip_req, id, pp->crtc_h, l->h);
+		atomic_req_set(&flip_req, id, pp->src_x, 0);
+		atomic_req_set(&flip_req, id, pp->src_y, 0);
+		atomic_req_set(&flip_req, id, pp->src_w, (uint64_t)l->w << 16);
+		atomic_req_set(&flip_req, id, pp->src_h, (uint64_t)l->h << 16);
+		if (s->cp.planes[p].zpos_mutable)
+			atomic_req_set(&flip_req, id, s->cp.zpos_prop[p],
+				       l->zpos);
+	}
+}
+
+static bool layer_scene_test(void *ctx, const struct planner_layer *layers,
+			     int n)
+{
+	struct layer_scene *s = ctx;
+
+	(void)layers; /* s->layers, updated in place by the planner */
+	layer_scene_build(s, n);
+	return atomic_req_test(&flip_req, s->kms->fd,
+			       DRM_MODE_ATOMIC_ALLOW_MODESET, &test_cache) == 0;
+}
+
+/*
+ * Draw the CPU-composited layers, bottom to top, inside @region of the
+ * primary buffer @bo.  ARGB8888 layers are blended when @bo can take
+ * it, other layers (and ARGB8888 ones otherwise) are filled opaque.
+ * Returns the number of pixels written by fills.
+ */
+static uint64_t composite_layers(struct buffer_object *bo,
+				 const struct layer_scene *s,
+				 const struct damage_region *region,
+				 struct argb_blend_stats *stats)
+{
+	uint64_t pixels = 0;
+
+	for (int k = 0; k < s->nlayers; k++) {
+		const struct planner_layer *l = &s->layers[k];
+		uint32_t packed = bo->fmt->pack(scene[k].color);
+
+		if (l->plane >= 0)
+			continue;
+		if (s->argb[k].pixels && argb_blend_target(bo->fmt)) {
+			composite_argb(bo, &s->argb[k], l->x, l->y, region,
+				       stats);
+			continue;
+		}
+		for (uint32_t i = 0; i < region->count; i++) {
+			const struct damage_rect *r = &region->rects[i];
+			int32_t x1 = r->x1 > l->x ? r->x1 : l->x;
+			int32_t y1 = r->y1 > l->y ? r->y1 : l->y;
+			int32_t x2 = r->x2 < l->x + (int32_t)l->w ?
+				     r->x2 : l->x + (int32_t)l->w;
+			int32_t y2 = r->y2 < l->y + (int32_t)l->h ?
+				     r->y2 : l->y + (int32_t)l->h;
+
+			if (x1 >= x2 || y1 >= y2)
+				continue;
+			for (int32_t y = y1; y < y2; y++)
+				bo->fmt->fill(bo->vaddr + (size_t)y * bo->pitch +
+					      (size_t)x1 * bo->fmt->cpp,
+					      packed, (uint32_t)(x2 - x1));
+			pixels += (uint64_t)(x2 - x1) * (uint64_t)(y2 - y1);
+		}
+	}
+	return pixels;
+}
+
+/* ============================================================
+ * run_layers - Plan the scene onto planes, then animate the primary.
+ * ============================================================ */
+static void run_layers(struct kms_state *kms,
+		       struct buffer_object primary_bufs[MAX_BUFFERS],
+		       int nlayers)
+{
+	struct layer_scene s = { .kms = kms, .nlayers = nlayers };
+	struct animation_state anim = { .bar_width = 80, .direction = 1 };
+	struct flip_pending pending = { .waiting = false };
+	struct damage_tracker dt;
+	struct planner pl;
+	struct argb_blend_stats blend = { 0, 0, 0 };
+	uint64_t cpu_pixels = 0;
+	double cpu_ms = 0;
+	int cur = 0, placed;
+	int32_t sw = kms->mode.hdisplay, sh = kms->mode.vdisplay;
+
+	s.primary_fb = primary_bufs[cur].fb_id;
+	if (enumerate_crtc_planes(kms->fd, kms, &s.cp) < 0) {
+		fprintf(stderr, "Cannot enumerate the CRTC's planes\n");
+		return;
+	}
+
+	for (int k = 0; k < nlayers; k++) {
+		const struct scene_layer *sl = &scene[k];
+		struct planner_layer *l = &s.layers[k];
+		struct buffer_object *bo = &s.bufs[k];
+
+		l->x = sl->x * sw / 1000;
+		l->y = sl->y * sh / 1000;
+		l->w = sl->w * (uint32_t)sw / 1000;
+		l->h = sl->h * (uint32_t)sh / 1000;
+		if (get_fb(bo, l->w, l->h, pixel_format_find(sl->format)) < 0) {
+			fprintf(stderr, "Failed to create fb for layer %s\n",
+				sl->name);
+			goto out;
+		}
+		l->fourcc = bo->fmt->fourcc;
+		if (bo->fmt->fourcc == DRM_FORMAT_ARGB8888) {
+			if (load_argb_layer(&s.argb[k], l->w, l->h,
+					    (uint32_t)sl->alpha << 24 | sl->color,
+					    sl->round, sl->premultiplied) < 0) {
+				fprintf(stderr, "Out of memory for layer %s\n",
+					sl->name);
+				goto out;
+			}
+			for (uint32_t y = 0; y < bo->height; y++)
+				memcpy(bo->vaddr + (size_t)y * bo->pitch,
+				       s.argb[k].pixels + (size_t)y * l->w,
+				       (size_t)l->w * sizeof(uint32_t));
+			continue;
+		}
+		uint32_t packed = bo->fmt->pack(sl->color);
+		for (uint32_t y = 0; y < bo->height; y++)
+			bo->fmt->fill(bo->vaddr + (size_t)y * bo->pitch,
+				      packed, bo->width);
+	}
+
+	double t0 = render_pool_now_ms();
+	placed = planner_assign(&pl, s.cp.planes, s.cp.count, s.cp.primary,
+				s.layers, nlayers, layer_scene_test, &s);
+	printf("\n[LAYER PLANNER] %d layers, %d planes on CRTC %u: "
+	       "%d on planes, %.2f ms\n",
+	       nlayers, s.cp.count, kms->crtc_id, placed < 0 ? 0 : placed,
+	       render_pool_now_ms() - t0);
+	printf("  %u search nodes, %u TEST_ONLY trials, %u rejected\n",
+	       pl.nodes, pl.tests, pl.rejected);
+	for (int k = 0; k < nlayers; k++) {
+		const struct planner_layer *l = &s.layers[k];
+
+		if (l->plane >= 0)
+			printf("  %-9s %-9s %4ux%-4u -> plane %u, zpos %llu\n",
+			       scene[k].name, scene[k].format, l->w, l->h,
+			       s.cp.planes[l->plane].id,
+			       (unsigned long long)l->zpos);
+		else
+			printf("  %-9s %-9s %4ux%-4u -> CPU composition\n",
+			       scene[k].name, scene[k].format, l->w, l->h);
+	}
+
+	layer_scene_build(&s, nlayers);
+	int ret = atomic_req_commit(&flip_req, kms->fd,
+				    DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	if (ret) {
+		fprintf(stderr, "Layer commit failed: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	printf("Bar on the primary plane, layers static -- Ctrl+C to stop\n\n");
+	damage_tracker_init(&dt, primary_bufs[0].width, primary_bufs[0].height);
+
+	while (keep_running()) {
+		int back = 1 - cur;
+
+		telemetry_begin(&telemetry, TEL_RENDER);
+		render_frame(&dt, primary_bufs, back, &anim, 0xffffff);
+		double c0 = render_pool_now_ms();
+		cpu_pixels += composite_layers(&primary_bufs[back], &s,
+					       &dt.repaint, &blend);
+		cpu_ms += render_pool_now_ms() - c0;
+		update_animation(&anim, (int)primary_bufs[back].width);
+		telemetry_end(&telemetry, TEL_RENDER);
+
+		atomic_req_set(&flip_req, kms->plane_id,
+			       kms->primary_props.fb_id,
+			       primary_bufs[back].fb_id);
+		add_damage_clips(kms, &flip_req, &dt, dt.frame - 1, dt.frame);
+
+		telemetry_begin(&telemetry, TEL_COMMIT);
+		ret = atomic_req_commit(&flip_req, kms->fd,
+					DRM_MODE_ATOMIC_NONBLOCK |
+					DRM_MODE_PAGE_FLIP_EVENT, &pending);
+		if (ret) {
+			fprintf(stderr, "atomic flip: %s\n", strerror(-ret));
+			break;
+		}
+		telemetry_end(&telemetry, TEL_COMMIT);
+		pending.waiting = true;
+
+		if (event_loop_wait(&events, &pending.waiting, 1000) < 0) {
+			fprintf(stderr, "No vblank event: %s\n", strerror(errno));
+			break;
+		}
+		cur = back;
+	}
+
+	if (anim.frame_count) {
+		double n = anim.frame_count;
+
+		printf("CPU composition: %.3f ms/frame for %d of %d layers "
+		       "(blend kernel %s)\n", cpu_ms / n,
+		       nlayers - (placed < 0 ? 0 : placed), nlayers,
+		       argb_blend_select()->name);
+		printf("  per frame: %.0f px filled, %.0f copied, "
+		       "%.0f blended, %.0f transparent skipped\n",
+		       cpu_pixels / n, blend.copied / n, blend.blended / n,
+		       blend.skipped / n);
+	}
+
+	/* Take the overlays off the layer buffers before freeing them */
+	for (int k = 0; k < nlayers; k++)
+		s.layers[k].plane = -1;
+	layer_scene_build(&s, 0);
+	atomic_req_commit(&flip_req, kms->fd, DRM_MODE_ATOMIC_ALLOW_MODESET,
+			  NULL);
+out:
+	for (int k = 0; k < nlayers; k++) {
+		if (s.bufs[k].fb_id)
+			put_fb(&s.bufs[k]);
+		argb_layer_free(&s.argb[k]);
+	}
+}
+
+/* ============================================================
+ * Multi-head assignment
+ *
+ * Connectors, CRTCs and primary planes form a small matching problem:
+ * a connector can only be driven by the CRTCs its encoders list in
+ * possible_crtcs, and each CRTC needs a primary plane of its own whose
+ * possible_crtcs includes it.  First-fit can strand a connector (HDMI
+ * takes the only CRTC the eDP could have used), so the assignment is
+ * a depth-first search over the few dozen combinations, keeping the
+ * one that lights up the most connectors.
+ * ============================================================ */
+#define MAX_CONNECTORS 16
+#define MAX_PRIMARIES  32
+
+struct head_match {
+	int      nconn;
+	int      nplanes;
+	int      limit;                       /* min(nconn, MAX_HEADS)     */
+	uint32_t conn_crtcs[MAX_CONNECTORS];  /* possible_crtcs, connector */
+	uint32_t plane_crtcs[MAX_PRIMARIES];  /* possible_crtcs, plane     */
+	int      crtc[MAX_CONNECTORS];        /* Current try, -1 = none    */
+	int      plane[MAX_CONNECTORS];
+	int      best_crtc[MAX_CONNECTORS];
+	int      best_plane[MAX_CONNECTORS];
+	int      best;                        /* Heads in best_*           */
+};
+
+static void match_heads(struct head_match *m, int i, uint32_t crtcs_used,
+			uint64_t planes_used, int assigned)
+{
+	int left = m->nconn - i;
+
+	if (left > m->limit - assigned)
+		left = m->limit - assigned;
+	if (m->best == m->limit || assigned + left <= m->best)
+		return; /* Cannot beat what we have */
+
+	if (i == m->nconn) {
+		m->best = assigned;
+		memcpy(m->best_crtc, m->crtc, sizeof(m->crtc));
+		memcpy(m->best_plane, m->plane, sizeof(m->plane));
+		return;
+	}
+
+	for (int c = 0; c < 32 && assigned < m->limit; c++) {
+		if (!(m->conn_crtcs[i] >> c & 1) || crtcs_used >> c & 1)
+			continue;
+		for (int p = 0; p < m->nplanes; p++) {
+			if (!(m->plane_crtcs[p] >> c & 1) || planes_used >> p & 1)
+				continue;
+			m->crtc[i]  = c;
+			m->plane[i] = p;
+			match_heads(m, i + 1, crtcs_used | 1u << c,
+				    planes_used | 1ull << p, assigned + 1);
+		}
+	}
+
+	/* Or leave this connector dark */
+	m->crtc[i] = -1;
+	match_heads(m, i + 1, crtcs_used, planes_used, assigned);
+}
+
+/* Union of possible_crtcs over all encoders of @conn */
+static uint32_t connector_crtcs(int fd, const drmModeConnector *conn)
+{
+	uint32_t mask = 0;
+
+	for (int i = 0; i < conn->count_encoders; i++) {
+		drmModeEncoder *enc = drmModeGetEncoder(fd, conn->encoders[i]);
+		if (!enc)
+			continue;
+		mask |= enc->possible_crtcs;
+		drmModeFreeEncoder(enc);
+	}
+	return mask;
+}
+
+/* Primary planes able to scan out @fourcc, with their possible_crtcs */
+static int list_primary_planes(int fd, uint32_t fourcc, uint32_t *ids,
+			       uint32_t *crtcs, int max)
+{
+	drmModePlaneRes *plane_res = drmModeGetPlaneResources(fd);
+	int n = 0;
+
+	if (!plane_res)
+		return 0;
+	for (uint32_t i = 0; i < plane_res->count_planes && n < max; i++) {
+		drmModePlane *plane = drmModeGetPlane(fd, plane_res->planes[i]);
+		uint64_t type = 0;
+
+		if (!plane)
+			continue;
+		drmModeObjectProperties *props =
+			drmModeObjectGetProperties(fd, plane->plane_id,
+						   DRM_MODE_OBJECT_PLANE);
+		int p = props ? prop_index_find(&prop_index, props, "type") : -1;
+		if (p >= 0)
+			type = props->prop_values[p];
+		drmModeFreeObjectProperties(props);
+
+		if (type == DRM_PLANE_TYPE_PRIMARY &&
+		    plane_supports_format(fd, plane->plane_id, fourcc)) {
+			ids[n]   = plane->plane_id;
+			crtcs[n] = plane->possible_crtcs;
+			n++;
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(plane_res);
+	return n;
+}
+
+static void destroy_heads(void)
+{
+	for (int i = 0; i < nheads; i++) {
+		struct head *h = &heads[i];
+
+		for (int b = 0; b < h->sc.depth; b++)
+			if (h->bufs[b].fb_id)
+				put_fb(&h->bufs[b]);
+		damage_blob_cache_destroy(h->kms.fd, &h->kms.damage_blobs);
+		if (h->kms.mode_blob_id)
+			drmModeDestroyPropertyBlob(h->kms.fd,
+						   h->kms.mode_blob_id);
+	}
+	nheads = 0;
+}
+
+/* ============================================================
+ * setup_heads - Assign connectors to CRTCs and primary planes,
+ *               allocate each head's buffers and light all of them
+ *               up in one atomic modeset.
+ *
+ * Returns the number of heads, or -1.
+ * ============================================================ */
+static int setup_heads(int fd, drmModeRes *res,
+		       const struct pixel_format *fmt, int depth,
+		       enum swapchain_mode mode)
+{
+	struct head_match m = { 0 };
+	uint32_t conn_ids[MAX_CONNECTORS];
+	drmModeModeInfo modes[MAX_CONNECTORS];
+	uint32_t plane_ids[MAX_PRIMARIES];
+
+	for (int i = 0; i < res->count_connectors &&
+			m.nconn < MAX_CONNECTORS; i++) {
+		drmModeConnector *conn =
+			drmModeGetConnector(fd, res->connectors[i]);
+
+		if (conn && conn->connection == DRM_MODE_CONNECTED &&
+		    conn->count_modes > 0) {
+			conn_ids[m.nconn]     = conn->connector_id;
+			modes[m.nconn]        = conn->modes[0];
+			m.conn_crtcs[m.nconn] = connector_crtcs(fd, conn);
+			m.nconn++;
+		}
+		drmModeFreeConnector(conn);
+	}
+	m.nplanes = list_primary_planes(fd, fmt->fourcc, plane_ids,
+					m.plane_crtcs, MAX_PRIMARIES);
+	m.limit = m.nconn < MAX_HEADS ? m.nconn : MAX_HEADS;
+	match_heads(&m, 0, 0, 0, 0);
+
+	printf("%d connected connector(s), %d CRTC(s), %d primary plane(s) "
+	       "for %s\n", m.nconn, res->count_crtcs, m.nplanes, fmt->name);
+	if (!m.best) {
+		fprintf(stderr, "No connector/CRTC/primary plane combination\n");
+		return -1;
+	}
+
+	for (int i = 0; i < m.nconn; i++) {
+		if (m.best_crtc[i] < 0) {
+			printf("  connector %u: no CRTC/primary plane left -- "
+			       "not driven\n", conn_ids[i]);
+			continue;
+		}
+
+		struct head *h = &heads[nheads++];
+		int c = m.best_crtc[i];
+
+		memset(h, 0, sizeof(*h));
+		h->kms.fd       = fd;
+		h->kms.conn_id  = conn_ids[i];
+		h->kms.crtc_id  = res->crtcs[c];
+		h->kms.crtc_idx = (uint32_t)c;
+		h->kms.plane_id = plane_ids[m.best_plane[i]];
+		h->kms.mode     = modes[i];
+		snprintf(h->name, sizeof(h->name), "head %d", nheads - 1);
+
+		printf("  %s: connector %u -> CRTC %u (idx %d), plane %u, "
+		       "%dx%d@%uHz\n", h->name, h->kms.conn_id, h->kms.crtc_id,
+		       c, h->kms.plane_id, h->kms.mode.hdisplay,
+		       h->kms.mode.vdisplay, h->kms.mode.vrefresh);
+
+		if (cache_connector_props(fd, h->kms.conn_id,
+					  &h->kms.conn_props) ||
+		    cache_crtc_props(fd, h->kms.crtc_id, &h->kms.crtc_props) ||
+		    cache_plane_props(fd, h->kms.plane_id,
+				      &h->kms.primary_props)) {
+			fprintf(stderr, "Failed to cache property IDs for %s\n",
+				h->name);
+			return -1;
+		}
+
+		swapchain_init(&h->sc, depth, mode, 0, render_pool_now_ms());
+		h->sc.name = h->name;
+		for (int b = 0; b < depth; b++) {
+			if (get_fb(&h->bufs[b], h->kms.mode.hdisplay,
+				   h->kms.mode.vdisplay, fmt) < 0) {
+				fprintf(stderr, "Failed to create fb %d for %s\n",
+					b, h->name);
+				return -1;
+			}
+			memset(h->bufs[b].vaddr, 0x20, h->bufs[b].size);
+		}
+		damage_tracker_init(&h->dt, h->bufs[0].width, h->bufs[0].height);
+		h->anim = (struct animation_state){ .bar_width = 80,
+						    .direction = 1 };
+		telemetry_init(&h->tel, 0, NULL);
+	}
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	int ret = req ? 0 : -ENOMEM;
+
+	for (int i = 0; i < nheads && !ret; i++)
+		ret = atomic_modeset_add(&heads[i].kms, req,
+					 heads[i].bufs[0].fb_id);
+	if (!ret)
+		ret = atomic_commit_modeset(fd, req);
+	drmModeAtomicFree(req);
+	return ret ? -1 : nheads;
+}
+
+/* Plane update showing the head's buffer @next */
+static void head_add_flip(struct head *h, struct atomic_req *req,
+			  uint32_t flags, int next)
+{
+	atomic_req_set(req, h->kms.plane_id, h->kms.primary_props.fb_id,
+		       h->bufs[next].fb_id);
+	if (!(flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+		atomic_req_set(req, h->kms.plane_id,
+			       h->kms.primary_props.crtc_id, h->kms.crtc_id);
+		add_damage_clips(&h->kms, req, &h->dt,
+				 swapchain_scanout_frame(&h->sc),
+				 h->sc.slots[next].frame);
+	}
+}
+
+/* Commit the head's next queued frame, if it has one and no flip is out */
+static int head_commit(struct head *h, uint32_t flags)
+{
+	int next = swapchain_next(&h->sc);
+	int ret;
+
+	if (next < 0)
+		return 0;
+
+	head_add_flip(h, &flip_req, flags, next);
+
+	/* No user_data: the flip event is routed by its crtc_id */
+	telemetry_begin(&h->tel, TEL_COMMIT);
+	ret = atomic_req_commit(&flip_req, h->kms.fd, flags, NULL);
+	if (ret == -EBUSY) {
+		h->sc.busy++;
+		return ret;
+	}
+	if (ret)
+		return ret;
+	telemetry_end(&h->tel, TEL_COMMIT);
+	swapchain_committed(&h->sc);
+	h->waiting = true;
+	return 0;
+}
+
+/* ============================================================
+ * multihead_step - One pass of the free-running multi-head loop.
+ *
+ * Renders into and commits every head that can take a frame right
+ * now; heads still waiting for their flip are skipped.  Clears *@idle
+ * if some head could render more, sets *@busy on -EBUSY.
+ * ============================================================ */
+static int multihead_step(uint32_t flags, bool *idle, bool *busy)
+{
+	for (int i = 0; i < nheads; i++) {
+		struct head *h = &heads[i];
+		int idx = swapchain_acquire(&h->sc);
+
+		if (idx >= 0) {
+			telemetry_begin(&h->tel, TEL_RENDER);
+			render_frame(&h->dt, h->bufs, idx, &h->anim,
+				     head_colors[i]);
+			telemetry_end(&h->tel, TEL_RENDER);
+			update_animation(&h->anim, (int)h->bufs[idx].width);
+			swapchain_queue(&h->sc, idx, h->dt.frame,
+					render_pool_now_ms());
+		}
 
-		drmModeAtomicReq *req = drmModeAtomicAlloc();
+		int ret = head_commit(h, flags);
+		if (ret == -EBUSY) {
+			*busy = true;
+		} else if (ret) {
+			fprintf(stderr, "%s: flip commit: %s\n",
+				h->name, strerror(-ret));
+			return -1;
+		}
+		if (swapchain_can_acquire(&h->sc))
+			*idle = false;
+		swapchain_report(&h->sc, 300, render_pool_now_ms());
+	}
+	return 0;
+}
 
-		/* Primary plane */
-		drmModeAtomicAddProperty(req, kms->plane_id,
-				     kms->primary_props.fb_id,
-				     primary_bufs[cur].fb_id);
-		drmModeAtomicAddProperty(req, kms->plane_id,
-				     kms->primary_props.crtc_id, kms->crtc_id);
-
-		/* Overlay plane */
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.fb_id,
-				     overlay_buf->fb_id);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.crtc_id, kms->crtc_id);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.crtc_x, 50);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.crtc_y, 50);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.crtc_w, ow);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.crtc_h, oh);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.src_x, 0);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.src_y, 0);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.src_w,
-				     (uint64_t)ow << 16);
-		drmModeAtomicAddProperty(req, kms->overlay_id,
-				     kms->overlay_props.src_h,
-				     (uint64_t)oh << 16);
-
-		int ret = drmModeAtomicCommit(kms->fd, req,
-					      DRM_MODE_ATOMIC_ALLOW_MODESET,
-					      NULL);
-		drmModeAtomicFree(req);
-		if (ret) {
-			fprintf(stderr,
-				"Overlay initial commit failed: %s\n"
-				"Hardware may not support overlay plane "
-				"on this CRTC -- falling back to primary only\n",
-				strerror(-ret));
-			kms->overlay_id = 0;
+/* ============================================================
+ * Genlock (--multihead --genlock)
+ *
+ * A video wall shows one scene across several displays.  Committing
+ * each head on its own lets them drift: one commit makes its vblank,
+ * the next misses it, and for a frame the bar is in two places at
+ * once.  run_multiplane() already relies on one commit updating
+ * several planes on the same vblank; here the planes belong to
+ * different CRTCs.  One drmModeAtomicCommit() carries every head's
+ * plane update, and the kernel sends one flip event per CRTC.
+ *
+ * The same vblank is only guaranteed when the CRTCs run with shared
+ * timing (same mode and pixel clock source).  How close the heads
+ * actually land is measured from the per-CRTC event timestamps: the
+ * skew of a frame is the spread between its earliest and latest
+ * flip, and a frame counts as split when that spread exceeds half a
+ * refresh period, i.e. the heads showed it on different vblanks.
+ * ============================================================ */
+struct genlock_state {
+	struct animation_state wall; /* Bar position in wall coordinates */
+	int32_t  wall_width;
+	bool     in_flight;          /* Group commit not fully flipped */
+
+	uint64_t frames;
+	uint64_t split;
+	double   skew_sum_ms;
+	double   skew_max_ms;
+	uint64_t window_frames;
+	uint64_t window_split;
+	double   window_skew_sum_ms;
+};
+
+static void genlock_init(struct genlock_state *g)
+{
+	memset(g, 0, sizeof(*g));
+	g->wall = (struct animation_state){ .bar_width = 80, .direction = 1 };
+
+	/* Heads side by side, left to right in assignment order */
+	for (int i = 0; i < nheads; i++) {
+		heads[i].wall_x = g->wall_width;
+		g->wall_width += (int32_t)heads[i].bufs[0].width;
+	}
+}
+
+/* All flip events of the group commit are in: measure their spread */
+static void genlock_flipped(struct genlock_state *g)
+{
+	double first = heads[0].flip_ms, last = heads[0].flip_ms;
+	double period = 0;
+
+	for (int i = 1; i < nheads; i++) {
+		if (heads[i].flip_ms < first) first = heads[i].flip_ms;
+		if (heads[i].flip_ms > last)  last  = heads[i].flip_ms;
+	}
+	for (int i = 0; i < nheads; i++) {
+		double p = 1000.0 / (heads[i].kms.mode.vrefresh ?
+				     heads[i].kms.mode.vrefresh : 60);
+		if (!period || p < period)
+			period = p;
+	}
+
+	double skew = last - first;
+	g->frames++;
+	g->skew_sum_ms += skew;
+	if (skew > g->skew_max_ms)
+		g->skew_max_ms = skew;
+	if (skew > period / 2)
+		g->split++;
+	g->in_flight = false;
+
+	if (g->frames - g->window_frames == 300) {
+		printf("  [genlock] %d heads, flip skew avg %.3f ms, "
+		       "%llu/300 frames split across vblanks\n", nheads,
+		       (g->skew_sum_ms - g->window_skew_sum_ms) / 300,
+		       (unsigned long long)(g->split - g->window_split));
+		g->window_frames      = g->frames;
+		g->window_split       = g->split;
+		g->window_skew_sum_ms = g->skew_sum_ms;
+	}
+}
+
+/* ============================================================
+ * genlock_step - One pass of the genlocked loop.
+ *
+ * All heads render the same wall frame -- each its own slice of it --
+ * and only once every head has a buffer to render into.  The frame is
+ * committed once every head has it queued and none is still flipping
+ * (the kernel would refuse a CRTC with a commit outstanding).
+ * ============================================================ */
+static int genlock_step(struct genlock_state *g, uint32_t flags,
+			bool *idle, bool *busy)
+{
+	bool can_render = true, can_commit = !g->in_flight;
+
+	for (int i = 0; i < nheads; i++) {
+		can_render &= swapchain_can_acquire(&heads[i].sc);
+		can_commit &= swapchain_next(&heads[i].sc) >= 0;
+	}
+
+	if (can_render) {
+		for (int i = 0; i < nheads; i++) {
+			struct head *h = &heads[i];
+			int idx = swapchain_acquire(&h->sc);
+
+			h->anim.bar_width  = g->wall.bar_width;
+			h->anim.bar_x      = g->wall.bar_x - h->wall_x;
+			h->anim.prev_bar_x = g->wall.prev_bar_x - h->wall_x;
+			telemetry_begin(&h->tel, TEL_RENDER);
+			render_frame(&h->dt, h->bufs, idx, &h->anim,
+				     head_colors[0]);
+			telemetry_end(&h->tel, TEL_RENDER);
+			swapchain_queue(&h->sc, idx, h->dt.frame,
+					render_pool_now_ms());
 		}
+		/* Same on-screen speed per display whatever the wall size */
+		move_bar(&g->wall, g->wall_width, BAR_STEP * nheads);
+		*idle = false;
 	}
 
-	printf("\n[MULTI-PLANE ATOMIC] Primary (animated) + Overlay (static red)\n");
-	printf("Both planes update on the same vblank -- Ctrl+C to stop\n\n");
+	if (!can_commit) {
+		for (int i = 0; i < nheads; i++)
+			swapchain_report(&heads[i].sc, 300, render_pool_now_ms());
+		return 0;
+	}
 
-	while (1) {
-		int back = 1 - cur;
+	for (int i = 0; i < nheads; i++) {
+		head_add_flip(&heads[i], &flip_req, flags,
+			      swapchain_next(&heads[i].sc));
+		telemetry_begin(&heads[i].tel, TEL_COMMIT);
+	}
 
-		draw_moving_bar(&primary_bufs[back], &anim, 0xffffff);
-		update_animation(&anim, (int)primary_bufs[back].width);
+	int ret = atomic_req_commit(&flip_req, heads[0].kms.fd, flags, NULL);
+	if (ret == -EBUSY) {
+		*busy = true;
+		return 0;
+	}
+	if (ret) {
+		fprintf(stderr, "Genlocked flip commit (%d CRTCs): %s\n",
+			nheads, strerror(-ret));
+		return -1;
+	}
+	for (int i = 0; i < nheads; i++) {
+		telemetry_end(&heads[i].tel, TEL_COMMIT);
+		swapchain_committed(&heads[i].sc);
+		heads[i].waiting = true;
+	}
+	g->in_flight = true;
+	return 0;
+}
 
-		drmModeAtomicReq *req = drmModeAtomicAlloc();
-		if (!req) break;
+/* ============================================================
+ * run_multihead - --atomic on every connected display at once.
+ *
+ * One thread, one fd, one event loop.  Each pass renders and commits
+ * whatever each head can take right now; a head waiting for its flip
+ * is skipped, never waited on, so a 30 Hz panel does not slow down a
+ * 60 Hz one.  The loop only blocks when no head has anything to do.
+ * The per-head summaries at the end show each head's own frame rate
+ * and vblank misses.
+ *
+ * With @genlock the heads instead move in lockstep, see genlock_step().
+ * ============================================================ */
+static int run_multihead(int fd, drmModeRes *res,
+			 const struct pixel_format *fmt, int depth,
+			 enum swapchain_mode mode, bool genlock)
+{
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	struct genlock_state g;
+	uint64_t cap = 0;
+
+	if (genlock && mode == SWAPCHAIN_IMMEDIATE) {
+		/* Tearing flips cannot be lined up across CRTCs */
+		printf("--genlock: using mailbox instead of immediate\n");
+		mode = SWAPCHAIN_MAILBOX;
+	}
+	if (mode == SWAPCHAIN_IMMEDIATE &&
+	    (drmGetCap(fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) || !cap)) {
+		printf("Atomic async page flip unsupported -- "
+		       "using mailbox instead of immediate\n");
+		mode = SWAPCHAIN_MAILBOX;
+	}
+	if (mode == SWAPCHAIN_IMMEDIATE)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
 
-		/*
-		 * Only FB_ID of the primary plane changes each frame.
-		 * The overlay stays at the same framebuffer and position,
-		 * so it does not need to be included in every flip commit.
-		 * The kernel's state machine retains the overlay configuration
-		 * from the initial commit above.
-		 */
-		drmModeAtomicAddProperty(req, kms->plane_id,
-				     kms->primary_props.fb_id,
-				     primary_bufs[back].fb_id);
-		drmModeAtomicAddProperty(req, kms->plane_id,
-				     kms->primary_props.crtc_id, kms->crtc_id);
-
-		int ret = drmModeAtomicCommit(kms->fd, req,
-					      DRM_MODE_ATOMIC_NONBLOCK |
-					      DRM_MODE_PAGE_FLIP_EVENT,
-					      &pending);
-		drmModeAtomicFree(req);
+	if (setup_heads(fd, res, fmt, depth, mode) < 0) {
+		destroy_heads();
+		return -1;
+	}
 
-		if (ret) { perror("atomic flip"); break; }
-		pending.waiting = true;
+	printf("\n[MULTI-HEAD ATOMIC] %d head(s), %d buffers each, %s present%s"
+	       " -- Ctrl+C to stop\n\n", nheads, depth,
+	       swapchain_mode_names[mode],
+	       genlock ? ", genlocked (one commit for all CRTCs)" : "");
+	if (genlock)
+		genlock_init(&g);
+
+	while (keep_running()) {
+		bool idle = true;
+		bool busy = false;
+		int ret = genlock ? genlock_step(&g, flags, &idle, &busy)
+				  : multihead_step(flags, &idle, &busy);
+		if (ret < 0)
+			break;
+
+		int s = event_loop_dispatch(&events,
+					    busy ? 1 : idle ? 1000 : 0);
+		if (s < 0)
+			break;
+		if (s == 0 && idle && !busy) {
+			fprintf(stderr, "Vblank timeout on every head\n");
+			break;
+		}
 
-		while (pending.waiting) {
-			fd_set fds;
-			FD_ZERO(&fds);
-			FD_SET(kms->fd, &fds);
-			struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
-			int s = select(kms->fd + 1, &fds, NULL, NULL, &timeout);
-			if (s <= 0) return;
-			drmHandleEvent(kms->fd, &ev_ctx);
+		if (genlock && g.in_flight) {
+			bool flipped = true;
+			for (int i = 0; i < nheads; i++)
+				flipped &= !heads[i].waiting;
+			if (flipped)
+				genlock_flipped(&g);
 		}
+	}
 
-		cur = back;
+	/* No head's buffers may go away under its queued flip */
+	for (int i = 0; i < nheads; i++)
+		if (heads[i].waiting &&
+		    event_loop_wait(&events, &heads[i].waiting, 1000) < 0)
+			fprintf(stderr, "%s: last flip event missing\n",
+				heads[i].name);
+
+	for (int i = 0; i < nheads; i++) {
+		struct head *h = &heads[i];
+
+		printf("\n%s: connector %u, CRTC %u, %dx%d@%uHz",
+		       h->name, h->kms.conn_id, h->kms.crtc_id,
+		       h->kms.mode.hdisplay, h->kms.mode.vdisplay,
+		       h->kms.mode.vrefresh);
+		telemetry_finish(&h->tel);
 	}
+	if (genlock && g.frames)
+		printf("\nGenlock: %llu frames on %d CRTCs, flip skew avg %.3f ms "
+		       "max %.3f ms, %llu split across vblanks\n",
+		       (unsigned long long)g.frames, nheads,
+		       g.skew_sum_ms / (double)g.frames, g.skew_max_ms,
+		       (unsigned long long)g.split);
+	destroy_heads();
+	return 0;
 }
 
 /* ============================================================
- * find_primary_and_overlay - Walk plane list for this CRTC.
- * @fd:          DRM file descriptor.
- * @crtc_idx:    Index into resource crtc array (used in bitmask check).
- * @primary_out: Receives the primary plane ID.
- * @overlay_out: Receives the first overlay plane ID (0 if none).
+ * Single-head discovery and the topology snapshot (--snapshot F)
+ *
+ * Everything the demo needs to know about the display before the
+ * first commit fits in a struct topology.  Finding it is a walk over
+ * the whole device that probes connectors; with --snapshot F it is
+ * saved after the walk and, on later starts, taken from F when
+ * kms-snapshot.h's key and a few probe-free checks still match.
  * ============================================================ */
-static int find_planes(int fd, uint32_t crtc_id, uint32_t crtc_idx,
-                       uint32_t *primary_out, uint32_t *overlay_out)
+struct topology {
+	uint32_t               conn_id;
+	uint32_t               crtc_id;
+	uint32_t               crtc_idx;
+	uint32_t               plane_id;
+	uint32_t               overlay_id;
+	uint32_t               fourcc; /* Checked against the primary plane */
+	drmModeModeInfo        mode;
+	struct connector_props conn_props;
+	struct crtc_props      crtc_props;
+	struct plane_props     primary_props;
+	struct plane_props     overlay_props;
+};
+
+/* ============================================================
+ * discover_single_head - First connected display, its CRTC, planes
+ *                        and property IDs, found the long way.
+ * ============================================================ */
+static int discover_single_head(struct kms_state *kms, drmModeRes *res,
+				const struct pixel_format *fmt)
 {
-        drmModePlaneRes *plane_res = drmModeGetPlaneResources(fd);
-        if (!plane_res) return -1;
+	/* Find a connected connector */
+	drmModeConnector *conn = NULL;
+	for (int i = 0; i < res->count_connectors; i++) {
+		conn = drmModeGetConnector(kms->fd, res->connectors[i]);
+		if (conn && conn->connection == DRM_MODE_CONNECTED &&
+		    conn->count_modes > 0)
+			break;
+		drmModeFreeConnector(conn);
+		conn = NULL;
+	}
+	if (!conn) { fprintf(stderr, "No connected display\n"); return -1; }
 
-        *primary_out = 0;
-        *overlay_out = 0;
+	/* Find a compatible CRTC */
+	drmModeEncoder *enc = NULL;
+	if (conn->encoder_id)
+		enc = drmModeGetEncoder(kms->fd, conn->encoder_id);
+	if (!enc && conn->count_encoders > 0)
+		enc = drmModeGetEncoder(kms->fd, conn->encoders[0]);
 
-        for (uint32_t i = 0; i < plane_res->count_planes; i++) {
-                drmModePlane *plane =
-                        drmModeGetPlane(fd, plane_res->planes[i]);
-                if (!plane) continue;
+	kms->crtc_id  = 0;
+	kms->crtc_idx = 0;
+	for (int i = 0; i < res->count_crtcs; i++) {
+		if (enc && (enc->possible_crtcs & (1 << i))) {
+			kms->crtc_id  = res->crtcs[i];
+			kms->crtc_idx = (uint32_t)i;
+			break;
+		}
+	}
+	if (enc) drmModeFreeEncoder(enc);
 
-                if (!(plane->possible_crtcs & (1 << crtc_idx))) {
-                        drmModeFreePlane(plane);
-                        continue;
-                }
+	kms->conn_id = conn->connector_id;
+	kms->mode    = conn->modes[0];
+	drmModeFreeConnector(conn);
+	if (!kms->crtc_id) { fprintf(stderr, "No usable CRTC\n"); return -1; }
 
-                drmModeObjectProperties *props =
-                        drmModeObjectGetProperties(fd, plane->plane_id,
-                                                   DRM_MODE_OBJECT_PLANE);
-                if (!props) { drmModeFreePlane(plane); continue; }
+	/* Find primary and overlay planes for this CRTC */
+	if (find_planes(kms->fd, kms->crtc_id, kms->crtc_idx,
+			&kms->plane_id, &kms->overlay_id) < 0) {
+		fprintf(stderr, "No primary plane found for CRTC\n");
+		return -1;
+	}
 
-                uint64_t type     = 0;
-                uint64_t curr_crtc = 0;
+	if (!plane_supports_format(kms->fd, kms->plane_id, fmt->fourcc)) {
+		fprintf(stderr, "Primary plane %u cannot scan out %s\n",
+			kms->plane_id, fmt->name);
+		return -1;
+	}
 
-                for (uint32_t p = 0; p < props->count_props; p++) {
-                        drmModePropertyRes *pr =
-                                drmModeGetProperty(fd, props->props[p]);
-                        if (!pr) continue;
-                        if (strcmp(pr->name, "type") == 0)
-                                type = props->prop_values[p];
-                        if (strcmp(pr->name, "CRTC_ID") == 0)
-                                curr_crtc = props->prop_values[p];
-                        drmModeFreeProperty(pr);
-                }
+	/* Cache all property IDs */
+	if (cache_connector_props(kms->fd, kms->conn_id, &kms->conn_props) ||
+	    cache_crtc_props     (kms->fd, kms->crtc_id, &kms->crtc_props) ||
+	    cache_plane_props    (kms->fd, kms->plane_id, &kms->primary_props)) {
+		fprintf(stderr, "Failed to cache required property IDs\n");
+		return -1;
+	}
+	if (kms->overlay_id)
+		cache_plane_props(kms->fd, kms->overlay_id, &kms->overlay_props);
+	return 0;
+}
 
-                drmModeFreeObjectProperties(props);
+static void save_topology(const struct kms_state *kms, const char *path,
+			  const struct pixel_format *fmt, double discovery_ms)
+{
+	struct kms_snapshot_header h;
+	struct topology t;
 
-                if (type == DRM_PLANE_TYPE_PRIMARY) {
-                        /*
-                         * Prefer the plane already active on this CRTC.
-                         * If none is active yet, fall back to the first
-                         * compatible PRIMARY plane found.
-                         */
-                        if (curr_crtc == crtc_id)
-                                *primary_out = plane->plane_id; /* best match */
-                        else if (!*primary_out)
-                                *primary_out = plane->plane_id; /* fallback */
-                } else if (type == DRM_PLANE_TYPE_OVERLAY && !*overlay_out) {
-                        *overlay_out = plane->plane_id;
-                }
+	if (kms_snapshot_identify(kms->fd, &h) < 0)
+		return;
+	h.edid_hash    = kms_snapshot_edid_hash(kms->fd, kms->conn_id,
+						kms->conn_props.edid);
+	h.discovery_ms = discovery_ms;
+
+	memset(&t, 0, sizeof(t)); /* Padding is checksummed too */
+	t.conn_id       = kms->conn_id;
+	t.crtc_id       = kms->crtc_id;
+	t.crtc_idx      = kms->crtc_idx;
+	t.plane_id      = kms->plane_id;
+	t.overlay_id    = kms->overlay_id;
+	t.fourcc        = fmt->fourcc;
+	t.mode          = kms->mode;
+	t.conn_props    = kms->conn_props;
+	t.crtc_props    = kms->crtc_props;
+	t.primary_props = kms->primary_props;
+	t.overlay_props = kms->overlay_props;
+
+	if (kms_snapshot_save(path, &h, &t, sizeof(t)) < 0)
+		fprintf(stderr, "Cannot write topology snapshot %s: %s\n",
+			path, strerror(errno));
+	else
+		printf("Topology snapshot written to %s\n", path);
+}
 
-                drmModeFreePlane(plane);
-        }
+/* Is @conn_id connected and offering @mode, as of its last probe? */
+static bool connector_offers(int fd, uint32_t conn_id,
+			     const drmModeModeInfo *mode)
+{
+	drmModeConnector *conn = drmModeGetConnectorCurrent(fd, conn_id);
+	bool found = false;
+
+	if (!conn)
+		return false;
+	for (int i = 0; i < conn->count_modes && !found; i++)
+		found = memcmp(&conn->modes[i], mode, sizeof(*mode)) == 0;
+	if (conn->connection != DRM_MODE_CONNECTED)
+		found = false;
+	drmModeFreeConnector(conn);
+	return found;
+}
 
-        drmModeFreePlaneResources(plane_res);
-        return (*primary_out) ? 0 : -1;
+/* ============================================================
+ * load_topology - Fill @kms from the snapshot at @path.
+ *
+ * On top of the key (driver, version, EDID) checks that the format
+ * is the one the primary plane was checked for and that the connector
+ * is still connected with the saved mode -- without a probe.  Returns
+ * false, and the caller discovers, on any mismatch.
+ * ============================================================ */
+static bool load_topology(struct kms_state *kms, const char *path,
+			  const struct pixel_format *fmt)
+{
+	struct kms_snapshot_header key;
+	struct kms_snapshot snap;
+	const struct topology *t = NULL;
+	const char *why = "driver version unavailable";
+
+	if (kms_snapshot_identify(kms->fd, &key) == 0)
+		t = kms_snapshot_map(path, &key, sizeof(*t), &snap, &why);
+	if (!t) {
+		printf("Topology snapshot %s not used: %s\n", path, why);
+		return false;
+	}
+
+	why = NULL;
+	if (t->fourcc != fmt->fourcc)
+		why = "other --format";
+	else if (!connector_offers(kms->fd, t->conn_id, &t->mode))
+		why = "display or mode changed";
+	else if (kms_snapshot_edid_hash(kms->fd, t->conn_id,
+					t->conn_props.edid) !=
+		 snap.hdr->edid_hash)
+		why = "other monitor";
+
+	if (why) {
+		printf("Topology snapshot %s not used: %s\n", path, why);
+	} else {
+		kms->conn_id       = t->conn_id;
+		kms->crtc_id       = t->crtc_id;
+		kms->crtc_idx      = t->crtc_idx;
+		kms->plane_id      = t->plane_id;
+		kms->overlay_id    = t->overlay_id;
+		kms->mode          = t->mode;
+		kms->conn_props    = t->conn_props;
+		kms->crtc_props    = t->crtc_props;
+		kms->primary_props = t->primary_props;
+		kms->overlay_props = t->overlay_props;
+		printf("Topology from snapshot %s (full discovery took "
+		       "%.1f ms)\n", path, snap.hdr->discovery_ms);
+	}
+	kms_snapshot_unmap(&snap);
+	return !why;
 }
 
 /* ============================================================
@@ -912,22 +3229,76 @@ static int find_planes(int fd, uint32_t crtc_id, uint32_t crtc_idx,
  * ============================================================ */
 int main(int argc, char **argv)
 {
-	int mode_choice = 0; /* 0=discovery, 1=atomic flip, 2=multiplane */
+	double t_start = render_pool_now_ms();
+	int mode_choice = 0; /* 0=discovery, 1=atomic flip, 2=multiplane,
+				3=multihead */
+	const char *snap_path = NULL;
+	int pool_mb = FB_POOL_DEFAULT_MB;
 
 	if (argc > 1 && strcmp(argv[1], "--atomic")      == 0) mode_choice = 1;
 	if (argc > 1 && strcmp(argv[1], "--multiplane")  == 0) mode_choice = 2;
+	if (argc > 1 && strcmp(argv[1], "--multihead")   == 0) mode_choice = 3;
+	for (int i = 1; i + 1 < argc; i++)
+		if (strcmp(argv[i], "--snapshot") == 0)
+			snap_path = argv[i + 1];
+		else if (strcmp(argv[i], "--pool-mb") == 0)
+			pool_mb = atoi(argv[i + 1]);
+	if (pool_mb < 0) {
+		fprintf(stderr, "--pool-mb: 0 or more\n");
+		return -1;
+	}
+
+	const struct pixel_format *fmt = pixel_format_parse(argc, argv);
+	if (!fmt)
+		return -1;
+
+	/* Kernel verification needs no display: run it before opening card0 */
+	if (argc > 1 && strcmp(argv[1], "--selftest") == 0) {
+		printf("ARGB blend kernels vs scalar reference:\n");
+		return argb_blend_selftest() ? 1 : 0;
+	}
+
+	int depth;
+	enum swapchain_mode present;
+	if (swapchain_parse(argc, argv, &depth, &present) < 0)
+		return -1;
 
 	printf("DRM Atomic KMS Demo\n");
 	printf("  %s                -> property discovery (print and exit)\n",
 	       argv[0]);
 	printf("  %s --atomic       -> atomic page flip animation\n", argv[0]);
-	printf("  %s --multiplane   -> primary + overlay plane demo\n\n",
+	printf("  %s --multiplane   -> primary + overlay plane demo\n",
 	       argv[0]);
+	printf("  %s --multihead    -> --atomic on every connected display\n",
+	       argv[0]);
+	printf("  %s --selftest     -> check the CPU blend kernels and exit\n",
+	       argv[0]);
+	printf("  add --genlock to --multihead to update all heads in one commit\n");
+	printf("  add --threads N to render with N threads\n");
+	printf("  add --shadow to render via a cached shadow buffer (one head)\n");
+	printf("  add --format F (XRGB8888 ARGB8888 RGB565 XRGB2101010 BGR888)\n");
+	printf("  add --buffers N (2-8) and --present fifo|mailbox|immediate\n");
+	printf("  add --threaded to render on a separate thread (--atomic)\n");
+	printf("  add --deadline to start rendering just before vblank (--atomic)\n");
+	printf("  add --bench-commit to time flip request building (--atomic)\n");
+	printf("  add --bench-resize to time swapchain reallocation (--atomic)\n");
+	printf("  add --arena to place the primary buffers in one GEM object\n");
+	printf("  add --bench-arena to compare that with separate buffers (--atomic)\n");
+	printf("  add --bench-layouts to time cached layout trials (--multiplane)\n");
+	printf("  add --layers N (1-%d) to plan N layers onto planes (--multiplane)\n",
+	       PLANNER_MAX_LAYERS);
+	printf("  add --snapshot F to reuse the discovered topology from file F\n");
+	printf("  add --pool-mb N to keep up to N MiB of idle buffers (default %d)\n",
+	       FB_POOL_DEFAULT_MB);
+	printf("  add --no-warmup to skip rendering and testing every buffer once\n");
+	printf("  add --frames N to stop after N frames (default: Ctrl+C)\n");
+	printf("  add --stats-csv F / --stats-json F to save frame timing\n\n");
 
 	struct kms_state kms = {0};
 
 	kms.fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
 	if (kms.fd < 0) { perror("open /dev/dri/card0"); return -1; }
+	prop_index_init(&prop_index, kms.fd);
 
 	/*
 	 * Universal planes must be explicitly enabled to gain access to
@@ -955,113 +3326,279 @@ int main(int argc, char **argv)
 	/* Property discovery mode needs no further setup */
 	if (mode_choice == 0) {
 		run_property_discovery(kms.fd, res, &kms);
+		printf("\n");
+		prop_index_report(&prop_index, "discovery");
+		prop_index_destroy(&prop_index);
 		drmModeFreeResources(res);
 		close(kms.fd);
 		return 0;
 	}
 
-	/* Find a connected connector */
-	drmModeConnector *conn = NULL;
-	for (int i = 0; i < res->count_connectors; i++) {
-		conn = drmModeGetConnector(kms.fd, res->connectors[i]);
-		if (conn && conn->connection == DRM_MODE_CONNECTED &&
-		    conn->count_modes > 0)
-			break;
-		drmModeFreeConnector(conn);
-		conn = NULL;
+	/* Blocks SIGINT/SIGTERM, so it must precede any thread creation */
+	if (event_loop_init(&events) < 0 ||
+	    event_loop_add_drm(&events, kms.fd, &ev_ctx) < 0)
+		return -1;
+	atomic_req_init(&flip_req);
+	atomic_test_cache_init(&test_cache);
+	render_pool_init(&pool, render_pool_parse_threads(argc, argv));
+	printf("Rendering with %d thread(s)\n", pool.nthreads);
+	if (buffer_pool_init(&fb_pool, sizeof(struct buffer_object),
+			     fb_pool_alloc, fb_pool_free, &kms.fd,
+			     (uint64_t)pool_mb << 20) < 0)
+		return -1;
+	telemetry_init(&telemetry, argc, argv);
+
+	/* Every connected display, each on a CRTC of its own */
+	if (mode_choice == 3) {
+		bool genlock = false;
+		for (int i = 1; i < argc; i++)
+			if (strcmp(argv[i], "--genlock") == 0)
+				genlock = true;
+
+		int ret = run_multihead(kms.fd, res, fmt, depth, present,
+					genlock);
+
+		telemetry_finish(&telemetry);
+		atomic_req_report(&flip_req);
+		atomic_test_cache_report(&test_cache);
+		buffer_pool_report(&fb_pool, "framebuffers");
+		buffer_pool_destroy(&fb_pool);
+		prop_index_report(&prop_index, "all heads");
+		prop_index_destroy(&prop_index);
+		drmModeFreeResources(res);
+		event_loop_destroy(&events);
+		close(kms.fd);
+		render_pool_destroy(&pool);
+		return ret;
 	}
-	if (!conn) { fprintf(stderr, "No connected display\n"); return -1; }
 
-	/* Find a compatible CRTC */
-	drmModeEncoder *enc = NULL;
-	if (conn->encoder_id)
-		enc = drmModeGetEncoder(kms.fd, conn->encoder_id);
-	if (!enc && conn->count_encoders > 0)
-		enc = drmModeGetEncoder(kms.fd, conn->encoders[0]);
+	/* Connector, CRTC, planes and property IDs */
+	bool from_snapshot = snap_path && load_topology(&kms, snap_path, fmt);
+	double discovery_ms = 0;
+	if (!from_snapshot) {
+		double t0 = render_pool_now_ms();
 
-	kms.crtc_id  = 0;
-	kms.crtc_idx = 0;
-	for (int i = 0; i < res->count_crtcs; i++) {
-		if (enc && (enc->possible_crtcs & (1 << i))) {
-			kms.crtc_id  = res->crtcs[i];
-			kms.crtc_idx = (uint32_t)i;
-			break;
-		}
+		if (discover_single_head(&kms, res, fmt) < 0)
+			return -1;
+		discovery_ms = render_pool_now_ms() - t0;
+		if (snap_path)
+			save_topology(&kms, snap_path, fmt, discovery_ms);
 	}
-	if (enc) drmModeFreeEncoder(enc);
-	if (!kms.crtc_id) { fprintf(stderr, "No usable CRTC\n"); return -1; }
-
-	kms.conn_id = conn->connector_id;
-	kms.mode    = conn->modes[0];
 
 	printf("Display: %dx%d @ %u Hz  (CRTC id=%u idx=%u)\n",
 	       kms.mode.hdisplay, kms.mode.vdisplay, kms.mode.vrefresh,
 	       kms.crtc_id, kms.crtc_idx);
-
-	/* Find primary and overlay planes for this CRTC */
-	if (find_planes(kms.fd, kms.crtc_id, kms.crtc_idx,
-			&kms.plane_id, &kms.overlay_id) < 0) {
-		fprintf(stderr, "No primary plane found for CRTC\n");
-		return -1;
-	}
 	printf("Primary plane id=%u  Overlay plane id=%u%s\n",
 	       kms.plane_id, kms.overlay_id,
 	       kms.overlay_id ? "" : " (none available)");
+	printf("Scanout format: %s (%u bytes/pixel)\n", fmt->name, fmt->cpp);
+
+	/* New every frame, but the same answer from TEST_ONLY */
+	atomic_test_cache_ignore(&test_cache, kms.primary_props.fb_id);
+	atomic_test_cache_ignore(&test_cache, kms.overlay_props.fb_id);
+	atomic_test_cache_ignore(&test_cache, kms.primary_props.fb_damage_clips);
+	if (kms.primary_props.fb_damage_clips)
+		printf("FB_DAMAGE_CLIPS prop id=%u -- flips carry damage rects\n",
+		       kms.primary_props.fb_damage_clips);
+	else
+		printf("FB_DAMAGE_CLIPS not exposed -- full-plane updates\n");
+	prop_index_report(&prop_index, "startup");
 
-	/* Cache all property IDs */
-	if (cache_connector_props(kms.fd, kms.conn_id,  &kms.conn_props)  ||
-	    cache_crtc_props     (kms.fd, kms.crtc_id,  &kms.crtc_props)  ||
-	    cache_plane_props    (kms.fd, kms.plane_id,  &kms.primary_props)) {
-		fprintf(stderr, "Failed to cache required property IDs\n");
+	/*
+	 * Immediate present needs atomic async flips; without them the
+	 * kernel would reject every commit, so degrade to mailbox, which
+	 * has the same queueing but waits for vblank.
+	 */
+	if (mode_choice == 1 && present == SWAPCHAIN_IMMEDIATE) {
+		uint64_t cap = 0;
+		if (drmGetCap(kms.fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) ||
+		    !cap) {
+			printf("Atomic async page flip unsupported -- "
+			       "using mailbox instead of immediate\n");
+			present = SWAPCHAIN_MAILBOX;
+		}
+	}
+	bool threaded = false;
+	bool deadline = false;
+	bool bench = false;
+	bool bench_layouts = false;
+	bool bench_resize = false;
+	bool bench_arena = false;
+	bool use_arena = false;
+	bool warmup = true;
+	bool present_given = false;
+	int nlayers = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--threaded") == 0)
+			threaded = true;
+		if (strcmp(argv[i], "--present") == 0)
+			present_given = true;
+		if (strcmp(argv[i], "--bench-commit") == 0)
+			bench = true;
+		if (strcmp(argv[i], "--bench-layouts") == 0)
+			bench_layouts = true;
+		if (strcmp(argv[i], "--bench-resize") == 0)
+			bench_resize = true;
+		if (strcmp(argv[i], "--bench-arena") == 0)
+			bench_arena = true;
+		if (strcmp(argv[i], "--arena") == 0)
+			use_arena = true;
+		if (strcmp(argv[i], "--no-warmup") == 0)
+			warmup = false;
+		if (strcmp(argv[i], "--layers") == 0 && i + 1 < argc) {
+			nlayers = atoi(argv[i + 1]);
+			if (nlayers < 1 || nlayers > PLANNER_MAX_LAYERS) {
+				fprintf(stderr, "--layers: 1 to %d\n",
+					PLANNER_MAX_LAYERS);
+				return -1;
+			}
+		}
+		if (strcmp(argv[i], "--deadline") == 0)
+			deadline = true;
+	}
+	if (deadline && threaded) {
+		/* The render thread renders ahead; there is no late start */
+		fprintf(stderr, "--deadline cannot be used with --threaded\n");
+		return -1;
+	}
+	if (threaded && present_given && present == SWAPCHAIN_FIFO) {
+		/* The display thread always flips the newest finished frame */
+		fprintf(stderr, "--present fifo cannot be used with --threaded "
+			"(it presents mailbox or immediate)\n");
 		return -1;
 	}
-	if (kms.overlay_id)
-		cache_plane_props(kms.fd, kms.overlay_id, &kms.overlay_props);
+	if (mode_choice == 1 && deadline &&
+	    (depth != 2 || present != SWAPCHAIN_FIFO)) {
+		/* Rendering ahead would defeat rendering late */
+		depth = 2;
+		present = SWAPCHAIN_FIFO;
+		printf("--deadline: using 2 buffers, fifo\n");
+	}
+	if (mode_choice == 1 && threaded && depth < FRAME_PIPELINE_DEPTH) {
+		/* Two buffers leave the render thread nothing to draw into */
+		depth = FRAME_PIPELINE_DEPTH;
+		printf("--threaded: using %d buffers\n", depth);
+	}
+	if (mode_choice != 1)
+		depth = MAX_BUFFERS;
 
 	/* Allocate primary plane framebuffers */
-	struct buffer_object primary_bufs[MAX_BUFFERS] = {0};
-	for (int i = 0; i < MAX_BUFFERS; i++) {
-		primary_bufs[i].width  = kms.mode.hdisplay;
-		primary_bufs[i].height = kms.mode.vdisplay;
-		if (create_fb(kms.fd, &primary_bufs[i]) < 0) {
+	struct buffer_object primary_bufs[SWAPCHAIN_MAX_DEPTH] = {0};
+	struct fb_arena arena = {0};
+	if (use_arena) {
+		if (create_arena(kms.fd, &arena, primary_bufs, depth,
+				 kms.mode.hdisplay, kms.mode.vdisplay, fmt) < 0) {
+			fprintf(stderr, "Failed to create the primary arena\n");
+			return -1;
+		}
+		printf("Primary buffers: %d in one %.1f MiB arena\n", depth,
+		       arena.size / (1024.0 * 1024.0));
+	}
+	for (int i = 0; i < depth; i++) {
+		if (!use_arena &&
+		    get_fb(&primary_bufs[i], kms.mode.hdisplay,
+			   kms.mode.vdisplay, fmt) < 0) {
 			fprintf(stderr, "Failed to create primary fb %d\n", i);
 			return -1;
 		}
-		memset(primary_bufs[i].vaddr, 0x20, primary_bufs[i].size);
+		/*
+		 * No clear: new dumb buffers are zeroed (black) by the
+		 * kernel, and each buffer's first frame repaints it in
+		 * full.  Touching it here would fault every page in on
+		 * this thread, ahead of warm_up().
+		 */
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--shadow") != 0)
+			continue;
+		if (shadow_buffer_init(&shadow, kms.mode.hdisplay,
+				       kms.mode.vdisplay, fmt->cpp) < 0)
+			return -1;
+		printf("Shadow rendering, flush kernel=%s\n",
+		       shadow_copy_select()->name);
+		break;
 	}
 
 	/* Perform atomic modeset with the first framebuffer */
 	if (atomic_modeset(&kms, primary_bufs[0].fb_id) < 0)
 		return -1;
+	if (from_snapshot)
+		printf("Start to first commit: %.1f ms (topology snapshot)\n",
+		       render_pool_now_ms() - t_start);
+	else
+		printf("Start to first commit: %.1f ms (full discovery "
+		       "%.1f ms)\n", render_pool_now_ms() - t_start,
+		       discovery_ms);
+	if (warmup)
+		warm_up(&kms, primary_bufs, depth);
 
 	if (mode_choice == 1) {
-		run_atomic_pageflip(&kms, primary_bufs);
+		struct frame_sched sched;
+
+		frame_sched_init(&sched, 1000.0 / (kms.mode.vrefresh ?
+						   kms.mode.vrefresh : 60));
+		if (bench)
+			run_commit_bench(&kms, primary_bufs);
+		else if (bench_resize)
+			run_resize_bench(&kms, fmt);
+		else if (bench_arena)
+			run_arena_bench(&kms, fmt, depth);
+		else if (threaded)
+			run_threaded_pageflip(&kms, primary_bufs, depth, present);
+		else
+			run_atomic_pageflip(&kms, primary_bufs, depth, present,
+					    deadline ? &sched : NULL);
+	} else if (nlayers) {
+		run_layers(&kms, primary_bufs, nlayers);
 	} else {
 		/* Allocate a small overlay buffer (256x256) */
 		struct buffer_object overlay_buf = {
 			.width  = 256,
 			.height = 256,
+			.fmt    = fmt,
 		};
-		if (kms.overlay_id && create_fb(kms.fd, &overlay_buf) == 0) {
+
+		/* Overlays often lack the more exotic formats */
+		if (kms.overlay_id &&
+		    !plane_supports_format(kms.fd, kms.overlay_id, fmt->fourcc))
+			overlay_buf.fmt = PIXEL_FORMAT_DEFAULT;
+		if (kms.overlay_id &&
+		    get_fb(&overlay_buf, 256, 256, overlay_buf.fmt) < 0)
+			kms.overlay_id = 0;
+
+		if (bench_layouts && kms.overlay_id)
+			run_layout_bench(&kms, primary_bufs, &overlay_buf);
+		else if (bench_layouts)
+			fprintf(stderr, "--bench-layouts needs an overlay plane\n");
+		else
+			/* Without an overlay plane the CPU draws the overlay */
 			run_multiplane(&kms, primary_bufs, &overlay_buf);
-			destroy_fb(kms.fd, &overlay_buf);
-		} else {
-			fprintf(stderr,
-				"No overlay plane available, "
-				"falling back to atomic flip\n");
-			run_atomic_pageflip(&kms, primary_bufs);
-		}
+		if (overlay_buf.fb_id)
+			put_fb(&overlay_buf);
 	}
 
+	telemetry_finish(&telemetry);
+	atomic_req_report(&flip_req);
+	atomic_test_cache_report(&test_cache);
+	buffer_pool_report(&fb_pool, "framebuffers");
+
 	/* Cleanup */
+	damage_blob_cache_destroy(kms.fd, &kms.damage_blobs);
 	if (kms.mode_blob_id)
 		drmModeDestroyPropertyBlob(kms.fd, kms.mode_blob_id);
 
-	for (int i = 0; i < MAX_BUFFERS; i++)
-		destroy_fb(kms.fd, &primary_bufs[i]);
+	if (use_arena)
+		destroy_arena(kms.fd, &arena, primary_bufs, depth);
+	for (int i = 0; i < depth && !use_arena; i++)
+		put_fb(&primary_bufs[i]);
+	buffer_pool_destroy(&fb_pool);
+	shadow_buffer_free(&shadow);
 
-	drmModeFreeConnector(conn);
 	drmModeFreeResources(res);
+	event_loop_destroy(&events);
+	prop_index_destroy(&prop_index);
 	close(kms.fd);
+	render_pool_destroy(&pool);
 	return 0;
 }
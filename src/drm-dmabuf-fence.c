@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,12 +10,27 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <linux/dma-buf.h>
 
+#include "atomic-req.h"
+#include "damage.h"
+#include "event-loop.h"
+#include "frame-ipc.h"
+#include "frame-pipeline.h"
+#include "frame-telemetry.h"
+#include "pixel-format.h"
+#include "prop-index.h"
+#include "render-pool.h"
+#include "shadow-buffer.h"
+#include "span-fill.h"
+#include "udmabuf-alloc.h"
+#include "yuv-convert.h"
+
 /* ============================================================
  * DRM DMA-BUF and Fence Synchronization Demo
  *
@@ -33,15 +49,29 @@
  * pipeline -- in real BSP work this would be GPU fd + display fd, or
  * ISP fd + display fd.  The fd separation is what matters conceptually.
  *
- * Three runnable modes:
+ * Runnable modes:
  *   (default)      DMA-BUF export/import, verify shared memory, display
+ *                  (--threaded: producer on its own thread)
  *   --nosync       Write to active scanout buffer with no fence (artifacts)
  *   --fence        Explicit fence via IN_FENCE_FD plane property
+ *   --ipc          Producer in a separate process, buffers passed over a
+ *                  UNIX socket (SCM_RIGHTS), see frame-ipc.h
+ *   --ipc-ceiling  Same producer, frames released unseen: the path's
+ *                  throughput limit at 1080p and 4K
+ *
+ * --udmabuf makes the producer buffers memfd memory exported through
+ * /dev/udmabuf instead of dumb buffers (see udmabuf-alloc.h), in any
+ * mode; --bench-udmabuf compares rendering into the two.
  *
  * Tested on RK3588 / VOP2 with Ubuntu Lite (no compositor).
  * ============================================================ */
 
-#define MAX_BUFFERS 2
+#define MAX_BUFFERS 2 /* FRAME_PIPELINE_DEPTH with --threaded */
+
+/* Bar colour per buffer, so a stale buffer on screen is easy to spot */
+static const uint32_t buffer_colors[FRAME_PIPELINE_DEPTH] = {
+	0xffffff, 0x00ff88, 0x4488ff,
+};
 
 /* ============================================================
  * KMS pipeline state -- same pattern as drm-atomic-demo.c
@@ -93,7 +123,10 @@ struct kms_state {
  * ============================================================ */
 struct dmabuf_buffer {
 	/* Producer side (models GPU / ISP / camera) */
-	int      fd_producer;    /* Second open() of /dev/dri/card0 */
+	int      fd_producer;    /* Second open() of /dev/dri/card0,
+				  * -1 for udmabuf memory           */
+	int      memfd;          /* udmabuf backing, -1 otherwise   */
+	bool     huge;           /* udmabuf on hugetlbfs pages      */
 	uint32_t producer_handle;
 	uint32_t producer_pitch;
 	uint32_t producer_size;
@@ -104,14 +137,18 @@ struct dmabuf_buffer {
 
 	/* Display side */
 	uint32_t display_handle; /* Imported via DRM_IOCTL_PRIME_FD_TO_HANDLE */
-	uint32_t fb_id;          /* Registered with drmModeAddFB() */
+	uint32_t fb_id;          /* Registered with drmModeAddFB2() */
 
 	uint32_t width;
 	uint32_t height;
+	const struct pixel_format *fmt; /* RGB layout, or staging format   */
+	const struct yuv_format   *yuv; /* NV12/NV16 if non-NULL           */
+	uint32_t chroma_offset;         /* Byte offset of the CbCr plane    */
 };
 
 struct animation_state {
 	int bar_x;
+	int prev_bar_x; /* Position before the last update (damage source) */
 	int bar_width;
 	int direction;
 	int frame_count;
@@ -124,21 +161,17 @@ struct flip_pending {
 /* ============================================================
  * get_property_id / cache helpers -- identical to drm-atomic-demo.c
  * ============================================================ */
-static int get_property_id(int fd, drmModeObjectProperties *props,
+static struct prop_index prop_index;
+
+static int get_property_id(drmModeObjectProperties *props,
 			   const char *name, uint32_t *id_out)
 {
-	for (uint32_t i = 0; i < props->count_props; i++) {
-		drmModePropertyRes *prop =
-			drmModeGetProperty(fd, props->props[i]);
-		if (!prop) continue;
-		if (strcmp(prop->name, name) == 0) {
-			*id_out = prop->prop_id;
-			drmModeFreeProperty(prop);
-			return 0;
-		}
-		drmModeFreeProperty(prop);
-	}
-	return -1;
+	int i = prop_index_find(&prop_index, props, name);
+
+	if (i < 0)
+		return -1;
+	*id_out = props->props[i];
+	return 0;
 }
 
 static int cache_plane_props(int fd, uint32_t plane_id, struct plane_props *p)
@@ -148,16 +181,16 @@ static int cache_plane_props(int fd, uint32_t plane_id, struct plane_props *p)
 	if (!props) return -1;
 
 	int ret = 0;
-	ret |= get_property_id(fd, props, "FB_ID",       &p->fb_id);
-	ret |= get_property_id(fd, props, "CRTC_ID",     &p->crtc_id);
-	ret |= get_property_id(fd, props, "CRTC_X",      &p->crtc_x);
-	ret |= get_property_id(fd, props, "CRTC_Y",      &p->crtc_y);
-	ret |= get_property_id(fd, props, "CRTC_W",      &p->crtc_w);
-	ret |= get_property_id(fd, props, "CRTC_H",      &p->crtc_h);
-	ret |= get_property_id(fd, props, "SRC_X",       &p->src_x);
-	ret |= get_property_id(fd, props, "SRC_Y",       &p->src_y);
-	ret |= get_property_id(fd, props, "SRC_W",       &p->src_w);
-	ret |= get_property_id(fd, props, "SRC_H",       &p->src_h);
+	ret |= get_property_id(props, "FB_ID",       &p->fb_id);
+	ret |= get_property_id(props, "CRTC_ID",     &p->crtc_id);
+	ret |= get_property_id(props, "CRTC_X",      &p->crtc_x);
+	ret |= get_property_id(props, "CRTC_Y",      &p->crtc_y);
+	ret |= get_property_id(props, "CRTC_W",      &p->crtc_w);
+	ret |= get_property_id(props, "CRTC_H",      &p->crtc_h);
+	ret |= get_property_id(props, "SRC_X",       &p->src_x);
+	ret |= get_property_id(props, "SRC_Y",       &p->src_y);
+	ret |= get_property_id(props, "SRC_W",       &p->src_w);
+	ret |= get_property_id(props, "SRC_H",       &p->src_h);
 
 	/*
 	 * IN_FENCE_FD is the explicit fence input property on a plane.
@@ -165,7 +198,7 @@ static int cache_plane_props(int fd, uint32_t plane_id, struct plane_props *p)
 	 * to signal before scanning out this framebuffer."
 	 * Not all drivers expose this property; failure here is non-fatal.
 	 */
-	if (get_property_id(fd, props, "IN_FENCE_FD", &p->in_fence_fd) < 0) {
+	if (get_property_id(props, "IN_FENCE_FD", &p->in_fence_fd) < 0) {
 		p->in_fence_fd = 0;
 		printf("  Note: IN_FENCE_FD property not available on this plane\n");
 	}
@@ -181,8 +214,8 @@ static int cache_crtc_props(int fd, uint32_t crtc_id, struct crtc_props *p)
 	if (!props) return -1;
 
 	int ret = 0;
-	ret |= get_property_id(fd, props, "ACTIVE",  &p->active);
-	ret |= get_property_id(fd, props, "MODE_ID", &p->mode_id);
+	ret |= get_property_id(props, "ACTIVE",  &p->active);
+	ret |= get_property_id(props, "MODE_ID", &p->mode_id);
 
 	/*
 	 * OUT_FENCE_PTR is a CRTC property that accepts a userspace pointer.
@@ -191,7 +224,7 @@ static int cache_crtc_props(int fd, uint32_t crtc_id, struct crtc_props *p)
 	 * actually being scanned out.  This is the "display done" signal
 	 * that a compositor uses to know when a buffer is safe to recycle.
 	 */
-	if (get_property_id(fd, props, "OUT_FENCE_PTR", &p->out_fence_ptr) < 0)
+	if (get_property_id(props, "OUT_FENCE_PTR", &p->out_fence_ptr) < 0)
 		p->out_fence_ptr = 0;
 
 	drmModeFreeObjectProperties(props);
@@ -205,14 +238,54 @@ static int cache_connector_props(int fd, uint32_t conn_id,
 		drmModeObjectGetProperties(fd, conn_id,
 					   DRM_MODE_OBJECT_CONNECTOR);
 	if (!props) return -1;
-	int ret = get_property_id(fd, props, "CRTC_ID", &p->crtc_id);
+	int ret = get_property_id(props, "CRTC_ID", &p->crtc_id);
 	drmModeFreeObjectProperties(props);
 	return ret;
 }
 
+/* /dev/udmabuf with --udmabuf or --bench-udmabuf */
+static struct udmabuf_dev udmabuf = { .fd = -1 };
+
+/* ============================================================
+ * udmabuf_producer_alloc - Steps 1-3 of dmabuf_create() for a
+ *                          producer with no DRM device.
+ *
+ * The buffer is laid out as CREATE_DUMB would (pitch aligned to 64
+ * bytes, CbCr plane after the Y plane) in a sealed memfd, mapped
+ * cached, and exported with UDMABUF_CREATE.  Import and AddFB2 are
+ * then the same as for a dumb buffer.
+ * ============================================================ */
+static int udmabuf_producer_alloc(struct dmabuf_buffer *buf)
+{
+	const struct yuv_format *yuv = buf->yuv;
+	uint32_t cpp  = yuv ? 1 : buf->fmt->cpp;
+	uint32_t rows = yuv ? buf->height + buf->height / yuv->vsub
+			    : buf->height;
+	struct udmabuf_mem m;
+
+	buf->producer_pitch = (buf->width * cpp + 63) & ~63u;
+	buf->chroma_offset  = yuv ? buf->producer_pitch * buf->height : 0;
+	if (udmabuf_alloc(&udmabuf, &m,
+			  (uint64_t)buf->producer_pitch * rows) < 0) {
+		perror("udmabuf allocation");
+		return -1;
+	}
+	buf->memfd          = m.memfd;
+	buf->huge           = m.huge;
+	buf->dmabuf_fd      = m.dmabuf_fd;
+	buf->producer_vaddr = m.vaddr;
+	buf->producer_size  = (uint32_t)m.size;
+	printf("  udmabuf: memfd=%d (%u KiB, %s pages) -> dmabuf_fd=%d\n",
+	       m.memfd, buf->producer_size / 1024, m.huge ? "huge" : "base",
+	       m.dmabuf_fd);
+	return 0;
+}
+
 /* ============================================================
  * dmabuf_create - Allocate a GEM buffer on fd_producer and export
  *                 it as a DMA-BUF, then import it on display_fd.
+ *                 With fd_producer -1 the memory is a memfd turned
+ *                 into a DMA-BUF by /dev/udmabuf instead.
  *
  * After this function returns, buf->producer_vaddr is writable by
  * the CPU (simulating a GPU/ISP write), and buf->fb_id is registered
@@ -226,20 +299,37 @@ static int cache_connector_props(int fd, uint32_t conn_id,
  *   DRM_IOCTL_PRIME_FD_TO_HANDLE  import DMA-BUF fd on display fd
  *                                  (driver creates a new local GEM handle
  *                                   pointing to the same physical pages)
- *   drmModeAddFB()                register as KMS framebuffer
+ *   drmModeAddFB2()               register as KMS framebuffer
+ *
+ * With @yuv set the buffer is semi-planar NV12/NV16 instead: one dumb
+ * allocation at 8 bpp holding the Y plane (height rows) followed by
+ * the interleaved CbCr plane (height / vsub rows of the same pitch),
+ * like a camera or decoder output.  AddFB2 then describes two planes
+ * in the same GEM object, distinguished only by their offsets.
  * ============================================================ */
 static int dmabuf_create(struct dmabuf_buffer *buf, int display_fd,
-			 int fd_producer, uint32_t width, uint32_t height)
+			 int fd_producer, uint32_t width, uint32_t height,
+			 const struct pixel_format *fmt,
+			 const struct yuv_format *yuv)
 {
 	buf->fd_producer = fd_producer;
+	buf->memfd       = -1;
 	buf->width       = width;
 	buf->height      = height;
+	buf->fmt         = fmt;
+	buf->yuv         = yuv;
+
+	if (fd_producer < 0) {
+		if (udmabuf_producer_alloc(buf) < 0)
+			return -1;
+		goto import;
+	}
 
 	/* Step 1: Allocate GEM buffer on the producer fd */
 	struct drm_mode_create_dumb create = {
 		.width  = width,
-		.height = height,
-		.bpp    = 32,
+		.height = yuv ? height + height / yuv->vsub : height,
+		.bpp    = yuv ? 8 : fmt->cpp * 8,
 	};
 	if (drmIoctl(fd_producer, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
 		perror("CREATE_DUMB on producer");
@@ -248,6 +338,7 @@ static int dmabuf_create(struct dmabuf_buffer *buf, int display_fd,
 	buf->producer_handle = create.handle;
 	buf->producer_pitch  = create.pitch;
 	buf->producer_size   = create.size;
+	buf->chroma_offset   = yuv ? create.pitch * height : 0;
 
 	/* Step 2: Map producer buffer for CPU writes */
 	struct drm_mode_map_dumb map = { .handle = create.handle };
@@ -255,9 +346,11 @@ static int dmabuf_create(struct dmabuf_buffer *buf, int display_fd,
 		perror("MAP_DUMB on producer");
 		return -1;
 	}
+	/* Not MAP_POPULATE: warm_up() prefaults it on the render pool,
+	 * see create_fb() in drm-atomic-demo.c */
 	buf->producer_vaddr = mmap(0, create.size,
-				   PROT_READ | PROT_WRITE, MAP_SHARED,
-				   fd_producer, map.offset);
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd_producer, map.offset);
 	if (buf->producer_vaddr == MAP_FAILED) {
 		perror("mmap producer");
 		return -1;
@@ -282,6 +375,7 @@ static int dmabuf_create(struct dmabuf_buffer *buf, int display_fd,
 	printf("  DMA-BUF exported: producer GEM handle=%u -> dmabuf_fd=%d\n",
 	       buf->producer_handle, buf->dmabuf_fd);
 
+import:
 	/*
 	 * Step 4: Import the DMA-BUF on the display fd.
 	 *
@@ -300,16 +394,34 @@ static int dmabuf_create(struct dmabuf_buffer *buf, int display_fd,
 	/*
 	 * Step 5: Register the imported GEM handle as a KMS framebuffer.
 	 * The display engine now knows this buffer's dimensions and format
-	 * and can use it as a scanout source.
+	 * and can use it as a scanout source.  The pitch comes from the
+	 * producer's allocation: the importer must describe the memory
+	 * exactly as the exporter laid it out.
 	 */
-	if (drmModeAddFB(display_fd, width, height, 24, 32,
-			 buf->producer_pitch, buf->display_handle,
-			 &buf->fb_id) < 0) {
-		perror("drmModeAddFB on imported buffer");
+	uint32_t handles[4] = { buf->display_handle };
+	uint32_t pitches[4] = { buf->producer_pitch };
+	uint32_t offsets[4] = { 0 };
+	if (yuv) {
+		handles[1] = buf->display_handle;
+		pitches[1] = buf->producer_pitch;
+		offsets[1] = buf->chroma_offset;
+	}
+	if (drmModeAddFB2(display_fd, width, height,
+			  yuv ? yuv->fourcc : fmt->fourcc,
+			  handles, pitches, offsets, &buf->fb_id, 0) < 0) {
+		perror("drmModeAddFB2 on imported buffer");
 		return -1;
 	}
-	printf("  Framebuffer registered: fb_id=%u  (width=%u height=%u)\n",
-	       buf->fb_id, width, height);
+	printf("  Framebuffer registered: fb_id=%u  (width=%u height=%u %s)\n",
+	       buf->fb_id, width, height, yuv ? yuv->name : fmt->name);
+	if (yuv) {
+		uint64_t rgb = (uint64_t)width * 4 * height;
+		printf("  %s planes: Y @0, CbCr @%u, pitch %u -- %u KiB vs %llu KiB XRGB8888 (-%.0f%%)\n",
+		       yuv->name, buf->chroma_offset, buf->producer_pitch,
+		       buf->producer_size / 1024,
+		       (unsigned long long)(rgb / 1024),
+		       100.0 - 100.0 * buf->producer_size / (double)rgb);
+	}
 
 	return 0;
 }
@@ -323,12 +435,141 @@ static void dmabuf_destroy(struct dmabuf_buffer *buf, int display_fd)
 	struct drm_gem_close close_display = { .handle = buf->display_handle };
 	drmIoctl(display_fd, DRM_IOCTL_GEM_CLOSE, &close_display);
 
-	/* Release the producer-side GEM object */
+	/* Release the producer-side GEM object (or memfd) */
 	munmap(buf->producer_vaddr, buf->producer_size);
+	if (buf->fd_producer < 0) {
+		close(buf->memfd);
+		return;
+	}
 	struct drm_mode_destroy_dumb destroy = { .handle = buf->producer_handle };
 	drmIoctl(buf->fd_producer, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
 }
 
+/* Band renderer for all modes; sized by --threads (default 1) */
+static struct render_pool pool;
+
+/* XRGB8888 copy of the current frame, the conversion source for YUV */
+static struct shadow_buffer staging;
+
+/* Per-frame timing histograms, printed when a display mode exits */
+static struct frame_telemetry telemetry;
+
+/* display_fd, out-fences and Ctrl+C; every wait goes through it */
+static struct event_loop events;
+
+/* Flip commits on display_fd, sending only what changed */
+static struct atomic_req flip_req;
+
+/* Until Ctrl+C or --frames N */
+static bool keep_running(void)
+{
+	return !events.quit && !telemetry_done(&telemetry);
+}
+
+/*
+ * Bar scene rectangles of @region into @base (@fmt, @pitch), split into
+ * bands on the worker pool.
+ */
+static void render_bar_region(const struct pixel_format *fmt,
+			      uint8_t *base, uint32_t pitch,
+			      struct animation_state *anim, uint32_t bar_color,
+			      const struct damage_region *region)
+{
+	struct pixel_bar_job job = {
+		.fmt       = fmt,
+		.base      = base,
+		.pitch     = pitch,
+		.bar_x     = anim->bar_x,
+		.bar_width = anim->bar_width,
+		.bar_color = fmt->pack(bar_color),
+		.bg_color  = fmt->pack(0x202020),
+	};
+
+	for (uint32_t i = 0; i < region->count; i++) {
+		const struct damage_rect *r = &region->rects[i];
+
+		job.xa = (uint32_t)r->x1;
+		job.xb = (uint32_t)r->x2;
+		render_pool_run(&pool, pixel_bar_band, &job,
+				(uint32_t)r->y1, (uint32_t)r->y2, pitch,
+				(job.xb - job.xa) * fmt->cpp);
+	}
+}
+
+/* ============================================================
+ * producer_write - Produce @region of the frame into @buf.
+ * @region: Rectangles to write, or NULL for the whole frame.
+ *
+ * RGB buffers get three solid spans per row in buf->fmt, directly in
+ * the shared mapping (see pixel-format.h).
+ *
+ * YUV buffers are produced the way a synthetic camera source would:
+ * the scene is drawn into the cached XRGB8888 staging frame and the
+ * SIMD converter in yuv-convert.h writes Y and CbCr into the mapping.
+ * Rectangles are first widened to whole chroma blocks (even x; even y
+ * for NV12) so no Cb/Cr sample is computed from half a block.
+ *
+ * render_pool_run() returns once all bands are written, so the caller
+ * never issues SYNC_END or a commit while a worker is still writing.
+ * ============================================================ */
+static void producer_write(struct dmabuf_buffer *buf,
+			   struct animation_state *anim, uint32_t bar_color,
+			   const struct damage_region *region)
+{
+	struct damage_region full;
+
+	if (!region) {
+		damage_region_full(&full, (int32_t)buf->width,
+				   (int32_t)buf->height);
+		region = &full;
+	}
+
+	if (!buf->yuv) {
+		render_bar_region(buf->fmt, buf->producer_vaddr,
+				  buf->producer_pitch, anim, bar_color, region);
+		return;
+	}
+
+	const int32_t hs = (int32_t)buf->yuv->hsub;
+	const int32_t vs = (int32_t)buf->yuv->vsub;
+	struct damage_region blocks = { .count = 0 };
+
+	for (uint32_t i = 0; i < region->count; i++) {
+		const struct damage_rect *r = &region->rects[i];
+		damage_region_add(&blocks, (struct damage_rect){
+			r->x1 / hs * hs, r->y1 / vs * vs,
+			(r->x2 + hs - 1) / hs * hs, (r->y2 + vs - 1) / vs * vs,
+		}, (int32_t)buf->width, (int32_t)buf->height);
+	}
+
+	render_bar_region(PIXEL_FORMAT_DEFAULT, staging.pixels, staging.pitch,
+			  anim, bar_color, &blocks);
+
+	struct yuv_convert_job job = {
+		.impl         = yuv_convert_select(),
+		.fmt          = buf->yuv,
+		.rgb          = staging.pixels,
+		.rgb_pitch    = staging.pitch,
+		.luma         = buf->producer_vaddr,
+		.luma_pitch   = buf->producer_pitch,
+		.chroma       = buf->producer_vaddr + buf->chroma_offset,
+		.chroma_pitch = buf->producer_pitch,
+	};
+
+	for (uint32_t i = 0; i < blocks.count; i++) {
+		const struct damage_rect *r = &blocks.rects[i];
+
+		job.x0 = (uint32_t)r->x1;
+		job.x1 = (uint32_t)r->x2;
+		/* Bands are chroma rows: vsub luma rows plus one CbCr row */
+		render_pool_run(&pool, yuv_convert_band, &job,
+				(uint32_t)r->y1 / buf->yuv->vsub,
+				(uint32_t)r->y2 / buf->yuv->vsub,
+				buf->producer_pitch * buf->yuv->vsub,
+				(job.x1 - job.x0) * 4 * buf->yuv->vsub);
+	}
+}
+
 /* ============================================================
  * draw_frame - CPU writes to the producer-side mapping.
  *
@@ -348,7 +589,8 @@ static void dmabuf_destroy(struct dmabuf_buffer *buf, int display_fd)
  * ============================================================ */
 static void draw_frame(struct dmabuf_buffer *buf,
 		       struct animation_state *anim,
-		       uint32_t bar_color)
+		       uint32_t bar_color,
+		       const struct damage_region *region)
 {
 	/*
 	 * Implicit fence: acquire write access.
@@ -360,19 +602,11 @@ static void draw_frame(struct dmabuf_buffer *buf,
 	};
 	ioctl(buf->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync_start);
 
-	uint32_t *pixel   = (uint32_t *)buf->producer_vaddr;
-	uint32_t bg_color = 0x202020;
-
-	for (uint32_t y = 0; y < buf->height; y++) {
-		for (uint32_t x = 0; x < buf->width; x++) {
-			uint32_t offset = y * (buf->producer_pitch / 4) + x;
-			if ((int)x >= anim->bar_x &&
-			    (int)x <  anim->bar_x + anim->bar_width)
-				pixel[offset] = bar_color;
-			else
-				pixel[offset] = bg_color;
-		}
-	}
+	/*
+	 * With a damage region only the listed rectangles are rewritten;
+	 * the SYNC bracket still covers the whole buffer.
+	 */
+	producer_write(buf, anim, bar_color, region);
 
 	/*
 	 * Implicit fence: release write access.
@@ -396,23 +630,12 @@ static void draw_frame_nosync(struct dmabuf_buffer *buf,
 	 * the CPU cache is not flushed before display DMA reads the buffer.
 	 * On RK3588 the effect is subtler but the race condition is real.
 	 */
-	uint32_t *pixel   = (uint32_t *)buf->producer_vaddr;
-	uint32_t bg_color = 0x202020;
-
-	for (uint32_t y = 0; y < buf->height; y++) {
-		for (uint32_t x = 0; x < buf->width; x++) {
-			uint32_t offset = y * (buf->producer_pitch / 4) + x;
-			if ((int)x >= anim->bar_x &&
-			    (int)x <  anim->bar_x + anim->bar_width)
-				pixel[offset] = bar_color;
-			else
-				pixel[offset] = bg_color;
-		}
-	}
+	producer_write(buf, anim, bar_color, NULL);
 }
 
 static void update_animation(struct animation_state *anim, int screen_width)
 {
+	anim->prev_bar_x = anim->bar_x;
 	anim->bar_x += anim->direction * 8;
 	if (anim->bar_x + anim->bar_width >= screen_width) {
 		anim->bar_x = screen_width - anim->bar_width;
@@ -424,6 +647,63 @@ static void update_animation(struct animation_state *anim, int screen_width)
 	anim->frame_count++;
 }
 
+/* ============================================================
+ * render_frame - Damage-tracked producer write into bufs[idx].
+ *
+ * Same buffer-age scheme as drm-atomic-demo.c (see damage.h): only the
+ * strips the bar left and entered since bufs[idx] was last written are
+ * repainted.  Each buffer keeps its own bar colour, so a partial
+ * repaint never mixes colours within one buffer.
+ * ============================================================ */
+static void render_frame(struct damage_tracker *dt,
+			 struct dmabuf_buffer *bufs, int idx,
+			 struct animation_state *anim, uint32_t bar_color)
+{
+	struct damage_region *frame = damage_begin_frame(dt);
+
+	damage_add_column_move(frame, anim->prev_bar_x, anim->bar_x,
+			       anim->bar_width, dt->width, dt->height);
+	draw_frame(&bufs[idx], anim, bar_color,
+		   damage_buffer_repaint(dt, idx));
+	damage_report(dt, 300);
+}
+
+/* ============================================================
+ * warm_up - same idea as drm-atomic-demo.c: every page of every
+ *           buffer prefaulted on the render pool, one full frame into
+ *           each buffer (SYNC ioctls and, for NV12/NV16, the
+ *           conversion kernels) and a TEST_ONLY flip to each, before
+ *           the first frame has to make its vblank.
+ * ============================================================ */
+static void warm_up(struct kms_state *kms, struct dmabuf_buffer *bufs, int n)
+{
+	struct animation_state anim = { .bar_width = 80, .direction = 1 };
+	const struct plane_props *pp = &kms->primary_props;
+	double t0 = render_pool_now_ms(), t1, t2;
+	int refused = 0;
+
+	for (int i = 0; i < n; i++)
+		render_pool_prefault(&pool, bufs[i].producer_vaddr,
+				     bufs[i].producer_size);
+	t1 = render_pool_now_ms();
+	for (int i = 0; i < n; i++)
+		draw_frame(&bufs[i], &anim, buffer_colors[i], NULL);
+	t2 = render_pool_now_ms();
+
+	for (int i = 0; i < n; i++) {
+		atomic_req_set(&flip_req, kms->plane_id, pp->fb_id,
+			       bufs[i].fb_id);
+		atomic_req_set(&flip_req, kms->plane_id, pp->crtc_id,
+			       kms->crtc_id);
+		if (atomic_req_commit(&flip_req, kms->display_fd,
+				      DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+			refused++;
+	}
+	printf("Warm-up: %d buffers, prefault %.1f ms, render %.1f ms, "
+	       "TEST_ONLY %.1f ms (%d refused)\n", n, t1 - t0, t2 - t1,
+	       render_pool_now_ms() - t2, refused);
+}
+
 /* ============================================================
  * atomic_modeset - same pattern as drm-atomic-demo.c
  * ============================================================ */
@@ -489,9 +769,15 @@ static void flip_handler(int fd, unsigned int seq, unsigned int tv_sec,
 {
 	struct flip_pending *p = user_data;
 	p->waiting = false;
-	(void)fd; (void)seq; (void)tv_sec; (void)tv_usec; (void)crtc_id;
+	telemetry_flip(&telemetry, seq);
+	(void)fd; (void)tv_sec; (void)tv_usec; (void)crtc_id;
 }
 
+static drmEventContext ev_ctx = {
+	.version            = 3,
+	.page_flip_handler2 = flip_handler,
+};
+
 /* ============================================================
  * run_dmabuf_demo - Basic DMA-BUF sharing with implicit fence (SYNC ioctl).
  *
@@ -509,18 +795,16 @@ static void run_dmabuf_demo(struct kms_state *kms,
 	struct animation_state anim = {
 		.bar_x = 0, .bar_width = 80, .direction = 1
 	};
-	uint32_t colors[MAX_BUFFERS] = { 0xffffff, 0x00ff88 };
 	int cur = 0;
 	struct flip_pending pending = { .waiting = false };
-	drmEventContext ev_ctx = {
-		.version            = 3,
-		.page_flip_handler2 = flip_handler,
-	};
+	struct damage_tracker dt;
+
+	damage_tracker_init(&dt, bufs[0].width, bufs[0].height);
 
 	printf("\n[DMA-BUF IMPLICIT FENCE] SYNC_START/SYNC_END around CPU writes\n");
 	printf("White/green bar alternates between two shared buffers -- Ctrl+C to stop\n\n");
 
-	while (1) {
+	while (keep_running()) {
 		int back = 1 - cur;
 
 		/*
@@ -528,42 +812,101 @@ static void run_dmabuf_demo(struct kms_state *kms,
 		 * draw_frame() brackets the write with DMA_BUF_IOCTL_SYNC,
 		 * ensuring cache coherency between CPU write and display DMA read.
 		 */
-		draw_frame(&bufs[back], &anim, colors[back]);
+		telemetry_begin(&telemetry, TEL_RENDER);
+		render_frame(&dt, bufs, back, &anim, buffer_colors[back]);
 		update_animation(&anim, (int)bufs[back].width);
-
-		drmModeAtomicReq *req = drmModeAtomicAlloc();
-		if (!req) break;
-
-		drmModeAtomicAddProperty(req, kms->plane_id,
-					 kms->primary_props.fb_id,
-					 bufs[back].fb_id);
-		drmModeAtomicAddProperty(req, kms->plane_id,
-					 kms->primary_props.crtc_id,
-					 kms->crtc_id);
-
-		int ret = drmModeAtomicCommit(kms->display_fd, req,
-					      DRM_MODE_ATOMIC_NONBLOCK |
-					      DRM_MODE_PAGE_FLIP_EVENT,
-					      &pending);
-		drmModeAtomicFree(req);
+		telemetry_end(&telemetry, TEL_RENDER);
+
+		atomic_req_set(&flip_req, kms->plane_id,
+			       kms->primary_props.fb_id, bufs[back].fb_id);
+		atomic_req_set(&flip_req, kms->plane_id,
+			       kms->primary_props.crtc_id, kms->crtc_id);
+
+		telemetry_begin(&telemetry, TEL_COMMIT);
+		int ret = atomic_req_commit(&flip_req, kms->display_fd,
+					    DRM_MODE_ATOMIC_NONBLOCK |
+					    DRM_MODE_PAGE_FLIP_EVENT,
+					    &pending);
 		if (ret) { perror("atomic flip"); break; }
+		telemetry_end(&telemetry, TEL_COMMIT);
 		pending.waiting = true;
 
-		while (pending.waiting) {
-			fd_set fds;
-			FD_ZERO(&fds);
-			FD_SET(kms->display_fd, &fds);
-			struct timeval timeout = { .tv_sec = 1 };
-			int s = select(kms->display_fd + 1, &fds,
-				       NULL, NULL, &timeout);
-			if (s <= 0) { fprintf(stderr, "vblank timeout\n"); return; }
-			drmHandleEvent(kms->display_fd, &ev_ctx);
+		if (event_loop_wait(&events, &pending.waiting, 1000) < 0) {
+			fprintf(stderr, "vblank timeout\n");
+			return;
 		}
 
 		cur = back;
 	}
 }
 
+/* ============================================================
+ * run_threaded_dmabuf_demo - Producer thread + display thread.
+ *
+ * The producer (render thread) writes frames inside their SYNC
+ * bracket into free buffers and hands them over through the ring in
+ * frame-pipeline.h -- the same hand-off a GPU or ISP driver thread
+ * would make.  This thread owns display_fd: it commits the newest
+ * finished buffer and gives the buffer the flip retired back to the
+ * producer, which is the point its SYNC_START may safely begin.
+ * ============================================================ */
+struct threaded_producer {
+	struct kms_state      *kms;
+	struct dmabuf_buffer  *bufs;
+	struct flip_pending   *pending;
+	struct damage_tracker  dt;   /* Producer thread only */
+	struct animation_state anim; /* Producer thread only */
+};
+
+static uint64_t threaded_render(void *ctx, int idx)
+{
+	struct threaded_producer *t = ctx;
+
+	render_frame(&t->dt, t->bufs, idx, &t->anim, buffer_colors[idx]);
+	update_animation(&t->anim, (int)t->bufs[idx].width);
+	return t->dt.frame;
+}
+
+static int threaded_commit(void *ctx, int idx)
+{
+	struct threaded_producer *t = ctx;
+
+	atomic_req_set(&flip_req, t->kms->plane_id,
+		       t->kms->primary_props.fb_id, t->bufs[idx].fb_id);
+	atomic_req_set(&flip_req, t->kms->plane_id,
+		       t->kms->primary_props.crtc_id, t->kms->crtc_id);
+	return atomic_req_commit(&flip_req, t->kms->display_fd,
+				 DRM_MODE_ATOMIC_NONBLOCK |
+				 DRM_MODE_PAGE_FLIP_EVENT, t->pending);
+}
+
+static void run_threaded_dmabuf_demo(struct kms_state *kms,
+				     struct dmabuf_buffer *bufs, int nbufs)
+{
+	struct flip_pending pending = { .waiting = false };
+	struct frame_pipeline fp;
+	struct threaded_producer t = {
+		.kms     = kms,
+		.bufs    = bufs,
+		.pending = &pending,
+		.anim    = { .bar_width = 80, .direction = 1 },
+	};
+
+	damage_tracker_init(&t.dt, bufs[0].width, bufs[0].height);
+
+	printf("\n[DMA-BUF IMPLICIT FENCE] Producer thread + display thread, %d buffers\n",
+	       nbufs);
+	printf("White/green/blue bar per shared buffer -- Ctrl+C to stop\n\n");
+
+	if (frame_pipeline_start(&fp, nbufs, 0, threaded_render, &t,
+				 &telemetry) < 0)
+		return;
+	frame_pipeline_display(&fp, &events, &pending.waiting,
+			       threaded_commit, &t, 0,
+			       1000.0 / (kms->mode.vrefresh ? kms->mode.vrefresh : 60));
+	frame_pipeline_stop(&fp);
+}
+
 /* ============================================================
  * run_nosync_demo - Write without DMA_BUF_IOCTL_SYNC (no fence).
  *
@@ -596,13 +939,24 @@ static void run_nosync_demo(struct kms_state *kms,
 			    DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
 	drmModeAtomicFree(req);
 
-	while (1) {
+	while (keep_running()) {
+		telemetry_begin(&telemetry, TEL_RENDER);
 		draw_frame_nosync(buf, &anim, 0xff4400);
 		update_animation(&anim, (int)buf->width);
+		telemetry_end(&telemetry, TEL_RENDER);
+		telemetry_frame(&telemetry);
 		/* No sleep, no sync -- maximum race condition exposure */
+		event_loop_dispatch(&events, 0); /* Ctrl+C only */
 	}
 }
 
+/* Out-fence signaled: the frame it belongs to is being scanned out */
+static void fence_handler(struct event_loop *loop, int fd, void *ctx)
+{
+	*(bool *)ctx = false;
+	(void)loop; (void)fd;
+}
+
 /* ============================================================
  * run_explicit_fence_demo - Demonstrate OUT_FENCE_PTR + IN_FENCE_FD.
  *
@@ -622,7 +976,9 @@ static void run_nosync_demo(struct kms_state *kms,
  *     I have finished rendering before you start scanning out."
  *
  * In this demo we use the out-fence from frame N as the in-fence for
- * frame N+1, creating a strict pipeline ordering.
+ * frame N+1, creating a strict pipeline ordering.  The out-fence is
+ * also waited on in the event loop next to the flip event: the
+ * buffer the next frame is drawn into is only free once it signals.
  * ============================================================ */
 static void run_explicit_fence_demo(struct kms_state *kms,
 				    struct dmabuf_buffer bufs[MAX_BUFFERS])
@@ -641,40 +997,38 @@ static void run_explicit_fence_demo(struct kms_state *kms,
 	int cur       = 0;
 	int out_fence = -1; /* sync_file fd received from the kernel */
 	struct flip_pending pending = { .waiting = false };
-	drmEventContext ev_ctx = {
-		.version            = 3,
-		.page_flip_handler2 = flip_handler,
-	};
+	struct damage_tracker dt;
+
+	damage_tracker_init(&dt, bufs[0].width, bufs[0].height);
 
 	printf("\n[EXPLICIT FENCE] OUT_FENCE_PTR -> IN_FENCE_FD pipeline\n");
 	printf("Each frame's out-fence becomes the next frame's in-fence\n");
 	printf("This is how Wayland compositors synchronize GPU and display -- Ctrl+C to stop\n\n");
 
-	while (1) {
+	while (keep_running()) {
 		int back = 1 - cur;
 
-		draw_frame(&bufs[back], &anim, 0x4488ff);
+		telemetry_begin(&telemetry, TEL_RENDER);
+		render_frame(&dt, bufs, back, &anim, 0x4488ff);
 		update_animation(&anim, (int)bufs[back].width);
-
-		drmModeAtomicReq *req = drmModeAtomicAlloc();
-		if (!req) break;
+		telemetry_end(&telemetry, TEL_RENDER);
 
 		/*
 		 * OUT_FENCE_PTR: pass a pointer to out_fence.
 		 * After this commit the kernel will write a new sync_file fd
 		 * into out_fence representing "frame back is on screen."
+		 * Like IN_FENCE_FD it is an argument of this one commit,
+		 * not plane or CRTC state, so it is always sent.
 		 */
 		int new_out_fence = -1;
-		drmModeAtomicAddProperty(req, kms->crtc_id,
-					 kms->crtc_props.out_fence_ptr,
-					 (uint64_t)(uintptr_t)&new_out_fence);
+		atomic_req_add(&flip_req, kms->crtc_id,
+			       kms->crtc_props.out_fence_ptr,
+			       (uint64_t)(uintptr_t)&new_out_fence);
 
-		drmModeAtomicAddProperty(req, kms->plane_id,
-					 kms->primary_props.fb_id,
-					 bufs[back].fb_id);
-		drmModeAtomicAddProperty(req, kms->plane_id,
-					 kms->primary_props.crtc_id,
-					 kms->crtc_id);
+		atomic_req_set(&flip_req, kms->plane_id,
+			       kms->primary_props.fb_id, bufs[back].fb_id);
+		atomic_req_set(&flip_req, kms->plane_id,
+			       kms->primary_props.crtc_id, kms->crtc_id);
 
 		/*
 		 * IN_FENCE_FD: pass the out-fence from the previous frame.
@@ -686,16 +1040,18 @@ static void run_explicit_fence_demo(struct kms_state *kms,
 		 * correct for the very first frame.
 		 */
 		if (kms->primary_props.in_fence_fd) {
-			drmModeAtomicAddProperty(req, kms->plane_id,
-						 kms->primary_props.in_fence_fd,
-						 (uint64_t)(int64_t)out_fence);
+			atomic_req_add(&flip_req, kms->plane_id,
+				       kms->primary_props.in_fence_fd,
+				       (uint64_t)(int64_t)out_fence);
 		}
 
-		int ret = drmModeAtomicCommit(kms->display_fd, req,
-					      DRM_MODE_ATOMIC_NONBLOCK |
-					      DRM_MODE_PAGE_FLIP_EVENT,
-					      &pending);
-		drmModeAtomicFree(req);
+		telemetry_begin(&telemetry, TEL_COMMIT);
+		int ret = atomic_req_commit(&flip_req, kms->display_fd,
+					    DRM_MODE_ATOMIC_NONBLOCK |
+					    DRM_MODE_PAGE_FLIP_EVENT,
+					    &pending);
+		if (!ret)
+			telemetry_end(&telemetry, TEL_COMMIT);
 
 		/* Close the fence fd we just consumed as IN_FENCE_FD */
 		if (out_fence >= 0) {
@@ -714,22 +1070,629 @@ static void run_explicit_fence_demo(struct kms_state *kms,
 			printf("  Frame %d: out_fence_fd=%d\n",
 			       anim.frame_count, out_fence);
 
+		bool fence_pending = out_fence >= 0;
+		if (fence_pending &&
+		    event_loop_add_fence(&events, out_fence, fence_handler,
+					 &fence_pending) < 0)
+			fence_pending = false;
+
 		pending.waiting = true;
-		while (pending.waiting) {
-			fd_set fds;
-			FD_ZERO(&fds);
-			FD_SET(kms->display_fd, &fds);
-			struct timeval timeout = { .tv_sec = 1 };
-			int s = select(kms->display_fd + 1, &fds,
-				       NULL, NULL, &timeout);
-			if (s <= 0) { fprintf(stderr, "vblank timeout\n"); goto out; }
-			drmHandleEvent(kms->display_fd, &ev_ctx);
+		if (event_loop_wait(&events, &pending.waiting, 1000) < 0 ||
+		    event_loop_wait(&events, &fence_pending, 1000) < 0) {
+			fprintf(stderr, "vblank/fence timeout\n");
+			goto out;
 		}
 
 		cur = back;
 	}
 out:
-	if (out_fence >= 0) close(out_fence);
+	if (out_fence >= 0) {
+		event_loop_remove(&events, out_fence);
+		close(out_fence);
+	}
+}
+
+/* ============================================================
+ * Producer process (--ipc, --ipc-ceiling)
+ *
+ * The other modes only model the producer with a second DRM fd in the
+ * same process.  Here it is a forked process that never opens the DRM
+ * device: it gets the buffers as DMA-BUF fds over a UNIX socket
+ * (SCM_RIGHTS, see frame-ipc.h), maps them and renders straight into
+ * the pages the display engine scans out.  Nothing is ever copied;
+ * per frame only a buffer index crosses the shared rings, plus the
+ * frame's sync_file over the socket.
+ * ============================================================ */
+#define IPC_CEILING_FRAMES 600
+
+static pid_t producer_pid = -1;
+
+/*
+ * The fences a reader of @dmabuf_fd has to wait for, as a sync_file
+ * (-1 before Linux 6.0).  After a CPU write it is already signalled;
+ * a GPU or ISP producer would hand over its pending job here.
+ */
+static int export_read_fence(int dmabuf_fd)
+{
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	struct dma_buf_export_sync_file arg = {
+		.flags = DMA_BUF_SYNC_READ,
+		.fd    = -1,
+	};
+
+	if (ioctl(dmabuf_fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &arg) == 0)
+		return arg.fd;
+#else
+	(void)dmabuf_fd;
+#endif
+	return -1;
+}
+
+static const struct pixel_format *pixel_format_by_fourcc(uint32_t fourcc)
+{
+	for (size_t i = 0; i < sizeof(pixel_formats) / sizeof(pixel_formats[0]);
+	     i++)
+		if (pixel_formats[i].fourcc == fourcc)
+			return &pixel_formats[i];
+	return NULL;
+}
+
+/*
+ * Producer side of one SETUP: render into free buffers until STOP.
+ * Returns -1 once the display process is gone.
+ */
+static int produce_frames(int sock, const struct frame_ipc_msg *setup,
+			  int *fds, int nfds)
+{
+	struct dmabuf_buffer bufs[FRAME_IPC_MAX_BUFFERS] = {0};
+	struct animation_state anim = { .bar_width = 80, .direction = 1 };
+	const struct pixel_format *fmt = pixel_format_by_fourcc(setup->fourcc);
+	struct damage_tracker dt;
+	struct frame_ipc ipc;
+	uint32_t free_mask = setup->free_mask;
+	uint64_t frame = 0;
+	int nbufs = (int)setup->nbufs, mapped = 0, ret = 0;
+
+	if (!fmt || nbufs < 1 || nbufs > FRAME_IPC_MAX_BUFFERS ||
+	    nfds != 3 + nbufs || frame_ipc_attach(&ipc, sock, fds) < 0) {
+		fprintf(stderr, "producer: bad SETUP\n");
+		for (int i = 0; i < nfds; i++)
+			close(fds[i]);
+		return -1;
+	}
+	for (; mapped < nbufs; mapped++) {
+		struct dmabuf_buffer *b = &bufs[mapped];
+
+		b->dmabuf_fd      = fds[3 + mapped];
+		b->width          = setup->width;
+		b->height         = setup->height;
+		b->fmt            = fmt;
+		b->producer_pitch = setup->pitch;
+		b->producer_size  = setup->size;
+		b->producer_vaddr = mmap(0, setup->size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED, b->dmabuf_fd, 0);
+		if (b->producer_vaddr == MAP_FAILED) {
+			perror("producer: mmap DMA-BUF");
+			close(b->dmabuf_fd);
+			ret = -1;
+			break;
+		}
+	}
+	for (int i = mapped + 1; i < nbufs; i++)
+		close(fds[3 + i]);
+	damage_tracker_init(&dt, setup->width, setup->height);
+
+	while (!ret) {
+		struct frame_ipc_entry e;
+		struct frame_ipc_msg msg;
+		int got[FRAME_IPC_MAX_FDS];
+		int n = frame_ipc_recv(sock, &msg, got, FRAME_IPC_MAX_FDS,
+				       MSG_DONTWAIT);
+
+		if (n < 0 && errno != EAGAIN) {
+			ret = -1;
+			break;
+		}
+		while (n > 0)
+			close(got[--n]);
+		if (n == 0 && msg.type == FRAME_IPC_STOP)
+			break;
+
+		/* Reset the wakeup first, so a release after the pop wakes us */
+		frame_ipc_drain(ipc.released_efd);
+		while (frame_ipc_pop(&ipc.shm->released, &e))
+			free_mask |= 1u << e.buffer;
+		if (!free_mask) {
+			struct pollfd pfd[2] = {
+				{ .fd = ipc.released_efd, .events = POLLIN },
+				{ .fd = sock,             .events = POLLIN },
+			};
+			poll(pfd, 2, 1000);
+			continue;
+		}
+
+		int idx = __builtin_ctz(free_mask);
+		free_mask &= ~(1u << idx);
+
+		e = (struct frame_ipc_entry){
+			.buffer = (uint32_t)idx,
+			.frame  = ++frame,
+			.t_ns   = frame_ipc_now_ns(),
+		};
+		render_frame(&dt, bufs, idx, &anim,
+			     buffer_colors[idx % FRAME_PIPELINE_DEPTH]);
+		update_animation(&anim, (int)setup->width);
+
+		/* The sync_file goes first, so it is queued when the display
+		 * pops the entry */
+		int fence = export_read_fence(bufs[idx].dmabuf_fd);
+		msg = (struct frame_ipc_msg){
+			.type   = FRAME_IPC_FRAME,
+			.buffer = (uint32_t)idx,
+			.frame  = frame,
+		};
+		if (frame_ipc_send(sock, &msg, &fence, fence >= 0) < 0)
+			ret = -1;
+		if (fence >= 0)
+			close(fence);
+		if (!ret) {
+			frame_ipc_push(&ipc.shm->ready, &e);
+			frame_ipc_signal(ipc.ready_efd);
+		}
+	}
+
+	for (int i = 0; i < mapped; i++) {
+		munmap(bufs[i].producer_vaddr, bufs[i].producer_size);
+		close(bufs[i].dmabuf_fd);
+	}
+	frame_ipc_close(&ipc);
+	if (!ret) {
+		struct frame_ipc_msg done = { .type = FRAME_IPC_STOPPED };
+		ret = frame_ipc_send(sock, &done, NULL, 0);
+	}
+	return ret;
+}
+
+/* Producer process: one SETUP ... STOP session after another */
+static int producer_main(int sock)
+{
+	struct frame_ipc_msg msg;
+	int fds[FRAME_IPC_MAX_FDS];
+	int n;
+
+	while ((n = frame_ipc_recv(sock, &msg, fds, FRAME_IPC_MAX_FDS, 0)) >= 0) {
+		if (msg.type == FRAME_IPC_SETUP) {
+			if (produce_frames(sock, &msg, fds, n) < 0)
+				break;
+			continue;
+		}
+		while (n > 0)
+			close(fds[--n]);
+	}
+	close(sock);
+	render_pool_destroy(&pool);
+	return 0;
+}
+
+/* ============================================================
+ * start_producer - Fork the producer process.
+ *
+ * Called before the DRM device is opened and before any thread
+ * exists, so the child inherits nothing but the socket.  Ctrl+C is
+ * left to the display process, which stops the producer over the
+ * socket (or by closing it).  Returns the display end, or -1.
+ * ============================================================ */
+static int start_producer(int argc, char **argv)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+	fflush(stdout);
+	producer_pid = fork();
+	if (producer_pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (producer_pid == 0) {
+		close(sv[0]);
+		signal(SIGINT, SIG_IGN);
+		render_pool_init(&pool, render_pool_parse_threads(argc, argv));
+		_exit(producer_main(sv[1]));
+	}
+	close(sv[1]);
+	return sv[0];
+}
+
+/* Display side of one producer session */
+struct ipc_display {
+	struct kms_state     *kms;
+	struct dmabuf_buffer *bufs;
+	struct frame_ipc      ipc;
+	bool                  ceiling; /* Release on arrival, no display */
+
+	/* Buffer indices, -1 if none */
+	int      ready;        /* Newest frame not committed yet (mailbox) */
+	int      ready_fence;  /* Its sync_file                            */
+	uint64_t ready_t_ns;   /* Its render start                         */
+	int      pending;      /* Committed, flip not completed            */
+	uint64_t pending_t_ns;
+	int      shown;        /* Being scanned out                        */
+
+	/* Statistics */
+	uint64_t received;
+	uint64_t replaced;     /* Overtaken in the mailbox, never shown    */
+	uint64_t fences;       /* Frames that came with a sync_file        */
+	uint64_t first_ns, last_ns;
+	struct telemetry_hist latency; /* us; render start -> on screen,
+					* or -> received with ceiling */
+};
+
+static void ipc_release(struct ipc_display *d, int buffer)
+{
+	struct frame_ipc_entry e = { .buffer = (uint32_t)buffer };
+
+	frame_ipc_push(&d->ipc.shm->released, &e);
+	frame_ipc_signal(d->ipc.released_efd);
+}
+
+/* ready eventfd: take every finished frame off the ring */
+static void ipc_ready_handler(struct event_loop *loop, int fd, void *ctx)
+{
+	struct ipc_display *d = ctx;
+	struct frame_ipc_entry e;
+
+	frame_ipc_drain(fd);
+	while (frame_ipc_pop(&d->ipc.shm->ready, &e)) {
+		struct frame_ipc_msg msg;
+		int fence = -1;
+		uint64_t now = frame_ipc_now_ns();
+
+		/* Its FRAME message was sent before the entry was pushed */
+		if (frame_ipc_recv(d->ipc.sock, &msg, &fence, 1,
+				   MSG_DONTWAIT) < 0 ||
+		    msg.type != FRAME_IPC_FRAME || msg.frame != e.frame)
+			fprintf(stderr, "ipc: no FRAME message for frame %llu\n",
+				(unsigned long long)e.frame);
+		if (fence >= 0)
+			d->fences++;
+		if (!d->received++)
+			d->first_ns = now;
+		d->last_ns = now;
+
+		if (d->ceiling) {
+			telemetry_hist_record(&d->latency,
+					      (uint32_t)((now - e.t_ns) / 1000));
+			if (fence >= 0)
+				close(fence);
+			ipc_release(d, (int)e.buffer);
+			continue;
+		}
+		if (d->ready >= 0) {
+			if (d->ready_fence >= 0)
+				close(d->ready_fence);
+			ipc_release(d, d->ready);
+			d->replaced++;
+		}
+		d->ready       = (int)e.buffer;
+		d->ready_fence = fence;
+		d->ready_t_ns  = e.t_ns;
+	}
+	(void)loop;
+}
+
+/* Send SETUP for @nbufs buffers; @shown is on screen (-1: none) */
+static int ipc_session_start(struct ipc_display *d, int sock, int nbufs,
+			     int shown)
+{
+	const struct dmabuf_buffer *b = &d->bufs[0];
+	int fds[FRAME_IPC_MAX_FDS];
+	struct frame_ipc_msg setup = {
+		.type      = FRAME_IPC_SETUP,
+		.nbufs     = (uint32_t)nbufs,
+		.width     = b->width,
+		.height    = b->height,
+		.fourcc    = b->fmt->fourcc,
+		.pitch     = b->producer_pitch,
+		.size      = b->producer_size,
+		.free_mask = ((1u << nbufs) - 1) & ~(shown >= 0 ? 1u << shown : 0),
+	};
+
+	d->ready = d->pending = -1;
+	d->ready_fence = -1;
+	d->shown = shown;
+	if (frame_ipc_create(&d->ipc, sock) < 0)
+		return -1;
+	fds[0] = d->ipc.shm_fd;
+	fds[1] = d->ipc.ready_efd;
+	fds[2] = d->ipc.released_efd;
+	for (int i = 0; i < nbufs; i++)
+		fds[3 + i] = d->bufs[i].dmabuf_fd;
+	if (frame_ipc_send(sock, &setup, fds, 3 + nbufs) < 0 ||
+	    event_loop_add_fd(&events, d->ipc.ready_efd, ipc_ready_handler,
+			      d) < 0) {
+		perror("ipc: SETUP");
+		frame_ipc_close(&d->ipc);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * STOP, then wait for STOPPED: only then has the producer unmapped
+ * the buffers, and they may be destroyed.
+ */
+static void ipc_session_stop(struct ipc_display *d)
+{
+	struct frame_ipc_msg msg = { .type = FRAME_IPC_STOP };
+	struct pollfd pfd = { .fd = d->ipc.sock, .events = POLLIN };
+
+	event_loop_remove(&events, d->ipc.ready_efd);
+	if (d->ready_fence >= 0)
+		close(d->ready_fence);
+	if (frame_ipc_send(d->ipc.sock, &msg, NULL, 0) == 0) {
+		while (poll(&pfd, 1, 1000) == 1) {
+			int fds[FRAME_IPC_MAX_FDS];
+			int n = frame_ipc_recv(d->ipc.sock, &msg, fds,
+					       FRAME_IPC_MAX_FDS, 0);
+
+			if (n < 0)
+				break;
+			while (n > 0)
+				close(fds[--n]);
+			if (msg.type == FRAME_IPC_STOPPED)
+				break;
+		}
+	}
+	frame_ipc_close(&d->ipc);
+}
+
+static void ipc_report(const struct ipc_display *d, const char *what)
+{
+	double secs = (d->last_ns - d->first_ns) / 1e9;
+
+	printf("  %llu frames in %.2f s: %.1f fps, %llu with a sync_file\n",
+	       (unsigned long long)d->received, secs,
+	       secs > 0 ? (d->received - 1) / secs : 0.0,
+	       (unsigned long long)d->fences);
+	printf("  %s: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", what,
+	       telemetry_percentile(&d->latency, 50) / 1e3,
+	       telemetry_percentile(&d->latency, 99) / 1e3,
+	       d->latency.max / 1e3);
+}
+
+/* ============================================================
+ * run_ipc_demo - Display frames rendered by the producer process.
+ *
+ * Mailbox: the display commits the newest finished frame once the
+ * previous flip completed; a frame overtaken before that goes straight
+ * back to the producer.  A buffer is released when the flip that
+ * replaced it on screen completes.  The frame's sync_file is the
+ * commit's IN_FENCE_FD, so the display engine (not this process)
+ * waits for the producer.  Latency runs from the producer starting
+ * the frame to the flip event that put it on screen.
+ * ============================================================ */
+static void run_ipc_demo(struct kms_state *kms, struct dmabuf_buffer *bufs,
+			 int nbufs, int sock)
+{
+	struct flip_pending pending = { .waiting = false };
+	struct ipc_display d = { .kms = kms, .bufs = bufs };
+
+	printf("\n[IPC] Producer process pid %d renders into %d shared "
+	       "buffers -- Ctrl+C to stop\n\n", (int)producer_pid, nbufs);
+	if (ipc_session_start(&d, sock, nbufs, 0) < 0)
+		return;
+
+	while (keep_running()) {
+		if (!pending.waiting && d.ready >= 0) {
+			atomic_req_set(&flip_req, kms->plane_id,
+				       kms->primary_props.fb_id,
+				       bufs[d.ready].fb_id);
+			atomic_req_set(&flip_req, kms->plane_id,
+				       kms->primary_props.crtc_id, kms->crtc_id);
+			if (kms->primary_props.in_fence_fd)
+				atomic_req_add(&flip_req, kms->plane_id,
+					       kms->primary_props.in_fence_fd,
+					       (uint64_t)(int64_t)d.ready_fence);
+
+			telemetry_begin(&telemetry, TEL_COMMIT);
+			int ret = atomic_req_commit(&flip_req, kms->display_fd,
+						    DRM_MODE_ATOMIC_NONBLOCK |
+						    DRM_MODE_PAGE_FLIP_EVENT,
+						    &pending);
+			if (d.ready_fence >= 0)
+				close(d.ready_fence);
+			d.ready_fence = -1;
+			if (ret) { perror("atomic flip (ipc)"); break; }
+			telemetry_end(&telemetry, TEL_COMMIT);
+
+			pending.waiting = true;
+			d.pending      = d.ready;
+			d.pending_t_ns = d.ready_t_ns;
+			d.ready        = -1;
+		}
+
+		if (event_loop_dispatch(&events, 1000) == 0) {
+			fprintf(stderr, "ipc: no frame or flip for 1 s\n");
+			break;
+		}
+
+		if (d.pending >= 0 && !pending.waiting) {
+			telemetry_hist_record(&d.latency, (uint32_t)
+				((frame_ipc_now_ns() - d.pending_t_ns) / 1000));
+			if (d.shown >= 0)
+				ipc_release(&d, d.shown);
+			d.shown   = d.pending;
+			d.pending = -1;
+		}
+	}
+
+	/* Buffers stay ours until the last flip is done */
+	if (pending.waiting)
+		event_loop_wait(&events, &pending.waiting, 1000);
+	ipc_session_stop(&d);
+	printf("\n[IPC] %llu frames overtaken in the mailbox\n",
+	       (unsigned long long)d.replaced);
+	ipc_report(&d, "render start -> on screen");
+}
+
+/* ============================================================
+ * run_ipc_ceiling - Throughput limit of the producer/IPC path.
+ *
+ * Same producer and hand-off, but the display side gives every frame
+ * back the moment it arrives and nothing is committed, so the rate is
+ * bounded by rendering and the round trip alone.  Runs at 1080p and at
+ * 4K regardless of the current mode; latency is render start to the
+ * frame being received.
+ * ============================================================ */
+static void run_ipc_ceiling(struct kms_state *kms, int fd_producer,
+			    const struct pixel_format *fmt, int sock)
+{
+	static const uint32_t sizes[][2] = { { 1920, 1080 }, { 3840, 2160 } };
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		struct dmabuf_buffer bufs[FRAME_PIPELINE_DEPTH] = {0};
+		struct ipc_display d = {
+			.kms = kms, .bufs = bufs, .ceiling = true,
+		};
+		int n = 0;
+
+		printf("\n[IPC CEILING] %ux%u %s, %d buffers, %d frames\n",
+		       sizes[s][0], sizes[s][1], fmt->name,
+		       FRAME_PIPELINE_DEPTH, IPC_CEILING_FRAMES);
+		for (; n < FRAME_PIPELINE_DEPTH; n++)
+			if (dmabuf_create(&bufs[n], kms->display_fd,
+					  fd_producer, sizes[s][0],
+					  sizes[s][1], fmt, NULL) < 0)
+				break;
+
+		if (n == FRAME_PIPELINE_DEPTH &&
+		    ipc_session_start(&d, sock, n, -1) == 0) {
+			while (keep_running() &&
+			       d.received < IPC_CEILING_FRAMES)
+				if (event_loop_dispatch(&events, 1000) == 0)
+					break;
+			ipc_session_stop(&d);
+			ipc_report(&d, "render start -> received");
+		}
+		for (int i = 0; i < n; i++)
+			dmabuf_destroy(&bufs[i], kms->display_fd);
+		if (n < FRAME_PIPELINE_DEPTH || events.quit)
+			break;
+	}
+}
+
+/* ============================================================
+ * run_udmabuf_bench - Producer fill rate: dumb buffer vs udmabuf.
+ *
+ * UDMABUF_BENCH_FRAMES full frames rendered with draw_frame(), SYNC
+ * bracket included, rotating through @n buffers of each kind at the
+ * mode size.  The dumb buffer's mapping is write-combined on most
+ * display drivers; udmabuf memory is cached, and pays for that in
+ * the cache maintenance the SYNC ioctls do.  Every buffer is also
+ * imported and added as a framebuffer, so a backend the display
+ * cannot scan out fails here.  Nothing is put on screen.
+ * ============================================================ */
+#define UDMABUF_BENCH_FRAMES 240
+
+/*
+ * One backend; returns ms per frame, or -1 if it cannot allocate (or,
+ * with @need_huge, did not get huge pages for every buffer)
+ */
+static double udmabuf_bench_pass(struct kms_state *kms, int fd_producer,
+				 int n, const struct pixel_format *fmt,
+				 const struct yuv_format *yuv, bool need_huge)
+{
+	struct dmabuf_buffer bufs[FRAME_PIPELINE_DEPTH] = {0};
+	struct animation_state anim = { .bar_width = 80, .direction = 1 };
+	bool usable = true;
+	double ms = -1;
+	int got = 0;
+
+	for (; got < n; got++)
+		if (dmabuf_create(&bufs[got], kms->display_fd, fd_producer,
+				  kms->mode.hdisplay, kms->mode.vdisplay,
+				  fmt, yuv) < 0)
+			break;
+	for (int i = 0; need_huge && i < got; i++)
+		if (!bufs[i].huge)
+			usable = false; /* Fell back to base pages */
+
+	if (got == n && usable) {
+		/* One untimed frame each: threads started, caches warm */
+		for (int i = 0; i < n; i++)
+			draw_frame(&bufs[i], &anim, buffer_colors[i], NULL);
+
+		double t0 = render_pool_now_ms();
+		for (int f = 0; f < UDMABUF_BENCH_FRAMES; f++) {
+			draw_frame(&bufs[f % n], &anim, buffer_colors[f % n],
+				   NULL);
+			update_animation(&anim, (int)bufs[0].width);
+		}
+		ms = (render_pool_now_ms() - t0) / UDMABUF_BENCH_FRAMES;
+	}
+	for (int i = 0; i < got; i++)
+		dmabuf_destroy(&bufs[i], kms->display_fd);
+	return ms;
+}
+
+static void run_udmabuf_bench(struct kms_state *kms, int fd_producer, int n,
+			      const struct pixel_format *fmt,
+			      const struct yuv_format *yuv)
+{
+	static const char *const names[] = {
+		"dumb (WC map)", "udmabuf", "udmabuf hugetlb",
+	};
+	uint32_t frame_bytes;
+	double ms[3];
+
+	printf("\n[UDMABUF BENCH] %d x %ux%u %s, %d frames each\n", n,
+	       kms->mode.hdisplay, kms->mode.vdisplay,
+	       yuv ? yuv->name : fmt->name, UDMABUF_BENCH_FRAMES);
+	if (udmabuf.fd < 0 && udmabuf_open(&udmabuf, false) < 0)
+		return;
+
+	ms[0] = udmabuf_bench_pass(kms, fd_producer, n, fmt, yuv, false);
+	udmabuf.hugetlb = false;
+	ms[1] = udmabuf_bench_pass(kms, -1, n, fmt, yuv, false);
+	udmabuf.hugetlb = true;
+	ms[2] = udmabuf_bench_pass(kms, -1, n, fmt, yuv, true);
+
+	/* Bytes the producer writes per frame, padding excluded */
+	frame_bytes = yuv ? kms->mode.hdisplay * (kms->mode.vdisplay +
+				kms->mode.vdisplay / yuv->vsub)
+			  : kms->mode.hdisplay * kms->mode.vdisplay * fmt->cpp;
+
+	printf("  %-18s %12s %10s\n", "", "render", "fill");
+	for (int i = 0; i < 3; i++) {
+		if (ms[i] < 0) {
+			printf("  %-18s %12s\n", names[i], "unavailable");
+			continue;
+		}
+		printf("  %-18s %7.2f ms/f %6.2f GB/s\n", names[i], ms[i],
+		       frame_bytes / (ms[i] * 1e6));
+	}
+	printf("  (hugetlb: %llu KiB pages, needs vm.nr_hugepages reserved)\n",
+	       (unsigned long long)(udmabuf.huge_page / 1024));
+}
+
+/* ============================================================
+ * plane_supports_format - same check as drm-atomic-demo.c; matters
+ * most for NV12/NV16, which only some VOP2 windows can fetch.
+ * ============================================================ */
+static bool plane_supports_format(int fd, uint32_t plane_id, uint32_t fourcc)
+{
+	drmModePlane *plane = drmModeGetPlane(fd, plane_id);
+	bool found = false;
+
+	if (!plane)
+		return false;
+	for (uint32_t i = 0; i < plane->count_formats && !found; i++)
+		found = plane->formats[i] == fourcc;
+	drmModeFreePlane(plane);
+	return found;
 }
 
 /* ============================================================
@@ -760,12 +1723,11 @@ static int find_active_primary_plane(int fd, uint32_t crtc_id,
 
 		uint64_t type = 0, curr_crtc = 0;
 		for (uint32_t p = 0; p < props->count_props; p++) {
-			drmModePropertyRes *pr =
-				drmModeGetProperty(fd, props->props[p]);
+			const struct prop_info *pr =
+				prop_index_get(&prop_index, props->props[p]);
 			if (!pr) continue;
 			if (strcmp(pr->name, "type")    == 0) type      = props->prop_values[p];
 			if (strcmp(pr->name, "CRTC_ID") == 0) curr_crtc = props->prop_values[p];
-			drmModeFreeProperty(pr);
 		}
 		drmModeFreeObjectProperties(props);
 
@@ -788,18 +1750,76 @@ static int find_active_primary_plane(int fd, uint32_t crtc_id,
  * ============================================================ */
 int main(int argc, char **argv)
 {
-	int mode = 0; /* 0=dmabuf+implicit fence, 1=nosync, 2=explicit fence */
+	/* 0=dmabuf+implicit fence, 1=nosync, 2=explicit fence, 3=ipc,
+	 * 4=ipc ceiling */
+	int mode = 0;
+
+	if (argc > 1 && strcmp(argv[1], "--nosync") == 0)      mode = 1;
+	if (argc > 1 && strcmp(argv[1], "--fence")  == 0)      mode = 2;
+	if (argc > 1 && strcmp(argv[1], "--ipc")    == 0)      mode = 3;
+	if (argc > 1 && strcmp(argv[1], "--ipc-ceiling") == 0) mode = 4;
+
+	int nbufs = MAX_BUFFERS;
+	bool threaded = false;
+	bool warmup = true;
+	bool use_udmabuf = false, hugetlb = false, bench_udmabuf = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--threaded") == 0)
+			threaded = true;
+		if (strcmp(argv[i], "--no-warmup") == 0)
+			warmup = false;
+		if (strcmp(argv[i], "--udmabuf") == 0)
+			use_udmabuf = true;
+		if (strcmp(argv[i], "--hugetlb") == 0)
+			hugetlb = true;
+		if (strcmp(argv[i], "--bench-udmabuf") == 0)
+			bench_udmabuf = true;
+	}
+	if ((threaded && mode == 0) || mode >= 3)
+		nbufs = FRAME_PIPELINE_DEPTH;
+
+	/* NV12/NV16 are produced from an XRGB8888 staging frame */
+	const struct yuv_format *yuv = yuv_format_parse(argc, argv);
+	const struct pixel_format *fmt = yuv ? PIXEL_FORMAT_DEFAULT
+					     : pixel_format_parse(argc, argv);
+	if (!fmt)
+		return -1;
 
-	if (argc > 1 && strcmp(argv[1], "--nosync") == 0) mode = 1;
-	if (argc > 1 && strcmp(argv[1], "--fence")  == 0) mode = 2;
+	if (argc > 1 && strcmp(argv[1], "--selftest") == 0) {
+		printf("RGB -> YUV kernels vs scalar reference:\n");
+		return yuv_convert_selftest() ? 1 : 0;
+	}
+	if (mode >= 3 && yuv) {
+		fprintf(stderr, "--ipc renders RGB formats only\n");
+		return -1;
+	}
 
 	printf("DRM DMA-BUF and Fence Synchronization Demo\n");
 	printf("  %s            -> DMA-BUF sharing + implicit fence (SYNC ioctl)\n",
 	       argv[0]);
 	printf("  %s --nosync   -> No fence (demonstrates why SYNC matters)\n",
 	       argv[0]);
-	printf("  %s --fence    -> Explicit fence via IN_FENCE_FD / OUT_FENCE_PTR\n\n",
+	printf("  %s --fence    -> Explicit fence via IN_FENCE_FD / OUT_FENCE_PTR\n",
+	       argv[0]);
+	printf("  %s --ipc      -> Producer process, buffers over SCM_RIGHTS\n",
+	       argv[0]);
+	printf("  %s --ipc-ceiling -> Producer process throughput, 1080p/4K\n",
 	       argv[0]);
+	printf("  %s --selftest -> verify SIMD RGB -> YUV kernels\n", argv[0]);
+	printf("  add --threads N to render with N threads\n");
+	printf("  add --threaded to produce on a separate thread (default mode)\n");
+	printf("  add --no-warmup to skip rendering and testing every buffer once\n");
+	printf("  add --udmabuf to back buffers with memfd memory (--hugetlb: huge pages)\n");
+	printf("  add --bench-udmabuf to compare rendering into dumb and udmabuf buffers\n");
+	printf("  add --frames N to stop after N frames (default: Ctrl+C)\n");
+	printf("  add --stats-csv F / --stats-json F to save frame timing\n");
+	printf("  add --format F (XRGB8888 ARGB8888 RGB565 XRGB2101010 BGR888\n");
+	printf("                  NV12 NV16)\n\n");
+
+	/* Before any DRM fd or thread exists, see start_producer() */
+	int ipc_sock = -1;
+	if (mode >= 3 && (ipc_sock = start_producer(argc, argv)) < 0)
+		return -1;
 
 	struct kms_state kms = {0};
 
@@ -811,6 +1831,7 @@ int main(int argc, char **argv)
 	 */
 	kms.display_fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
 	if (kms.display_fd < 0) { perror("open card0 (display)"); return -1; }
+	prop_index_init(&prop_index, kms.display_fd);
 
 	int fd_producer = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
 	if (fd_producer < 0) { perror("open card0 (producer)"); return -1; }
@@ -819,6 +1840,16 @@ int main(int argc, char **argv)
 	printf("  display_fd=%d  (KMS / atomic commit)\n", kms.display_fd);
 	printf("  fd_producer=%d (buffer producer / writer)\n\n", fd_producer);
 
+	/* A producer without a DRM device: its buffers come from udmabuf */
+	int producer = fd_producer;
+	if (use_udmabuf) {
+		if (udmabuf_open(&udmabuf, hugetlb) < 0)
+			return -1;
+		producer = -1;
+		printf("Producer buffers: memfd + /dev/udmabuf%s\n\n",
+		       hugetlb ? " (hugetlb)" : "");
+	}
+
 	if (drmSetClientCap(kms.display_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
 	    drmSetClientCap(kms.display_fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
 		fprintf(stderr, "Atomic/universal planes not supported\n");
@@ -828,6 +1859,15 @@ int main(int argc, char **argv)
 	drmModeRes *res = drmModeGetResources(kms.display_fd);
 	if (!res) return -1;
 
+	/* Blocks SIGINT/SIGTERM, so it must precede any thread creation */
+	if (event_loop_init(&events) < 0 ||
+	    event_loop_add_drm(&events, kms.display_fd, &ev_ctx) < 0)
+		return -1;
+	atomic_req_init(&flip_req);
+	render_pool_init(&pool, render_pool_parse_threads(argc, argv));
+	telemetry_init(&telemetry, argc, argv);
+	printf("Rendering with %d thread(s)\n", pool.nthreads);
+
 	/* Find connected connector */
 	drmModeConnector *conn = NULL;
 	for (int i = 0; i < res->count_connectors; i++) {
@@ -869,7 +1909,27 @@ int main(int argc, char **argv)
 		fprintf(stderr, "No primary plane found\n");
 		return -1;
 	}
-	printf("Primary plane id=%u\n\n", kms.plane_id);
+	printf("Primary plane id=%u\n", kms.plane_id);
+
+	uint32_t fourcc = yuv ? yuv->fourcc : fmt->fourcc;
+	if (!plane_supports_format(kms.display_fd, kms.plane_id, fourcc)) {
+		fprintf(stderr, "Primary plane %u cannot scan out %s\n",
+			kms.plane_id, yuv ? yuv->name : fmt->name);
+		return -1;
+	}
+	if (yuv) {
+		if ((kms.mode.hdisplay % yuv->hsub) ||
+		    (kms.mode.vdisplay % yuv->vsub)) {
+			fprintf(stderr, "%s needs even dimensions\n", yuv->name);
+			return -1;
+		}
+		if (shadow_buffer_init(&staging, kms.mode.hdisplay,
+				       kms.mode.vdisplay, 4) < 0)
+			return -1;
+		printf("Producer format %s, converted from XRGB8888 (kernel=%s)\n",
+		       yuv->name, yuv_convert_select()->name);
+	}
+	printf("\n");
 
 	/* Cache property IDs */
 	if (cache_connector_props(kms.display_fd, kms.conn_id, &kms.conn_props) ||
@@ -878,22 +1938,37 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Failed to cache property IDs\n");
 		return -1;
 	}
+	prop_index_report(&prop_index, "startup");
 
 	/*
 	 * Allocate DMA-BUF backed framebuffers.
-	 * Each buffer is created on fd_producer and imported on display_fd,
-	 * demonstrating the full zero-copy sharing path.
+	 * Each buffer is created on fd_producer (with --udmabuf: in a memfd)
+	 * and imported on display_fd, demonstrating the full zero-copy sharing path.
 	 */
 	printf("=== DMA-BUF Buffer Allocation ===\n");
-	struct dmabuf_buffer bufs[MAX_BUFFERS] = {0};
-	for (int i = 0; i < MAX_BUFFERS; i++) {
+	struct dmabuf_buffer bufs[FRAME_PIPELINE_DEPTH] = {0};
+	for (int i = 0; i < nbufs; i++) {
 		printf("Buffer [%d]:\n", i);
-		if (dmabuf_create(&bufs[i], kms.display_fd, fd_producer,
-				  kms.mode.hdisplay, kms.mode.vdisplay) < 0) {
+		if (dmabuf_create(&bufs[i], kms.display_fd, producer,
+				  kms.mode.hdisplay, kms.mode.vdisplay,
+				  fmt, yuv) < 0) {
 			fprintf(stderr, "Failed to create DMA-BUF buffer %d\n", i);
 			return -1;
 		}
-		memset(bufs[i].producer_vaddr, 0x20, bufs[i].producer_size);
+	}
+
+	/*
+	 * No clear of the rest: new buffers are zeroed by the kernel, and
+	 * each buffer's first frame repaints it in full.  Touching them
+	 * here would fault every page in on this thread, ahead of
+	 * warm_up().  Zero is green in YUV, so the buffer the modeset
+	 * scans out is cleared to black (BT.601 limited range: Y=16,
+	 * Cb=Cr=128) -- the only pages taken before warm_up().
+	 */
+	if (yuv) {
+		memset(bufs[0].producer_vaddr, 16, bufs[0].chroma_offset);
+		memset(bufs[0].producer_vaddr + bufs[0].chroma_offset, 128,
+		       bufs[0].producer_size - bufs[0].chroma_offset);
 	}
 
 	printf("\n=== Memory Sharing Verification ===\n");
@@ -909,23 +1984,46 @@ int main(int argc, char **argv)
 	/* Initial modeset */
 	if (atomic_modeset(&kms, bufs[0].fb_id) < 0)
 		return -1;
+	if (warmup && mode < 3 && !bench_udmabuf)
+		warm_up(&kms, bufs, nbufs);
 
 	/* Run selected mode */
-	if (mode == 0)
+	if (bench_udmabuf)
+		run_udmabuf_bench(&kms, fd_producer, nbufs, fmt, yuv);
+	else if (mode == 0 && threaded)
+		run_threaded_dmabuf_demo(&kms, bufs, nbufs);
+	else if (mode == 0)
 		run_dmabuf_demo(&kms, bufs);
 	else if (mode == 1)
 		run_nosync_demo(&kms, &bufs[0]);
-	else
+	else if (mode == 2)
 		run_explicit_fence_demo(&kms, bufs);
+	else if (mode == 3)
+		run_ipc_demo(&kms, bufs, nbufs, ipc_sock);
+	else
+		run_ipc_ceiling(&kms, producer, fmt, ipc_sock);
+
+	telemetry_finish(&telemetry);
+	atomic_req_report(&flip_req);
 
 	/* Cleanup */
 	if (kms.mode_blob_id)
 		drmModeDestroyPropertyBlob(kms.display_fd, kms.mode_blob_id);
-	for (int i = 0; i < MAX_BUFFERS; i++)
+	for (int i = 0; i < nbufs; i++)
 		dmabuf_destroy(&bufs[i], kms.display_fd);
 	drmModeFreeConnector(conn);
 	drmModeFreeResources(res);
 	close(fd_producer);
+	udmabuf_close(&udmabuf);
+	if (ipc_sock >= 0) {
+		/* EOF on the socket ends the producer */
+		close(ipc_sock);
+		waitpid(producer_pid, NULL, 0);
+	}
+	event_loop_destroy(&events);
+	prop_index_destroy(&prop_index);
 	close(kms.display_fd);
+	shadow_buffer_free(&staging);
+	render_pool_destroy(&pool);
 	return 0;
 }
@@ -7,13 +7,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <sys/select.h>
 #include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
-#define MAX_BUFFERS 2
+#include "damage.h"
+#include "event-loop.h"
+#include "frame-pipeline.h"
+#include "frame-sched.h"
+#include "frame-telemetry.h"
+#include "pixel-format.h"
+#include "render-pool.h"
+#include "shadow-buffer.h"
+#include "span-fill.h"
+
+#define MAX_BUFFERS 2 /* FRAME_PIPELINE_DEPTH with --threaded */
+
+#define BAR_STEP   8      /* Pixels per frame, fixed-step animation   */
+#define BAR_SPEED  480.0  /* Pixels per second with --deadline (8@60) */
 
 /*
  * animation_state - Tracks the position and direction of the moving bar.
@@ -24,9 +36,12 @@
  */
 struct animation_state {
 	int bar_x;       /* Current X position of the leading edge */
+	int prev_bar_x;  /* Position before the last update         */
 	int bar_width;   /* Width of the bar in pixels              */
 	int direction;   /* +1 = moving right, -1 = moving left     */
 	int frame_count; /* Total frames rendered so far            */
+	double time_ms;  /* Presentation time of the current frame  */
+	double frac;     /* Sub-pixel motion carried to next frame  */
 };
 
 struct buffer_object {
@@ -37,6 +52,7 @@ struct buffer_object {
 	uint32_t size;   /* Total buffer size in bytes                */
 	uint8_t  *vaddr; /* CPU-accessible mapping via mmap()         */
 	uint32_t fb_id;  /* DRM framebuffer ID registered with KMS    */
+	const struct pixel_format *fmt; /* Scanout format (--format)  */
 };
 
 /*
@@ -48,44 +64,84 @@ struct buffer_object {
  */
 struct flip_pending {
 	bool waiting;
+	struct frame_sched *sched; /* --deadline: fed every flip event */
 };
 
+/* Band renderer shared by every mode; sized by --threads (default 1) */
+static struct render_pool pool;
+
+/* Cached copy of the current frame, allocated only with --shadow */
+static struct shadow_buffer shadow;
+
+/* Per-frame timing histograms, printed when a display mode exits */
+static struct frame_telemetry telemetry;
+
+/* DRM fd, timers and Ctrl+C; every wait goes through it */
+static struct event_loop events;
+
+/* Until Ctrl+C or --frames N */
+static bool keep_running(void)
+{
+	return !events.quit && !telemetry_done(&telemetry);
+}
+
 /* ============================================================
  * draw_moving_bar - Renders a white vertical bar on a dark background.
- * @bo:   The buffer object to draw into.
- * @anim: Current animation state describing bar position.
+ * @bo:     The buffer object to draw into.
+ * @anim:   Current animation state describing bar position.
+ * @region: Rectangles to repaint, or NULL for the whole buffer.
  *
  * When tearing occurs, the scanout hardware is reading from this buffer
  * mid-update.  The horizontal discontinuity in the bar's position between
  * the upper and lower halves of the screen is what makes tearing visible.
+ *
+ * Each row is background / bar / background, so the frame is drawn as
+ * three solid spans per row by the writer for bo->fmt (pixel-format.h)
+ * instead of a per-pixel range compare.  Colours are packed into the
+ * scanout format once per frame.
  * ============================================================ */
 static void draw_moving_bar(struct buffer_object *bo,
-			    struct animation_state *anim)
+			    struct animation_state *anim,
+			    const struct damage_region *region)
 {
-	uint32_t *pixel    = (uint32_t *)bo->vaddr;
-	uint32_t bg_color  = 0x202020; /* Dark grey background */
-	uint32_t bar_color = 0xffffff; /* White moving bar     */
-
-	for (uint32_t y = 0; y < bo->height; y++) {
-		for (uint32_t x = 0; x < bo->width; x++) {
-			uint32_t offset = y * (bo->pitch / 4) + x;
-			if ((int)x >= anim->bar_x &&
-			    (int)x <  anim->bar_x + anim->bar_width)
-				pixel[offset] = bar_color;
-			else
-				pixel[offset] = bg_color;
-		}
+	struct damage_region full;
+	struct pixel_bar_job job = {
+		.fmt       = bo->fmt,
+		.base      = bo->vaddr,
+		.pitch     = bo->pitch,
+		.bar_x     = anim->bar_x,
+		.bar_width = anim->bar_width,
+		.bar_color = bo->fmt->pack(0xffffff), /* White moving bar */
+		.bg_color  = bo->fmt->pack(0x202020), /* Dark grey        */
+	};
+
+	if (!region) {
+		damage_region_full(&full, (int32_t)bo->width,
+				   (int32_t)bo->height);
+		region = &full;
+	}
+
+	/*
+	 * Each rectangle is split into horizontal bands across the worker
+	 * pool.  render_pool_run() returns only when all bands are done,
+	 * so the buffer is complete before the caller flips to it.
+	 */
+	for (uint32_t i = 0; i < region->count; i++) {
+		const struct damage_rect *r = &region->rects[i];
+
+		job.xa = (uint32_t)r->x1;
+		job.xb = (uint32_t)r->x2;
+		render_pool_run(&pool, pixel_bar_band, &job,
+				(uint32_t)r->y1, (uint32_t)r->y2, bo->pitch,
+				(job.xb - job.xa) * bo->fmt->cpp);
 	}
 }
 
-/* ============================================================
- * update_animation - Advances the bar position by one frame.
- * @anim:         Current animation state (modified in-place).
- * @screen_width: Horizontal resolution used for bounce detection.
- * ============================================================ */
-static void update_animation(struct animation_state *anim, int screen_width)
+/* Move the bar @step pixels in its direction, bouncing at the edges */
+static void move_bar(struct animation_state *anim, int screen_width, int step)
 {
-	anim->bar_x += anim->direction * 8; /* 8-pixel step per frame */
+	anim->prev_bar_x = anim->bar_x;
+	anim->bar_x += anim->direction * step;
 
 	if (anim->bar_x + anim->bar_width >= screen_width) {
 		anim->bar_x = screen_width - anim->bar_width;
@@ -97,14 +153,100 @@ static void update_animation(struct animation_state *anim, int screen_width)
 	anim->frame_count++;
 }
 
+/* ============================================================
+ * update_animation - Advances the bar position by one frame.
+ * @anim:         Current animation state (modified in-place).
+ * @screen_width: Horizontal resolution used for bounce detection.
+ * ============================================================ */
+static void update_animation(struct animation_state *anim, int screen_width)
+{
+	move_bar(anim, screen_width, BAR_STEP);
+}
+
+/* ============================================================
+ * update_animation_at - Advances the bar to presentation time @t_ms.
+ *
+ * The step is BAR_SPEED times the time since the previous frame's
+ * presentation, so a frame that misses its vblank shows the bar where
+ * it should be by then instead of one fixed step further.
+ * ============================================================ */
+static void update_animation_at(struct animation_state *anim,
+				int screen_width, double t_ms)
+{
+	double px = anim->frac;
+
+	if (anim->time_ms)
+		px += BAR_SPEED * (t_ms - anim->time_ms) / 1e3;
+	anim->time_ms = t_ms;
+	anim->frac = px - (int)px;
+	move_bar(anim, screen_width, (int)px);
+}
+
+/* The shadow buffer seen as a render target for draw_moving_bar() */
+static struct buffer_object shadow_target(const struct pixel_format *fmt)
+{
+	return (struct buffer_object){
+		.fmt    = fmt,
+		.width  = shadow.width,
+		.height = shadow.height,
+		.pitch  = shadow.pitch,
+		.size   = (uint32_t)shadow.size,
+		.vaddr  = shadow.pixels,
+	};
+}
+
+/* ============================================================
+ * render_frame - Bring buffer @idx up to date for the current frame.
+ * @dt:   Damage tracker shared by all buffers of the swap set.
+ * @bufs: The swap set.
+ * @idx:  Index of the back buffer about to be displayed.
+ * @anim: Animation state; prev_bar_x -> bar_x is this frame's motion.
+ *
+ * Records the two column strips the bar left and entered as this
+ * frame's damage, then repaints only what bufs[idx] missed since it
+ * was last drawn (its buffer age).  With two buffers that is the last
+ * two frames' strips: ~35k pixels per frame at 1080p instead of ~2M.
+ *
+ * With --shadow the scene is drawn into the cached shadow instead
+ * (this frame's damage only, since the shadow is always current) and
+ * the buffer's repaint region is streamed out of it into the mapping,
+ * so the write-combined buffer only ever sees full-row sequential
+ * stores.  See shadow-buffer.h.
+ * ============================================================ */
+static void render_frame(struct damage_tracker *dt,
+			 struct buffer_object *bufs, int idx,
+			 struct animation_state *anim)
+{
+	struct damage_region *frame = damage_begin_frame(dt);
+
+	damage_add_column_move(frame, anim->prev_bar_x, anim->bar_x,
+			       anim->bar_width, dt->width, dt->height);
+
+	if (!shadow.pixels) {
+		draw_moving_bar(&bufs[idx], anim,
+				damage_buffer_repaint(dt, idx));
+	} else {
+		struct buffer_object target = shadow_target(bufs[idx].fmt);
+
+		draw_moving_bar(&target, anim, shadow.valid ? frame : NULL);
+		shadow.valid = true;
+		shadow_buffer_flush(&pool, &shadow, bufs[idx].vaddr,
+				    bufs[idx].pitch,
+				    damage_buffer_repaint(dt, idx),
+				    shadow_copy_select());
+	}
+	damage_report(dt, 300);
+}
+
 static int modeset_create_fb(int fd, struct buffer_object *bo)
 {
 	struct drm_mode_create_dumb create = {
 		.width  = bo->width,
 		.height = bo->height,
-		.bpp    = 32,
+		.bpp    = bo->fmt->cpp * 8,
 	};
 	struct drm_mode_map_dumb map = {0};
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
 
 	/*
 	 * DRM_IOCTL_MODE_CREATE_DUMB allocates a GEM buffer object in the
@@ -119,13 +261,19 @@ static int modeset_create_fb(int fd, struct buffer_object *bo)
 	bo->handle = create.handle;
 
 	/*
-	 * drmModeAddFB() registers the GEM buffer as a KMS framebuffer,
+	 * drmModeAddFB2() registers the GEM buffer as a KMS framebuffer,
 	 * associating pixel format metadata so the display engine knows
-	 * how to interpret the raw memory during scanout.
+	 * how to interpret the raw memory during scanout.  Unlike the
+	 * legacy depth/bpp pair of drmModeAddFB(), the fourcc names the
+	 * exact channel layout, which is what RGB565 or 10-bit need.
 	 */
-	if (drmModeAddFB(fd, bo->width, bo->height, 24, 32,
-			 bo->pitch, bo->handle, &bo->fb_id))
+	handles[0] = bo->handle;
+	pitches[0] = bo->pitch;
+	if (drmModeAddFB2(fd, bo->width, bo->height, bo->fmt->fourcc,
+			  handles, pitches, offsets, &bo->fb_id, 0)) {
+		perror("drmModeAddFB2");
 		return -1;
+	}
 
 	/*
 	 * DRM_IOCTL_MODE_MAP_DUMB returns a fake offset suitable for mmap().
@@ -153,6 +301,13 @@ static void modeset_destroy_fb(int fd, struct buffer_object *bo)
 	drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
 }
 
+/* Swap timer tick: lets the tearing loop go on to the next frame */
+static void tick_handler(struct event_loop *loop, int fd, void *ctx)
+{
+	*(bool *)ctx = false;
+	(void)loop; (void)fd;
+}
+
 /* ============================================================
  * run_tearing_demo - Deliberately induces screen tearing.
  *
@@ -175,15 +330,30 @@ static void run_tearing_demo(int fd, uint32_t crtc_id, uint32_t conn_id,
 		.frame_count = 0,
 	};
 	int cur = 0;
+	bool tick_pending;
+	struct damage_tracker dt;
+
+	damage_tracker_init(&dt, bufs[0].width, bufs[0].height);
+
+	/*
+	 * Swap every 2 ms -- much shorter than a 60 Hz vblank interval
+	 * (~16.67 ms) -- so buffer swaps frequently race the scanout.
+	 */
+	int timer = event_loop_add_timer(&events, 2.0, tick_handler,
+					 &tick_pending);
+	if (timer < 0)
+		return;
 
 	printf("\n[TEARING MODE] Running without vblank sync - Ctrl+C to stop\n");
 	printf("Watch the white bar for a horizontal split/offset (the tear line)\n\n");
 
-	while (1) {
+	while (keep_running()) {
 		int back = 1 - cur;
 
-		draw_moving_bar(&bufs[back], &anim);
+		telemetry_begin(&telemetry, TEL_RENDER);
+		render_frame(&dt, bufs, back, &anim);
 		update_animation(&anim, (int)bufs[back].width);
+		telemetry_end(&telemetry, TEL_RENDER);
 
 		/*
 		 * SetCrtc reconfigures the CRTC immediately with no regard for
@@ -192,20 +362,24 @@ static void run_tearing_demo(int fd, uint32_t crtc_id, uint32_t conn_id,
 		 * show the new buffer while the upper portion already showed
 		 * the old one -- the definition of a torn frame.
 		 */
+		telemetry_begin(&telemetry, TEL_COMMIT);
 		if (drmModeSetCrtc(fd, crtc_id, bufs[back].fb_id,
 				   0, 0, &conn_id, 1, mode)) {
 			perror("drmModeSetCrtc");
 			break;
 		}
+		telemetry_end(&telemetry, TEL_COMMIT);
+		telemetry_frame(&telemetry);
 
 		cur = back;
 
-		/*
-		 * Sleep for 2 ms -- much shorter than a 60 Hz vblank interval
-		 * (~16.67 ms) -- so buffer swaps frequently race the scanout.
-		 */
-		usleep(2000);
+		tick_pending = true;
+		if (event_loop_wait(&events, &tick_pending, 1000) < 0) {
+			perror("Waiting for the swap timer");
+			break;
+		}
 	}
+	event_loop_remove(&events, timer);
 }
 
 /* ============================================================
@@ -231,13 +405,25 @@ static void page_flip_handler(int fd, unsigned int sequence,
 	 * 'sequence' increments once per vblank.  Comparing it across calls
 	 * lets you detect dropped frames (sequence delta > 1 means a vblank
 	 * was missed and the frame rate has fallen below the refresh rate).
+	 * With --deadline the scheduler uses it, and the timestamp, to
+	 * predict the next vblank.
 	 */
+	if (pending->sched)
+		frame_sched_vblank(pending->sched, sequence, tv_sec, tv_usec);
+	telemetry_flip(&telemetry, sequence);
 	(void)fd;
-	(void)sequence;
-	(void)tv_sec;
-	(void)tv_usec;
 }
 
+/*
+ * Our callback in the DRM event dispatch table.  drmHandleEvent(),
+ * called from the event loop, reads from the DRM fd and routes each
+ * event to the appropriate handler based on the event type field.
+ */
+static drmEventContext ev_ctx = {
+	.version           = DRM_EVENT_CONTEXT_VERSION,
+	.page_flip_handler = page_flip_handler,
+};
+
 /* ============================================================
  * run_pageflip_demo - Correct double-buffering with vblank synchronization.
  *
@@ -255,10 +441,15 @@ static void page_flip_handler(int fd, unsigned int sequence,
  *              -> drm_crtc_handle_vblank()
  *                 -> plane scanout address updated in hardware
  *                    -> DRM_EVENT_FLIP_COMPLETE sent to fd
+ *
+ * With @sched (--deadline) rendering does not start right after the
+ * flip event but as late as the measured render time allows, and the
+ * bar is placed for the predicted vblank; see frame-sched.h.
  * ============================================================ */
 static void run_pageflip_demo(int fd, uint32_t crtc_id, uint32_t conn_id,
 			      drmModeModeInfo *mode,
-			      struct buffer_object bufs[MAX_BUFFERS])
+			      struct buffer_object bufs[MAX_BUFFERS],
+			      struct frame_sched *sched)
 {
 	struct animation_state anim = {
 		.bar_x      = 0,
@@ -267,17 +458,10 @@ static void run_pageflip_demo(int fd, uint32_t crtc_id, uint32_t conn_id,
 		.frame_count = 0,
 	};
 	int cur = 0;
-	struct flip_pending pending = { .waiting = false };
+	struct flip_pending pending = { .waiting = false, .sched = sched };
+	struct damage_tracker dt;
 
-	/*
-	 * Register our callback with the DRM event dispatch table.
-	 * drmHandleEvent() reads from the DRM fd and routes each event
-	 * to the appropriate handler based on the event type field.
-	 */
-	drmEventContext ev_ctx = {
-		.version           = DRM_EVENT_CONTEXT_VERSION,
-		.page_flip_handler = page_flip_handler,
-	};
+	damage_tracker_init(&dt, bufs[0].width, bufs[0].height);
 
 	/* Display the first buffer before entering the flip loop. */
 	if (drmModeSetCrtc(fd, crtc_id, bufs[cur].fb_id,
@@ -289,13 +473,23 @@ static void run_pageflip_demo(int fd, uint32_t crtc_id, uint32_t conn_id,
 	printf("\n[PAGE FLIP MODE] vblank-synchronized - Ctrl+C to stop\n");
 	printf("The white bar should move perfectly smoothly with no visible tear\n\n");
 
-	while (1) {
+	while (keep_running()) {
 		int back = 1 - cur;
 
 		/* Render the next frame into the back buffer while the
-		 * front buffer is safely being scanned out by hardware. */
-		draw_moving_bar(&bufs[back], &anim);
-		update_animation(&anim, (int)bufs[back].width);
+		 * front buffer is safely being scanned out by hardware.
+		 * Only the strips that differ from what the back buffer
+		 * already holds are repainted. */
+		if (sched)
+			update_animation_at(&anim, (int)bufs[back].width,
+					    frame_sched_begin(sched));
+		telemetry_begin(&telemetry, TEL_RENDER);
+		render_frame(&dt, bufs, back, &anim);
+		telemetry_end(&telemetry, TEL_RENDER);
+		if (sched)
+			frame_sched_end(sched);
+		else
+			update_animation(&anim, (int)bufs[back].width);
 
 		/*
 		 * Queue the flip.  DRM_MODE_PAGE_FLIP_EVENT requests a
@@ -306,43 +500,100 @@ static void run_pageflip_demo(int fd, uint32_t crtc_id, uint32_t conn_id,
 		 * already pending, so we must wait for the event before
 		 * calling this again.
 		 */
+		telemetry_begin(&telemetry, TEL_COMMIT);
 		if (drmModePageFlip(fd, crtc_id, bufs[back].fb_id,
 				    DRM_MODE_PAGE_FLIP_EVENT, &pending)) {
 			perror("drmModePageFlip");
 			break;
 		}
+		telemetry_end(&telemetry, TEL_COMMIT);
 		pending.waiting = true;
 
 		/*
-		 * Block on select() until the DRM fd becomes readable,
-		 * which happens when the kernel posts the flip-complete event.
-		 * This yields the CPU during the vblank wait instead of
-		 * spinning, keeping system load low.
+		 * Sleep in the event loop until the DRM fd becomes readable,
+		 * which happens when the kernel posts the flip-complete event,
+		 * and let it run page_flip_handler().  This yields the CPU
+		 * during the vblank wait instead of spinning, keeping system
+		 * load low.  Ctrl+C only ends the loop once this flip landed.
 		 */
-		while (pending.waiting) {
-			fd_set fds;
-			FD_ZERO(&fds);
-			FD_SET(fd, &fds);
+		if (event_loop_wait(&events, &pending.waiting, 1000) < 0) {
+			fprintf(stderr, "No vblank event: %s\n", strerror(errno));
+			return;
+		}
+		if (sched)
+			frame_sched_report(sched, 300);
 
-			struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
-			int ret = select(fd + 1, &fds, NULL, NULL, &timeout);
+		cur = back;
+	}
+}
 
-			if (ret < 0) {
-				perror("select");
-				return;
-			}
-			if (ret == 0) {
-				fprintf(stderr,
-					"Timeout: no vblank event within 1s\n");
-				return;
-			}
+/* ============================================================
+ * run_threaded_pageflip - --pageflip with a separate render thread.
+ *
+ * In run_pageflip_demo() the next frame is only started after the
+ * flip event, so rendering plus drmModePageFlip() must fit in what is
+ * left of the vblank interval.  Here a render thread keeps drawing
+ * into free buffers while this thread queues the newest finished one
+ * and sleeps in the event loop; see frame-pipeline.h.
+ * ============================================================ */
+struct threaded_flip {
+	int                    fd;
+	uint32_t               crtc_id;
+	struct buffer_object  *bufs;
+	struct flip_pending   *pending;
+	struct damage_tracker  dt;   /* Render thread only */
+	struct animation_state anim; /* Render thread only */
+};
 
-			/* Parse the event and invoke page_flip_handler(). */
-			drmHandleEvent(fd, &ev_ctx);
-		}
+static uint64_t threaded_render(void *ctx, int idx)
+{
+	struct threaded_flip *t = ctx;
 
-		cur = back;
+	render_frame(&t->dt, t->bufs, idx, &t->anim);
+	update_animation(&t->anim, (int)t->bufs[idx].width);
+	return t->dt.frame;
+}
+
+static int threaded_commit(void *ctx, int idx)
+{
+	struct threaded_flip *t = ctx;
+
+	return drmModePageFlip(t->fd, t->crtc_id, t->bufs[idx].fb_id,
+			       DRM_MODE_PAGE_FLIP_EVENT, t->pending);
+}
+
+static void run_threaded_pageflip(int fd, uint32_t crtc_id, uint32_t conn_id,
+				  drmModeModeInfo *mode,
+				  struct buffer_object *bufs, int nbufs)
+{
+	struct flip_pending pending = { .waiting = false };
+	struct frame_pipeline fp;
+	struct threaded_flip t = {
+		.fd      = fd,
+		.crtc_id = crtc_id,
+		.bufs    = bufs,
+		.pending = &pending,
+		.anim    = { .bar_width = 80, .direction = 1 },
+	};
+
+	damage_tracker_init(&t.dt, bufs[0].width, bufs[0].height);
+
+	if (drmModeSetCrtc(fd, crtc_id, bufs[0].fb_id,
+			   0, 0, &conn_id, 1, mode)) {
+		perror("initial drmModeSetCrtc");
+		return;
 	}
+
+	printf("\n[PAGE FLIP MODE] render thread + display thread, %d buffers - Ctrl+C to stop\n\n",
+	       nbufs);
+
+	if (frame_pipeline_start(&fp, nbufs, 0, threaded_render, &t,
+				 &telemetry) < 0)
+		return;
+	frame_pipeline_display(&fp, &events, &pending.waiting,
+			       threaded_commit, &t, 0,
+			       1000.0 / (mode->vrefresh ? mode->vrefresh : 60));
+	frame_pipeline_stop(&fp);
 }
 
 /* ============================================================
@@ -380,7 +631,7 @@ static void run_single_buffer_tearing(int fd, uint32_t crtc_id,
     printf("\n[SINGLE BUFFER TEARING] Writing to active scanout buffer\n");
     printf("The tear line moves with the race between CPU write and DMA read\n\n");
 
-    while (1) {
+    while (keep_running()) {
         /*
          * Draw directly into the buffer currently being scanned out.
          * VOP2 reads this memory top-to-bottom at ~60 lines/ms (1080p60).
@@ -388,17 +639,160 @@ static void run_single_buffer_tearing(int fd, uint32_t crtc_id,
          * guaranteeing that some scanlines see the old bar position and
          * others see the new one within the same displayed frame.
          */
-        draw_moving_bar(bo, &anim);
+        telemetry_begin(&telemetry, TEL_RENDER);
+        draw_moving_bar(bo, &anim, NULL);
         update_animation(&anim, (int)bo->width);
+        telemetry_end(&telemetry, TEL_RENDER);
+        telemetry_frame(&telemetry);
 
         /*
          * No sleep here -- maximum write rate keeps the race condition
-         * active and makes the tear line clearly visible.
+         * active and makes the tear line clearly visible.  The
+         * zero-timeout dispatch only picks up Ctrl+C.
          * Optionally add usleep(500) if the artifact moves too fast.
          */
+        event_loop_dispatch(&events, 0);
     }
 }
 
+/* ============================================================
+ * run_thread_scaling_bench - Full-frame render time vs thread count.
+ * @max_threads: Largest pool size to measure.
+ *
+ * Renders the bar scene into a malloc'ed buffer (pitch padded to 64
+ * bytes like VOP2 dumb buffers) at 1080p, 4K and 8K with pools of
+ * 1..max_threads threads, and reports the mean time per frame.  No
+ * DRM device is needed.  Note that real dumb-buffer mappings are often
+ * write-combined, so absolute numbers on the device will differ; the
+ * scaling trend is what this measures.
+ * ============================================================ */
+static int run_thread_scaling_bench(int max_threads,
+				    const struct pixel_format *fmt)
+{
+	static const uint32_t sizes[][2] = {
+		{ 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 },
+	};
+	const int frames = 60;
+
+	printf("Render scaling: full-frame bar, %s, kernel=%s, %d frames each\n",
+	       fmt->name, span_fill_select()->name, frames);
+	printf("  %-10s  %7s  %9s  %7s  %7s\n",
+	       "Resolution", "Threads", "ms/frame", "Speedup", "Stolen");
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		struct buffer_object bo = {
+			.width  = sizes[s][0],
+			.height = sizes[s][1],
+			.pitch  = (sizes[s][0] * fmt->cpp + 63) & ~63u,
+			.fmt    = fmt,
+		};
+		struct animation_state anim = {
+			.bar_x = 0, .bar_width = 80, .direction = 1,
+		};
+		double base_ms = 0;
+
+		bo.size  = bo.pitch * bo.height;
+		bo.vaddr = aligned_alloc(64, bo.size);
+		if (!bo.vaddr) {
+			perror("aligned_alloc");
+			return 1;
+		}
+		memset(bo.vaddr, 0, bo.size); /* Fault pages in up front */
+
+		for (int t = 1; t <= max_threads; t++) {
+			render_pool_init(&pool, t);
+			draw_moving_bar(&bo, &anim, NULL); /* Warm-up */
+
+			double t0 = render_pool_now_ms();
+			for (int f = 0; f < frames; f++) {
+				draw_moving_bar(&bo, &anim, NULL);
+				update_animation(&anim, (int)bo.width);
+			}
+			double ms = (render_pool_now_ms() - t0) / frames;
+
+			if (t == 1)
+				base_ms = ms;
+			printf("  %4ux%-5u  %7d  %9.3f  %6.2fx  %7llu\n",
+			       bo.width, bo.height, pool.nthreads, ms,
+			       base_ms / ms,
+			       (unsigned long long)render_pool_stolen(&pool));
+			render_pool_destroy(&pool);
+		}
+		free(bo.vaddr);
+	}
+	return 0;
+}
+
+/* ============================================================
+ * run_shadow_bench - Scanout write paths on this device's mapping.
+ * @bo: A mapped dumb buffer (not being scanned out).
+ *
+ * Times full-frame redraws three ways:
+ *   direct    span fill straight into the MAP_DUMB mapping
+ *   shadow    span fill into the cached shadow, then copy the frame
+ *             into the mapping with each available copy kernel
+ *             (memcpy and the streaming-store variants)
+ * and reports render and copy time per frame and the write bandwidth
+ * seen by the mapping.  The mapping type (write-combined, uncached,
+ * cached) is up to the driver, which is exactly what this measures.
+ * ============================================================ */
+static void run_shadow_bench(struct buffer_object *bo)
+{
+	const int frames = 120;
+	struct animation_state anim = { .bar_x = 0, .bar_width = 80,
+					.direction = 1 };
+	double mb = (double)bo->width * bo->fmt->cpp * bo->height /
+		    (1024.0 * 1024.0);
+	double t0, t1, t2;
+
+	if (shadow_buffer_init(&shadow, bo->width, bo->height,
+			       bo->fmt->cpp) < 0)
+		return;
+
+	printf("Shadow bench: %ux%u %s, %d frames, %d thread(s), kernel=%s\n",
+	       bo->width, bo->height, bo->fmt->name, frames, pool.nthreads,
+	       span_fill_select()->name);
+	printf("  %-20s  %9s  %9s  %9s  %10s\n",
+	       "Path", "render ms", "copy ms", "total ms", "scanout MB/s");
+
+	draw_moving_bar(bo, &anim, NULL); /* Warm-up / fault in */
+	t0 = render_pool_now_ms();
+	for (int f = 0; f < frames; f++) {
+		draw_moving_bar(bo, &anim, NULL);
+		update_animation(&anim, (int)bo->width);
+	}
+	t1 = (render_pool_now_ms() - t0) / frames;
+	printf("  %-20s  %9.3f  %9s  %9.3f  %10.0f\n",
+	       "direct", t1, "-", t1, mb / (t1 / 1e3));
+
+	for (size_t i = 0; i < SHADOW_COPY_NUM_IMPLS; i++) {
+		const struct shadow_copy_impl *impl = &shadow_copy_impls[i];
+		struct buffer_object target = shadow_target(bo->fmt);
+		char name[32];
+
+		if (!impl->supported())
+			continue;
+
+		t1 = t2 = 0;
+		for (int f = 0; f < frames; f++) {
+			t0 = render_pool_now_ms();
+			draw_moving_bar(&target, &anim, NULL);
+			double mid = render_pool_now_ms();
+			shadow_buffer_flush(&pool, &shadow, bo->vaddr,
+					    bo->pitch, NULL, impl);
+			t2 += render_pool_now_ms() - mid;
+			t1 += mid - t0;
+			update_animation(&anim, (int)bo->width);
+		}
+		t1 /= frames;
+		t2 /= frames;
+		snprintf(name, sizeof(name), "shadow+%s", impl->name);
+		printf("  %-20s  %9.3f  %9.3f  %9.3f  %10.0f\n",
+		       name, t1, t2, t1 + t2, mb / (t2 / 1e3));
+	}
+	shadow_buffer_free(&shadow);
+}
+
 int main(int argc, char **argv)
 {
 	int fd;
@@ -406,23 +800,87 @@ int main(int argc, char **argv)
 	drmModeConnector *conn = NULL;
 	drmModeEncoder   *enc  = NULL;
 	uint32_t conn_id, crtc_id;
-	struct buffer_object bufs[MAX_BUFFERS] = {0};
+	struct buffer_object bufs[FRAME_PIPELINE_DEPTH] = {0};
+	int nbufs = MAX_BUFFERS;
 	int mode_choice = 0; /* 0 = tearing demo, 1 = page-flip demo */
 
 	if (argc > 1 && strcmp(argv[1], "--pageflip")  == 0) mode_choice = 1;
 	if (argc > 1 && strcmp(argv[1], "--singlebuf") == 0) mode_choice = 2;
+	if (argc > 1 && strcmp(argv[1], "--bench-shadow") == 0) mode_choice = 3;
+
+	bool use_shadow = false;
+	bool threaded = false;
+	bool deadline = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--shadow") == 0)
+			use_shadow = true;
+		if (strcmp(argv[i], "--threaded") == 0)
+			threaded = true;
+		if (strcmp(argv[i], "--deadline") == 0)
+			deadline = true;
+	}
+	if (deadline && threaded) {
+		/* The render thread renders ahead; there is no late start */
+		fprintf(stderr, "--deadline cannot be used with --threaded\n");
+		return -1;
+	}
+	if (threaded && mode_choice == 1)
+		nbufs = FRAME_PIPELINE_DEPTH;
+
+	const struct pixel_format *fmt = pixel_format_parse(argc, argv);
+	if (!fmt)
+		return -1;
+
+	/* Kernel verification needs no display: run it before opening card0 */
+	if (argc > 1 && strcmp(argv[1], "--selftest") == 0) {
+		int bad;
+
+		printf("Span-fill kernels vs scalar reference:\n");
+		bad = span_fill_selftest() != 0;
+		printf("Pixel formats vs per-pixel reference:\n");
+		bad += pixel_format_selftest() != 0;
+		return bad ? 1 : 0;
+	}
+	if (argc > 1 && strcmp(argv[1], "--bench-threads") == 0) {
+		int max = render_pool_parse_threads(argc, argv);
+		if (max == 1)
+			max = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		return run_thread_scaling_bench(max > 0 ? max : 1, fmt);
+	}
+
+	/* Blocks SIGINT/SIGTERM, so it must precede any thread creation */
+	if (event_loop_init(&events) < 0)
+		return -1;
+	render_pool_init(&pool, render_pool_parse_threads(argc, argv));
+	telemetry_init(&telemetry, argc, argv);
 
 	printf("DRM Tearing vs Page-Flip Experiment\n");
 	printf("Usage: %s            -> tearing mode (no vblank sync)\n",
 	       argv[0]);
-	printf("Usage: %s --pageflip -> correct vblank-synchronized mode\n\n",
+	printf("Usage: %s --pageflip -> correct vblank-synchronized mode\n",
 	       argv[0]);
+	printf("Usage: %s --selftest -> verify SIMD span-fill kernels\n",
+	       argv[0]);
+	printf("Usage: %s --bench-threads [--threads N] -> render scaling\n",
+	       argv[0]);
+	printf("Usage: %s --bench-shadow -> direct vs shadow scanout writes\n",
+	       argv[0]);
+	printf("       add --threads N to any mode to render with N threads\n");
+	printf("       add --shadow to render via a cached shadow buffer\n");
+	printf("       add --threaded to --pageflip to render on its own thread\n");
+	printf("       add --deadline to --pageflip to render just before vblank\n");
+	printf("       add --frames N to stop after N frames (default: Ctrl+C)\n");
+	printf("       add --stats-csv F / --stats-json F to save frame timing\n");
+	printf("       add --format F (XRGB8888 ARGB8888 RGB565 XRGB2101010 BGR888)\n\n");
+	printf("Rendering with %d thread(s)\n", pool.nthreads);
 
 	fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
 	if (fd < 0) {
 		perror("open /dev/dri/card0");
 		return -1;
 	}
+	if (event_loop_add_drm(&events, fd, &ev_ctx) < 0)
+		return -1;
 
 	res = drmModeGetResources(fd);
 	if (!res) {
@@ -472,12 +930,14 @@ int main(int argc, char **argv)
 
 	printf("Display: %dx%d @ %u Hz\n",
 	       mode.hdisplay, mode.vdisplay, mode.vrefresh);
-	printf("Vblank interval: ~%.2f ms\n\n", 1000.0 / mode.vrefresh);
+	printf("Vblank interval: ~%.2f ms\n", 1000.0 / mode.vrefresh);
+	printf("Scanout format:  %s (%u bytes/pixel)\n\n", fmt->name, fmt->cpp);
 
-	/* Allocate two framebuffers for double-buffering. */
-	for (int i = 0; i < MAX_BUFFERS; i++) {
+	/* Allocate two framebuffers for double-buffering (three threaded). */
+	for (int i = 0; i < nbufs; i++) {
 		bufs[i].width  = mode.hdisplay;
 		bufs[i].height = mode.vdisplay;
+		bufs[i].fmt    = fmt;
 		if (modeset_create_fb(fd, &bufs[i]) < 0) {
 			fprintf(stderr, "Failed to create framebuffer %d\n", i);
 			return -1;
@@ -485,20 +945,46 @@ int main(int argc, char **argv)
 		memset(bufs[i].vaddr, 0x20, bufs[i].size); /* Fill dark grey */
 	}
 
-	if (mode_choice == 0)
+	/*
+	 * The single-buffer demo draws straight into scanout on purpose,
+	 * so the shadow path only applies to the double-buffered modes.
+	 */
+	if (use_shadow && mode_choice < 2) {
+		if (shadow_buffer_init(&shadow, mode.hdisplay,
+				       mode.vdisplay, fmt->cpp) < 0)
+			return -1;
+		printf("Shadow rendering, flush kernel=%s\n",
+		       shadow_copy_select()->name);
+	}
+
+	if (mode_choice == 3)
+		run_shadow_bench(&bufs[0]);
+	else if (mode_choice == 0)
 		run_tearing_demo(fd, crtc_id, conn_id, &mode, bufs);
-	else if (mode_choice == 1)
-		run_pageflip_demo(fd, crtc_id, conn_id, &mode, bufs);
-	else
+	else if (mode_choice == 1 && threaded)
+		run_threaded_pageflip(fd, crtc_id, conn_id, &mode, bufs, nbufs);
+	else if (mode_choice == 1 && deadline) {
+		struct frame_sched sched;
+
+		frame_sched_init(&sched, 1000.0 / (mode.vrefresh ? mode.vrefresh : 60));
+		run_pageflip_demo(fd, crtc_id, conn_id, &mode, bufs, &sched);
+	} else if (mode_choice == 1)
+		run_pageflip_demo(fd, crtc_id, conn_id, &mode, bufs, NULL);
+	else if (mode_choice == 2)
 		/* Single buffer only needs bufs[0] */
     		run_single_buffer_tearing(fd, crtc_id, conn_id, &mode, &bufs[0]);
+	if (mode_choice != 3)
+		telemetry_finish(&telemetry);
 
 	/* Release all DRM resources in reverse allocation order. */
-	for (int i = 0; i < MAX_BUFFERS; i++)
+	for (int i = 0; i < nbufs; i++)
 		modeset_destroy_fb(fd, &bufs[i]);
+	shadow_buffer_free(&shadow);
 
 	drmModeFreeConnector(conn);
 	drmModeFreeResources(res);
+	event_loop_destroy(&events);
 	close(fd);
+	render_pool_destroy(&pool);
 	return 0;
 }
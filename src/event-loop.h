@@ -0,0 +1,367 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+/* ============================================================
+ * event-loop.h - epoll loop over the DRM fd, fences, timers, signals
+ *
+ * The demo loops used to rebuild an fd_set and select() on the DRM fd
+ * alone, so anything else worth waiting for (a render thread's eventfd,
+ * an out-fence, a frame timer) needed its own wait, and Ctrl+C was
+ * either fatal or an EINTR every wait had to special-case.
+ *
+ * One epoll instance now carries every source:
+ *
+ *   drm     the card fd; on wakeup drmHandleEvent() runs until the fd
+ *           has nothing more to read, so a flip event and a vblank
+ *           event queued together are handled in one pass
+ *   fd      any pollable fd (eventfd, ...), level-triggered; the
+ *           callback must drain it
+ *   fence   a sync_file fd, readable once the fence signals; removed
+ *           again after it fired.  The caller keeps ownership.
+ *   timer   a timerfd owned by the loop, periodic
+ *   signal  SIGINT/SIGTERM through a signalfd: sets quit instead of
+ *           killing the process, so the loops fall out and the
+ *           teardown in main() runs
+ *
+ * The signals are blocked in event_loop_init(); call it before any
+ * thread is started so every thread inherits the mask.
+ *
+ * Sources live in a small fixed table.  The epoll cookie carries the
+ * slot and a generation count, so an event for a source removed by an
+ * earlier callback in the same batch is recognised and dropped.
+ * ============================================================ */
+
+#define EVENT_LOOP_MAX_SOURCES 16
+#define EVENT_LOOP_BATCH       8
+
+enum event_source_type {
+	EVENT_SOURCE_NONE,
+	EVENT_SOURCE_DRM,
+	EVENT_SOURCE_FD,
+	EVENT_SOURCE_FENCE,
+	EVENT_SOURCE_TIMER,
+	EVENT_SOURCE_SIGNAL,
+};
+
+struct event_loop;
+
+/* Called when @fd is ready; @ctx as passed when the source was added */
+typedef void (*event_loop_fn)(struct event_loop *loop, int fd, void *ctx);
+
+struct event_source {
+	enum event_source_type type;
+	int              fd;
+	uint32_t         gen;
+	event_loop_fn    fn;
+	void            *ctx;
+	drmEventContext *drm; /* EVENT_SOURCE_DRM only */
+};
+
+struct event_loop {
+	int  epfd;
+	bool quit;     /* SIGINT/SIGTERM received */
+	struct event_source sources[EVENT_LOOP_MAX_SOURCES];
+
+	/* Statistics */
+	uint64_t wakeups;
+	uint64_t drm_reads; /* drmHandleEvent() calls */
+};
+
+static inline int event_loop_add(struct event_loop *l,
+				 enum event_source_type type, int fd,
+				 event_loop_fn fn, void *ctx)
+{
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+		struct event_source *s = &l->sources[i];
+
+		if (s->type != EVENT_SOURCE_NONE)
+			continue;
+
+		struct epoll_event ev = {
+			.events   = EPOLLIN,
+			.data.u64 = (uint64_t)s->gen << 32 | (uint32_t)i,
+		};
+		if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl add");
+			return -1;
+		}
+		s->type = type;
+		s->fd   = fd;
+		s->fn   = fn;
+		s->ctx  = ctx;
+		s->drm  = NULL;
+		return i;
+	}
+	fprintf(stderr, "event loop: more than %d sources\n",
+		EVENT_LOOP_MAX_SOURCES);
+	return -1;
+}
+
+static inline void event_loop_release(struct event_loop *l,
+				      struct event_source *s)
+{
+	epoll_ctl(l->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	/* Timers and the signalfd were opened by the loop */
+	if (s->type == EVENT_SOURCE_TIMER || s->type == EVENT_SOURCE_SIGNAL)
+		close(s->fd);
+	s->type = EVENT_SOURCE_NONE;
+	s->fd   = -1;
+	s->gen++;
+}
+
+/* ============================================================
+ * event_loop_remove - Stop watching @fd.
+ *
+ * A no-op if @fd is not registered (e.g. a fence that already fired),
+ * so callers can remove unconditionally before closing a fence fd.
+ * ============================================================ */
+static inline void event_loop_remove(struct event_loop *l, int fd)
+{
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+		struct event_source *s = &l->sources[i];
+
+		if (s->type != EVENT_SOURCE_NONE && s->fd == fd)
+			event_loop_release(l, s);
+	}
+}
+
+/* ============================================================
+ * event_loop_init - Create the epoll instance and route SIGINT and
+ *                   SIGTERM into it.
+ *
+ * Returns 0, or -1 if epoll or the signalfd could not be set up.
+ * ============================================================ */
+static inline int event_loop_init(struct event_loop *l)
+{
+	sigset_t mask;
+
+	memset(l, 0, sizeof(*l));
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++)
+		l->sources[i].fd = -1;
+
+	l->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (l->epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	int sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sfd < 0) {
+		perror("signalfd");
+		goto fail;
+	}
+	if (event_loop_add(l, EVENT_SOURCE_SIGNAL, sfd, NULL, NULL) < 0) {
+		close(sfd);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	close(l->epfd);
+	l->epfd = -1;
+	return -1;
+}
+
+static inline void event_loop_destroy(struct event_loop *l)
+{
+	for (int i = 0; i < EVENT_LOOP_MAX_SOURCES; i++)
+		if (l->sources[i].type != EVENT_SOURCE_NONE)
+			event_loop_release(l, &l->sources[i]);
+	close(l->epfd);
+}
+
+/* The DRM fd; flip and vblank events go to the handlers in @ev */
+static inline int event_loop_add_drm(struct event_loop *l, int fd,
+				     drmEventContext *ev)
+{
+	int i = event_loop_add(l, EVENT_SOURCE_DRM, fd, NULL, NULL);
+
+	if (i < 0)
+		return -1;
+	l->sources[i].drm = ev;
+	return 0;
+}
+
+/* A pollable fd watched until event_loop_remove(); @fn must drain it */
+static inline int event_loop_add_fd(struct event_loop *l, int fd,
+				    event_loop_fn fn, void *ctx)
+{
+	return event_loop_add(l, EVENT_SOURCE_FD, fd, fn, ctx) < 0 ? -1 : 0;
+}
+
+/* ============================================================
+ * event_loop_add_fence - Call @fn once the sync_file @fence_fd
+ *                        signals.
+ *
+ * The source is dropped after @fn ran; the fd stays the caller's.
+ * ============================================================ */
+static inline int event_loop_add_fence(struct event_loop *l, int fence_fd,
+				       event_loop_fn fn, void *ctx)
+{
+	return event_loop_add(l, EVENT_SOURCE_FENCE, fence_fd, fn, ctx) < 0 ?
+	       -1 : 0;
+}
+
+/* ============================================================
+ * event_loop_add_timer - Call @fn every @period_ms, first time one
+ *                        period from now.
+ *
+ * Returns the timerfd (for event_loop_remove()), or -1.
+ * ============================================================ */
+static inline int event_loop_add_timer(struct event_loop *l,
+				       double period_ms, event_loop_fn fn,
+				       void *ctx)
+{
+	long ns = (long)(period_ms * 1e6);
+	struct itimerspec its = {
+		.it_interval = { ns / 1000000000L, ns % 1000000000L },
+		.it_value    = { ns / 1000000000L, ns % 1000000000L },
+	};
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+	if (fd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	if (timerfd_settime(fd, 0, &its, NULL) < 0 ||
+	    event_loop_add(l, EVENT_SOURCE_TIMER, fd, fn, ctx) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Handle every DRM event that is already queued, not just one read */
+static inline void event_loop_drain_drm(struct event_loop *l,
+					struct event_source *s)
+{
+	struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+
+	do {
+		drmHandleEvent(s->fd, s->drm);
+		l->drm_reads++;
+	} while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN));
+}
+
+static inline void event_loop_dispatch_one(struct event_loop *l,
+					   struct event_source *s)
+{
+	uint64_t n;
+
+	switch (s->type) {
+	case EVENT_SOURCE_DRM:
+		event_loop_drain_drm(l, s);
+		break;
+	case EVENT_SOURCE_SIGNAL: {
+		struct signalfd_siginfo si;
+
+		while (read(s->fd, &si, sizeof(si)) == sizeof(si)) {
+			if (!l->quit)
+				fprintf(stderr, "\n%s: stopping\n",
+					strsignal((int)si.ssi_signo));
+			l->quit = true;
+		}
+		break;
+	}
+	case EVENT_SOURCE_TIMER:
+		if (read(s->fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+			perror("read timerfd");
+		s->fn(l, s->fd, s->ctx);
+		break;
+	case EVENT_SOURCE_FENCE: {
+		event_loop_fn fn = s->fn;
+		void *ctx = s->ctx;
+		int fd = s->fd;
+
+		/* A signaled fence stays readable: drop it before the call */
+		event_loop_release(l, s);
+		fn(l, fd, ctx);
+		break;
+	}
+	case EVENT_SOURCE_FD:
+		s->fn(l, s->fd, s->ctx);
+		break;
+	case EVENT_SOURCE_NONE:
+		break;
+	}
+}
+
+/* ============================================================
+ * event_loop_dispatch - Wait up to @timeout_ms (-1 = forever, 0 =
+ *                       poll) and run the callbacks of every ready
+ *                       source.
+ *
+ * Returns the number of sources handled, 0 on timeout, -1 on error.
+ * ============================================================ */
+static inline int event_loop_dispatch(struct event_loop *l, int timeout_ms)
+{
+	struct epoll_event evs[EVENT_LOOP_BATCH];
+	int n;
+
+	do {
+		n = epoll_wait(l->epfd, evs, EVENT_LOOP_BATCH, timeout_ms);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		perror("epoll_wait");
+		return -1;
+	}
+	if (n)
+		l->wakeups++;
+
+	for (int i = 0; i < n; i++) {
+		uint32_t slot = (uint32_t)evs[i].data.u64;
+		uint32_t gen  = (uint32_t)(evs[i].data.u64 >> 32);
+		struct event_source *s = &l->sources[slot];
+
+		if (s->type != EVENT_SOURCE_NONE && s->gen == gen)
+			event_loop_dispatch_one(l, s);
+	}
+	return n;
+}
+
+/* ============================================================
+ * event_loop_wait - Dispatch until a callback clears *@pending.
+ *
+ * This deliberately keeps going after a signal set quit: the flip or
+ * fence being waited for is already queued, and tearing down buffers
+ * under it is what the wait is there to prevent.
+ *
+ * Returns 0, or -1 with errno set (ETIME: nothing arrived within
+ * @timeout_ms).
+ * ============================================================ */
+static inline int event_loop_wait(struct event_loop *l,
+				  const bool *pending, int timeout_ms)
+{
+	while (*pending) {
+		int n = event_loop_dispatch(l, timeout_ms);
+
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = ETIME;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#endif /* EVENT_LOOP_H */
@@ -0,0 +1,301 @@
+#ifndef FRAME_IPC_H
+#define FRAME_IPC_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* ============================================================
+ * frame-ipc.h - Hand frames between a producer and a display process
+ *
+ * The display process owns the DRM device and the buffers.  It gives a
+ * producer process (camera, decoder, renderer) everything it needs in
+ * one SETUP message over a UNIX socket: the DMA-BUF fd of every buffer
+ * and three more fds, all passed with SCM_RIGHTS.  From then on the
+ * producer writes pixels straight into the shared pages it mapped from
+ * those DMA-BUFs, and only buffer indices travel between the two:
+ *
+ *   shared memory (memfd)  two single-producer/single-consumer rings:
+ *                          "ready" (producer -> display: frame done)
+ *                          and "released" (display -> producer: buffer
+ *                          no longer scanned out, may be rewritten)
+ *   eventfd x2             a wakeup per ring, so neither side polls
+ *   socket                 SETUP / STOP, and per frame the sync_file
+ *                          that must signal before the frame may be
+ *                          read -- fds cannot travel through shared
+ *                          memory, so each ready entry has exactly one
+ *                          FRAME message, sent before the entry is
+ *                          pushed
+ *
+ * Ring indices are free-running 32-bit counters; entries are published
+ * with release stores and taken with acquire loads, which is all an
+ * SPSC ring needs and works across processes on a MAP_SHARED mapping.
+ * A ring holds more entries than there are buffers, and each buffer is
+ * in at most one ring entry at a time, so a push never finds it full.
+ * ============================================================ */
+
+#define FRAME_IPC_MAGIC       0x43504946u /* "FIPC" */
+#define FRAME_IPC_MAX_BUFFERS 8
+#define FRAME_IPC_RING_SIZE   16          /* Power of two             */
+#define FRAME_IPC_MAX_FDS     (3 + FRAME_IPC_MAX_BUFFERS)
+
+enum frame_ipc_msg_type {
+	FRAME_IPC_SETUP,   /* Display -> producer; fds: shm, ready, released,
+			    * then one DMA-BUF per buffer */
+	FRAME_IPC_FRAME,   /* Producer -> display; fd: sync_file, if any */
+	FRAME_IPC_STOP,    /* Display -> producer: unmap everything */
+	FRAME_IPC_STOPPED, /* Producer -> display: buffers let go */
+};
+
+struct frame_ipc_msg {
+	uint32_t type;
+
+	/* FRAME_IPC_FRAME */
+	uint32_t buffer;
+	uint64_t frame;
+
+	/* FRAME_IPC_SETUP: every buffer alike */
+	uint32_t nbufs;
+	uint32_t width, height;
+	uint32_t fourcc;
+	uint32_t pitch, size;
+	uint32_t free_mask; /* Buffers the producer may write right away */
+};
+
+struct frame_ipc_entry {
+	uint32_t buffer;
+	uint32_t pad;
+	uint64_t frame;
+	uint64_t t_ns;  /* CLOCK_MONOTONIC: render start (ready ring) */
+};
+
+struct frame_ipc_ring {
+	_Atomic uint32_t head; /* Next entry the writer fills */
+	uint8_t          pad0[60];
+	_Atomic uint32_t tail; /* Next entry the reader takes */
+	uint8_t          pad1[60];
+	struct frame_ipc_entry entries[FRAME_IPC_RING_SIZE];
+};
+
+struct frame_ipc_shm {
+	uint32_t              magic;
+	struct frame_ipc_ring ready;
+	struct frame_ipc_ring released;
+};
+
+/* One side's view of the channel */
+struct frame_ipc {
+	int                   sock;
+	int                   shm_fd;
+	int                   ready_efd;
+	int                   released_efd;
+	struct frame_ipc_shm *shm;
+};
+
+static inline uint64_t frame_ipc_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline bool frame_ipc_push(struct frame_ipc_ring *r,
+				  const struct frame_ipc_entry *e)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (head - tail == FRAME_IPC_RING_SIZE)
+		return false;
+	r->entries[head & (FRAME_IPC_RING_SIZE - 1)] = *e;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return true;
+}
+
+static inline bool frame_ipc_pop(struct frame_ipc_ring *r,
+				 struct frame_ipc_entry *e)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (head == tail)
+		return false;
+	*e = r->entries[tail & (FRAME_IPC_RING_SIZE - 1)];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+static inline void frame_ipc_signal(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write");
+}
+
+/* Reset a (non-blocking) eventfd before draining its ring */
+static inline void frame_ipc_drain(int efd)
+{
+	uint64_t v;
+
+	if (read(efd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		perror("eventfd read");
+}
+
+/* ============================================================
+ * frame_ipc_send - @msg plus @nfds file descriptors (SCM_RIGHTS).
+ *
+ * The receiver gets its own duplicates; the caller still owns @fds.
+ * Returns 0 or -1 (errno set).
+ * ============================================================ */
+static inline int frame_ipc_send(int sock, const struct frame_ipc_msg *msg,
+				 const int *fds, int nfds)
+{
+	union {
+		char           buf[CMSG_SPACE(FRAME_IPC_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct iovec iov = { .iov_base = (void *)msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	if (nfds > 0) {
+		memset(&ctl, 0, sizeof(ctl));
+		mh.msg_control    = ctl.buf;
+		mh.msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int));
+
+		struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type  = SCM_RIGHTS;
+		c->cmsg_len   = CMSG_LEN((size_t)nfds * sizeof(int));
+		memcpy(CMSG_DATA(c), fds, (size_t)nfds * sizeof(int));
+	}
+	return sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t)sizeof(*msg)
+	       ? 0 : -1;
+}
+
+/* ============================================================
+ * frame_ipc_recv - One message and the fds that came with it.
+ * @flags: MSG_DONTWAIT to poll.
+ *
+ * Returns the number of fds stored in @fds (extra ones are closed),
+ * or -1: errno EAGAIN if nothing is queued, EPIPE if the peer is gone.
+ * ============================================================ */
+static inline int frame_ipc_recv(int sock, struct frame_ipc_msg *msg,
+				 int *fds, int max_fds, int flags)
+{
+	union {
+		char           buf[CMSG_SPACE(FRAME_IPC_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+	struct msghdr mh = {
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = ctl.buf,
+		.msg_controllen = sizeof(ctl.buf),
+	};
+	ssize_t n = recvmsg(sock, &mh, flags | MSG_CMSG_CLOEXEC);
+	int nfds = 0;
+
+	if (n == 0)
+		errno = EPIPE;
+	if (n <= 0)
+		return -1;
+
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c;
+	     c = CMSG_NXTHDR(&mh, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		int count = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		int got[FRAME_IPC_MAX_FDS];
+
+		memcpy(got, CMSG_DATA(c), (size_t)count * sizeof(int));
+		for (int i = 0; i < count; i++) {
+			if (nfds < max_fds)
+				fds[nfds++] = got[i];
+			else
+				close(got[i]);
+		}
+	}
+	if (n != (ssize_t)sizeof(*msg)) {
+		while (nfds)
+			close(fds[--nfds]);
+		errno = EPROTO;
+		return -1;
+	}
+	return nfds;
+}
+
+static inline void frame_ipc_close(struct frame_ipc *ipc)
+{
+	if (ipc->shm)
+		munmap(ipc->shm, sizeof(*ipc->shm));
+	if (ipc->shm_fd >= 0)
+		close(ipc->shm_fd);
+	if (ipc->ready_efd >= 0)
+		close(ipc->ready_efd);
+	if (ipc->released_efd >= 0)
+		close(ipc->released_efd);
+	ipc->shm    = NULL;
+	ipc->shm_fd = ipc->ready_efd = ipc->released_efd = -1;
+}
+
+static inline int frame_ipc_map(struct frame_ipc *ipc)
+{
+	ipc->shm = mmap(NULL, sizeof(*ipc->shm), PROT_READ | PROT_WRITE,
+			MAP_SHARED, ipc->shm_fd, 0);
+	if (ipc->shm == MAP_FAILED) {
+		ipc->shm = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Display side: new rings and eventfds, to be sent with SETUP */
+static inline int frame_ipc_create(struct frame_ipc *ipc, int sock)
+{
+	ipc->sock         = sock;
+	ipc->shm          = NULL;
+	ipc->shm_fd       = memfd_create("frame-ipc", MFD_CLOEXEC);
+	ipc->ready_efd    = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ipc->released_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ipc->shm_fd < 0 || ipc->ready_efd < 0 || ipc->released_efd < 0 ||
+	    ftruncate(ipc->shm_fd, sizeof(*ipc->shm)) < 0 ||
+	    frame_ipc_map(ipc) < 0) {
+		perror("frame-ipc setup");
+		frame_ipc_close(ipc);
+		return -1;
+	}
+	memset(ipc->shm, 0, sizeof(*ipc->shm));
+	ipc->shm->magic = FRAME_IPC_MAGIC;
+	return 0;
+}
+
+/* Producer side: adopt the three fds that came with SETUP */
+static inline int frame_ipc_attach(struct frame_ipc *ipc, int sock,
+				   const int fds[3])
+{
+	ipc->sock         = sock;
+	ipc->shm          = NULL;
+	ipc->shm_fd       = fds[0];
+	ipc->ready_efd    = fds[1];
+	ipc->released_efd = fds[2];
+	if (frame_ipc_map(ipc) < 0 || ipc->shm->magic != FRAME_IPC_MAGIC) {
+		fprintf(stderr, "frame-ipc: bad shared ring\n");
+		frame_ipc_close(ipc);
+		return -1;
+	}
+	return 0;
+}
+
+#endif /* FRAME_IPC_H */
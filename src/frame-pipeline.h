@@ -0,0 +1,421 @@
+#ifndef FRAME_PIPELINE_H
+#define FRAME_PIPELINE_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "event-loop.h"
+#include "frame-telemetry.h"
+#include "render-pool.h"
+
+/* ============================================================
+ * frame-pipeline.h - Render thread decoupled from the display thread
+ *
+ * The single-threaded loops render, commit and then block waiting
+ * for the flip event, one after the other.  The render only starts
+ * once the previous flip has completed, so any frame that takes longer
+ * than the slack left in the vblank interval misses its vblank.
+ *
+ * Here rendering moves to its own thread and the two sides talk
+ * through two lock-free single-producer/single-consumer rings:
+ *
+ *   render thread                         display thread (owns DRM fd)
+ *   -------------                         ----------------------------
+ *   pop buffer from "free"   <-- free --  release the buffer a flip
+ *   render into it                        took off screen
+ *   push it to "ready"       -- ready ->  commit the NEWEST ready
+ *                                         frame, recycle older ones
+ *
+ * Each ring carries buffer indices, so the caller's buffer arrays stay
+ * as they are.  An eventfd per direction turns "ring was empty, now is
+ * not" into a wakeup: the render thread blocks in read() on the free
+ * eventfd, the display thread waits in its event loop with the ready
+ * eventfd registered next to the DRM fd.
+ *
+ * The render thread owns everything the render callback touches (damage
+ * tracker, animation, shadow buffer, render pool); the display thread
+ * only ever sees buffer indices and frame numbers.  A buffer is never
+ * in both places: it is either free/being rendered (render thread),
+ * ready, in flight or on screen (display thread).
+ * ============================================================ */
+
+#define FRAME_PIPELINE_DEPTH    3  /* Default: screen + flip + render */
+#define FRAME_PIPELINE_MAX      8
+#define FRAME_RING_SIZE        16  /* Power of two, > FRAME_PIPELINE_MAX */
+
+struct pipeline_frame {
+	int      idx;      /* Buffer index in the caller's array   */
+	uint64_t frame;    /* Frame number the render produced     */
+	double   ready_ms; /* When rendering finished              */
+};
+
+/* Head and tail on separate cache lines: each has a single writer */
+struct frame_ring {
+	_Atomic uint32_t head __attribute__((aligned(RENDER_POOL_CACHE_LINE)));
+	_Atomic uint32_t tail __attribute__((aligned(RENDER_POOL_CACHE_LINE)));
+	struct pipeline_frame slots[FRAME_RING_SIZE];
+};
+
+static inline bool frame_ring_push(struct frame_ring *r,
+				   const struct pipeline_frame *f)
+{
+	uint32_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (t - h == FRAME_RING_SIZE)
+		return false;
+	r->slots[t & (FRAME_RING_SIZE - 1)] = *f;
+	atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+	return true;
+}
+
+static inline bool frame_ring_pop(struct frame_ring *r,
+				  struct pipeline_frame *f)
+{
+	uint32_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t t = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (h == t)
+		return false;
+	*f = r->slots[h & (FRAME_RING_SIZE - 1)];
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+	return true;
+}
+
+/* Renders the next frame into buffer @idx, returns its frame number */
+typedef uint64_t (*pipeline_render_fn)(void *ctx, int idx);
+
+/* Queues a flip to buffer @idx; returns 0 or a negative errno */
+typedef int (*pipeline_commit_fn)(void *ctx, int idx);
+
+struct frame_pipeline {
+	struct frame_ring ready;    /* render -> display */
+	struct frame_ring released; /* display -> render */
+	int               ready_efd;
+	int               free_efd;
+	pthread_t         thread;
+	_Atomic bool      quit;
+
+	pipeline_render_fn render;
+	void              *render_ctx;
+	struct frame_telemetry *tel; /* Render: render thread, rest: display */
+
+	/* Render-thread stage times, in microseconds (read by display) */
+	_Atomic uint64_t  rendered;
+	_Atomic uint64_t  render_us;  /* Inside the render callback      */
+	_Atomic uint64_t  starved_us; /* Waiting for a free buffer       */
+
+	/* Display-thread stats, reset by frame_pipeline_report() */
+	uint64_t          shown;
+	uint64_t          skipped;    /* Ready frames superseded by newer */
+	uint64_t          busy;       /* Commits refused with -EBUSY      */
+	double            commit_ms;  /* Inside the commit callback       */
+	double            latency_ms; /* Ready -> flip completed          */
+	double            window_ms;
+	uint64_t          window_rendered;
+	uint64_t          window_render_us;
+	uint64_t          window_starved_us;
+};
+
+static inline void *frame_pipeline_thread(void *arg)
+{
+	struct frame_pipeline *p = arg;
+	struct pipeline_frame f;
+
+	for (;;) {
+		double t0 = render_pool_now_ms();
+
+		while (!frame_ring_pop(&p->released, &f)) {
+			uint64_t n;
+			if (atomic_load(&p->quit))
+				return NULL;
+			if (read(p->free_efd, &n, sizeof(n)) < 0 &&
+			    errno != EINTR)
+				return NULL;
+		}
+		if (atomic_load(&p->quit))
+			return NULL;
+
+		double t1 = render_pool_now_ms();
+		if (p->tel)
+			telemetry_begin(p->tel, TEL_RENDER);
+		f.frame = p->render(p->render_ctx, f.idx);
+		if (p->tel)
+			telemetry_end(p->tel, TEL_RENDER);
+		f.ready_ms = render_pool_now_ms();
+
+		atomic_fetch_add(&p->starved_us, (uint64_t)((t1 - t0) * 1e3));
+		atomic_fetch_add(&p->render_us,
+				 (uint64_t)((f.ready_ms - t1) * 1e3));
+		atomic_fetch_add(&p->rendered, 1);
+
+		frame_ring_push(&p->ready, &f);
+		uint64_t one = 1;
+		if (write(p->ready_efd, &one, sizeof(one)) < 0)
+			perror("write ready eventfd");
+	}
+}
+
+/* Hand buffer @idx back to the render thread */
+static inline void frame_pipeline_release(struct frame_pipeline *p, int idx)
+{
+	struct pipeline_frame f = { .idx = idx };
+	uint64_t one = 1;
+
+	frame_ring_push(&p->released, &f);
+	if (write(p->free_efd, &one, sizeof(one)) < 0)
+		perror("write free eventfd");
+}
+
+/* Undo a failed frame_pipeline_start(): fds closed, free ring emptied */
+static inline void frame_pipeline_abort(struct frame_pipeline *p)
+{
+	if (p->ready_efd >= 0)
+		close(p->ready_efd);
+	if (p->free_efd >= 0)
+		close(p->free_efd);
+	memset(p, 0, sizeof(*p));
+	p->ready_efd = p->free_efd = -1;
+}
+
+/* ============================================================
+ * frame_pipeline_start - Start the render thread.
+ * @depth:   Buffers in the caller's array (2..FRAME_PIPELINE_MAX).
+ * @onscreen: Index of the buffer already being scanned out; every
+ *           other buffer starts out free.
+ * @tel:     Optional telemetry: render times are recorded here, commit
+ *           times by frame_pipeline_display(), which also stops once
+ *           telemetry_done() says so.
+ *
+ * Returns 0, or -1 if the eventfds or the thread could not be created.
+ * ============================================================ */
+static inline int frame_pipeline_start(struct frame_pipeline *p, int depth,
+				       int onscreen, pipeline_render_fn render,
+				       void *ctx, struct frame_telemetry *tel)
+{
+	memset(p, 0, sizeof(*p));
+	p->render     = render;
+	p->render_ctx = ctx;
+	p->tel        = tel;
+	p->window_ms  = render_pool_now_ms();
+
+	p->ready_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	p->free_efd  = eventfd(0, EFD_CLOEXEC);
+	if (p->ready_efd < 0 || p->free_efd < 0) {
+		perror("eventfd");
+		frame_pipeline_abort(p);
+		return -1;
+	}
+
+	for (int i = 0; i < depth; i++)
+		if (i != onscreen)
+			frame_pipeline_release(p, i);
+
+	if (pthread_create(&p->thread, NULL, frame_pipeline_thread, p)) {
+		perror("pthread_create (render thread)");
+		frame_pipeline_abort(p);
+		return -1;
+	}
+	return 0;
+}
+
+static inline void frame_pipeline_stop(struct frame_pipeline *p)
+{
+	uint64_t one = 1;
+
+	atomic_store(&p->quit, true);
+	if (write(p->free_efd, &one, sizeof(one)) < 0)
+		perror("write free eventfd");
+	pthread_join(p->thread, NULL);
+	close(p->ready_efd);
+	close(p->free_efd);
+}
+
+/* ============================================================
+ * frame_pipeline_take - Newest ready frame, if any.
+ *
+ * Older ready frames are handed straight back to the render thread:
+ * showing them would only add latency.
+ * ============================================================ */
+static inline bool frame_pipeline_take(struct frame_pipeline *p,
+				       struct pipeline_frame *out)
+{
+	struct pipeline_frame f;
+	bool have = false;
+	uint64_t n;
+
+	if (read(p->ready_efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		perror("read ready eventfd");
+
+	while (frame_ring_pop(&p->ready, &f)) {
+		if (have) {
+			frame_pipeline_release(p, out->idx);
+			p->skipped++;
+		}
+		*out = f;
+		have = true;
+	}
+	return have;
+}
+
+/* ============================================================
+ * frame_pipeline_report - Per-stage timing every @every frames shown.
+ * @budget_ms: Frame period (1000 / refresh rate).
+ *
+ * "render" is the time the render thread spent producing a frame,
+ * "starved" the time it sat waiting for a free buffer.  Render time
+ * above the budget no longer costs a vblank as long as the shown
+ * rate holds, because it now overlaps the flip wait.
+ * ============================================================ */
+static inline void frame_pipeline_report(struct frame_pipeline *p,
+					 uint32_t every, double budget_ms)
+{
+	if (!every || p->shown < every)
+		return;
+
+	double now = render_pool_now_ms();
+	double secs = (now - p->window_ms) / 1e3;
+	uint64_t rendered = atomic_load(&p->rendered);
+	uint64_t render_us = atomic_load(&p->render_us);
+	uint64_t starved_us = atomic_load(&p->starved_us);
+	uint64_t nr = rendered - p->window_rendered;
+	double render_ms = nr ? (double)(render_us - p->window_render_us) /
+				1e3 / (double)nr : 0.0;
+
+	printf("  [pipeline] %.1f fps shown, %.1f rendered | render %.2f ms "
+	       "(%.0f%% of %.2f ms budget), starved %.2f ms | commit %.3f ms, "
+	       "ready->scanout %.2f ms | %llu skipped, %llu EBUSY\n",
+	       secs > 0 ? (double)p->shown / secs : 0.0,
+	       secs > 0 ? (double)nr / secs : 0.0,
+	       render_ms, budget_ms > 0 ? 100.0 * render_ms / budget_ms : 0.0,
+	       budget_ms,
+	       nr ? (double)(starved_us - p->window_starved_us) / 1e3 /
+		    (double)nr : 0.0,
+	       p->commit_ms / (double)p->shown,
+	       p->latency_ms / (double)p->shown,
+	       (unsigned long long)p->skipped,
+	       (unsigned long long)p->busy);
+
+	p->shown = p->skipped = p->busy = 0;
+	p->commit_ms = p->latency_ms = 0;
+	p->window_ms = now;
+	p->window_rendered   = rendered;
+	p->window_render_us  = render_us;
+	p->window_starved_us = starved_us;
+}
+
+/* The ready eventfd is level-triggered: drain it, the ring is read later */
+static inline void frame_pipeline_on_ready(struct event_loop *loop, int fd,
+					   void *ctx)
+{
+	uint64_t n;
+
+	if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		perror("read ready eventfd");
+	(void)loop; (void)ctx;
+}
+
+/* ============================================================
+ * frame_pipeline_display - Display-thread loop.
+ * @loop:         Event loop the DRM fd is registered with; its flip
+ *                handler must clear *@flip_waiting.
+ * @flip_waiting: Set here after each successful commit.
+ * @commit:       Queues a non-blocking flip to a buffer index.
+ * @onscreen:     Buffer scanned out when the loop starts.
+ * @budget_ms:    Frame period, for the report.
+ *
+ * Runs until a commit fails, no frame or flip event arrives within
+ * 1 s, Ctrl+C, or the telemetry says the run is over (--frames N).
+ * A flip still in flight at that point is waited for.
+ * ============================================================ */
+static inline void frame_pipeline_display(struct frame_pipeline *p,
+					  struct event_loop *loop,
+					  bool *flip_waiting,
+					  pipeline_commit_fn commit,
+					  void *commit_ctx, int onscreen,
+					  double budget_ms)
+{
+	struct pipeline_frame next = { .idx = -1 };
+	struct pipeline_frame flying = { .idx = -1 };
+
+	*flip_waiting = false;
+	if (event_loop_add_fd(loop, p->ready_efd, frame_pipeline_on_ready,
+			      NULL) < 0)
+		return;
+
+	while (!loop->quit && (!p->tel || !telemetry_done(p->tel))) {
+		bool busy = false;
+
+		if (flying.idx < 0) {
+			struct pipeline_frame newer;
+
+			/* A frame left over after -EBUSY can still be replaced */
+			if (frame_pipeline_take(p, &newer)) {
+				if (next.idx >= 0) {
+					frame_pipeline_release(p, next.idx);
+					p->skipped++;
+				}
+				next = newer;
+			}
+		}
+		if (flying.idx < 0 && next.idx >= 0) {
+			double t0 = render_pool_now_ms();
+			if (p->tel)
+				telemetry_begin(p->tel, TEL_COMMIT);
+			int ret = commit(commit_ctx, next.idx);
+			if (p->tel && !ret)
+				telemetry_end(p->tel, TEL_COMMIT);
+
+			p->commit_ms += render_pool_now_ms() - t0;
+			if (ret == -EBUSY) {
+				p->busy++;
+				busy = true;
+			} else if (ret) {
+				fprintf(stderr, "Flip commit failed: %s\n",
+					strerror(-ret));
+				goto out;
+			} else {
+				flying = next;
+				next.idx = -1;
+				*flip_waiting = true;
+			}
+		}
+
+		/*
+		 * A frame finishing while a flip is in flight only drains
+		 * the eventfd; it is picked up once the flip completes.
+		 */
+		int n = event_loop_dispatch(loop, busy ? 1 : 1000);
+		if (n < 0)
+			goto out;
+		if (n == 0 && !busy) {
+			fprintf(stderr, "Timeout: no frame or flip event within 1s\n");
+			goto out;
+		}
+		if (flying.idx < 0 || *flip_waiting)
+			continue;
+
+		/* Flip completed: the old front buffer can be reused */
+		frame_pipeline_release(p, onscreen);
+		onscreen = flying.idx;
+		p->latency_ms += render_pool_now_ms() - flying.ready_ms;
+		p->shown++;
+		flying.idx = -1;
+
+		frame_pipeline_report(p, 300, budget_ms);
+	}
+
+	/* The kernel still owns a buffer until its flip event arrives */
+	if (*flip_waiting && event_loop_wait(loop, flip_waiting, 1000) < 0)
+		perror("Waiting for the last flip");
+out:
+	event_loop_remove(loop, p->ready_efd);
+}
+
+#endif /* FRAME_PIPELINE_H */
@@ -0,0 +1,207 @@
+#ifndef FRAME_SCHED_H
+#define FRAME_SCHED_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "render-pool.h"
+
+/* ============================================================
+ * frame-sched.h - Vblank-deadline frame scheduling
+ *
+ * The plain flip loop starts rendering the moment the previous flip
+ * completes, i.e. right after a vblank.  The frame then sits finished
+ * in memory for most of the refresh period before it is scanned out,
+ * so what reaches the screen is up to a whole period old.
+ *
+ * The flip event already says exactly when the vblank happened
+ * (sequence number plus CLOCK_MONOTONIC timestamp).  From those the
+ * scheduler keeps:
+ *
+ *   period   smoothed vblank interval, measured over the sequence
+ *            delta so a missed vblank does not look like a 30 Hz mode
+ *   phase    timestamp of the last vblank; the next one is expected
+ *            at phase + period
+ *   render   mean and mean deviation of the measured render time
+ *
+ * and sleeps until
+ *
+ *   start = next_vblank - (render + max(3 * deviation, MIN_SLACK)
+ *                          + COMMIT_SLACK + penalty)
+ *
+ * so the frame is finished just before its deadline.  A miss (the
+ * flip lands on a later vblank than targeted) doubles the penalty;
+ * every frame on time decays it, so the margin settles at the
+ * smallest value that holds on this system.
+ *
+ * The animation is advanced to the predicted presentation time
+ * returned by frame_sched_begin(), not by a fixed step per frame, so
+ * motion speed is the same whatever the frame rate and a late frame
+ * does not slow the bar down.
+ * ============================================================ */
+
+#define FRAME_SCHED_COMMIT_MS  0.5  /* Commit ioctl + driver latch     */
+#define FRAME_SCHED_MIN_SLACK  0.5  /* Floor for the deviation term    */
+#define FRAME_SCHED_EMA        16   /* Smoothing: 1/16 per sample      */
+
+struct frame_sched {
+	bool     valid;       /* Saw at least one flip event         */
+	uint64_t seq;         /* Sequence of the last vblank         */
+	double   vblank_ms;   /* Its timestamp (phase)               */
+	double   period_ms;   /* Estimated refresh period            */
+
+	double   render_ms;   /* Render time, smoothed               */
+	double   render_dev;  /* Mean absolute deviation             */
+	double   penalty_ms;  /* Extra margin after misses           */
+
+	uint64_t target_seq;  /* Vblank the current frame aims for   */
+	double   start_ms;    /* When rendering of it started        */
+	double   present_ms;  /* Predicted presentation time         */
+
+	/* Statistics */
+	uint64_t frames;
+	uint64_t missed;
+	double   latency_sum; /* Render start -> vblank, on-time frames */
+	uint64_t window_frames;
+	uint64_t window_missed;
+};
+
+static inline void frame_sched_init(struct frame_sched *s,
+				    double nominal_period_ms)
+{
+	*s = (struct frame_sched){
+		.period_ms = nominal_period_ms,
+	};
+}
+
+/* ============================================================
+ * frame_sched_vblank - Feed the sequence and timestamp of a
+ *                      completed flip (from the flip event).
+ * ============================================================ */
+static inline void frame_sched_vblank(struct frame_sched *s, uint32_t seq,
+				      uint32_t tv_sec, uint32_t tv_usec)
+{
+	double t = (double)tv_sec * 1e3 + (double)tv_usec / 1e3;
+
+	if (s->valid && seq > s->seq) {
+		double p = (t - s->vblank_ms) / (double)(seq - s->seq);
+
+		/* Ignore samples a mode change or a timer hiccup distorted */
+		if (p > 0.5 * s->period_ms && p < 1.5 * s->period_ms)
+			s->period_ms += (p - s->period_ms) / FRAME_SCHED_EMA;
+	}
+
+	if (s->target_seq) {
+		s->frames++;
+		if (seq > s->target_seq) {
+			s->missed++;
+			s->penalty_ms = s->penalty_ms * 2 + 0.25;
+			if (s->penalty_ms > s->period_ms / 2)
+				s->penalty_ms = s->period_ms / 2;
+		} else {
+			s->penalty_ms *= 0.95;
+			s->latency_sum += t - s->start_ms;
+		}
+		s->target_seq = 0;
+	}
+
+	s->valid     = true;
+	s->seq       = seq;
+	s->vblank_ms = t;
+}
+
+/* Time budget reserved in front of the deadline */
+static inline double frame_sched_margin(const struct frame_sched *s)
+{
+	double dev = 3 * s->render_dev;
+
+	if (dev < FRAME_SCHED_MIN_SLACK)
+		dev = FRAME_SCHED_MIN_SLACK;
+	return s->render_ms + dev + FRAME_SCHED_COMMIT_MS + s->penalty_ms;
+}
+
+/* ============================================================
+ * frame_sched_begin - Sleep until it is time to render the frame for
+ *                     the next vblank.
+ *
+ * Call after the previous flip completed.  Returns the predicted
+ * presentation time (ms, CLOCK_MONOTONIC) to animate to.  Before the
+ * first flip event there is no phase yet and it returns at once.
+ * ============================================================ */
+static inline double frame_sched_begin(struct frame_sched *s)
+{
+	double now = render_pool_now_ms();
+
+	if (!s->valid) {
+		s->start_ms   = now;
+		s->present_ms = now + s->period_ms;
+		return s->present_ms;
+	}
+
+	/* Next vblank that is still reachable from now */
+	double deadline = s->vblank_ms + s->period_ms;
+	uint64_t target = s->seq + 1;
+	while (deadline - FRAME_SCHED_COMMIT_MS < now) {
+		deadline += s->period_ms;
+		target++;
+	}
+
+	double start = deadline - frame_sched_margin(s);
+	if (start > now) {
+		struct timespec ts = {
+			.tv_sec  = (time_t)(start / 1e3),
+			.tv_nsec = (long)((start - (double)(time_t)(start / 1e3) *
+					   1e3) * 1e6),
+		};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &ts, NULL) == EINTR)
+			;
+		now = render_pool_now_ms();
+	}
+
+	s->target_seq = target;
+	s->start_ms   = now;
+	s->present_ms = deadline;
+	return deadline;
+}
+
+/* Call once the frame is rendered, right before the commit */
+static inline void frame_sched_end(struct frame_sched *s)
+{
+	double r = render_pool_now_ms() - s->start_ms;
+	double d = r > s->render_ms ? r - s->render_ms : s->render_ms - r;
+
+	if (!s->render_ms) {
+		s->render_ms = r;
+		return;
+	}
+	s->render_ms  += (r - s->render_ms) / FRAME_SCHED_EMA;
+	s->render_dev += (d - s->render_dev) / FRAME_SCHED_EMA;
+}
+
+/* Report the estimate and deadline misses every @every frames */
+static inline void frame_sched_report(struct frame_sched *s, uint32_t every)
+{
+	if (!every || s->frames - s->window_frames < every)
+		return;
+
+	uint64_t n    = s->frames - s->window_frames;
+	uint64_t miss = s->missed - s->window_missed;
+	printf("  [deadline] period %.3f ms (%.2f Hz), render %.2f +- %.2f ms, "
+	       "margin %.2f ms, render->vblank %.2f ms, missed %llu/%llu "
+	       "(%llu total)\n",
+	       s->period_ms, 1e3 / s->period_ms,
+	       s->render_ms, s->render_dev, frame_sched_margin(s),
+	       n > miss ? s->latency_sum / (double)(n - miss) : 0.0,
+	       (unsigned long long)miss, (unsigned long long)n,
+	       (unsigned long long)s->missed);
+
+	s->latency_sum   = 0;
+	s->window_frames = s->frames;
+	s->window_missed = s->missed;
+}
+
+#endif /* FRAME_SCHED_H */
@@ -0,0 +1,379 @@
+#ifndef FRAME_TELEMETRY_H
+#define FRAME_TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ============================================================
+ * frame-telemetry.h - Per-frame timing histograms
+ *
+ * Every loop records, per frame:
+ *
+ *   render   time spent drawing the frame
+ *   commit   time inside the flip/commit ioctl
+ *   flip     commit returned -> flip event delivered
+ *   seq      vblank sequence delta between consecutive flip events;
+ *            anything above 1 is a vblank that showed an old frame,
+ *            i.e. a dropped frame
+ *   cpu      process CPU time per frame (all threads, so render pool
+ *            workers count too)
+ *
+ * The first flip that lands one vblank after the previous one is the
+ * first on-time frame; its number and the time since telemetry_init()
+ * say how long start-up costs (page faults, first commits, cold
+ * caches) kept the loop from running at the refresh rate.  Frame 0
+ * has no previous flip: it counts as on time if its flip arrived
+ * within one refresh period of its commit returning, the period
+ * being measured between the first two flips.  Delivery jitter can
+ * only make that test call a made vblank late, never the reverse.
+ *
+ * Samples go into fixed log-linear histograms: values below 16 get a
+ * bucket each, above that every power of two is split into 8 buckets
+ * (at most 12.5% relative error).  240 buckets cover the whole
+ * uint32_t range, so recording is an index computation and an
+ * increment -- no allocation, no sample log, constant memory however
+ * long the run.
+ *
+ * The demo loops run until Ctrl+C (see event-loop.h) or --frames N;
+ * on the way out the
+ * summary (count, mean, p50/p90/p99/max per metric, dropped frames)
+ * is printed and optionally written with --stats-csv / --stats-json.
+ *
+ * Each metric has a single writer.  With a separate render thread the
+ * render histogram belongs to it and everything else to the display
+ * thread; the summary is only read after the render thread is joined.
+ * ============================================================ */
+
+#define TELEMETRY_SUB_BITS 3
+#define TELEMETRY_LINEAR   (2u << TELEMETRY_SUB_BITS) /* 16 */
+#define TELEMETRY_BUCKETS  (TELEMETRY_LINEAR + \
+			    (32 - TELEMETRY_SUB_BITS - 1) * (1u << TELEMETRY_SUB_BITS))
+
+enum telemetry_metric {
+	TEL_RENDER,
+	TEL_COMMIT,
+	TEL_FLIP,
+	TEL_SEQ,
+	TEL_CPU,
+	TEL_METRICS,
+};
+
+static const struct {
+	const char *name;
+	const char *unit;
+} telemetry_metric_info[TEL_METRICS] = {
+	[TEL_RENDER] = { "render", "us" },
+	[TEL_COMMIT] = { "commit", "us" },
+	[TEL_FLIP]   = { "flip",   "us" },
+	[TEL_SEQ]    = { "seq",    "vblanks" },
+	[TEL_CPU]    = { "cpu",    "us" },
+};
+
+struct telemetry_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint32_t max;
+	uint32_t buckets[TELEMETRY_BUCKETS];
+};
+
+struct frame_telemetry {
+	struct telemetry_hist hist[TEL_METRICS];
+	double   start_ms[TEL_METRICS]; /* Open interval per metric   */
+
+	uint64_t frames;
+	uint64_t dropped;               /* Sum of (seq delta - 1)     */
+	uint32_t last_seq;
+	bool     have_seq;
+	double   cpu_ms;                /* Process CPU at last frame  */
+	double   init_ms;               /* When telemetry_init() ran  */
+	bool     have_on_time;
+	uint64_t first_on_time;         /* Frame number, if have_on_time */
+	double   first_on_time_ms;      /* Since init_ms              */
+	double   first_flip_ms;         /* Frame 0's flip event       */
+	double   first_flip_latency_ms; /* Its commit -> flip, < 0 if the
+					 * commit was not timed       */
+
+	uint64_t    max_frames;         /* --frames N, 0 = unlimited  */
+	const char *csv_path;           /* --stats-csv FILE           */
+	const char *json_path;          /* --stats-json FILE          */
+};
+
+static inline uint32_t telemetry_bucket(uint32_t v)
+{
+	if (v < TELEMETRY_LINEAR)
+		return v;
+
+	uint32_t msb = 31u - (uint32_t)__builtin_clz(v);
+	uint32_t sub = (v >> (msb - TELEMETRY_SUB_BITS)) &
+		       ((1u << TELEMETRY_SUB_BITS) - 1);
+	return TELEMETRY_LINEAR +
+	       (msb - TELEMETRY_SUB_BITS - 1) * (1u << TELEMETRY_SUB_BITS) + sub;
+}
+
+/* Largest value that falls into bucket @b */
+static inline uint32_t telemetry_bucket_max(uint32_t b)
+{
+	if (b < TELEMETRY_LINEAR)
+		return b;
+
+	uint32_t k   = b - TELEMETRY_LINEAR;
+	uint32_t msb = k / (1u << TELEMETRY_SUB_BITS) + TELEMETRY_SUB_BITS + 1;
+	uint32_t sub = k % (1u << TELEMETRY_SUB_BITS);
+	uint64_t lo  = ((uint64_t)((1u << TELEMETRY_SUB_BITS) | sub))
+		       << (msb - TELEMETRY_SUB_BITS);
+	uint64_t hi  = lo + (1ull << (msb - TELEMETRY_SUB_BITS)) - 1;
+	return hi > UINT32_MAX ? UINT32_MAX : (uint32_t)hi;
+}
+
+static inline void telemetry_hist_record(struct telemetry_hist *h, uint32_t v)
+{
+	h->buckets[telemetry_bucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+static inline void telemetry_record(struct frame_telemetry *t,
+				    enum telemetry_metric m, uint32_t v)
+{
+	telemetry_hist_record(&t->hist[m], v);
+}
+
+/* Value at percentile @p (0..100), reported as its bucket's upper end */
+static inline uint32_t telemetry_percentile(const struct telemetry_hist *h,
+					    double p)
+{
+	if (!h->count)
+		return 0;
+
+	uint64_t rank = (uint64_t)(p / 100.0 * (double)h->count + 0.5);
+	uint64_t seen = 0;
+	if (rank < 1)
+		rank = 1;
+	for (uint32_t b = 0; b < TELEMETRY_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if (seen >= rank) {
+			uint32_t v = telemetry_bucket_max(b);
+			return v < h->max ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+static inline double telemetry_now_ms(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+static inline void telemetry_begin(struct frame_telemetry *t,
+				   enum telemetry_metric m)
+{
+	t->start_ms[m] = telemetry_now_ms(CLOCK_MONOTONIC);
+}
+
+static inline void telemetry_end(struct frame_telemetry *t,
+				 enum telemetry_metric m)
+{
+	double now = telemetry_now_ms(CLOCK_MONOTONIC);
+
+	telemetry_record(t, m, (uint32_t)((now - t->start_ms[m]) * 1e3));
+	/* The flip latency starts where the commit ioctl returned */
+	if (m == TEL_COMMIT)
+		t->start_ms[TEL_FLIP] = now;
+}
+
+/* ============================================================
+ * telemetry_frame - One frame done (no flip event, e.g. SetCrtc or
+ *                   front-buffer rendering): count it, sample CPU.
+ * ============================================================ */
+static inline void telemetry_frame(struct frame_telemetry *t)
+{
+	double cpu = telemetry_now_ms(CLOCK_PROCESS_CPUTIME_ID);
+
+	if (t->frames)
+		telemetry_record(t, TEL_CPU, (uint32_t)((cpu - t->cpu_ms) * 1e3));
+	t->cpu_ms = cpu;
+	t->frames++;
+}
+
+/* ============================================================
+ * telemetry_flip - Flip event for vblank @seq arrived.
+ * ============================================================ */
+static inline void telemetry_flip(struct frame_telemetry *t, uint32_t seq)
+{
+	double now = telemetry_now_ms(CLOCK_MONOTONIC);
+	double latency = -1;
+
+	/* Only flips whose commit was timed (not e.g. a modeset) */
+	if (t->start_ms[TEL_FLIP]) {
+		latency = now - t->start_ms[TEL_FLIP];
+		telemetry_end(t, TEL_FLIP);
+		t->start_ms[TEL_FLIP] = 0;
+	}
+	if (!t->have_seq) {
+		t->first_flip_ms         = now;
+		t->first_flip_latency_ms = latency;
+	} else {
+		uint32_t delta = seq - t->last_seq;
+
+		telemetry_record(t, TEL_SEQ, delta);
+		if (delta > 1)
+			t->dropped += delta - 1;
+
+		/* Second flip: now the period is known, judge frame 0 */
+		if (t->frames == 1 && delta && t->first_flip_latency_ms >= 0 &&
+		    t->first_flip_latency_ms <=
+		    (now - t->first_flip_ms) / delta) {
+			t->have_on_time     = true;
+			t->first_on_time    = 0;
+			t->first_on_time_ms = t->first_flip_ms - t->init_ms;
+		}
+		if (delta == 1 && !t->have_on_time) {
+			t->have_on_time     = true;
+			t->first_on_time    = t->frames;
+			t->first_on_time_ms = now - t->init_ms;
+		}
+	}
+	t->last_seq = seq;
+	t->have_seq = true;
+	telemetry_frame(t);
+}
+
+/* True once --frames N frames were shown */
+static inline bool telemetry_done(const struct frame_telemetry *t)
+{
+	return t->max_frames && t->frames >= t->max_frames;
+}
+
+/* ============================================================
+ * telemetry_init - Parse --frames N, --stats-csv FILE and
+ *                  --stats-json FILE.
+ * ============================================================ */
+static inline void telemetry_init(struct frame_telemetry *t,
+				  int argc, char **argv)
+{
+	memset(t, 0, sizeof(*t));
+	t->init_ms = telemetry_now_ms(CLOCK_MONOTONIC);
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--frames") == 0)
+			t->max_frames = strtoull(argv[i + 1], NULL, 10);
+		else if (strcmp(argv[i], "--stats-csv") == 0)
+			t->csv_path = argv[i + 1];
+		else if (strcmp(argv[i], "--stats-json") == 0)
+			t->json_path = argv[i + 1];
+	}
+}
+
+static inline void telemetry_write_csv(const struct frame_telemetry *t,
+				       FILE *f)
+{
+	fprintf(f, "metric,unit,count,mean,p50,p90,p99,max\n");
+	for (int m = 0; m < TEL_METRICS; m++) {
+		const struct telemetry_hist *h = &t->hist[m];
+
+		fprintf(f, "%s,%s,%llu,%.1f,%u,%u,%u,%u\n",
+			telemetry_metric_info[m].name,
+			telemetry_metric_info[m].unit,
+			(unsigned long long)h->count,
+			h->count ? (double)h->sum / (double)h->count : 0.0,
+			telemetry_percentile(h, 50), telemetry_percentile(h, 90),
+			telemetry_percentile(h, 99), h->max);
+	}
+	fprintf(f, "dropped,frames,%llu,,,,,\n",
+		(unsigned long long)t->dropped);
+}
+
+/* Summary plus the non-empty buckets as [upper_bound, count] pairs */
+static inline void telemetry_write_json(const struct frame_telemetry *t,
+					FILE *f)
+{
+	fprintf(f, "{\n  \"frames\": %llu,\n  \"dropped\": %llu,\n"
+		"  \"first_on_time_frame\": %lld,\n"
+		"  \"first_on_time_ms\": %.1f,\n  \"metrics\": {\n",
+		(unsigned long long)t->frames, (unsigned long long)t->dropped,
+		t->have_on_time ? (long long)t->first_on_time : -1LL,
+		t->first_on_time_ms);
+	for (int m = 0; m < TEL_METRICS; m++) {
+		const struct telemetry_hist *h = &t->hist[m];
+		const char *sep = "";
+
+		fprintf(f, "    \"%s\": { \"unit\": \"%s\", \"count\": %llu, "
+			"\"mean\": %.1f, \"p50\": %u, \"p90\": %u, \"p99\": %u, "
+			"\"max\": %u,\n      \"buckets\": [",
+			telemetry_metric_info[m].name,
+			telemetry_metric_info[m].unit,
+			(unsigned long long)h->count,
+			h->count ? (double)h->sum / (double)h->count : 0.0,
+			telemetry_percentile(h, 50), telemetry_percentile(h, 90),
+			telemetry_percentile(h, 99), h->max);
+		for (uint32_t b = 0; b < TELEMETRY_BUCKETS; b++) {
+			if (!h->buckets[b])
+				continue;
+			fprintf(f, "%s[%u, %u]", sep, telemetry_bucket_max(b),
+				h->buckets[b]);
+			sep = ", ";
+		}
+		fprintf(f, "] }%s\n", m + 1 < TEL_METRICS ? "," : "");
+	}
+	fprintf(f, "  }\n}\n");
+}
+
+static inline void telemetry_write_file(const struct frame_telemetry *t,
+					const char *path, bool json)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		perror(path);
+		return;
+	}
+	if (json)
+		telemetry_write_json(t, f);
+	else
+		telemetry_write_csv(t, f);
+	fclose(f);
+	printf("Frame statistics written to %s\n", path);
+}
+
+/* ============================================================
+ * telemetry_finish - Print the summary table and write the files
+ *                    requested on the command line.
+ * ============================================================ */
+static inline void telemetry_finish(const struct frame_telemetry *t)
+{
+	printf("\n=== Frame timing: %llu frames, %llu dropped ===\n",
+	       (unsigned long long)t->frames, (unsigned long long)t->dropped);
+	if (t->have_on_time)
+		printf("  first on-time frame: #%llu, %.1f ms after start\n",
+		       (unsigned long long)t->first_on_time,
+		       t->first_on_time_ms);
+	printf("  %-7s %8s %10s %8s %8s %8s %8s  %s\n", "metric", "count",
+	       "mean", "p50", "p90", "p99", "max", "unit");
+	for (int m = 0; m < TEL_METRICS; m++) {
+		const struct telemetry_hist *h = &t->hist[m];
+
+		if (!h->count)
+			continue;
+		printf("  %-7s %8llu %10.1f %8u %8u %8u %8u  %s\n",
+		       telemetry_metric_info[m].name,
+		       (unsigned long long)h->count,
+		       (double)h->sum / (double)h->count,
+		       telemetry_percentile(h, 50), telemetry_percentile(h, 90),
+		       telemetry_percentile(h, 99), h->max,
+		       telemetry_metric_info[m].unit);
+	}
+
+	if (t->csv_path)
+		telemetry_write_file(t, t->csv_path, false);
+	if (t->json_path)
+		telemetry_write_file(t, t->json_path, true);
+}
+
+#endif /* FRAME_TELEMETRY_H */
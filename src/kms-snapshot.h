@@ -0,0 +1,236 @@
+#ifndef KMS_SNAPSHOT_H
+#define KMS_SNAPSHOT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* ============================================================
+ * kms-snapshot.h - Discovered KMS topology saved for the next start
+ *
+ * Finding the display is the same walk on every launch: resources,
+ * each connector (drmModeGetConnector() makes the driver probe it,
+ * which on HDMI means reading the EDID over DDC), encoders, CRTCs,
+ * every plane and its properties, the mode list.  Its result is a
+ * handful of object and property IDs and one mode, and it only
+ * changes when the kernel, the driver or the monitor does.
+ *
+ * A snapshot file is a fixed header followed by the caller's payload
+ * (a plain struct of IDs), written once after a full discovery and
+ * mmap()ed read-only on the next start.  The header carries the key:
+ *
+ *   - driver name and version (drmGetVersion()): a different kernel
+ *     or driver may number its objects differently,
+ *   - a hash of the connector's EDID blob: another monitor means
+ *     other modes,
+ *   - a checksum of the payload, so a truncated or stale-format file
+ *     is never trusted.
+ *
+ * kms_snapshot_map() checks everything but the EDID, which needs the
+ * connector from the payload; the caller then hashes the EDID with
+ * kms_snapshot_edid_hash() and checks whatever else it relies on
+ * without probing (drmModeGetConnectorCurrent()).  Any mismatch means
+ * full discovery, which writes a fresh snapshot.
+ * ============================================================ */
+
+#define KMS_SNAPSHOT_MAGIC   0x4f50544bu /* "KTPO" */
+#define KMS_SNAPSHOT_VERSION 1
+
+struct kms_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t payload_size;
+	uint32_t reserved;
+	uint64_t payload_hash;
+
+	/* Key */
+	char     driver[32];
+	int32_t  driver_major, driver_minor, driver_patch;
+	uint32_t pad;
+	uint64_t edid_hash;
+
+	/* Informational */
+	double   discovery_ms; /* Full discovery, when this was written */
+};
+
+/* A mapped snapshot file */
+struct kms_snapshot {
+	void                             *map;
+	size_t                            len;
+	const struct kms_snapshot_header *hdr;
+	const void                       *payload;
+};
+
+/* FNV-1a, 64-bit */
+static inline uint64_t kms_snapshot_hash(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ull;
+	return h;
+}
+
+/* Fill in the driver part of the key; returns -1 if unavailable */
+static inline int kms_snapshot_identify(int fd, struct kms_snapshot_header *h)
+{
+	drmVersionPtr v = drmGetVersion(fd);
+
+	memset(h, 0, sizeof(*h));
+	if (!v)
+		return -1;
+	snprintf(h->driver, sizeof(h->driver), "%.*s", v->name_len,
+		 v->name ? v->name : "");
+	h->driver_major = v->version_major;
+	h->driver_minor = v->version_minor;
+	h->driver_patch = v->version_patchlevel;
+	drmFreeVersion(v);
+	return 0;
+}
+
+/*
+ * Hash of the EDID blob on @conn_id (@edid_prop is its "EDID" property
+ * ID).  Returns 0 if the connector has none.
+ */
+static inline uint64_t kms_snapshot_edid_hash(int fd, uint32_t conn_id,
+					      uint32_t edid_prop)
+{
+	drmModeObjectProperties *props;
+	uint64_t hash = 0;
+	uint32_t blob_id = 0;
+
+	if (!edid_prop)
+		return 0;
+	props = drmModeObjectGetProperties(fd, conn_id,
+					   DRM_MODE_OBJECT_CONNECTOR);
+	for (uint32_t i = 0; props && i < props->count_props; i++)
+		if (props->props[i] == edid_prop)
+			blob_id = (uint32_t)props->prop_values[i];
+	drmModeFreeObjectProperties(props);
+
+	drmModePropertyBlobPtr blob =
+		blob_id ? drmModeGetPropertyBlob(fd, blob_id) : NULL;
+	if (blob) {
+		hash = kms_snapshot_hash(blob->data, blob->length);
+		drmModeFreePropertyBlob(blob);
+	}
+	return hash;
+}
+
+/* ============================================================
+ * kms_snapshot_save - Write @h and @payload to @path.
+ *
+ * Goes through a temporary file and rename(), so a reader never maps
+ * a half-written snapshot.  Returns 0 or -1 (errno set).
+ * ============================================================ */
+static inline int kms_snapshot_save(const char *path,
+				    const struct kms_snapshot_header *h,
+				    const void *payload, uint32_t size)
+{
+	struct kms_snapshot_header out = *h;
+	char tmp[4096];
+	int fd;
+
+	out.magic        = KMS_SNAPSHOT_MAGIC;
+	out.version      = KMS_SNAPSHOT_VERSION;
+	out.payload_size = size;
+	out.payload_hash = kms_snapshot_hash(payload, size);
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	errno = 0;
+	if (write(fd, &out, sizeof(out)) != (ssize_t)sizeof(out) ||
+	    write(fd, payload, size) != (ssize_t)size) {
+		if (errno == 0)
+			errno = EIO;
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+static inline void kms_snapshot_unmap(struct kms_snapshot *s)
+{
+	if (s->map)
+		munmap(s->map, s->len);
+	memset(s, 0, sizeof(*s));
+}
+
+/* ============================================================
+ * kms_snapshot_map - Map @path if it matches @key.
+ * @key:  Driver part of the key, from kms_snapshot_identify().
+ * @size: Expected payload size.
+ *
+ * Returns the payload, or NULL (with a reason in *@why) if the file is
+ * missing, of another format, damaged or from another driver.  The
+ * EDID hash is left to the caller.
+ * ============================================================ */
+static inline const void *kms_snapshot_map(const char *path,
+					   const struct kms_snapshot_header *key,
+					   uint32_t size, struct kms_snapshot *s,
+					   const char **why)
+{
+	const struct kms_snapshot_header *h;
+	struct stat st;
+	int fd;
+
+	memset(s, 0, sizeof(*s));
+	*why = "no snapshot";
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 ||
+	    (size_t)st.st_size != sizeof(*h) + size) {
+		*why = "size differs";
+		close(fd);
+		return NULL;
+	}
+	s->len = (size_t)st.st_size;
+	s->map = mmap(NULL, s->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		*why = "mmap failed";
+		return NULL;
+	}
+
+	h = s->map;
+	s->hdr     = h;
+	s->payload = h + 1;
+	if (h->magic != KMS_SNAPSHOT_MAGIC ||
+	    h->version != KMS_SNAPSHOT_VERSION || h->payload_size != size)
+		*why = "other format";
+	else if (h->payload_hash != kms_snapshot_hash(s->payload, size))
+		*why = "checksum mismatch";
+	else if (strncmp(h->driver, key->driver, sizeof(h->driver)) != 0 ||
+		 h->driver_major != key->driver_major ||
+		 h->driver_minor != key->driver_minor ||
+		 h->driver_patch != key->driver_patch)
+		*why = "driver changed";
+	else
+		return s->payload;
+
+	kms_snapshot_unmap(s);
+	return NULL;
+}
+
+#endif /* KMS_SNAPSHOT_H */
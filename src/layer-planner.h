@@ -0,0 +1,220 @@
+#ifndef LAYER_PLANNER_H
+#define LAYER_PLANNER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <xf86drmMode.h>
+
+/* ============================================================
+ * layer-planner.h - Put as many layers as possible on hardware planes
+ *
+ * A scene is a stack of layers (rectangles with a format and a z
+ * order).  Each one either gets a KMS plane of its own, which the
+ * display engine blends for free while scanning out, or is drawn by
+ * the CPU into the primary plane's buffer underneath everything else.
+ * VOP2 has up to eight windows per video port, so every layer left to
+ * the CPU is per-pixel work that did not have to happen.
+ *
+ * Static constraints, checked without the kernel:
+ *   - the plane can scan out the layer's format,
+ *   - planes stack in layer order: each plane's zpos is above the one
+ *     before; a mutable zpos is assigned, an immutable one must fit
+ *     (planes without a zpos property are taken to stack in list
+ *     order, above the primary),
+ *   - a CPU layer is drawn into the primary plane, below every
+ *     overlay, so it must not overlap a lower layer that is on one.
+ *
+ * Everything else -- scaling limits, bandwidth, how many windows may
+ * share a line, a plane still busy on another CRTC -- only the driver
+ * knows.  The search asks it: every time a layer is put on a plane
+ * the partial assignment is tried with TEST_ONLY (through the
+ * caller's @test, ideally cached -- see atomic_req_test()) and the
+ * branch is dropped if the kernel refuses.
+ *
+ * The search is depth-first over the layers in z order, planes first
+ * and CPU last, and stops exploring a branch that cannot beat the
+ * best assignment found so far even if every remaining layer got a
+ * plane.
+ * ============================================================ */
+
+#define PLANNER_MAX_PLANES  16
+#define PLANNER_MAX_LAYERS  8
+#define PLANNER_MAX_FORMATS 64
+#define PLANNER_MAX_NODES   4096 /* Search budget */
+
+struct planner_plane {
+	uint32_t id;
+	uint32_t type; /* DRM_PLANE_TYPE_* */
+	uint32_t formats[PLANNER_MAX_FORMATS];
+	uint32_t nformats;
+	bool     has_zpos;
+	bool     zpos_mutable;
+	uint64_t zpos, zpos_min, zpos_max;
+};
+
+struct planner_layer {
+	int32_t  x, y;
+	uint32_t w, h;
+	uint32_t fourcc;
+
+	/* Result */
+	int      plane; /* Index into planes[], or -1 for CPU composition */
+	uint64_t zpos;  /* For a plane with a mutable zpos */
+};
+
+/*
+ * Would the kernel accept @layers[0 .. @n) on their ->plane, with
+ * every other plane of the CRTC but the primary turned off?
+ */
+typedef bool (*planner_test_fn)(void *ctx, const struct planner_layer *layers,
+				int n);
+
+struct planner {
+	const struct planner_plane *planes;
+	int                         nplanes;
+	int                         primary; /* Index of the primary plane */
+	struct planner_layer       *layers;  /* Bottom to top */
+	int                         nlayers;
+	planner_test_fn             test;
+	void                       *ctx;
+
+	int      best;                      /* Layers on planes, -1: none */
+	int      best_plane[PLANNER_MAX_LAYERS];
+	uint64_t best_zpos[PLANNER_MAX_LAYERS];
+
+	/* Statistics */
+	uint32_t nodes;
+	uint32_t tests;
+	uint32_t rejected;
+};
+
+static inline bool planner_supports(const struct planner_plane *p,
+				    uint32_t fourcc)
+{
+	for (uint32_t i = 0; i < p->nformats; i++)
+		if (p->formats[i] == fourcc)
+			return true;
+	return false;
+}
+
+static inline bool planner_overlap(const struct planner_layer *a,
+				   const struct planner_layer *b)
+{
+	return a->x < b->x + (int32_t)b->w && b->x < a->x + (int32_t)a->w &&
+	       a->y < b->y + (int32_t)b->h && b->y < a->y + (int32_t)a->h;
+}
+
+/* Stacking position; without zpos the primary is at the bottom */
+static inline uint64_t planner_plane_zpos(const struct planner_plane *p,
+					  int index)
+{
+	if (p->has_zpos)
+		return p->zpos;
+	return p->type == DRM_PLANE_TYPE_PRIMARY ? 0 : (uint64_t)index + 1;
+}
+
+/*
+ * Can plane @p hold a layer above stacking position @floor?  Sets
+ * *@zpos to the position it would get.
+ */
+static inline bool planner_zpos_fits(const struct planner_plane *p, int index,
+				     uint64_t floor, uint64_t *zpos)
+{
+	if (p->has_zpos && p->zpos_mutable) {
+		*zpos = floor + 1 > p->zpos_min ? floor + 1 : p->zpos_min;
+		return *zpos <= p->zpos_max;
+	}
+	*zpos = planner_plane_zpos(p, index);
+	return *zpos > floor;
+}
+
+static inline void planner_search(struct planner *pl, int i, uint32_t used,
+				  uint64_t floor, int placed)
+{
+	struct planner_layer *l = &pl->layers[i];
+
+	if (++pl->nodes > PLANNER_MAX_NODES)
+		return;
+	/* Even all remaining layers on planes would not do better */
+	if (placed + (pl->nlayers - i) <= pl->best)
+		return;
+	if (i == pl->nlayers) {
+		pl->best = placed;
+		for (int k = 0; k < pl->nlayers; k++) {
+			pl->best_plane[k] = pl->layers[k].plane;
+			pl->best_zpos[k]  = pl->layers[k].zpos;
+		}
+		return;
+	}
+
+	for (int p = 0; p < pl->nplanes; p++) {
+		const struct planner_plane *pp = &pl->planes[p];
+		uint64_t zpos;
+
+		if (p == pl->primary || (used & 1u << p) ||
+		    pp->type == DRM_PLANE_TYPE_CURSOR ||
+		    !planner_supports(pp, l->fourcc) ||
+		    !planner_zpos_fits(pp, p, floor, &zpos))
+			continue;
+
+		l->plane = p;
+		l->zpos  = zpos;
+		pl->tests++;
+		if (!pl->test(pl->ctx, pl->layers, i + 1)) {
+			pl->rejected++;
+			continue;
+		}
+		planner_search(pl, i + 1, used | 1u << p, zpos, placed + 1);
+	}
+
+	/* CPU composition: below every plane, so no overlay may cover it */
+	for (int k = 0; k < i; k++)
+		if (pl->layers[k].plane >= 0 &&
+		    planner_overlap(&pl->layers[k], l))
+			return;
+	l->plane = -1;
+	l->zpos  = 0;
+	planner_search(pl, i + 1, used, floor, placed);
+}
+
+/* ============================================================
+ * planner_assign - Give @layers (bottom to top) their planes.
+ * @planes:  Every plane usable on the CRTC.
+ * @primary: Index of the CRTC's primary plane in @planes.
+ *
+ * On return each layer's ->plane is an index into @planes or -1 for
+ * CPU composition.  Returns the number of layers on planes, or -1 if
+ * no assignment was found within the search budget (then every layer
+ * is left to the CPU).
+ * ============================================================ */
+static inline int planner_assign(struct planner *pl,
+				 const struct planner_plane *planes,
+				 int nplanes, int primary,
+				 struct planner_layer *layers, int nlayers,
+				 planner_test_fn test, void *ctx)
+{
+	memset(pl, 0, sizeof(*pl));
+	pl->planes  = planes;
+	pl->nplanes = nplanes < PLANNER_MAX_PLANES ? nplanes
+						   : PLANNER_MAX_PLANES;
+	pl->primary = primary;
+	pl->layers  = layers;
+	pl->nlayers = nlayers < PLANNER_MAX_LAYERS ? nlayers
+						   : PLANNER_MAX_LAYERS;
+	pl->test    = test;
+	pl->ctx     = ctx;
+	pl->best    = -1;
+
+	/* Overlays go above the primary plane */
+	planner_search(pl, 0, 0, planner_plane_zpos(&planes[primary], primary),
+		       0);
+
+	for (int k = 0; k < pl->nlayers; k++) {
+		layers[k].plane = pl->best < 0 ? -1 : pl->best_plane[k];
+		layers[k].zpos  = pl->best < 0 ? 0 : pl->best_zpos[k];
+	}
+	return pl->best;
+}
+
+#endif /* LAYER_PLANNER_H */
@@ -11,6 +11,9 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "pixel-format.h"
+#include "render-pool.h"
+
 #define MAX_BUFFERS 2
 #define PATTERN_RGB 0
 #define PATTERN_GBR 1
@@ -23,42 +26,69 @@ struct buffer_object {
 	uint32_t size;
 	uint8_t *vaddr;
 	uint32_t fb_id;
+	const struct pixel_format *fmt;
 };
 
+/* Band renderer for the test patterns; sized by --threads (default 1) */
+static struct render_pool pool;
+
+struct pattern_job {
+	struct buffer_object *bo;
+	uint32_t              colors[3]; /* Segment colors, packed in bo->fmt */
+};
+
+/* Fill rows [y0, y1) of the pattern: three solid runs per row */
+static void draw_pattern_band(void *ctx, uint32_t y0, uint32_t y1)
+{
+	struct pattern_job *job = ctx;
+	struct buffer_object *bo = job->bo;
+	const uint32_t cpp = bo->fmt->cpp;
+
+	for (uint32_t y = y0; y < y1; y++) {
+		uint8_t *row = bo->vaddr + (size_t)y * bo->pitch;
+
+		for (int seg = 0; seg < 3; seg++) {
+			/* Segment boundaries, same as x * 3 / width per pixel */
+			uint32_t x0 = (seg * bo->width + 2) / 3;
+			uint32_t x1 = ((seg + 1) * bo->width + 2) / 3;
+
+			bo->fmt->fill(row + (size_t)x0 * cpp,
+				      job->colors[seg], x1 - x0);
+		}
+	}
+}
+
 /**
  * draw_test_pattern - Renders a vertical bar pattern to the buffer.
  * @bo: The buffer object to draw into.
  * @pattern_type: The color sequence to use (PATTERN_RGB or PATTERN_GBR).
- * * This function calculates the color for each pixel without using nested 
- * conditional branches inside the inner loop, optimizing for CPU pipeline 
- * efficiency. It divides the screen into three vertical segments.
+ * * The screen is divided into three vertical segments.  Each row is
+ * written as three branch-free runs by the writer for bo->fmt (colors
+ * are packed once, see pixel-format.h), and the rows are split into
+ * cache-line aligned bands rendered on the worker pool.  The call
+ * returns only after every band is written.
  */
 static void draw_test_pattern(struct buffer_object *bo, int pattern_type)
 {
-	uint32_t *pixel = (uint32_t *)bo->vaddr;
-	
 	/* Pre-define the color sequence to avoid branching inside loops */
-	uint32_t colors[2][3] = {
+	static const uint32_t colors[2][3] = {
 		{0xff0000, 0x00ff00, 0x0000ff}, // PATTERN_RGB: Red, Green, Blue
 		{0x00ff00, 0x0000ff, 0xff0000}  // PATTERN_GBR: Green, Blue, Red
 	};
+	struct pattern_job job = { .bo = bo };
 
-	for (uint32_t y = 0; y < bo->height; y++) {
-		for (uint32_t x = 0; x < bo->width; x++) {
-			/* Select color segment (0, 1, or 2) */
-			int segment = x * 3 / bo->width;
-			if (segment > 2) segment = 2; // Boundary safety
+	for (int seg = 0; seg < 3; seg++)
+		job.colors[seg] = bo->fmt->pack(colors[pattern_type][seg]);
 
-			uint32_t offset = y * (bo->pitch / 4) + x;
-			pixel[offset] = colors[pattern_type][segment];
-		}
-	}
+	render_pool_run(&pool, draw_pattern_band, &job, 0, bo->height,
+			bo->pitch, bo->width * bo->fmt->cpp);
 }
 
 static int modeset_create_fb(int fd, struct buffer_object *bo, int pattern_type)
 {
-	struct drm_mode_create_dumb create = { .width = bo->width, .height = bo->height, .bpp = 32 };
+	struct drm_mode_create_dumb create = { .width = bo->width, .height = bo->height, .bpp = bo->fmt->cpp * 8 };
 	struct drm_mode_map_dumb map = {0};
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
 
 	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) return -1;
 
@@ -66,7 +96,11 @@ static int modeset_create_fb(int fd, struct buffer_object *bo, int pattern_type)
 	bo->size = create.size;
 	bo->handle = create.handle;
 
-	if (drmModeAddFB(fd, bo->width, bo->height, 24, 32, bo->pitch, bo->handle, &bo->fb_id)) return -1;
+	/* AddFB2: the fourcc, not a depth/bpp pair, selects the scanout format */
+	handles[0] = bo->handle;
+	pitches[0] = bo->pitch;
+	if (drmModeAddFB2(fd, bo->width, bo->height, bo->fmt->fourcc,
+			  handles, pitches, offsets, &bo->fb_id, 0)) return -1;
 
 	map.handle = bo->handle;
 	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) return -1;
@@ -94,6 +128,10 @@ int main(int argc, char **argv)
 	uint32_t conn_id, crtc_id;
 	struct buffer_object bufs[MAX_BUFFERS] = {0};
 
+	/* --format F selects the scanout pixel format (default XRGB8888) */
+	const struct pixel_format *fmt = pixel_format_parse(argc, argv);
+	if (!fmt) return -1;
+
 	fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
 	if (fd < 0) {
 		perror("Failed to open /dev/dri/card0");
@@ -130,14 +168,22 @@ int main(int argc, char **argv)
 
 	conn_id = conn->connector_id;
 
+	/*
+	 * --threads N renders the patterns with N threads.  Started only
+	 * now, so the early returns above leave no threads behind.
+	 */
+	render_pool_init(&pool, render_pool_parse_threads(argc, argv));
+
 	/* Initialize all buffers in a loop */
 	for (int i = 0; i < MAX_BUFFERS; i++) {
 		bufs[i].width = conn->modes[0].hdisplay;
 		bufs[i].height = conn->modes[0].vdisplay;
+		bufs[i].fmt = fmt;
 		
 		/* Use i as pattern index (0 for RGB, 1 for GBR) */
 		if (modeset_create_fb(fd, &bufs[i], i % 2) < 0) {
 			fprintf(stderr, "Failed to create buffer %d\n", i);
+			render_pool_destroy(&pool);
 			return -1;
 		}
 	}
@@ -161,6 +207,7 @@ int main(int argc, char **argv)
 	drmModeFreeConnector(conn);
 	drmModeFreeResources(res);
 	close(fd);
+	render_pool_destroy(&pool);
 
 	return 0;
 }
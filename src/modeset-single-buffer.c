@@ -11,6 +11,8 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "pixel-format.h"
+
 /**
  * struct buffer_object - Scaffolding for DRM dumb buffer management
  * @width:  Width in pixels
@@ -20,6 +22,7 @@
  * @size:   Total buffer size in bytes
  * @vaddr:  Userspace virtual address (mmap'ed)
  * @fb_id:  Framebuffer ID registered with the DRM subsystem
+ * @fmt:    Pixel format (fourcc, bytes per pixel, packer and writer)
  */
 struct buffer_object {
 	uint32_t width;
@@ -29,6 +32,7 @@ struct buffer_object {
 	uint32_t size;
 	uint8_t *vaddr;
 	uint32_t fb_id;
+	const struct pixel_format *fmt;
 };
 
 /**
@@ -41,8 +45,9 @@ struct buffer_object {
  */
 static int modeset_create_fb(int fd, struct buffer_object *bo)
 {
-	struct drm_mode_create_dumb create = { .width = bo->width, .height = bo->height, .bpp = 32 };
+	struct drm_mode_create_dumb create = { .width = bo->width, .height = bo->height, .bpp = bo->fmt->cpp * 8 };
 	struct drm_mode_map_dumb map = {0};
+	uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
 
 	/* 1. Allocate memory on the device for the dumb buffer */
 	if (drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) return -1;
@@ -51,8 +56,15 @@ static int modeset_create_fb(int fd, struct buffer_object *bo)
 	bo->size = create.size;
 	bo->handle = create.handle;
 
-	/* 2. Create a Framebuffer (FB) object that references our dumb buffer */
-	if (drmModeAddFB(fd, bo->width, bo->height, 24, 32, bo->pitch, bo->handle, &bo->fb_id)) return -1;
+	/*
+	 * 2. Create a Framebuffer (FB) object that references our dumb buffer.
+	 *    AddFB2 takes a fourcc, so the layout is exact (RGB565, 10-bit...)
+	 *    rather than implied by the legacy depth/bpp pair.
+	 */
+	handles[0] = bo->handle;
+	pitches[0] = bo->pitch;
+	if (drmModeAddFB2(fd, bo->width, bo->height, bo->fmt->fourcc,
+			  handles, pitches, offsets, &bo->fb_id, 0)) return -1;
 
 	/* 3. Prepare the buffer for memory mapping */
 	map.handle = bo->handle;
@@ -62,18 +74,23 @@ static int modeset_create_fb(int fd, struct buffer_object *bo)
 	bo->vaddr = mmap(0, bo->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map.offset);
 	if (bo->vaddr == MAP_FAILED) return -1;
 
-	/* 5. Draw RGB vertical bars. Note: pitch is used for proper memory alignment */
-	uint32_t *pixel = (uint32_t *)bo->vaddr;
+	/*
+	 * 5. Draw RGB vertical bars. Note: pitch is used for proper memory alignment.
+	 *    Colors are packed into the buffer's format once, and each bar is one
+	 *    solid run per row written by the format's span writer.
+	 */
+	uint32_t red   = bo->fmt->pack(0xff0000);
+	uint32_t green = bo->fmt->pack(0x00ff00);
+	uint32_t blue  = bo->fmt->pack(0x0000ff);
+	uint32_t x1 = bo->width / 3, x2 = (bo->width * 2) / 3;
+	uint32_t cpp = bo->fmt->cpp;
+
 	for (uint32_t y = 0; y < bo->height; y++) {
-		for (uint32_t x = 0; x < bo->width; x++) {
-			uint32_t offset = y * (bo->pitch / 4) + x;
-			if (x < bo->width / 3)
-				pixel[offset] = 0xff0000; // Red
-			else if (x < (bo->width * 2) / 3)
-				pixel[offset] = 0x00ff00; // Green
-			else
-				pixel[offset] = 0x0000ff; // Blue
-		}
+		uint8_t *row = bo->vaddr + (size_t)y * bo->pitch;
+
+		bo->fmt->fill(row, red, x1);
+		bo->fmt->fill(row + (size_t)x1 * cpp, green, x2 - x1);
+		bo->fmt->fill(row + (size_t)x2 * cpp, blue, bo->width - x2);
 	}
 	return 0;
 }
@@ -96,6 +113,10 @@ int main(int argc, char **argv)
 	uint32_t conn_id, crtc_id;
 	struct buffer_object buf = {0};
 
+	/* --format F selects the scanout pixel format (default XRGB8888) */
+	buf.fmt = pixel_format_parse(argc, argv);
+	if (!buf.fmt) return -1;
+
 	/* Open the primary DRM device */
 	fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
 	if (fd < 0) {
@@ -151,7 +172,7 @@ int main(int argc, char **argv)
 	buf.width = conn->modes[0].hdisplay;
 	buf.height = conn->modes[0].vdisplay;
 
-	printf("Targeting Resolution: %dx%d @ %dHz\n", buf.width, buf.height, conn->modes[0].vrefresh);
+	printf("Targeting Resolution: %dx%d @ %dHz, format %s\n", buf.width, buf.height, conn->modes[0].vrefresh, buf.fmt->name);
 
 	/* Prepare the framebuffer */
 	if (modeset_create_fb(fd, &buf) < 0) {
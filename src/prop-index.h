@@ -0,0 +1,215 @@
+#ifndef PROP_INDEX_H
+#define PROP_INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* ============================================================
+ * prop-index.h - Property metadata fetched once per property ID
+ *
+ * drmModeObjectGetProperties() returns only (property ID, value)
+ * pairs; the name, flags, range and enum names come from a separate
+ * DRM_IOCTL_MODE_GETPROPERTY per property, usually two (one for the
+ * counts, one for the arrays).  Finding "zpos" on a plane that way
+ * fetches every property of the plane, and the next plane fetches the
+ * same ones again: property IDs are global to the device, so all
+ * planes share "FB_ID", "CRTC_X", "zpos" and so on.  On a VOP2 with
+ * a dozen planes that is hundreds of ioctls before the first frame.
+ *
+ * struct prop_index is a hash table from property ID to its metadata,
+ * filled on first use.  Every name lookup and every dump goes through
+ * it, so each property is fetched from the kernel once per process.
+ * Metadata never changes while the device is open; current values are
+ * per object and still come from drmModeObjectGetProperties().
+ *
+ * The GETPROPERTY ioctls are issued here directly and counted.  Every
+ * lookup used to be a drmModeGetProperty() call, which always issues
+ * two, so 2 * lookups is what the same code cost without the index.
+ * ============================================================ */
+
+#define PROP_INDEX_MIN_SLOTS 128
+
+struct prop_info {
+	uint32_t  id;
+	uint32_t  flags;   /* DRM_MODE_PROP_* */
+	char      name[DRM_PROP_NAME_LEN];
+	uint32_t  count_values;
+	uint64_t *values;  /* Range: min, max; enum/bitmask: the values */
+	uint32_t  count_enums;
+	struct drm_mode_property_enum *enums;
+};
+
+struct prop_index {
+	int                fd;
+	struct prop_info **slots; /* Open addressing, power of two */
+	uint32_t           nslots;
+	uint32_t           count;
+
+	/* Statistics */
+	uint64_t lookups;
+	uint64_t ioctls; /* GETPROPERTY issued */
+};
+
+static inline void prop_index_init(struct prop_index *ix, int fd)
+{
+	memset(ix, 0, sizeof(*ix));
+	ix->fd = fd;
+}
+
+static inline void prop_index_destroy(struct prop_index *ix)
+{
+	for (uint32_t i = 0; i < ix->nslots; i++) {
+		if (!ix->slots[i])
+			continue;
+		free(ix->slots[i]->values);
+		free(ix->slots[i]->enums);
+		free(ix->slots[i]);
+	}
+	free(ix->slots);
+	prop_index_init(ix, -1);
+}
+
+static inline uint32_t prop_index_slot(const struct prop_index *ix,
+				       uint32_t id)
+{
+	uint32_t i = id * 2654435761u & (ix->nslots - 1);
+
+	while (ix->slots[i] && ix->slots[i]->id != id)
+		i = (i + 1) & (ix->nslots - 1);
+	return i;
+}
+
+/* Keep the load factor under 3/4; returns -1 if out of memory */
+static inline int prop_index_reserve(struct prop_index *ix)
+{
+	struct prop_info **old = ix->slots;
+	uint32_t nold = ix->nslots;
+
+	if ((ix->count + 1) * 4 < ix->nslots * 3)
+		return 0;
+
+	uint32_t n = nold ? nold * 2 : PROP_INDEX_MIN_SLOTS;
+	struct prop_info **slots = calloc(n, sizeof(*slots));
+	if (!slots)
+		return -1;
+	ix->slots  = slots;
+	ix->nslots = n;
+	for (uint32_t i = 0; i < nold; i++)
+		if (old[i])
+			ix->slots[prop_index_slot(ix, old[i]->id)] = old[i];
+	free(old);
+	return 0;
+}
+
+/*
+ * DRM_IOCTL_MODE_GETPROPERTY for @id: the first call reports the
+ * array sizes, a second fills the arrays if there are any.
+ */
+static inline struct prop_info *prop_index_fetch(struct prop_index *ix,
+						 uint32_t id)
+{
+	struct drm_mode_get_property arg = { .prop_id = id };
+	struct prop_info *info = calloc(1, sizeof(*info));
+
+	if (!info)
+		return NULL;
+	info->id = id;
+
+	ix->ioctls++;
+	if (drmIoctl(ix->fd, DRM_IOCTL_MODE_GETPROPERTY, &arg))
+		goto fail;
+
+	/* Only enum and bitmask properties have enums; blobs are legacy */
+	if (!(arg.flags & (DRM_MODE_PROP_ENUM | DRM_MODE_PROP_BITMASK)))
+		arg.count_enum_blobs = 0;
+	info->count_values = arg.count_values;
+	info->count_enums  = arg.count_enum_blobs;
+	if (arg.count_values || arg.count_enum_blobs) {
+		info->values = calloc(arg.count_values + 1,
+				      sizeof(*info->values));
+		info->enums  = calloc(arg.count_enum_blobs + 1,
+				      sizeof(*info->enums));
+		if (!info->values || !info->enums)
+			goto fail;
+		arg.values_ptr    = (uint64_t)(uintptr_t)info->values;
+		arg.enum_blob_ptr = (uint64_t)(uintptr_t)info->enums;
+
+		ix->ioctls++;
+		if (drmIoctl(ix->fd, DRM_IOCTL_MODE_GETPROPERTY, &arg))
+			goto fail;
+	}
+
+	info->flags = arg.flags;
+	memcpy(info->name, arg.name, sizeof(info->name));
+	info->name[sizeof(info->name) - 1] = '\0';
+	return info;
+
+fail:
+	free(info->values);
+	free(info->enums);
+	free(info);
+	return NULL;
+}
+
+/* ============================================================
+ * prop_index_get - Metadata of property @id.
+ *
+ * Fetched from the kernel on first use, from the table afterwards.
+ * Returns NULL if the kernel does not know @id (or out of memory);
+ * the pointer stays valid until prop_index_destroy().
+ * ============================================================ */
+static inline const struct prop_info *prop_index_get(struct prop_index *ix,
+						     uint32_t id)
+{
+	ix->lookups++;
+	if (ix->nslots) {
+		struct prop_info *hit = ix->slots[prop_index_slot(ix, id)];
+		if (hit)
+			return hit;
+	}
+
+	if (prop_index_reserve(ix) < 0)
+		return NULL;
+	struct prop_info *info = prop_index_fetch(ix, id);
+	if (!info)
+		return NULL;
+	ix->slots[prop_index_slot(ix, id)] = info;
+	ix->count++;
+	return info;
+}
+
+/* ============================================================
+ * prop_index_find - Position of property @name in an object's list.
+ * @props: From drmModeObjectGetProperties().
+ *
+ * Returns the index into @props->props / ->prop_values, or -1.
+ * ============================================================ */
+static inline int prop_index_find(struct prop_index *ix,
+				  const drmModeObjectProperties *props,
+				  const char *name)
+{
+	for (uint32_t i = 0; i < props->count_props; i++) {
+		const struct prop_info *info =
+			prop_index_get(ix, props->props[i]);
+		if (info && strcmp(info->name, name) == 0)
+			return (int)i;
+	}
+	return -1;
+}
+
+/* GETPROPERTY ioctls so far, and what a fetch per lookup would cost */
+static inline void prop_index_report(const struct prop_index *ix,
+				     const char *when)
+{
+	printf("Property index (%s): %u properties, %llu lookups, "
+	       "%llu GETPROPERTY ioctls (%llu without the index)\n",
+	       when, ix->count, (unsigned long long)ix->lookups,
+	       (unsigned long long)ix->ioctls,
+	       (unsigned long long)(2 * ix->lookups));
+}
+
+#endif /* PROP_INDEX_H */
@@ -0,0 +1,373 @@
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* ============================================================
+ * render-pool.h - Persistent worker pool for band rendering
+ *
+ * A frame is cut into horizontal bands and the bands are spread over
+ * a fixed set of threads that live for the whole run (no per-frame
+ * pthread_create).  The thread that calls render_pool_run() works on
+ * bands too and only returns once every band is finished, so the call
+ * doubles as the barrier in front of the atomic commit: the kernel is
+ * never handed a framebuffer that a worker is still writing.
+ *
+ * Band layout:
+ *   - Band height is rounded so that every band starts on a 64-byte
+ *     cache line (relevant when the pitch is not a multiple of 64),
+ *     so two threads never write the same line.
+ *   - There are RENDER_POOL_BANDS_PER_THREAD bands per thread.  Each
+ *     thread owns a contiguous run of them, and a thread that runs out
+ *     steals from the front of the other threads' runs.  Claiming is a
+ *     single atomic fetch-add on the owner's cursor, so stealing needs
+ *     no locks and each band is rendered exactly once.
+ *
+ * Workers are pinned one per core, fastest cores first (RK3588: the
+ * Cortex-A76 cluster, cpu_capacity 1024, before the A55s).  The calling
+ * thread is left unpinned because it also services DRM events.
+ *
+ * A pool of one thread spawns nothing and just calls the band function
+ * inline, which is also what happens for jobs too small to be worth a
+ * wakeup (e.g. the narrow damage strips of an incremental redraw).
+ * ============================================================ */
+
+#define RENDER_POOL_MAX_THREADS      64
+#define RENDER_POOL_BANDS_PER_THREAD 4
+#define RENDER_POOL_CACHE_LINE       64
+#define RENDER_POOL_MIN_BYTES        (256 * 1024)
+
+typedef void (*render_band_fn)(void *ctx, uint32_t y0, uint32_t y1);
+
+struct render_pool;
+
+struct render_worker {
+	_Atomic uint32_t    next;   /* Next unclaimed band in this run */
+	uint32_t            end;    /* One past the last band          */
+	uint64_t            stolen; /* Bands taken from other runs     */
+	pthread_t           thread;
+	struct render_pool *pool;
+	int                 index;
+	int                 cpu;    /* Pinned CPU, -1 if not pinned    */
+} __attribute__((aligned(RENDER_POOL_CACHE_LINE)));
+
+struct render_pool {
+	int             nthreads; /* Including the calling thread */
+	pthread_mutex_t lock;
+	pthread_cond_t  start_cv;
+	pthread_cond_t  done_cv;
+	uint64_t        generation;
+	int             busy;
+	bool            quit;
+
+	/* Current job, written under lock before generation++ */
+	render_band_fn  fn;
+	void           *ctx;
+	uint32_t        y0, y1;
+	uint32_t        band_rows;
+
+	struct render_worker workers[RENDER_POOL_MAX_THREADS];
+};
+
+/* Bands rendered by a thread other than their owner, all threads */
+static inline uint64_t render_pool_stolen(const struct render_pool *p)
+{
+	uint64_t n = 0;
+	for (int i = 0; i < p->nthreads; i++)
+		n += p->workers[i].stolen;
+	return n;
+}
+
+/* ============================================================
+ * render_pool_cpu_order - Online CPUs sorted by cpu_capacity, fastest
+ *                         first.  Falls back to index order when the
+ *                         kernel does not export capacities.
+ * ============================================================ */
+static inline int render_pool_cpu_order(int *cpus, int max)
+{
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	int n = (online > 0 && online < max) ? (int)online : max;
+	int cap[RENDER_POOL_MAX_THREADS] = {0};
+
+	for (int i = 0; i < n; i++) {
+		char path[96];
+		FILE *f;
+
+		cpus[i] = i;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cpu_capacity", i);
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%d", &cap[i]) != 1)
+				cap[i] = 0;
+			fclose(f);
+		}
+	}
+
+	/* Insertion sort: n is at most a few dozen */
+	for (int i = 1; i < n; i++) {
+		int c = cpus[i];
+		int j = i - 1;
+		while (j >= 0 && cap[cpus[j]] < cap[c]) {
+			cpus[j + 1] = cpus[j];
+			j--;
+		}
+		cpus[j + 1] = c;
+	}
+	return n;
+}
+
+static inline void render_pool_work(struct render_pool *p, int self)
+{
+	for (int k = 0; k < p->nthreads; k++) {
+		struct render_worker *victim =
+			&p->workers[(self + k) % p->nthreads];
+
+		for (;;) {
+			uint32_t b = atomic_fetch_add_explicit(&victim->next, 1,
+							       memory_order_relaxed);
+			if (b >= victim->end)
+				break;
+
+			uint32_t y0 = p->y0 + b * p->band_rows;
+			uint32_t y1 = y0 + p->band_rows;
+			if (y1 > p->y1)
+				y1 = p->y1;
+			p->fn(p->ctx, y0, y1);
+			if (k)
+				p->workers[self].stolen++;
+		}
+	}
+}
+
+static inline void *render_pool_thread(void *arg)
+{
+	struct render_worker *w = arg;
+	struct render_pool *p = w->pool;
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->generation == seen && !p->quit)
+			pthread_cond_wait(&p->start_cv, &p->lock);
+		if (p->quit)
+			break;
+		seen = p->generation;
+		pthread_mutex_unlock(&p->lock);
+
+		render_pool_work(p, w->index);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->busy == 0)
+			pthread_cond_signal(&p->done_cv);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* ============================================================
+ * render_pool_init - Start @nthreads - 1 pinned worker threads.
+ * @p:        Pool to initialise.
+ * @nthreads: Total rendering threads including the caller (>= 1).
+ *
+ * Returns 0 on success, -1 if a worker could not be created (the
+ * pool then runs with however many threads did start).
+ * ============================================================ */
+static inline int render_pool_init(struct render_pool *p, int nthreads)
+{
+	int cpus[RENDER_POOL_MAX_THREADS];
+	int ncpus = render_pool_cpu_order(cpus, RENDER_POOL_MAX_THREADS);
+	int ret = 0;
+
+	memset(p, 0, sizeof(*p));
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > RENDER_POOL_MAX_THREADS)
+		nthreads = RENDER_POOL_MAX_THREADS;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start_cv, NULL);
+	pthread_cond_init(&p->done_cv, NULL);
+
+	p->nthreads = 1;
+	p->workers[0].pool  = p;
+	p->workers[0].index = 0;
+	p->workers[0].cpu   = -1;
+
+	for (int i = 1; i < nthreads; i++) {
+		struct render_worker *w = &p->workers[i];
+
+		w->pool  = p;
+		w->index = i;
+		w->cpu   = ncpus > 0 ? cpus[i % ncpus] : -1;
+		if (pthread_create(&w->thread, NULL, render_pool_thread, w)) {
+			perror("pthread_create (render worker)");
+			ret = -1;
+			break;
+		}
+		if (w->cpu >= 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(w->cpu, &set);
+			if (pthread_setaffinity_np(w->thread, sizeof(set), &set))
+				w->cpu = -1;
+		}
+		p->nthreads++;
+	}
+	return ret;
+}
+
+static inline void render_pool_destroy(struct render_pool *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_broadcast(&p->start_cv);
+	pthread_mutex_unlock(&p->lock);
+
+	for (int i = 1; i < p->nthreads; i++)
+		pthread_join(p->workers[i].thread, NULL);
+
+	pthread_cond_destroy(&p->done_cv);
+	pthread_cond_destroy(&p->start_cv);
+	pthread_mutex_destroy(&p->lock);
+	p->nthreads = 0;
+}
+
+static inline uint32_t render_pool_gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* ============================================================
+ * render_pool_run - Render rows [y0, y1) in bands and wait for them.
+ * @p:         The pool.
+ * @fn:        Band callback, called as fn(ctx, band_y0, band_y1).
+ * @ctx:       Opaque job context passed to @fn.
+ * @y0, @y1:   Row range of the job.
+ * @pitch:     Row stride in bytes (for cache-line aligned bands).
+ * @row_bytes: Bytes written per row (for the inline threshold).
+ *
+ * Returns after every band has been rendered.
+ * ============================================================ */
+static inline void render_pool_run(struct render_pool *p, render_band_fn fn,
+				   void *ctx, uint32_t y0, uint32_t y1,
+				   uint32_t pitch, uint32_t row_bytes)
+{
+	if (y1 <= y0)
+		return;
+
+	uint32_t rows = y1 - y0;
+	if (p->nthreads <= 1 ||
+	    (uint64_t)rows * row_bytes < RENDER_POOL_MIN_BYTES) {
+		fn(ctx, y0, y1);
+		return;
+	}
+
+	/* Rows per band must be a multiple of this for line alignment */
+	uint32_t align = RENDER_POOL_CACHE_LINE /
+			 render_pool_gcd(pitch, RENDER_POOL_CACHE_LINE);
+	uint32_t nbands = (uint32_t)p->nthreads * RENDER_POOL_BANDS_PER_THREAD;
+	uint32_t band = (rows + nbands - 1) / nbands;
+	band = (band + align - 1) / align * align;
+	nbands = (rows + band - 1) / band;
+
+	pthread_mutex_lock(&p->lock);
+	p->fn        = fn;
+	p->ctx       = ctx;
+	p->y0        = y0;
+	p->y1        = y1;
+	p->band_rows = band;
+
+	/* Hand each thread an equal contiguous run of bands */
+	for (int i = 0; i < p->nthreads; i++) {
+		struct render_worker *w = &p->workers[i];
+		uint32_t first = nbands * (uint32_t)i / (uint32_t)p->nthreads;
+		uint32_t last  = nbands * (uint32_t)(i + 1) / (uint32_t)p->nthreads;
+
+		atomic_store_explicit(&w->next, first, memory_order_relaxed);
+		w->end = last;
+	}
+	p->busy = p->nthreads - 1;
+	p->generation++;
+	pthread_cond_broadcast(&p->start_cv);
+	pthread_mutex_unlock(&p->lock);
+
+	render_pool_work(p, 0);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->busy)
+		pthread_cond_wait(&p->done_cv, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+struct render_pool_touch {
+	uint8_t *base;
+	size_t   page;
+};
+
+static inline void render_pool_touch_band(void *ctx, uint32_t p0, uint32_t p1)
+{
+	const struct render_pool_touch *t = ctx;
+
+	for (uint32_t i = p0; i < p1; i++) {
+		volatile uint8_t *b = t->base + (size_t)i * t->page;
+		*b = *b;
+	}
+}
+
+/* ============================================================
+ * render_pool_prefault - Write-fault every page of [@addr, @addr +
+ *                        @len) in, one byte per page, on the pool.
+ *
+ * The contents are left as they are.  For mappings that fault pages
+ * in on first touch (MAP_POPULATE does nothing for GEM's PFN
+ * mappings), this takes the faults up front and spreads them over
+ * the worker threads.
+ * ============================================================ */
+static inline void render_pool_prefault(struct render_pool *p, void *addr,
+					size_t len)
+{
+	struct render_pool_touch t = {
+		.base = addr,
+		.page = (size_t)sysconf(_SC_PAGESIZE),
+	};
+	uint32_t pages = (uint32_t)((len + t.page - 1) / t.page);
+
+	render_pool_run(p, render_pool_touch_band, &t, 0, pages,
+			(uint32_t)t.page, (uint32_t)t.page);
+}
+
+/* "--threads N" anywhere on the command line; 1 if absent */
+static inline int render_pool_parse_threads(int argc, char **argv)
+{
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--threads") == 0) {
+			int n = atoi(argv[i + 1]);
+			return n > 0 ? n : 1;
+		}
+	}
+	return 1;
+}
+
+static inline double render_pool_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec / 1e6;
+}
+
+#endif /* RENDER_POOL_H */
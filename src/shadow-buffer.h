@@ -0,0 +1,336 @@
+#ifndef SHADOW_BUFFER_H
+#define SHADOW_BUFFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHADOW_COPY_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SHADOW_COPY_NEON 1
+#endif
+
+#include "damage.h"
+#include "render-pool.h"
+
+/* ============================================================
+ * shadow-buffer.h - Cached shadow framebuffer with streaming flush
+ *
+ * A dumb buffer mapped through DRM_IOCTL_MODE_MAP_DUMB is usually
+ * write-combined (or outright uncached) on the CPU side.  Full-line
+ * sequential stores to such a mapping are fine, but anything that
+ * reads it back, or writes it in small scattered pieces, goes to DRAM
+ * one transaction at a time.
+ *
+ * In shadow mode the renderer draws into an ordinary cached buffer in
+ * system memory (64-byte aligned rows), which always holds the latest
+ * frame.  Each frame only the damaged rectangles of the scanout buffer
+ * are then copied out of the shadow, row by row, with non-temporal
+ * stores that bypass the cache and fill whole write-combining lines:
+ *
+ *   avx-stream   32-byte VMOVNTDQ, x86 with AVX
+ *   sse2-stream  16-byte MOVNTDQ, any x86-64
+ *   neon-stream  32-byte STNP pairs, AArch64
+ *   memcpy       libc memcpy, always available (the baseline)
+ *
+ * Because the shadow is always current, it is redrawn with the damage
+ * of one frame only, while the copy covers the age-based repaint
+ * region of the buffer being flushed (see damage.h).
+ *
+ * Setting SHADOW_COPY=<name> in the environment forces a copy kernel.
+ * ============================================================ */
+
+#define SHADOW_BUFFER_ALIGN 64
+
+typedef void (*shadow_copy_fn)(uint8_t *dst, const uint8_t *src,
+			       uint32_t bytes);
+
+struct shadow_copy_impl {
+	const char     *name;
+	shadow_copy_fn  copy;
+	void          (*fence)(void); /* Orders streaming stores, or NULL */
+	bool          (*supported)(void);
+};
+
+struct shadow_buffer {
+	uint8_t *pixels;
+	uint32_t width;
+	uint32_t height;
+	uint32_t cpp;    /* Bytes per pixel, same as the scanout buffer */
+	uint32_t pitch;
+	size_t   size;
+	bool     valid;  /* Holds a complete frame */
+};
+
+static inline void shadow_copy_memcpy(uint8_t *dst, const uint8_t *src,
+				      uint32_t bytes)
+{
+	memcpy(dst, src, bytes);
+}
+
+static inline bool shadow_copy_always(void)
+{
+	return true;
+}
+
+#ifdef SHADOW_COPY_X86
+/*
+ * The stream kernels copy a scalar head up to the vector alignment of
+ * @dst (the shadow side may be misaligned by a different amount, so
+ * loads are unaligned), then write one full 64-byte line per loop.
+ * Streaming stores are weakly ordered: shadow_copy_sfence() must run
+ * on the same thread before the buffer is handed to the display.
+ */
+__attribute__((target("sse2")))
+static inline void shadow_copy_sse2_stream(uint8_t *dst, const uint8_t *src,
+					   uint32_t bytes)
+{
+	uint32_t head = (uint32_t)(-(uintptr_t)dst & 15);
+
+	if (head > bytes)
+		head = bytes;
+	memcpy(dst, src, head);
+	dst += head; src += head; bytes -= head;
+
+	for (; bytes >= 64; bytes -= 64, dst += 64, src += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src + 0);
+		__m128i b = _mm_loadu_si128((const __m128i *)src + 1);
+		__m128i c = _mm_loadu_si128((const __m128i *)src + 2);
+		__m128i d = _mm_loadu_si128((const __m128i *)src + 3);
+		_mm_stream_si128((__m128i *)dst + 0, a);
+		_mm_stream_si128((__m128i *)dst + 1, b);
+		_mm_stream_si128((__m128i *)dst + 2, c);
+		_mm_stream_si128((__m128i *)dst + 3, d);
+	}
+	for (; bytes >= 16; bytes -= 16, dst += 16, src += 16)
+		_mm_stream_si128((__m128i *)dst,
+				 _mm_loadu_si128((const __m128i *)src));
+
+	memcpy(dst, src, bytes);
+}
+
+__attribute__((target("avx")))
+static inline void shadow_copy_avx_stream(uint8_t *dst, const uint8_t *src,
+					  uint32_t bytes)
+{
+	uint32_t head = (uint32_t)(-(uintptr_t)dst & 31);
+
+	if (head > bytes)
+		head = bytes;
+	memcpy(dst, src, head);
+	dst += head; src += head; bytes -= head;
+
+	for (; bytes >= 64; bytes -= 64, dst += 64, src += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)src + 0);
+		__m256i b = _mm256_loadu_si256((const __m256i *)src + 1);
+		_mm256_stream_si256((__m256i *)dst + 0, a);
+		_mm256_stream_si256((__m256i *)dst + 1, b);
+	}
+	for (; bytes >= 32; bytes -= 32, dst += 32, src += 32)
+		_mm256_stream_si256((__m256i *)dst,
+				    _mm256_loadu_si256((const __m256i *)src));
+
+	memcpy(dst, src, bytes);
+}
+
+static inline void shadow_copy_sfence(void)
+{
+	_mm_sfence();
+}
+
+static inline bool shadow_copy_has_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+static inline bool shadow_copy_has_avx(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx");
+}
+#endif /* SHADOW_COPY_X86 */
+
+#ifdef SHADOW_COPY_NEON
+/*
+ * STNP is the AArch64 non-temporal store pair: a hint that the line
+ * will not be read again soon, so the core need not allocate it.  It
+ * has no intrinsic, hence the inline asm.  Ordering is the normal
+ * memory model; the pool barrier (a mutex) is enough before the flip.
+ */
+static inline void shadow_copy_neon_stream(uint8_t *dst, const uint8_t *src,
+					   uint32_t bytes)
+{
+	uint32_t head = (uint32_t)(-(uintptr_t)dst & 15);
+
+	if (head > bytes)
+		head = bytes;
+	memcpy(dst, src, head);
+	dst += head; src += head; bytes -= head;
+
+	for (; bytes >= 64; bytes -= 64, dst += 64, src += 64) {
+		uint8x16_t a = vld1q_u8(src + 0);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+		__asm__ volatile("stnp %q0, %q1, [%2]\n\t"
+				 "stnp %q3, %q4, [%2, #32]"
+				 :
+				 : "w"(a), "w"(b), "r"(dst), "w"(c), "w"(d)
+				 : "memory");
+	}
+
+	memcpy(dst, src, bytes);
+}
+#endif /* SHADOW_COPY_NEON */
+
+static const struct shadow_copy_impl shadow_copy_impls[] = {
+#ifdef SHADOW_COPY_X86
+	{ "avx-stream",  shadow_copy_avx_stream,  shadow_copy_sfence,
+	  shadow_copy_has_avx },
+	{ "sse2-stream", shadow_copy_sse2_stream, shadow_copy_sfence,
+	  shadow_copy_has_sse2 },
+#endif
+#ifdef SHADOW_COPY_NEON
+	{ "neon-stream", shadow_copy_neon_stream, NULL, shadow_copy_always },
+#endif
+	{ "memcpy",      shadow_copy_memcpy,      NULL, shadow_copy_always },
+};
+
+#define SHADOW_COPY_NUM_IMPLS \
+	(sizeof(shadow_copy_impls) / sizeof(shadow_copy_impls[0]))
+
+/* ============================================================
+ * shadow_copy_select - Pick the flush kernel for this CPU (cached).
+ *
+ * Returns the first supported entry of shadow_copy_impls[], or the one
+ * named by $SHADOW_COPY if it exists and the CPU supports it.
+ * ============================================================ */
+static inline const struct shadow_copy_impl *shadow_copy_select(void)
+{
+	static const struct shadow_copy_impl *chosen;
+
+	if (chosen)
+		return chosen;
+
+	const char *force = getenv("SHADOW_COPY");
+	for (size_t i = 0; i < SHADOW_COPY_NUM_IMPLS; i++) {
+		const struct shadow_copy_impl *impl = &shadow_copy_impls[i];
+		if (!impl->supported())
+			continue;
+		if (force && strcmp(force, impl->name) != 0)
+			continue;
+		chosen = impl;
+		break;
+	}
+	if (!chosen) {
+		fprintf(stderr, "SHADOW_COPY=%s not available, using default\n",
+			force);
+		for (size_t i = 0; !chosen && i < SHADOW_COPY_NUM_IMPLS; i++)
+			if (shadow_copy_impls[i].supported())
+				chosen = &shadow_copy_impls[i];
+	}
+	return chosen;
+}
+
+/* Allocate a zeroed shadow; rows are padded to a cache line */
+static inline int shadow_buffer_init(struct shadow_buffer *sb,
+				     uint32_t width, uint32_t height,
+				     uint32_t cpp)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->width  = width;
+	sb->height = height;
+	sb->cpp    = cpp;
+	sb->pitch  = (width * cpp + SHADOW_BUFFER_ALIGN - 1) &
+		     ~(uint32_t)(SHADOW_BUFFER_ALIGN - 1);
+	sb->size   = (size_t)sb->pitch * height;
+
+	sb->pixels = aligned_alloc(SHADOW_BUFFER_ALIGN, sb->size);
+	if (!sb->pixels) {
+		perror("aligned_alloc (shadow buffer)");
+		return -1;
+	}
+	memset(sb->pixels, 0, sb->size); /* Fault every page in up front */
+	return 0;
+}
+
+static inline void shadow_buffer_free(struct shadow_buffer *sb)
+{
+	free(sb->pixels);
+	memset(sb, 0, sizeof(*sb));
+}
+
+struct shadow_copy_job {
+	const struct shadow_copy_impl *impl;
+	uint8_t       *dst;
+	uint32_t       dst_pitch;
+	const uint8_t *src;
+	uint32_t       src_pitch;
+	uint32_t       x_bytes;  /* Byte offset of the rect in each row */
+	uint32_t       bytes;    /* Bytes per row                       */
+};
+
+/* render_band_fn: copy rows [y0, y1) of one rectangle */
+static inline void shadow_copy_band(void *ctx, uint32_t y0, uint32_t y1)
+{
+	const struct shadow_copy_job *j = ctx;
+
+	for (uint32_t y = y0; y < y1; y++)
+		j->impl->copy(j->dst + (size_t)y * j->dst_pitch + j->x_bytes,
+			      j->src + (size_t)y * j->src_pitch + j->x_bytes,
+			      j->bytes);
+	if (j->impl->fence)
+		j->impl->fence();
+}
+
+/* ============================================================
+ * shadow_buffer_flush - Copy @region of the shadow into a mapping.
+ * @pool:      Worker pool the rows are spread over.
+ * @sb:        Source shadow buffer.
+ * @dst:       Destination mapping (same size and format as @sb).
+ * @dst_pitch: Destination row stride in bytes.
+ * @region:    Rectangles to copy, or NULL for the whole frame.
+ * @impl:      Copy kernel, normally shadow_copy_select().
+ *
+ * Every band is fenced on the thread that wrote it and the pool waits
+ * for all bands, so the copy is complete and visible on return.
+ * ============================================================ */
+static inline void shadow_buffer_flush(struct render_pool *pool,
+				       const struct shadow_buffer *sb,
+				       uint8_t *dst, uint32_t dst_pitch,
+				       const struct damage_region *region,
+				       const struct shadow_copy_impl *impl)
+{
+	struct damage_region full;
+	struct shadow_copy_job job = {
+		.impl      = impl,
+		.dst       = dst,
+		.dst_pitch = dst_pitch,
+		.src       = sb->pixels,
+		.src_pitch = sb->pitch,
+	};
+
+	if (!region) {
+		damage_region_full(&full, (int32_t)sb->width,
+				   (int32_t)sb->height);
+		region = &full;
+	}
+
+	for (uint32_t i = 0; i < region->count; i++) {
+		const struct damage_rect *r = &region->rects[i];
+
+		job.x_bytes = (uint32_t)r->x1 * sb->cpp;
+		job.bytes   = (uint32_t)(r->x2 - r->x1) * sb->cpp;
+		render_pool_run(pool, shadow_copy_band, &job,
+				(uint32_t)r->y1, (uint32_t)r->y2, dst_pitch,
+				job.bytes);
+	}
+}
+
+#endif /* SHADOW_BUFFER_H */
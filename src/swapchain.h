@@ -0,0 +1,288 @@
+#ifndef SWAPCHAIN_H
+#define SWAPCHAIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================
+ * swapchain.h - Buffer rotation with FIFO / mailbox / immediate
+ *               present modes
+ *
+ * With two buffers and "back = 1 - cur" the renderer can never get
+ * ahead of the display: one buffer is on screen, the other is waiting
+ * for the flip, and nothing is left to draw into until the flip event
+ * arrives.  The swapchain tracks 2..SWAPCHAIN_MAX_DEPTH buffers by
+ * index (the caller keeps its own struct buffer_object array) through
+ * four states:
+ *
+ *   FREE     -> may be acquired and rendered into
+ *   QUEUED   -> rendered, waiting for its commit
+ *   PENDING  -> committed, flip not completed yet (at most one: KMS
+ *               allows a single outstanding commit per CRTC)
+ *   SCANOUT  -> on screen; becomes FREE when the next flip completes
+ *
+ * Present modes decide what happens to QUEUED frames:
+ *
+ *   fifo       every frame is shown, in order.  The renderer runs up
+ *              to depth - 2 frames ahead and then blocks on the flip
+ *              event, trading latency for never dropping a frame.
+ *   mailbox    at most one frame waits; a newer frame replaces it and
+ *              the old buffer is recycled.  The renderer never blocks
+ *              with depth >= 3 and the frame shown is always the
+ *              newest one.  A commit refused with -EBUSY just leaves
+ *              the frame in the mailbox for the next attempt.
+ *   immediate  mailbox queueing, but commits carry
+ *              DRM_MODE_PAGE_FLIP_ASYNC so the flip does not wait for
+ *              vblank (tears).  Needs DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP;
+ *              the caller falls back to mailbox without it.
+ *
+ * Queueing latency is measured from swapchain_queue() (frame finished)
+ * to swapchain_flip_done() (frame on screen).
+ * ============================================================ */
+
+#define SWAPCHAIN_MIN_DEPTH 2
+#define SWAPCHAIN_MAX_DEPTH 8
+
+enum swapchain_mode {
+	SWAPCHAIN_FIFO,
+	SWAPCHAIN_MAILBOX,
+	SWAPCHAIN_IMMEDIATE,
+};
+
+static const char *const swapchain_mode_names[] = {
+	[SWAPCHAIN_FIFO]      = "fifo",
+	[SWAPCHAIN_MAILBOX]   = "mailbox",
+	[SWAPCHAIN_IMMEDIATE] = "immediate",
+};
+
+enum swapchain_state {
+	SWAPCHAIN_FREE,
+	SWAPCHAIN_QUEUED,
+	SWAPCHAIN_PENDING,
+	SWAPCHAIN_SCANOUT,
+};
+
+struct swapchain_slot {
+	enum swapchain_state state;
+	uint64_t frame;     /* Frame number rendered into the buffer */
+	double   queued_ms; /* When it was queued, for latency       */
+};
+
+struct swapchain {
+	int                 depth;
+	enum swapchain_mode mode;
+	const char         *name; /* Report prefix (one per head), or NULL */
+	struct swapchain_slot slots[SWAPCHAIN_MAX_DEPTH];
+
+	int queue[SWAPCHAIN_MAX_DEPTH]; /* QUEUED slots, oldest first */
+	int queued;
+	int pending;                    /* -1 if no commit in flight  */
+	int scanout;
+
+	/* Statistics, reset by swapchain_report() */
+	uint64_t rendered;
+	uint64_t presented;
+	uint64_t dropped;      /* Mailbox frames replaced before commit */
+	uint64_t busy;         /* Commits refused with -EBUSY           */
+	double   latency_sum_ms;
+	double   latency_max_ms;
+	double   window_ms;    /* Start of the reporting window         */
+};
+
+/* ============================================================
+ * swapchain_init - Set up @depth buffers, @scanout already on screen.
+ * ============================================================ */
+static inline void swapchain_init(struct swapchain *sc, int depth,
+				  enum swapchain_mode mode, int scanout,
+				  double now_ms)
+{
+	memset(sc, 0, sizeof(*sc));
+	sc->depth     = depth;
+	sc->mode      = mode;
+	sc->pending   = -1;
+	sc->scanout   = scanout;
+	sc->window_ms = now_ms;
+	sc->slots[scanout].state = SWAPCHAIN_SCANOUT;
+}
+
+/* Frame number currently on screen (0 = initial contents) */
+static inline uint64_t swapchain_scanout_frame(const struct swapchain *sc)
+{
+	return sc->slots[sc->scanout].frame;
+}
+
+static inline void swapchain_drop_oldest(struct swapchain *sc)
+{
+	int idx = sc->queue[0];
+
+	memmove(&sc->queue[0], &sc->queue[1],
+		(size_t)(sc->queued - 1) * sizeof(sc->queue[0]));
+	sc->queued--;
+	sc->slots[idx].state = SWAPCHAIN_FREE;
+	sc->dropped++;
+}
+
+/* ============================================================
+ * swapchain_acquire - Buffer to render the next frame into.
+ *
+ * Returns a FREE buffer, or -1 when every buffer is busy and the
+ * caller has to wait for a flip event.  In mailbox/immediate mode a
+ * queued frame that has not been committed yet is recycled instead
+ * of waiting -- it would have been replaced anyway.
+ * ============================================================ */
+static inline int swapchain_acquire(struct swapchain *sc)
+{
+	for (int i = 0; i < sc->depth; i++)
+		if (sc->slots[i].state == SWAPCHAIN_FREE)
+			return i;
+
+	if (sc->mode == SWAPCHAIN_FIFO || !sc->queued)
+		return -1;
+
+	int idx = sc->queue[0];
+	swapchain_drop_oldest(sc);
+	return idx;
+}
+
+/* True if swapchain_acquire() would return a buffer */
+static inline bool swapchain_can_acquire(const struct swapchain *sc)
+{
+	for (int i = 0; i < sc->depth; i++)
+		if (sc->slots[i].state == SWAPCHAIN_FREE)
+			return true;
+	return sc->mode != SWAPCHAIN_FIFO && sc->queued;
+}
+
+/* ============================================================
+ * swapchain_queue - Hand a rendered buffer over for presentation.
+ * @frame: Frame number now held by the buffer (for damage clips).
+ * ============================================================ */
+static inline void swapchain_queue(struct swapchain *sc, int idx,
+				   uint64_t frame, double now_ms)
+{
+	if (sc->mode != SWAPCHAIN_FIFO) {
+		while (sc->queued)
+			swapchain_drop_oldest(sc);
+	}
+	sc->slots[idx].state     = SWAPCHAIN_QUEUED;
+	sc->slots[idx].frame     = frame;
+	sc->slots[idx].queued_ms = now_ms;
+	sc->queue[sc->queued++]  = idx;
+	sc->rendered++;
+}
+
+/* Next buffer to commit, or -1 (nothing queued or a flip in flight) */
+static inline int swapchain_next(const struct swapchain *sc)
+{
+	if (sc->pending >= 0 || !sc->queued)
+		return -1;
+	return sc->queue[0];
+}
+
+/* The buffer from swapchain_next() was committed successfully */
+static inline void swapchain_committed(struct swapchain *sc)
+{
+	int idx = sc->queue[0];
+
+	memmove(&sc->queue[0], &sc->queue[1],
+		(size_t)(sc->queued - 1) * sizeof(sc->queue[0]));
+	sc->queued--;
+	sc->slots[idx].state = SWAPCHAIN_PENDING;
+	sc->pending = idx;
+}
+
+/* ============================================================
+ * swapchain_flip_done - Flip event for the pending commit arrived.
+ *
+ * The pending buffer is now on screen and the previous scanout
+ * buffer is released.
+ * ============================================================ */
+static inline void swapchain_flip_done(struct swapchain *sc, double now_ms)
+{
+	int idx = sc->pending;
+
+	if (idx < 0)
+		return;
+
+	double lat = now_ms - sc->slots[idx].queued_ms;
+	sc->latency_sum_ms += lat;
+	if (lat > sc->latency_max_ms)
+		sc->latency_max_ms = lat;
+	sc->presented++;
+
+	sc->slots[sc->scanout].state = SWAPCHAIN_FREE;
+	sc->slots[idx].state = SWAPCHAIN_SCANOUT;
+	sc->scanout = idx;
+	sc->pending = -1;
+}
+
+/* ============================================================
+ * swapchain_report - Print FPS and queueing latency every @every
+ *                    presented frames, then start a new window.
+ * ============================================================ */
+static inline void swapchain_report(struct swapchain *sc, uint32_t every,
+				    double now_ms)
+{
+	if (!every || sc->presented < every)
+		return;
+
+	double secs = (now_ms - sc->window_ms) / 1e3;
+	printf("  [%s%s%s x%d] %.1f fps shown, %.1f fps rendered, "
+	       "latency avg %.2f ms max %.2f ms, %llu dropped, %llu EBUSY\n",
+	       sc->name ? sc->name : "", sc->name ? " " : "",
+	       swapchain_mode_names[sc->mode], sc->depth,
+	       secs > 0 ? (double)sc->presented / secs : 0.0,
+	       secs > 0 ? (double)sc->rendered / secs : 0.0,
+	       sc->latency_sum_ms / (double)sc->presented,
+	       sc->latency_max_ms,
+	       (unsigned long long)sc->dropped,
+	       (unsigned long long)sc->busy);
+
+	sc->rendered = sc->presented = sc->dropped = sc->busy = 0;
+	sc->latency_sum_ms = sc->latency_max_ms = 0;
+	sc->window_ms = now_ms;
+}
+
+/* ============================================================
+ * swapchain_parse - "--buffers N" (default 2) and
+ *                   "--present fifo|mailbox|immediate" (default fifo).
+ *
+ * Returns 0, or -1 after printing the choices for a bad value.
+ * ============================================================ */
+static inline int swapchain_parse(int argc, char **argv, int *depth,
+				  enum swapchain_mode *mode)
+{
+	*depth = SWAPCHAIN_MIN_DEPTH;
+	*mode  = SWAPCHAIN_FIFO;
+
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--buffers") == 0) {
+			*depth = atoi(argv[i + 1]);
+			if (*depth < SWAPCHAIN_MIN_DEPTH ||
+			    *depth > SWAPCHAIN_MAX_DEPTH) {
+				fprintf(stderr, "--buffers must be %d..%d\n",
+					SWAPCHAIN_MIN_DEPTH,
+					SWAPCHAIN_MAX_DEPTH);
+				return -1;
+			}
+		} else if (strcmp(argv[i], "--present") == 0) {
+			int m = -1;
+			for (int k = 0; k <= SWAPCHAIN_IMMEDIATE; k++)
+				if (strcmp(argv[i + 1], swapchain_mode_names[k]) == 0)
+					m = k;
+			if (m < 0) {
+				fprintf(stderr, "Unknown present mode '%s' "
+					"(fifo, mailbox, immediate)\n",
+					argv[i + 1]);
+				return -1;
+			}
+			*mode = (enum swapchain_mode)m;
+		}
+	}
+	return 0;
+}
+
+#endif /* SWAPCHAIN_H */
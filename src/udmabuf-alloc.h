@@ -0,0 +1,169 @@
+#ifndef UDMABUF_ALLOC_H
+#define UDMABUF_ALLOC_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/udmabuf.h>
+
+/* ============================================================
+ * udmabuf-alloc.h - DMA-BUFs made from plain memfd memory
+ *
+ * A dumb buffer can only be allocated on a DRM fd, and its CPU mapping
+ * is write-combined on most ARM display drivers: fine for streaming
+ * stores, slow for anything that reads back or writes unevenly.  A
+ * producer with no DRM device (software decoder, network receiver)
+ * could only copy into such a buffer.
+ *
+ * /dev/udmabuf (CONFIG_UDMABUF) turns the pages of a memfd into a
+ * DMA-BUF instead.  The producer allocates ordinary shmem (or
+ * hugetlbfs) memory, maps it cached, and the display imports the
+ * DMA-BUF with drmPrimeFDToHandle() as it would any other:
+ *
+ *   memfd_create(MFD_ALLOW_SEALING [| MFD_HUGETLB])
+ *   ftruncate, F_ADD_SEALS(F_SEAL_SHRINK | F_SEAL_GROW)
+ *                      udmabuf requires that the pages cannot go away
+ *   mmap(MAP_SHARED | MAP_POPULATE)
+ *   UDMABUF_CREATE     the DMA-BUF fd
+ *
+ * Because the mapping is cached, CPU writes must be bracketed with
+ * DMA_BUF_IOCTL_SYNC on the DMA-BUF, which udmabuf turns into cache
+ * maintenance; the scanout engine must also be able to reach the
+ * pages (an IOMMU, as on VOP2, or memory the controller can address).
+ * ============================================================ */
+
+struct udmabuf_dev {
+	int      fd;        /* /dev/udmabuf, -1 if not in use        */
+	bool     hugetlb;   /* Try MFD_HUGETLB first                  */
+	uint64_t huge_page; /* Default hugetlbfs page size, 0: none   */
+};
+
+/* One allocation */
+struct udmabuf_mem {
+	int      memfd;
+	int      dmabuf_fd;
+	uint8_t *vaddr;
+	uint64_t size;   /* Mapped, rounded up to the page size */
+	bool     huge;   /* Backed by hugetlbfs                 */
+};
+
+/*
+ * The default huge page size, which MFD_HUGETLB without a size flag
+ * uses: 2 MiB on x86 and 4K-granule arm64, but 32 MiB or 512 MiB with
+ * 16K or 64K pages.  Returns 0 if hugetlbfs is not available.
+ */
+static inline uint64_t udmabuf_huge_page_size(void)
+{
+	FILE *f = fopen("/proc/meminfo", "re");
+	unsigned long long kb = 0;
+	char line[128];
+
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Hugepagesize: %llu kB", &kb) == 1)
+			break;
+	fclose(f);
+	return (uint64_t)kb * 1024;
+}
+
+static inline int udmabuf_open(struct udmabuf_dev *ud, bool hugetlb)
+{
+	ud->hugetlb   = hugetlb;
+	ud->huge_page = udmabuf_huge_page_size();
+	ud->fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (ud->fd < 0)
+		perror("open /dev/udmabuf");
+	return ud->fd < 0 ? -1 : 0;
+}
+
+static inline void udmabuf_close(struct udmabuf_dev *ud)
+{
+	if (ud->fd >= 0)
+		close(ud->fd);
+	ud->fd = -1;
+}
+
+static inline void udmabuf_free(struct udmabuf_mem *m)
+{
+	if (m->vaddr)
+		munmap(m->vaddr, m->size);
+	if (m->dmabuf_fd >= 0)
+		close(m->dmabuf_fd);
+	if (m->memfd >= 0)
+		close(m->memfd);
+	m->vaddr = NULL;
+	m->memfd = m->dmabuf_fd = -1;
+}
+
+static inline int udmabuf_try_alloc(const struct udmabuf_dev *ud,
+				    struct udmabuf_mem *m, uint64_t size,
+				    bool huge)
+{
+	uint64_t page = huge ? ud->huge_page
+			     : (uint64_t)sysconf(_SC_PAGESIZE);
+	unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+	int err;
+
+	if (huge)
+		flags |= MFD_HUGETLB;
+	m->vaddr     = NULL;
+	m->dmabuf_fd = -1;
+	m->huge      = huge;
+	m->size      = (size + page - 1) & ~(page - 1);
+	m->memfd     = memfd_create("udmabuf", flags);
+	if (m->memfd < 0 ||
+	    ftruncate(m->memfd, (off_t)m->size) < 0 ||
+	    fcntl(m->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0)
+		goto fail;
+
+	/* Populated: the pages exist before udmabuf pins them */
+	m->vaddr = mmap(NULL, m->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m->memfd, 0);
+	if (m->vaddr == MAP_FAILED) {
+		m->vaddr = NULL;
+		goto fail;
+	}
+
+	struct udmabuf_create create = {
+		.memfd  = (uint32_t)m->memfd,
+		.flags  = UDMABUF_FLAGS_CLOEXEC,
+		.offset = 0,
+		.size   = m->size,
+	};
+	m->dmabuf_fd = ioctl(ud->fd, UDMABUF_CREATE, &create);
+	if (m->dmabuf_fd < 0)
+		goto fail;
+	return 0;
+
+fail:
+	err = errno;
+	udmabuf_free(m);
+	errno = err;
+	return -1;
+}
+
+/* ============================================================
+ * udmabuf_alloc - @size bytes of memfd memory and its DMA-BUF.
+ *
+ * With ud->hugetlb, huge pages of the default size are tried first;
+ * without reserved huge pages (vm.nr_hugepages) that fails and normal
+ * pages are used -- m->huge says which.
+ * Returns 0, or -1 with errno set.
+ * ============================================================ */
+static inline int udmabuf_alloc(const struct udmabuf_dev *ud,
+				struct udmabuf_mem *m, uint64_t size)
+{
+	if (ud->hugetlb && ud->huge_page &&
+	    udmabuf_try_alloc(ud, m, size, true) == 0)
+		return 0;
+	return udmabuf_try_alloc(ud, m, size, false);
+}
+
+#endif /* UDMABUF_ALLOC_H */
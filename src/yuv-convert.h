@@ -0,0 +1,434 @@
+#ifndef YUV_CONVERT_H
+#define YUV_CONVERT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <drm_fourcc.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_CONVERT_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define YUV_CONVERT_NEON 1
+#endif
+
+/* ============================================================
+ * yuv-convert.h - XRGB8888 -> NV12 / NV16 conversion
+ *
+ * Cameras and video decoders hand the display semi-planar YUV, not
+ * RGB: a full-resolution Y (luma) plane followed by one plane of
+ * interleaved Cb/Cr (U/V) samples at reduced resolution.
+ *
+ *   NV12  4:2:0  chroma halved in x and y   12 bits/pixel
+ *   NV16  4:2:2  chroma halved in x only    16 bits/pixel
+ *
+ * versus 32 for XRGB8888: a 1080p NV12 frame is 3 MiB instead of
+ * 8 MiB, which is the memory and scanout bandwidth saved when a plane
+ * can fetch YUV directly.
+ *
+ * Colour math is BT.601 limited range in 8.8 fixed point, the default
+ * COLOR_ENCODING / COLOR_RANGE of a KMS plane:
+ *
+ *   Y  = (( 66 R + 129 G +  25 B + 128) >> 8) +  16
+ *   Cb = ((-38 R -  74 G + 112 B + 128) >> 8) + 128
+ *   Cr = ((112 R -  94 G -  18 B + 128) >> 8) + 128
+ *
+ * Chroma is computed from the rounded average of each 2x2 (NV12) or
+ * 2x1 (NV16) block of RGB pixels.  Every kernel uses exactly these
+ * integer steps, so all of them produce identical bytes:
+ *
+ *   sse2    8 pixels per step, any x86-64
+ *   neon    16 pixels per step, AArch64 (VLD4 de-interleave)
+ *   scalar  reference implementation, always available
+ *
+ * YUV_CONVERT=<name> in the environment forces a kernel.
+ * ============================================================ */
+
+struct yuv_format {
+	const char *name;
+	uint32_t    fourcc;
+	uint32_t    hsub;  /* Horizontal chroma subsampling */
+	uint32_t    vsub;  /* Vertical chroma subsampling   */
+};
+
+static const struct yuv_format yuv_formats[] = {
+	{ "NV12", DRM_FORMAT_NV12, 2, 2 },
+	{ "NV16", DRM_FORMAT_NV16, 2, 1 },
+};
+
+#define YUV_FORMAT_COUNT (sizeof(yuv_formats) / sizeof(yuv_formats[0]))
+
+/* "--format NV12|NV16" on the command line, or NULL for anything else */
+static inline const struct yuv_format *yuv_format_parse(int argc, char **argv)
+{
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--format") != 0)
+			continue;
+		for (size_t k = 0; k < YUV_FORMAT_COUNT; k++)
+			if (strcasecmp(yuv_formats[k].name, argv[i + 1]) == 0)
+				return &yuv_formats[k];
+		return NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Row kernels.  @n is a pixel count; for the chroma kernel it is even
+ * and @rgb1 is the second row of the block (== @rgb0 for NV16).
+ */
+struct yuv_convert_impl {
+	const char *name;
+	void      (*luma)(uint8_t *y, const uint32_t *rgb, uint32_t n);
+	void      (*chroma)(uint8_t *uv, const uint32_t *rgb0,
+			    const uint32_t *rgb1, uint32_t n);
+	bool      (*supported)(void);
+};
+
+static inline uint8_t yuv_y(uint32_t r, uint32_t g, uint32_t b)
+{
+	return (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static inline void yuv_uv(uint8_t *uv, int r, int g, int b)
+{
+	uv[0] = (uint8_t)(((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128);
+	uv[1] = (uint8_t)(((112 * r -  94 * g -  18 * b + 128) >> 8) + 128);
+}
+
+static inline void yuv_luma_scalar(uint8_t *y, const uint32_t *rgb,
+				   uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t p = rgb[i];
+		y[i] = yuv_y((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff);
+	}
+}
+
+static inline void yuv_chroma_scalar(uint8_t *uv, const uint32_t *rgb0,
+				     const uint32_t *rgb1, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; i += 2, uv += 2) {
+		uint32_t a = rgb0[i], b = rgb0[i + 1];
+		uint32_t c = rgb1[i], d = rgb1[i + 1];
+		int r = (int)((((a >> 16) & 0xff) + ((b >> 16) & 0xff) +
+			       ((c >> 16) & 0xff) + ((d >> 16) & 0xff) + 2) >> 2);
+		int g = (int)((((a >> 8) & 0xff) + ((b >> 8) & 0xff) +
+			       ((c >> 8) & 0xff) + ((d >> 8) & 0xff) + 2) >> 2);
+		int bl = (int)(((a & 0xff) + (b & 0xff) +
+				(c & 0xff) + (d & 0xff) + 2) >> 2);
+		yuv_uv(uv, r, g, bl);
+	}
+}
+
+static inline bool yuv_convert_always(void)
+{
+	return true;
+}
+
+#ifdef YUV_CONVERT_X86
+/* Split 8 XRGB pixels into R, G, B as eight 16-bit lanes each */
+__attribute__((target("sse2")))
+static inline void yuv_sse2_split(const uint32_t *rgb, __m128i *r,
+				  __m128i *g, __m128i *b)
+{
+	const __m128i lo = _mm_set1_epi32(0xff);
+	__m128i p0 = _mm_loadu_si128((const __m128i *)rgb);
+	__m128i p1 = _mm_loadu_si128((const __m128i *)rgb + 1);
+
+	*r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), lo),
+			     _mm_and_si128(_mm_srli_epi32(p1, 16), lo));
+	*g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), lo),
+			     _mm_and_si128(_mm_srli_epi32(p1, 8), lo));
+	*b = _mm_packs_epi32(_mm_and_si128(p0, lo), _mm_and_si128(p1, lo));
+}
+
+/*
+ * 66 R + 129 G + 25 B + 128 peaks at 56228: it fits an unsigned
+ * 16-bit lane, so wrapping mullo/add plus a logical shift is exact.
+ */
+__attribute__((target("sse2")))
+static inline void yuv_luma_sse2(uint8_t *y, const uint32_t *rgb, uint32_t n)
+{
+	uint32_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i r, g, b;
+		yuv_sse2_split(rgb + i, &r, &g, &b);
+
+		__m128i acc = _mm_add_epi16(
+			_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+				      _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+			_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)),
+				      _mm_set1_epi16(128)));
+		acc = _mm_add_epi16(_mm_srli_epi16(acc, 8), _mm_set1_epi16(16));
+		_mm_storel_epi64((__m128i *)(y + i), _mm_packus_epi16(acc, acc));
+	}
+	yuv_luma_scalar(y + i, rgb + i, n - i);
+}
+
+/* Rounded 2x2 block average: vertical add, pairwise madd, (+2) >> 2 */
+__attribute__((target("sse2")))
+static inline __m128i yuv_sse2_avg(__m128i top, __m128i bottom)
+{
+	__m128i sum = _mm_madd_epi16(_mm_add_epi16(top, bottom),
+				     _mm_set1_epi16(1));
+	sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), 2);
+	return _mm_packs_epi32(sum, sum);
+}
+
+/* |Cb|, |Cr| partial sums stay within +-28688: signed 16-bit is exact */
+__attribute__((target("sse2")))
+static inline __m128i yuv_sse2_dot(__m128i r, __m128i g, __m128i b,
+				   short kr, short kg, short kb)
+{
+	__m128i acc = _mm_add_epi16(
+		_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kr)),
+			      _mm_mullo_epi16(g, _mm_set1_epi16(kg))),
+		_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kb)),
+			      _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srai_epi16(acc, 8), _mm_set1_epi16(128));
+}
+
+__attribute__((target("sse2")))
+static inline void yuv_chroma_sse2(uint8_t *uv, const uint32_t *rgb0,
+				   const uint32_t *rgb1, uint32_t n)
+{
+	uint32_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i r0, g0, b0, r1, g1, b1;
+		yuv_sse2_split(rgb0 + i, &r0, &g0, &b0);
+		yuv_sse2_split(rgb1 + i, &r1, &g1, &b1);
+
+		__m128i r = yuv_sse2_avg(r0, r1);
+		__m128i g = yuv_sse2_avg(g0, g1);
+		__m128i b = yuv_sse2_avg(b0, b1);
+		__m128i u = yuv_sse2_dot(r, g, b, -38, -74, 112);
+		__m128i v = yuv_sse2_dot(r, g, b, 112, -94, -18);
+
+		/* Lanes 0..3 are valid: interleave to U0 V0 U1 V1 ... */
+		__m128i uvw = _mm_unpacklo_epi16(u, v);
+		_mm_storel_epi64((__m128i *)(uv + i),
+				 _mm_packus_epi16(uvw, uvw));
+	}
+	yuv_chroma_scalar(uv + i, rgb0 + i, rgb1 + i, n - i);
+}
+
+static inline bool yuv_convert_has_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+#endif /* YUV_CONVERT_X86 */
+
+#ifdef YUV_CONVERT_NEON
+/* XRGB8888 in memory is B, G, R, X: VLD4 splits the channels for free */
+static inline void yuv_luma_neon(uint8_t *y, const uint32_t *rgb, uint32_t n)
+{
+	uint32_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t p = vld4q_u8((const uint8_t *)(rgb + i));
+		uint16x8_t lo = vmull_u8(vget_low_u8(p.val[2]), vdup_n_u8(66));
+		uint16x8_t hi = vmull_u8(vget_high_u8(p.val[2]), vdup_n_u8(66));
+
+		lo = vmlal_u8(lo, vget_low_u8(p.val[1]),  vdup_n_u8(129));
+		hi = vmlal_u8(hi, vget_high_u8(p.val[1]), vdup_n_u8(129));
+		lo = vmlal_u8(lo, vget_low_u8(p.val[0]),  vdup_n_u8(25));
+		hi = vmlal_u8(hi, vget_high_u8(p.val[0]), vdup_n_u8(25));
+		lo = vaddq_u16(lo, vdupq_n_u16(128));
+		hi = vaddq_u16(hi, vdupq_n_u16(128));
+
+		uint8x16_t out = vcombine_u8(vshrn_n_u16(lo, 8),
+					     vshrn_n_u16(hi, 8));
+		vst1q_u8(y + i, vaddq_u8(out, vdupq_n_u8(16)));
+	}
+	yuv_luma_scalar(y + i, rgb + i, n - i);
+}
+
+static inline int16x8_t yuv_neon_dot(int16x8_t r, int16x8_t g, int16x8_t b,
+				     int16_t kr, int16_t kg, int16_t kb)
+{
+	int16x8_t acc = vmulq_n_s16(r, kr);
+
+	acc = vmlaq_n_s16(acc, g, kg);
+	acc = vmlaq_n_s16(acc, b, kb);
+	acc = vaddq_s16(acc, vdupq_n_s16(128));
+	return vaddq_s16(vshrq_n_s16(acc, 8), vdupq_n_s16(128));
+}
+
+static inline void yuv_chroma_neon(uint8_t *uv, const uint32_t *rgb0,
+				   const uint32_t *rgb1, uint32_t n)
+{
+	uint32_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t p = vld4q_u8((const uint8_t *)(rgb0 + i));
+		uint8x16x4_t q = vld4q_u8((const uint8_t *)(rgb1 + i));
+		int16x8_t c[3];
+
+		/* Pairwise widen-add per row, then rows, then (+2) >> 2 */
+		for (int k = 0; k < 3; k++) {
+			uint16x8_t s = vaddq_u16(vpaddlq_u8(p.val[k]),
+						 vpaddlq_u8(q.val[k]));
+			c[k] = vreinterpretq_s16_u16(vrshrq_n_u16(s, 2));
+		}
+
+		uint8x8x2_t out = {{
+			vqmovun_s16(yuv_neon_dot(c[2], c[1], c[0], -38, -74, 112)),
+			vqmovun_s16(yuv_neon_dot(c[2], c[1], c[0], 112, -94, -18)),
+		}};
+		vst2_u8(uv + i, out);
+	}
+	yuv_chroma_scalar(uv + i, rgb0 + i, rgb1 + i, n - i);
+}
+#endif /* YUV_CONVERT_NEON */
+
+static const struct yuv_convert_impl yuv_convert_impls[] = {
+#ifdef YUV_CONVERT_X86
+	{ "sse2",   yuv_luma_sse2,   yuv_chroma_sse2,   yuv_convert_has_sse2 },
+#endif
+#ifdef YUV_CONVERT_NEON
+	{ "neon",   yuv_luma_neon,   yuv_chroma_neon,   yuv_convert_always   },
+#endif
+	{ "scalar", yuv_luma_scalar, yuv_chroma_scalar, yuv_convert_always   },
+};
+
+#define YUV_CONVERT_NUM_IMPLS \
+	(sizeof(yuv_convert_impls) / sizeof(yuv_convert_impls[0]))
+
+/* First supported kernel, or the one named by $YUV_CONVERT (cached) */
+static inline const struct yuv_convert_impl *yuv_convert_select(void)
+{
+	static const struct yuv_convert_impl *chosen;
+
+	if (chosen)
+		return chosen;
+
+	const char *force = getenv("YUV_CONVERT");
+	for (size_t i = 0; i < YUV_CONVERT_NUM_IMPLS; i++) {
+		const struct yuv_convert_impl *impl = &yuv_convert_impls[i];
+		if (!impl->supported())
+			continue;
+		if (force && strcmp(force, impl->name) != 0)
+			continue;
+		chosen = impl;
+		break;
+	}
+	if (!chosen) {
+		fprintf(stderr, "YUV_CONVERT=%s not available, using default\n",
+			force);
+		for (size_t i = 0; !chosen && i < YUV_CONVERT_NUM_IMPLS; i++)
+			if (yuv_convert_impls[i].supported())
+				chosen = &yuv_convert_impls[i];
+	}
+	return chosen;
+}
+
+/*
+ * One conversion job: columns [x0, x1) of an XRGB source into a
+ * semi-planar destination.  x0 and x1 must be even.  Band rows are
+ * chroma rows, so a band never splits a 2x2 NV12 block.
+ */
+struct yuv_convert_job {
+	const struct yuv_convert_impl *impl;
+	const struct yuv_format       *fmt;
+	const uint8_t *rgb;
+	uint32_t       rgb_pitch;
+	uint8_t       *luma;
+	uint32_t       luma_pitch;
+	uint8_t       *chroma;
+	uint32_t       chroma_pitch;
+	uint32_t       x0, x1;
+};
+
+/* render_band_fn: convert chroma rows [c0, c1) and their luma rows */
+static inline void yuv_convert_band(void *ctx, uint32_t c0, uint32_t c1)
+{
+	const struct yuv_convert_job *j = ctx;
+	const uint32_t n = j->x1 - j->x0;
+
+	for (uint32_t c = c0; c < c1; c++) {
+		uint32_t y0 = c * j->fmt->vsub;
+		const uint32_t *top = (const uint32_t *)
+			(j->rgb + (size_t)y0 * j->rgb_pitch) + j->x0;
+		const uint32_t *bottom = top;
+
+		for (uint32_t k = 0; k < j->fmt->vsub; k++) {
+			const uint32_t *src = (const uint32_t *)
+				(j->rgb + (size_t)(y0 + k) * j->rgb_pitch) + j->x0;
+			j->impl->luma(j->luma + (size_t)(y0 + k) * j->luma_pitch +
+				      j->x0, src, n);
+			bottom = src;
+		}
+		j->impl->chroma(j->chroma + (size_t)c * j->chroma_pitch +
+				j->x0, top, bottom, n);
+	}
+}
+
+/* ============================================================
+ * yuv_convert_selftest - Every kernel against the scalar reference.
+ *
+ * Converts a frame of pseudo-random pixels (all channel values occur)
+ * at widths that exercise the vector loops and the scalar tails, and
+ * compares Y and UV byte-for-byte.  Also checks the BT.601 anchors:
+ * black -> (16, 128, 128), white -> (235, 128, 128).
+ *
+ * Returns the number of mismatches.
+ * ============================================================ */
+static inline int yuv_convert_selftest(void)
+{
+	enum { W = 70, H = 4 };
+	static uint32_t rgb[H][W];
+	static uint8_t ref_y[W], out_y[W], ref_uv[W], out_uv[W];
+	uint32_t seed = 12345;
+	int failures = 0;
+
+	for (int y = 0; y < H; y++)
+		for (int x = 0; x < W; x++) {
+			seed = seed * 1103515245u + 12345u;
+			rgb[y][x] = seed;
+		}
+	rgb[0][0] = rgb[0][1] = rgb[1][0] = rgb[1][1] = 0x000000;
+	rgb[2][0] = rgb[2][1] = rgb[3][0] = rgb[3][1] = 0xffffff;
+
+	yuv_luma_scalar(ref_y, rgb[0], 2);
+	yuv_chroma_scalar(ref_uv, rgb[0], rgb[1], 2);
+	if (ref_y[0] != 16 || ref_uv[0] != 128 || ref_uv[1] != 128)
+		failures++;
+	yuv_luma_scalar(ref_y, rgb[2], 2);
+	yuv_chroma_scalar(ref_uv, rgb[2], rgb[3], 2);
+	if (ref_y[0] != 235 || ref_uv[0] != 128 || ref_uv[1] != 128)
+		failures++;
+
+	for (size_t i = 0; i < YUV_CONVERT_NUM_IMPLS; i++) {
+		const struct yuv_convert_impl *impl = &yuv_convert_impls[i];
+		int bad = 0;
+
+		if (!impl->supported())
+			continue;
+
+		for (uint32_t n = 0; n <= W; n += 2) {
+			for (int y = 0; y + 1 < H; y++) {
+				yuv_luma_scalar(ref_y, rgb[y], n);
+				impl->luma(out_y, rgb[y], n);
+				yuv_chroma_scalar(ref_uv, rgb[y], rgb[y + 1], n);
+				impl->chroma(out_uv, rgb[y], rgb[y + 1], n);
+				if (memcmp(ref_y, out_y, n) ||
+				    memcmp(ref_uv, out_uv, n))
+					bad++;
+			}
+		}
+		printf("  %-6s  %s\n", impl->name,
+		       bad ? "MISMATCH" : "byte-identical to scalar");
+		failures += bad;
+	}
+	return failures;
+}
+
+#endif /* YUV_CONVERT_H */